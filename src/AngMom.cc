@@ -1,23 +1,94 @@
 
 #include "AngMom.hh"
 #include <cmath>
-#include <gsl/gsl_sf_gamma.h>
-#include <gsl/gsl_sf_coupling.h>
+#include <vector>
+#include <algorithm>
 #include <iostream>
 
 
 namespace AngMom
 {
 
+ // Binomial coefficients are tabulated up to this n. Beyond that, they're computed from lgamma.
+ const int binomial_nmax = 256;
+ // Factorials overflow a double beyond 170!, and double factorials beyond 300!!
+ const int factorial_nmax = 170;
+ const int doublefactorial_nmax = 300;
+
+ // The tables are built the first time they're needed. Initialization of a
+ // function-local static is thread-safe in C++11, so these can be called from parallel regions.
+ static const vector<double>& BinomialTable()
+ {
+   static const vector<double> table = []()
+   {
+     // Build Pascal's triangle in long double so the additions don't accumulate rounding error.
+     vector<double> tab( (binomial_nmax+1)*(binomial_nmax+2)/2 );
+     vector<long double> row(1,1.0L);
+     for (int n=0; n<=binomial_nmax; ++n)
+     {
+       for (int k=0; k<=n; ++k) tab[n*(n+1)/2+k] = row[k];
+       vector<long double> next(n+2,1.0L);
+       for (int k=1; k<=n; ++k) next[k] = row[k-1] + row[k];
+       row.swap(next);
+     }
+     return tab;
+   }();
+   return table;
+ }
+
+ static const vector<double>& FactorialTable()
+ {
+   static const vector<double> table = []()
+   {
+     vector<double> tab(factorial_nmax+1,1.0);
+     for (int n=1; n<=factorial_nmax; ++n) tab[n] = tab[n-1]*n;
+     return tab;
+   }();
+   return table;
+ }
+
+ static const vector<double>& DoubleFactorialTable()
+ {
+   static const vector<double> table = []()
+   {
+     vector<double> tab(doublefactorial_nmax+1,1.0);
+     for (int n=2; n<=doublefactorial_nmax; ++n) tab[n] = tab[n-2]*n;
+     return tab;
+   }();
+   return table;
+ }
+
  int phase(int x)
  {
     return x%2==0 ? 1 : -1;
  }
 
+ double Binomial(int n, int k)
+ {
+   if (k<0 or k>n) return 0;
+   if (n<=binomial_nmax) return BinomialTable()[n*(n+1)/2+k];
+   return exp( lgamma(n+1.0) - lgamma(k+1.0) - lgamma(n-k+1.0) );
+ }
+
+ double Factorial(int n)
+ {
+   if (n<0) return 0;
+   if (n<=factorial_nmax) return FactorialTable()[n];
+   return exp( lgamma(n+1.0) );
+ }
+
+ double DoubleFactorial(int n)
+ {
+   if (n<-1) return 0;
+   if (n<=0) return 1;
+   if (n<=doublefactorial_nmax) return DoubleFactorialTable()[n];
+   return n * DoubleFactorial(n-2);
+ }
+
  
  double Tri(double j1, double j2, double j3)
  {
-    return gsl_sf_fact(j1+j2-j3) * gsl_sf_fact(j1-j2+j3) * gsl_sf_fact(-j1+j2+j3)/gsl_sf_fact(j1+j2+j3+1);
+    return Factorial(lround(j1+j2-j3)) * Factorial(lround(j1-j2+j3)) * Factorial(lround(-j1+j2+j3))/Factorial(lround(j1+j2+j3+1));
  }
  bool Triangle(double j1, double j2, double j3)
  {
@@ -26,25 +97,113 @@ namespace AngMom
    return true;
  }
 
+ // Triangle condition with twice the angular momenta, including the requirement that a+b+c is an integer.
+ static inline bool Triangle2(int a, int b, int c)
+ {
+   return a>=0 and b>=0 and c>=0 and ((a+b+c)&1)==0 and c<=a+b and c>=abs(a-b);
+ }
+
+ // The square of the triangle coefficient
+ // \f$ \Delta^2(abc) = \frac{(a+b-c)!(a-b+c)!(-a+b+c)!}{(a+b+c+1)!} \f$
+ // written in terms of binomial coefficients. Arguments are twice the angular momenta.
+ static inline double Delta2(int a, int b, int c)
+ {
+   int J = (a+b+c)/2;
+   return 1.0 / ( (J+1) * Binomial(J,c) * Binomial(c,(c+a-b)/2) );
+ }
+
+ /// Wigner 3j symbol, with arguments being twice the angular momenta.
+ /// This uses the Racah formula, with the sum written in terms of binomial coefficients as in L. Wei, Comp. Phys. Comm. 120 (1999) 222.
+ double ThreeJ_int(int j1, int j2, int j3, int m1, int m2, int m3)
+ {
+   if (m1+m2+m3 != 0) return 0;
+   if ( not Triangle2(j1,j2,j3) ) return 0;
+   if ( abs(m1)>j1 or abs(m2)>j2 or abs(m3)>j3 ) return 0;
+   if ( ((j1+m1)&1) or ((j2+m2)&1) or ((j3+m3)&1) ) return 0;
+   int J = (j1+j2+j3)/2;
+   int jm1 = (j1-m1)/2;
+   int jm2 = (j2-m2)/2;
+   int jp2 = (j2+m2)/2;
+   int jm3 = (j3-m3)/2;
+   int kmin = max( 0, max( jm1-(J-j2), jp2-(J-j1) ) );
+   int kmax = min( J-j3, min( jm1, jp2 ) );
+   double sum = 0;
+   for (int k=kmin; k<=kmax; ++k)
+   {
+     sum += phase(k) * Binomial(J-j3,k) * Binomial(J-j2,jm1-k) * Binomial(J-j1,jp2-k);
+   }
+   double norm = Factorial((j1+m1)/2) * Factorial(jm1) * Factorial(jp2) * Factorial(jm2) * Factorial((j3+m3)/2) * Factorial(jm3)
+               / ( Factorial(J+1) * Factorial(J-j1) * Factorial(J-j2) * Factorial(J-j3) );
+   return phase((j1-j2-m3)/2) * sqrt(norm) * sum;
+ }
+
+ /// Wigner 6j symbol, with arguments being twice the angular momenta.
+ /// \f[
+ /// \begin{Bmatrix} j_1 & j_2 & j_3 \\ j_4 & j_5 & j_6 \end{Bmatrix}
+ ///  = \frac{\Delta(j_1j_5j_6)\Delta(j_4j_2j_6)\Delta(j_4j_5j_3)}{\Delta(j_1j_2j_3)}
+ ///    \sum_t (-1)^t \binom{t+1}{J_1+1} \binom{j_1+j_2-j_3}{t-J_4} \binom{j_1-j_2+j_3}{t-J_3} \binom{-j_1+j_2+j_3}{t-J_2}
+ /// \f]
+ /// where the \f$J_i\f$ are the sums of the four triads.
+ double SixJ_int(int j1, int j2, int j3, int j4, int j5, int j6)
+ {
+   if ( not (Triangle2(j1,j2,j3) and Triangle2(j1,j5,j6) and Triangle2(j4,j2,j6) and Triangle2(j4,j5,j3)) ) return 0;
+   int J1 = (j1+j2+j3)/2;
+   int J2 = (j1+j5+j6)/2;
+   int J3 = (j4+j2+j6)/2;
+   int J4 = (j4+j5+j3)/2;
+   int K1 = (j1+j2+j4+j5)/2;
+   int K2 = (j2+j3+j5+j6)/2;
+   int K3 = (j3+j1+j6+j4)/2;
+   int tmin = max( max(J1,J2), max(J3,J4) );
+   int tmax = min( K1, min(K2,K3) );
+   double sum = 0;
+   for (int t=tmin; t<=tmax; ++t)
+   {
+     sum += phase(t) * Binomial(t+1,J1+1) * Binomial(K1-J4,t-J4) * Binomial(K3-J3,t-J3) * Binomial(K2-J2,t-J2);
+   }
+   return sum * sqrt( Delta2(j1,j5,j6) * Delta2(j4,j2,j6) * Delta2(j4,j5,j3) / Delta2(j1,j2,j3) );
+ }
+
+ /// Wigner 9j symbol, with arguments being twice the angular momenta. This is evaluated as a sum over products of 6j symbols.
+ /// \f[
+ /// \begin{Bmatrix} a & b & c \\ d & e & f \\ g & h & i \end{Bmatrix}
+ ///  = \sum_x (-1)^{2x} (2x+1)
+ /// \begin{Bmatrix} a & b & c \\ f & i & x \end{Bmatrix}
+ /// \begin{Bmatrix} d & e & f \\ b & x & h \end{Bmatrix}
+ /// \begin{Bmatrix} g & h & i \\ x & a & d \end{Bmatrix}
+ /// \f]
+ double NineJ_int(int a, int b, int c, int d, int e, int f, int g, int h, int i)
+ {
+   if ( not (Triangle2(a,b,c) and Triangle2(d,e,f) and Triangle2(g,h,i)
+         and Triangle2(a,d,g) and Triangle2(b,e,h) and Triangle2(c,f,i)) ) return 0;
+   int xmin = max( abs(a-i), max( abs(f-b), abs(d-h) ) );
+   int xmax = min( a+i, min( f+b, d+h ) );
+   double sum = 0;
+   for (int x=xmin; x<=xmax; x+=2)
+   {
+     sum += phase(x) * (x+1) * SixJ_int(a,b,c,f,i,x) * SixJ_int(d,e,f,b,x,h) * SixJ_int(g,h,i,x,a,d);
+   }
+   return sum;
+ }
+
  double ThreeJ(double j1, double j2, double j3, double m1, double m2, double m3)
  {
-   return gsl_sf_coupling_3j(int(2*j1), int(2*j2), int(2*j3), int(2*m1), int(2*m2), int(2*m3));
+   return ThreeJ_int(int(2*j1), int(2*j2), int(2*j3), int(2*m1), int(2*m2), int(2*m3));
  }
 
  double CG(double ja, double ma, double jb, double mb, double J, double M)
  {
-//    return phase(ja-jb+M) * sqrt(2*J+1) * gsl_sf_coupling_3j(int(2*ja),int(2*jb),int(2*J),int(2*ma),int(2*mb),int(2*-M));
     return phase(ja-jb+M) * sqrt(2*J+1) * ThreeJ(ja,jb,J,ma,mb,-M);
  }
 
  double SixJ(double j1, double j2, double j3, double J1, double J2,double J3)
  {
-   return gsl_sf_coupling_6j(int(2*j1),int(2*j2),int(2*j3),int(2*J1),int(2*J2),int(2*J3));
+   return SixJ_int(int(2*j1),int(2*j2),int(2*j3),int(2*J1),int(2*J2),int(2*J3));
  }
 
  double NineJ(double j1,double j2, double J12, double j3, double j4, double J34, double J13, double J24, double J)
  {
-   return gsl_sf_coupling_9j(int(2*j1),int(2*j2),int(2*J12),int(2*j3),int(2*j4),int(2*J34),int(2*J13),int(2*J24),int(2*J));
+   return NineJ_int(int(2*j1),int(2*j2),int(2*J12),int(2*j3),int(2*j4),int(2*J34),int(2*J13),int(2*J24),int(2*J));
  }
 
  double NormNineJ(double j1,double j2, double J12, double j3, double j4, double J34, double J13, double J24, double J)
@@ -53,6 +212,90 @@ namespace AngMom
  }
 
 
+ /// Fill sixj[k] with \f$ \{ j_1 j_2 j_3 ; J_1 J_2 J_3 \} \f$ for \f$ J_3 = J_{3min}+k \f$, up to \f$ J_{3max} \f$.
+ /// The parts that don't depend on \f$ J_3 \f$ are only computed once.
+ void SixJ_Batch(double j1, double j2, double j3, double J1, double J2, double J3min, double J3max, double* sixj)
+ {
+   int a = int(2*j1);
+   int b = int(2*j2);
+   int c = int(2*j3);
+   int d = int(2*J1);
+   int e = int(2*J2);
+   int fmin = int(2*J3min);
+   int fmax = int(2*J3max);
+   int nf = (fmax-fmin)/2+1;
+   for (int k=0; k<nf; ++k) sixj[k] = 0;
+   if ( not (Triangle2(a,b,c) and Triangle2(d,e,c)) ) return;
+   int J1sum = (a+b+c)/2;
+   int J4sum = (d+e+c)/2;
+   int K1 = (a+b+d+e)/2;
+   double norm_abc_dec = Delta2(d,e,c) / Delta2(a,b,c);
+   for (int k=0; k<nf; ++k)
+   {
+     int f = fmin + 2*k;
+     if ( not (Triangle2(a,e,f) and Triangle2(d,b,f)) ) continue;
+     int J2sum = (a+e+f)/2;
+     int J3sum = (d+b+f)/2;
+     int K2 = (b+c+e+f)/2;
+     int K3 = (c+a+f+d)/2;
+     int tmin = max( max(J1sum,J2sum), max(J3sum,J4sum) );
+     int tmax = min( K1, min(K2,K3) );
+     double sum = 0;
+     for (int t=tmin; t<=tmax; ++t)
+     {
+       sum += phase(t) * Binomial(t+1,J1sum+1) * Binomial(K1-J4sum,t-J4sum) * Binomial(K3-J3sum,t-J3sum) * Binomial(K2-J2sum,t-J2sum);
+     }
+     sixj[k] = sum * sqrt( norm_abc_dec * Delta2(a,e,f) * Delta2(d,b,f) );
+   }
+ }
+
+ /// Fill ninej[k] with the 9j symbol for \f$ J = J_{min}+k \f$, up to \f$ J_{max} \f$.
+ /// The middle 6j symbol in the sum over x doesn't depend on \f$ J \f$, so it's computed once for all \f$ J \f$.
+ void NineJ_Batch(double j1,double j2, double J12, double j3, double j4, double J34, double J13, double J24, double Jmin, double Jmax, double* ninej)
+ {
+   int a = int(2*j1);
+   int b = int(2*j2);
+   int c = int(2*J12);
+   int d = int(2*j3);
+   int e = int(2*j4);
+   int f = int(2*J34);
+   int g = int(2*J13);
+   int h = int(2*J24);
+   int imin = int(2*Jmin);
+   int imax = int(2*Jmax);
+   int ni = (imax-imin)/2+1;
+   for (int k=0; k<ni; ++k) ninej[k] = 0;
+   if ( not (Triangle2(a,b,c) and Triangle2(d,e,f) and Triangle2(a,d,g) and Triangle2(b,e,h)) ) return;
+   int xmin = max( abs(f-b), abs(d-h) );
+   int xmax = min( f+b, d+h );
+   if (xmax<xmin) return;
+   vector<double> sixj_mid( (xmax-xmin)/2+1 );
+   for (int x=xmin; x<=xmax; x+=2) sixj_mid[(x-xmin)/2] = phase(x) * (x+1) * SixJ_int(d,e,f,b,x,h);
+   for (int k=0; k<ni; ++k)
+   {
+     int i = imin + 2*k;
+     if ( not (Triangle2(g,h,i) and Triangle2(c,f,i)) ) continue;
+     double sum = 0;
+     for (int x=max(xmin,abs(a-i)); x<=min(xmax,a+i); x+=2)
+     {
+       sum += sixj_mid[(x-xmin)/2] * SixJ_int(a,b,c,f,i,x) * SixJ_int(g,h,i,x,a,d);
+     }
+     ninej[k] = sum;
+   }
+ }
+
+ /// Fill cg[k] with \f$ \langle j_a m_a j_b m_b | J M \rangle \f$ for \f$ J = J_{min}+k \f$, up to \f$ J_{max} \f$.
+ void CG_Batch(double ja, double ma, double jb, double mb, double Jmin, double Jmax, double M, double* cg)
+ {
+   int nJ = int(Jmax-Jmin)+1;
+   for (int k=0; k<nJ; ++k)
+   {
+     double J = Jmin + k;
+     cg[k] = phase(ja-jb+M) * sqrt(2*J+1) * ThreeJ_int(int(2*ja),int(2*jb),int(2*J),int(2*ma),int(2*mb),int(-2*M));
+   }
+ }
+
+
 
 
 
@@ -76,11 +319,11 @@ double Moshinsky(int N, int L, int n, int l, int n1, int l1, int n2, int l2, int
    double sB = sin(B);
 
    double mosh1 = phase((l1+l2+L+l)/2) / pow(2.,(l1+l2+L+l)/4.0);
-   mosh1 *= sqrt( gsl_sf_fact(n1) * gsl_sf_fact(n2) * gsl_sf_fact(N) * gsl_sf_fact(n) );
-   mosh1 *= sqrt( gsl_sf_doublefact(2*(n1+l1)+1) );
-   mosh1 *= sqrt( gsl_sf_doublefact(2*(n2+l2)+1) );
-   mosh1 *= sqrt( gsl_sf_doublefact(2*(N+ L)+1)  );
-   mosh1 *= sqrt( gsl_sf_doublefact(2*(n+ l)+1)  );
+   mosh1 *= sqrt( Factorial(n1) * Factorial(n2) * Factorial(N) * Factorial(n) );
+   mosh1 *= sqrt( DoubleFactorial(2*(n1+l1)+1) );
+   mosh1 *= sqrt( DoubleFactorial(2*(n2+l2)+1) );
+   mosh1 *= sqrt( DoubleFactorial(2*(N+ L)+1)  );
+   mosh1 *= sqrt( DoubleFactorial(2*(n+ l)+1)  );
 
    double mosh2 = 0;
    for (int la=0;la<=min(f1,F);++la)
@@ -108,10 +351,10 @@ double Moshinsky(int N, int L, int n, int l, int n1, int l1, int n2, int l2, int
           double mosh3 = phase(la+lb+lc) * pow(2.,(la+lb+lc+ld)/2.);
           mosh3 *= pow(sB,2*a+la+2*d+ld);
           mosh3 *= pow(cB,2*b+lb+2*c+lc);
-          mosh3 *= (2*la+1)/gsl_sf_fact(a)/gsl_sf_doublefact(2.*(a+la)+1);
-          mosh3 *= (2*lb+1)/gsl_sf_fact(b)/gsl_sf_doublefact(2.*(b+lb)+1);
-          mosh3 *= (2*lc+1)/gsl_sf_fact(c)/gsl_sf_doublefact(2.*(c+lc)+1);
-          mosh3 *= (2*ld+1)/gsl_sf_fact(d)/gsl_sf_doublefact(2.*(d+ld)+1);
+          mosh3 *= (2*la+1)/Factorial(a)/DoubleFactorial(2*(a+la)+1);
+          mosh3 *= (2*lb+1)/Factorial(b)/DoubleFactorial(2*(b+lb)+1);
+          mosh3 *= (2*lc+1)/Factorial(c)/DoubleFactorial(2*(c+lc)+1);
+          mosh3 *= (2*ld+1)/Factorial(d)/DoubleFactorial(2*(d+ld)+1);
           mosh3 *= NineJ(la,lb,l1,lc,ld,l2,L,l,lam);
           mosh3 *= cg_ab * cg_ac * cg_bd * cg_cd;
           mosh2 += mosh3;
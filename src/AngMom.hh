@@ -8,6 +8,9 @@ using namespace std;
 namespace AngMom
 {
    int phase(int x);
+   double Binomial(int n, int k);
+   double Factorial(int n);
+   double DoubleFactorial(int n);
    double Tri(double j1, double j2, double j3);
    bool Triangle(double j1, double j2, double j3);
    double CG(double ja, double ma, double jb, double mb, double J, double M);
@@ -15,6 +18,14 @@ namespace AngMom
    double SixJ(double j1, double j2, double j3, double J1, double J2,double J3);
    double NineJ(double j1, double j2, double j3, double j4, double j5, double j6, double j7, double j8, double j9);
    double NormNineJ(double j1, double j2, double j3, double j4, double j5, double j6, double j7, double j8, double j9);
+   // Same as above, but with integer arguments equal to twice the angular momenta
+   double ThreeJ_int(int j1, int j2, int j3, int m1, int m2, int m3);
+   double SixJ_int(int j1, int j2, int j3, int j4, int j5, int j6);
+   double NineJ_int(int j1, int j2, int j3, int j4, int j5, int j6, int j7, int j8, int j9);
+   // Fill an array with the symbols for a range of the last angular momentum
+   void SixJ_Batch(double j1, double j2, double j3, double J1, double J2, double J3min, double J3max, double* sixj);
+   void NineJ_Batch(double j1, double j2, double J12, double j3, double j4, double J34, double J13, double J24, double Jmin, double Jmax, double* ninej);
+   void CG_Batch(double ja, double ma, double jb, double mb, double Jmin, double Jmax, double M, double* cg);
    double Moshinsky(int N, int L, int n, int l, int n1, int l1, int n2, int l2, int lam);
 };
 
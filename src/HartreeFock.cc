@@ -2,6 +2,7 @@
 #include "HartreeFock.hh"
 #include "ModelSpace.hh"
 #include <iomanip>
+#include <fstream>
 #include <utility> // for make_pair
 
 #ifndef SQRT2
@@ -12,9 +13,18 @@
 using namespace std;
 
 HartreeFock::HartreeFock(Operator& hbare)
-  : Hbare(hbare), modelspace(hbare.GetModelSpace()), 
+  : HartreeFock(hbare, hbare)
+{
+}
+
+/// Use the 0-, 1- and 2-body parts of hbare, and the three-body part of h3bare.
+/// This way several calculations can share one copy of the 3N interaction, which is only read.
+HartreeFock::HartreeFock(Operator& hbare, Operator& h3bare)
+  : Hbare(hbare), H3bare(h3bare), modelspace(hbare.GetModelSpace()), 
     KE(Hbare.OneBody), energies(Hbare.OneBody.diag()),
-    tolerance(1e-8), convergence_ediff(7,0), convergence_EHF(7,0)
+    tolerance(1e-8), vmon3_memory("Vmon3"), convergence_ediff(7,0), convergence_EHF(7,0),
+    maxiter(1000), convergence_method("none"), DIIS_fallback("mixing"), DIIS_max_vectors(8),
+    mixing_alpha(0.5), level_shift(1.0), applied_shift(0), D_cache_memory("HF_D")
 {
    int norbits = modelspace->GetNumberOrbits();
    //bool isNuclear = modelspace->GetNuclear();
@@ -35,6 +45,7 @@ HartreeFock::HartreeFock(Operator& hbare)
          }
       }
       prev_energies = arma::vec(norbits,arma::fill::zeros);
+      prev_F_energies = arma::vec(norbits,arma::fill::zeros);
       vector<index_t> hvec;
       vector<double> occvec;
       for (auto& it_h : modelspace->holes)
@@ -46,7 +57,8 @@ HartreeFock::HartreeFock(Operator& hbare)
       hole_occ = arma::rowvec(occvec);
 //   holeorbs = arma::uvec(modelspace->holes);
       BuildMonopoleV();
-      if (hbare.GetParticleRank()>2)
+      BuildMonopoleGather();
+      if (H3bare.GetParticleRank()>2)
       {
          BuildMonopoleV3();
       }
@@ -71,8 +83,12 @@ HartreeFock::HartreeFock(Operator& hbare)
 //*********************************************************************
 void HartreeFock::Solve()
 {
+   double start_time = omp_get_wtime();
    iterations = 0; // counter so we don't go on forever
-   int maxiter = 1000;
+   DIIS_F.clear();
+   DIIS_error.clear();
+   applied_shift = 0;
+   prev_F_energies.zeros();
 
    //F.print();
 
@@ -84,7 +100,21 @@ void HartreeFock::Solve()
       UpdateF();              // Update the Fock matrix
 
       if ( CheckConvergence() ) break;
+      AccelerateF();          // Get a better guess for the Fock matrix to diagonalize next time around
    }
+   // If we didn't converge, F was modified by AccelerateF(). Put back the one consistent with rho.
+   if (iterations == maxiter) UpdateF();
+   // The unoccupied energies came out of a shifted Fock matrix.
+   if (applied_shift != 0)
+   {
+      for (index_t i=0; i<energies.size(); ++i)
+      {
+        if ( not arma::any(holeorbs==i) ) energies(i) -= applied_shift;
+      }
+      applied_shift = 0;
+   }
+   DIIS_F.clear();
+   DIIS_error.clear();
    CalcEHF();
 
    cout << setw(15) << setprecision(10);
@@ -103,6 +133,113 @@ void HartreeFock::Solve()
       cout << endl;
    }
    PrintEHF();
+   profiler.counter["HF_iterations"] += iterations;
+   profiler.timer["HF_Solve"] += omp_get_wtime() - start_time;
+}
+
+
+//*********************************************************************
+/// Use the Fock matrix just obtained in UpdateF() to make a better guess for the
+/// one to be diagonalized in the next iteration, according to convergence_method.
+/// - "diis" : Pulay's direct inversion in the iterative subspace, see ExtrapolateF_DIIS().
+///            Until there are two Fock matrices to extrapolate from, or if the extrapolation
+///            is ill-conditioned, the method given by DIIS_fallback is used instead.
+/// - "mixing" : See MixF().
+/// - "levelshift" : See LevelShiftF().
+/// - "none" : Plain fixed-point iteration.
+//*********************************************************************
+void HartreeFock::AccelerateF()
+{
+   string method = convergence_method;
+   if (method == "diis" and not ExtrapolateF_DIIS() )  method = DIIS_fallback;
+
+   if (method == "mixing")  MixF();
+   else if (method == "levelshift")  LevelShiftF();
+   else applied_shift = 0;
+}
+
+
+//*********************************************************************
+/// Pulay's DIIS. At self-consistency, the Fock matrix commutes with the density matrix,
+/// so we take the error vector to be \f$ e_i = F_i\rho_i - \rho_i F_i \f$ and
+/// replace F with \f$ \sum_i c_i F_i \f$ over the last DIIS_max_vectors iterations,
+/// where the coefficients minimize \f$ |\sum_i c_i e_i| \f$ subject to \f$ \sum_i c_i=1 \f$:
+/// \f[
+/// \begin{pmatrix} B & -1 \\ -1 & 0 \end{pmatrix} \begin{pmatrix} c \\ \lambda \end{pmatrix}
+///  = \begin{pmatrix} 0 \\ -1 \end{pmatrix}, \qquad B_{ij} = \mathrm{Tr}( e_i^{T} e_j )
+/// \f]
+/// If the system is ill-conditioned, the oldest vectors are dropped until it isn't.
+//*********************************************************************
+bool HartreeFock::ExtrapolateF_DIIS()
+{
+   DIIS_F.push_back(F);
+   DIIS_error.push_back(F*rho - rho*F);
+   while ( (int)DIIS_F.size() > max(DIIS_max_vectors,2) )
+   {
+     DIIS_F.pop_front();
+     DIIS_error.pop_front();
+   }
+
+   while ( DIIS_F.size() >= 2 )
+   {
+     int n = DIIS_F.size();
+     arma::mat B(n+1,n+1,arma::fill::zeros);
+     for (int i=0; i<n; ++i)
+     {
+       for (int j=i; j<n; ++j)
+       {
+         B(i,j) = B(j,i) = arma::accu( DIIS_error[i] % DIIS_error[j] );
+       }
+     }
+     double scale = B.diag().max(); // normalize, so the constraint row isn't lost in round-off
+     if (scale > 0) B.submat(0,0,n-1,n-1) /= scale;
+     B.row(n).fill(-1);
+     B.col(n).fill(-1);
+     B(n,n) = 0;
+     arma::vec rhs(n+1,arma::fill::zeros);
+     rhs(n) = -1;
+     arma::vec coeff;
+     bool success = arma::solve(coeff, B, rhs);
+     if ( success and coeff.is_finite() and arma::cond(B) < 1e14 )
+     {
+       F.zeros();
+       for (int i=0; i<n; ++i) F += coeff(i) * DIIS_F[i];
+       applied_shift = 0;
+       return true;
+     }
+     DIIS_F.pop_front();
+     DIIS_error.pop_front();
+   }
+   return false;
+}
+
+
+//*********************************************************************
+/// Linear mixing of the Fock matrices,
+/// \f$ F \rightarrow \alpha F + (1-\alpha) F_{prev} \f$
+/// where \f$ F_{prev} \f$ is the one diagonalized on the previous iteration.
+/// This damps the oscillations that plain iteration can get into.
+//*********************************************************************
+void HartreeFock::MixF()
+{
+   if (F_prev.n_rows == F.n_rows and applied_shift==0)
+     F = mixing_alpha * F + (1-mixing_alpha) * F_prev;
+   applied_shift = 0;
+}
+
+
+//*********************************************************************
+/// Level shift. Add \f$ \lambda(1-P) \f$ to the Fock matrix, where \f$ P \f$ projects onto the occupied orbits.
+/// This pushes the unoccupied orbits up by \f$ \lambda \f$, which suppresses
+/// the mixing of occupied and unoccupied orbits from one iteration to the next.
+/// At self-consistency \f$ [F,P]=0 \f$, so the orbits are unchanged and the unoccupied
+/// energies are just shifted, which is undone at the end of Solve().
+//*********************************************************************
+void HartreeFock::LevelShiftF()
+{
+   arma::mat Cocc = C.cols(holeorbs);
+   F += level_shift * ( arma::eye(F.n_rows,F.n_cols) - Cocc * Cocc.t() );
+   applied_shift = level_shift;
 }
 
 
@@ -165,6 +302,8 @@ void HartreeFock::PrintEHF()
 void HartreeFock::Diagonalize()
 {
    prev_energies = energies;
+   F_prev = F;
+   FreeTransformationMatrices(); // C is about to change
    for ( auto& it : modelspace->OneBodyChannels )
    {
       arma::uvec orbvec(it.second);
@@ -245,7 +384,32 @@ void HartreeFock::BuildMonopoleV3()
 {
    double start_time = omp_get_wtime();
   // First, allocate. This is fast so don't parallelize.
+  // The entries are grouped in rows of (i,j), and within a row (a,b) and (c,d) are stored as indices into Vmon3_pairs.
   int norbits = modelspace->GetNumberOrbits();
+  vector<int> pair_index(norbits*norbits,-1);
+  Vmon3_pairs.clear();
+  for (int a=0; a<norbits; ++a)
+  {
+    Orbit& oa = modelspace->GetOrbit(a);
+    if (2*oa.n+oa.l > H3bare.E3max) continue;
+    for (int b : modelspace->OneBodyChannels.at({oa.l,oa.j2,oa.tz2}) )
+    {
+      Orbit& ob = modelspace->GetOrbit(b);
+      if (2*ob.n+ob.l > H3bare.E3max) continue;
+      pair_index[a*norbits+b] = Vmon3_pairs.size();
+      Vmon3_pairs.push_back({a,b});
+    }
+  }
+  if (Vmon3_pairs.size() > 0xFFFF)
+  {
+    cerr << "!!! Error in HartreeFock::BuildMonopoleV3 : " << Vmon3_pairs.size() << " orbit pairs is too many to pack in Vmon3_keys. Ignoring the 3-body part." << endl;
+    Vmon3_pairs.clear();
+    return;
+  }
+
+  Vmon3_rows.clear();
+  Vmon3_row_start.assign(1,0);
+  Vmon3_keys.clear();
   for (int i=0; i<norbits; ++i)
   {
     Orbit& oi = modelspace->GetOrbit(i);
@@ -255,8 +419,6 @@ void HartreeFock::BuildMonopoleV3()
       if (j<i) continue;
       Orbit& oj = modelspace->GetOrbit(j);
       int ej = 2*oj.n + oj.l;
-
-
       for (int a=0; a<norbits; ++a)
       {
         Orbit& oa = modelspace->GetOrbit(a);
@@ -265,51 +427,54 @@ void HartreeFock::BuildMonopoleV3()
         {
           Orbit& ob = modelspace->GetOrbit(b);
           int eb = 2*ob.n + ob.l;
-
-     
             for (int c=0; c<norbits; ++c)
             {
               Orbit& oc = modelspace->GetOrbit(c);
               int ec = 2*oc.n + oc.l;
-              if ( ea+ec+ei > Hbare.E3max ) continue;
+              if ( ea+ec+ei > H3bare.E3max ) continue;
               for (int d : modelspace->OneBodyChannels.at({oc.l,oc.j2,oc.tz2}) )
               {
                 Orbit& od = modelspace->GetOrbit(d);
                 int ed = 2*od.n + od.l;
  
-                if ( eb+ed+ej > Hbare.E3max ) continue;
+                if ( eb+ed+ej > H3bare.E3max ) continue;
                 if ( (oi.l+oa.l+ob.l+oj.l+oc.l+od.l)%2 >0) continue;
-                  array<int,6> key = {a,c,i,b,d,j};
-                  Vmon3.push_back( make_pair( key, 0.) );
+                uint32_t ab = pair_index[a*norbits+b];
+                uint32_t cd = pair_index[c*norbits+d];
+                Vmon3_keys.push_back( ab | (cd << 16) );
               }
             }
           }
         }
-      }
+      if (Vmon3_keys.size() == Vmon3_row_start.back()) continue;
+      Vmon3_rows.push_back({i,j});
+      Vmon3_row_start.push_back( Vmon3_keys.size() );
     }
-    Vmon3.shrink_to_fit();
+  }
+  Vmon3_keys.shrink_to_fit();
+  Vmon3.assign(Vmon3_keys.size(),0.);
 
 
    // the calculation takes longer, so parallelize this part
-   #pragma omp parallel for 
-   for (size_t ind=0; ind<Vmon3.size(); ++ind)
+   #pragma omp parallel for schedule(dynamic,1)
+   for (size_t row=0; row<Vmon3_rows.size(); ++row)
    {
-
-      const array<int,6>& orb = Vmon3[ind].first;
-      double& v         = Vmon3[ind].second;
-      int a = orb[0];
-      int c = orb[1];
-      int i = orb[2];
-      int b = orb[3];
-      int d = orb[4];
-      int j = orb[5];
+     int i = Vmon3_rows[row][0];
+     int j = Vmon3_rows[row][1];
+     int j2i = modelspace->GetOrbit(i).j2;
+     int j2j = modelspace->GetOrbit(j).j2;
+     for (size_t ind=Vmon3_row_start[row]; ind<Vmon3_row_start[row+1]; ++ind)
+     {
+      double& v = Vmon3[ind];
+      int a = Vmon3_pairs[ Vmon3_keys[ind] & 0xFFFF ][0];
+      int b = Vmon3_pairs[ Vmon3_keys[ind] & 0xFFFF ][1];
+      int c = Vmon3_pairs[ Vmon3_keys[ind] >> 16 ][0];
+      int d = Vmon3_pairs[ Vmon3_keys[ind] >> 16 ][1];
 
       int j2a = modelspace->GetOrbit(a).j2;
       int j2c = modelspace->GetOrbit(c).j2;
-      int j2i = modelspace->GetOrbit(i).j2;
       int j2b = modelspace->GetOrbit(b).j2;
       int j2d = modelspace->GetOrbit(d).j2;
-      int j2j = modelspace->GetOrbit(j).j2;
  
       int j2min = max( abs(j2a-j2c), abs(j2b-j2d) )/2;
       int j2max = min (j2a+j2c, j2b+j2d)/2;
@@ -319,16 +484,85 @@ void HartreeFock::BuildMonopoleV3()
         int Jmax = 2*j2 + min(j2i, j2j);
         for (int J=Jmin; J<=Jmax; J+=2)
         {
-           v += Hbare.ThreeBody.GetME_pn(j2,j2,J,a,c,i,b,d,j) * (J+1);
+           v += H3bare.ThreeBody.GetME_pn(j2,j2,J,a,c,i,b,d,j) * (J+1);
         }
       }
       v /= (j2i+1);
+     }
    }
+   vmon3_memory.Set( Vmon3.capacity()*sizeof(double) + Vmon3_keys.capacity()*sizeof(uint32_t) + Vmon3_row_start.capacity()*sizeof(size_t)
+                     + (Vmon3_rows.capacity() + Vmon3_pairs.capacity())*sizeof(array<int,2>) );
    profiler.timer["HF_BuildMonopoleV3"] += omp_get_wtime() - start_time;
 }
 
 
 
+//*********************************************************************
+/// Rearrange the monopole interaction so that the two-body part of UpdateF() is
+/// a set of dense matrix-vector products, with no lookups inside the HF iterations.
+/// Orbits are sorted into 4 classes by \f$ (t_z, (-1)^l) \f$, which is all that is needed to
+/// know which \f$ (T_z,\pi) \f$ block of Vmon a pair of orbits belongs to.
+/// For each class, HF_pairs holds the pairs \f$ i\leq j \f$ in the same one-body channel,
+/// and for classes \f$ c_i, c_a \f$ the matrix
+/// \f[ G^{c_ic_a}_{(ij),(ab)} = \bar{V}_{iajb} + (1-\delta_{ab})\bar{V}_{ibja} \f]
+/// is a slice of a single \f$ (T_z,\pi) \f$ block of Vmon or Vmon_exch,
+/// where we have used the symmetry of \f$ \rho \f$ to only keep \f$ a\leq b \f$. Then
+/// \f$ (2j_i+1)\tilde{V}^{(2)}_{ij} = \sum_{c_a} \sum_{a\leq b} G^{c_ic_a}_{(ij),(ab)} \rho_{ab} \f$.
+//*********************************************************************
+void HartreeFock::BuildMonopoleGather()
+{
+   double start_time = omp_get_wtime();
+   int norbits = modelspace->GetNumberOrbits();
+   for (int c=0; c<4; ++c) HF_pairs[c].clear();
+   for (int i=0;i<norbits;i++)
+   {
+      Orbit& oi = modelspace->GetOrbit(i);
+      int ci = (oi.tz2+1) + oi.l%2;
+      for (int j : modelspace->OneBodyChannels.at({oi.l,oi.j2,oi.tz2}) )
+      {
+         if (j>=i) HF_pairs[ci].push_back({i,j});
+      }
+   }
+
+   // <ia|Vmon|jb>, taking care of the ordering of the kets.
+   auto Vmonopole = [&](int i, int a, int j, int b)
+   {
+      Orbit& oi = modelspace->GetOrbit(i);
+      Orbit& oa = modelspace->GetOrbit(a);
+      int Tz = (oi.tz2+oa.tz2)/2;
+      int parity = (oi.l+oa.l)%2;
+      index_t local_bra = modelspace->MonopoleKets[Tz+1][parity].at( modelspace->GetKetIndex(min(i,a),max(i,a)) );
+      index_t local_ket = modelspace->MonopoleKets[Tz+1][parity].at( modelspace->GetKetIndex(min(j,b),max(j,b)) );
+      if ((a>i) xor (b>j))
+        return Vmon_exch[Tz+1][parity](local_bra,local_ket); // <ai|Vmon|jb>
+      else
+        return Vmon[Tz+1][parity](local_bra,local_ket); // <ai|Vmon|bj>
+   };
+
+   #pragma omp parallel for schedule(dynamic,1)
+   for (int icombo=0; icombo<16; ++icombo)
+   {
+      int ci = icombo/4;
+      int ca = icombo%4;
+      arma::mat& G = Vmon_gathered[ci][ca];
+      G.set_size( HF_pairs[ci].size(), HF_pairs[ca].size() );
+      for (size_t ipair=0; ipair<HF_pairs[ci].size(); ++ipair)
+      {
+         int i = HF_pairs[ci][ipair][0];
+         int j = HF_pairs[ci][ipair][1];
+         for (size_t apair=0; apair<HF_pairs[ca].size(); ++apair)
+         {
+            int a = HF_pairs[ca][apair][0];
+            int b = HF_pairs[ca][apair][1];
+            G(ipair,apair) = Vmonopole(i,a,j,b);
+            if (a!=b) G(ipair,apair) += Vmonopole(i,b,j,a);
+         }
+      }
+   }
+   profiler.timer["HF_BuildMonopoleGather"] += omp_get_wtime() - start_time;
+}
+
+
 //*********************************************************************
 /// one-body density matrix 
 /// \f$ <i|\rho|j> = \sum\limits_{\beta} n_{\beta} <i|\beta> <\beta|j> \f$
@@ -357,55 +591,56 @@ void HartreeFock::UpdateDensityMatrix()
 void HartreeFock::UpdateF()
 {
    double start_time = omp_get_wtime();
-   int norbits = modelspace->GetNumberOrbits();
    Vij.zeros();
    V3ij.zeros();
 
 
-   // This loop isn't thread safe for some reason. Regardless, parallelizing it makes it slower. 
-   for (int i=0;i<norbits;i++)
+   // 2body term. One matrix-vector product for each combination of orbit classes, see BuildMonopoleGather().
+   array< arma::vec,4> rho_pairs;
+   for (int ca=0; ca<4; ++ca)
    {
-      Orbit& oi = modelspace->GetOrbit(i);
-      for (int j : modelspace->OneBodyChannels.at({oi.l,oi.j2,oi.tz2}) )
+      rho_pairs[ca].set_size( HF_pairs[ca].size() );
+      for (size_t ipair=0; ipair<HF_pairs[ca].size(); ++ipair)
+         rho_pairs[ca](ipair) = rho( HF_pairs[ca][ipair][0], HF_pairs[ca][ipair][1] );
+   }
+   array< array< arma::vec,4>,4> Vij_pairs;
+   #pragma omp parallel for schedule(dynamic,1)
+   for (int icombo=0; icombo<16; ++icombo)
+   {
+      int ci = icombo/4;
+      int ca = icombo%4;
+      if (Vmon_gathered[ci][ca].n_elem < 1) continue;
+      Vij_pairs[ci][ca] = Vmon_gathered[ci][ca] * rho_pairs[ca];
+   }
+   for (int ci=0; ci<4; ++ci)
+   {
+      for (size_t ipair=0; ipair<HF_pairs[ci].size(); ++ipair)
       {
-         if (j<i) continue;
-         for (int a=0;a<norbits;++a)
+         int i = HF_pairs[ci][ipair][0];
+         int j = HF_pairs[ci][ipair][1];
+         for (int ca=0; ca<4; ++ca)
          {
-            Orbit& oa = modelspace->GetOrbit(a);
-            int Tz = (oi.tz2+oa.tz2)/2;
-            int parity = (oi.l+oa.l)%2;
-            int bra = modelspace->GetKetIndex(min(i,a),max(i,a));
-            int local_bra = modelspace->MonopoleKets[Tz+1][parity][bra];
-            for (int b : modelspace->OneBodyChannels.at({oa.l,oa.j2,oa.tz2}) )
-            {
-               int ket = modelspace->GetKetIndex(min(j,b),max(j,b));
-               int local_ket = modelspace->MonopoleKets[Tz+1][parity][ket];
-               // 2body term <ai|V|bj>
-               if ((a>i) xor (b>j))  // code needed some obfuscation, so threw an xor in there...
-                  Vij(i,j) += rho(a,b)*Vmon_exch[Tz+1][parity](local_bra,local_ket); // <a|rho|b> * <ai|Vmon|jb>
-               else
-                  Vij(i,j) += rho(a,b)*Vmon[Tz+1][parity](local_bra,local_ket); // <a|rho|b> * <ai|Vmon|bj>
-           }
+            if (Vij_pairs[ci][ca].n_elem > 0)  Vij(i,j) += Vij_pairs[ci][ca](ipair);
          }
+         Vij(i,j) /= modelspace->GetOrbit(i).j2+1;
       }
-      Vij.col(i) /= (oi.j2+1);
    }
 
-   if (Hbare.GetParticleRank()>=3) 
+   if (H3bare.GetParticleRank()>=3) 
    {
-//      # pragma omp parallel for num_threads(2)  // Note that this is risky and not fully thread safe.
-      for (size_t ind=0;ind<Vmon3.size(); ++ind)
+      // Each thread takes whole rows, so there's no race to update V3ij.
+      arma::vec rho_pairs3( Vmon3_pairs.size() );
+      for (size_t ipair=0; ipair<Vmon3_pairs.size(); ++ipair)
+         rho_pairs3(ipair) = rho( Vmon3_pairs[ipair][0], Vmon3_pairs[ipair][1] );
+      #pragma omp parallel for schedule(dynamic,1)
+      for (size_t row=0; row<Vmon3_rows.size(); ++row)
       {
-        const array<int,6>& orb = Vmon3[ind].first;
-        double& v         = Vmon3[ind].second;
-        int a = orb[0];
-        int c = orb[1];
-        int i = orb[2];
-        int b = orb[3];
-        int d = orb[4];
-        int j = orb[5];
-
-        V3ij(i,j) += rho(a,b) * rho(c,d) * v ;
+        double v3 = 0;
+        for (size_t ind=Vmon3_row_start[row]; ind<Vmon3_row_start[row+1]; ++ind)
+        {
+          v3 += rho_pairs3( Vmon3_keys[ind] & 0xFFFF ) * rho_pairs3( Vmon3_keys[ind] >> 16 ) * Vmon3[ind];
+        }
+        V3ij( Vmon3_rows[row][0], Vmon3_rows[row][1] ) = v3;
       }
    }
 
@@ -427,14 +662,31 @@ void HartreeFock::UpdateF()
 /// Converged when
 /// \f[ \delta_{e} \equiv \sqrt{ \sum_{i}(e_{i}^{(n)}-e_{i}^{(n-1)})^2} < \textrm{tolerance} \f]
 /// where \f$ e_{i}^{(n)} \f$ is the \f$ i \f$th eigenvalue of the Fock matrix after \f$ n \f$ iterations.
-///
+/// With an accelerated convergence_method, the energies from Diagonalize() belong to the
+/// extrapolated/mixed/shifted Fock matrix, so the eigenvalues of the true F built by UpdateF()
+/// are used instead.
 //********************************************************
 bool HartreeFock::CheckConvergence()
 {
    CalcEHF();
    convergence_EHF.push_back(EHF);
    convergence_EHF.pop_front();
-   double ediff = arma::norm(energies-prev_energies, "frob") / energies.size();
+   double ediff;
+   if (convergence_method == "none")
+   {
+     ediff = arma::norm(energies-prev_energies, "frob") / energies.size();
+   }
+   else
+   {
+     arma::vec F_energies(energies.size(), arma::fill::zeros);
+     for ( auto& it : modelspace->OneBodyChannels )
+     {
+        arma::uvec orbvec(it.second);
+        F_energies(orbvec) = arma::eig_sym( F.submat(orbvec,orbvec) );
+     }
+     ediff = arma::norm(F_energies-prev_F_energies, "frob") / energies.size();
+     prev_F_energies = F_energies;
+   }
    convergence_ediff.push_back(ediff); // update list of convergence checks
    convergence_ediff.pop_front();
    return (ediff < tolerance);
@@ -463,6 +715,7 @@ bool HartreeFock::CheckConvergence()
 //**********************************************************************
 void HartreeFock::ReorderCoefficients()
 {
+   FreeTransformationMatrices();
    for ( auto& it : modelspace->OneBodyChannels )
    {
      arma::uvec orbvec(it.second);
@@ -508,76 +761,115 @@ void HartreeFock::ReorderCoefficients()
 //**************************************************************************
 Operator HartreeFock::TransformToHFBasis( Operator& OpHO)
 {
-
    Operator OpHF(OpHO);
+   vector<Operator*> ops = {&OpHF};
+   TransformInPlace(ops);
+   return OpHF;
+}
+
+
+/// Transform several operators to the HF basis. The matrices \f$ D \f$ are only built once,
+/// and the channels of all the operators are done in parallel.
+vector<Operator> HartreeFock::TransformToHFBasis( vector<Operator>& OpsHO)
+{
+   vector<Operator> OpsHF(OpsHO);
+   vector<Operator*> ops;
+   for (auto& op : OpsHF) ops.push_back(&op);
+   TransformInPlace(ops);
+   return OpsHF;
+}
+
+
+/// Does the work for TransformToHFBasis(). The operators passed in are
+/// still in the oscillator basis, and are overwritten with their HF-basis versions.
+void HartreeFock::TransformInPlace( vector<Operator*>& Ops)
+{
+   double start_time = omp_get_wtime();
+   BuildTransformationMatrices();
+
    // Easy part:
    //Update the one-body part by multiplying by the matrix C(i,a) = <i|a>
    // where |i> is the original basis and |a> is the HF basis
-   OpHF.OneBody = C.t() * OpHO.OneBody * C;
-
+   for (auto op : Ops)
+   {
+     op->OneBody = C.t() * op->OneBody * C;
+   }
 
    // Moderately difficult part:
    // Update the two-body part by multiplying by the matrix D(ij,ab) = <ij|ab>
-   // for each channel J,p,Tz. Most of the effort here is in constructing D.
-
-   for ( auto& it : OpHO.TwoBody.MatEl )
-   {
-      int ch_bra = it.first[0];
-      int ch_ket = it.first[1];
-      TwoBodyChannel& tbc_bra = OpHF.GetModelSpace()->GetTwoBodyChannel(ch_bra);
-      TwoBodyChannel& tbc_ket = OpHF.GetModelSpace()->GetTwoBodyChannel(ch_ket);
-      int nbras = it.second.n_rows;
-      int nkets = it.second.n_cols;
-      arma::mat Dbra(nbras,nbras);
-      arma::mat Dket(nkets,nkets);
+   // for each channel J,p,Tz. The D matrices are the same for all operators.
+   vector< pair<const array<int,2>,arma::mat>* > blocks;
+   for (auto op : Ops)
+   {
+     for ( auto& it : op->TwoBody.MatEl ) blocks.push_back( &it );
+     op->TwoBody.InvalidateNorm();
+   }
+
+   #pragma omp parallel for schedule(dynamic,1)
+   for (size_t iblock=0; iblock<blocks.size(); ++iblock)
+   {
+      int ch_bra = blocks[iblock]->first[0];
+      int ch_ket = blocks[iblock]->first[1];
+      arma::mat& M = blocks[iblock]->second;
+      M = D_cache[ch_bra].t() * M * D_cache[ch_ket];
+   }
+   FreeTransformationMatrices();
+
+   profiler.timer["HF_TransformToHFBasis"] += omp_get_wtime() - start_time;
+}
+
+
+/// Construct the matrix \f$ D(J)_{ab\alpha\beta} \f$ defined in TransformToHFBasis() for each two-body channel
+/// and store it in D_cache, so it can be used for many operators.
+/// Rows correspond to kets in the oscillator basis and columns to kets in the HF basis.
+/// Nothing is done if the matrices are already built for the current C.
+/// They take as much memory as a two-body operator, so they're freed again by FreeTransformationMatrices()
+/// at the end of TransformInPlace() and GetNormalOrderedH(). To transform several operators with one set of D's,
+/// pass them together to TransformToHFBasis().
+void HartreeFock::BuildTransformationMatrices()
+{
+   int nchan = modelspace->GetNumberTwoBodyChannels();
+   if ((int)D_cache.size() == nchan) return;
+   double start_time = omp_get_wtime();
+   D_cache.resize(nchan);
+
+   #pragma omp parallel for schedule(dynamic,1)
+   for (int ch=0; ch<nchan; ++ch)
+   {
+      TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(ch);
+      int nkets = tbc.GetNumberKets();
+      arma::mat& D = D_cache[ch];
+      D.set_size(nkets,nkets);
       // loop over all possible original basis configurations <pq| in this J,p,Tz channel.
-      // and all possible HF configurations |p'q'> in this J,p,Tz channel                                    
-      // bra is in the original basis, ket is in the HF basis                                              
-      // i and j are the indices of the matrix D for this channel                    
-      for (int i=0; i<nkets; ++i)    
+      // and all possible HF configurations |p'q'> in this J,p,Tz channel
+      // i and j are the indices of the matrix D for this channel
+      for (int i=0; i<nkets; ++i)
       {
-         Ket & ket_ho = tbc_ket.GetKet(i);   
-         for (int j=0; j<nkets; ++j)    
+         Ket & ket_ho = tbc.GetKet(i);
+         for (int j=0; j<nkets; ++j)
          {
-            Ket & ket_hf = tbc_ket.GetKet(j); 
-            Dket(i,j) = C(ket_ho.p,ket_hf.p) * C(ket_ho.q,ket_hf.q);
+            Ket & ket_hf = tbc.GetKet(j);
+            D(i,j) = C(ket_ho.p,ket_hf.p) * C(ket_ho.q,ket_hf.q);
             if (ket_ho.p!=ket_ho.q)
             {
-               Dket(i,j) += C(ket_ho.q, ket_hf.p) * C(ket_ho.p, ket_hf.q) * ket_ho.Phase(tbc_ket.J);
+               D(i,j) += C(ket_ho.q, ket_hf.p) * C(ket_ho.p, ket_hf.q) * ket_ho.Phase(tbc.J);
             }
-            if (ket_ho.p==ket_ho.q)    Dket(i,j) *= SQRT2;
-            if (ket_hf.p==ket_hf.q)    Dket(i,j) /= SQRT2;
+            if (ket_ho.p==ket_ho.q)    D(i,j) *= SQRT2;
+            if (ket_hf.p==ket_hf.q)    D(i,j) /= SQRT2;
          }
       }
-      if (ch_bra == ch_ket)
-      {
-        Dbra = Dket.t();
-      }
-      else
-      {
-        for (int i=0; i<nbras; ++i)    
-        {
-           Ket & bra_hf = tbc_bra.GetKet(i);   
-           for (int j=0; j<nbras; ++j)    
-           {
-              Ket & bra_ho = tbc_bra.GetKet(j); 
-              Dbra(i,j) = C(bra_ho.p,bra_hf.p) * C(bra_ho.q,bra_hf.q);
-              if (bra_ho.p!=bra_ho.q)
-              {
-                 Dbra(i,j) += C(bra_ho.q, bra_hf.p) * C(bra_ho.p, bra_hf.q) * bra_ho.Phase(tbc_bra.J);
-              }
-              if (bra_ho.p==bra_ho.q)    Dbra(i,j) *= SQRT2;
-              if (bra_hf.p==bra_hf.q)    Dbra(i,j) /= SQRT2;
-           }
-        }
-      }
-      auto& IN  =  it.second;
-      auto& OUT =  OpHF.TwoBody.GetMatrix(ch_bra,ch_ket);
-      OUT  =    Dbra * IN * Dket;
-
    }
+   size_t nbytes = 0;
+   for (auto& D : D_cache) nbytes += D.n_elem*sizeof(double);
+   D_cache_memory.Set(nbytes);
+   profiler.timer["HF_BuildTransformationMatrices"] += omp_get_wtime() - start_time;
+}
 
-   return OpHF;
+
+void HartreeFock::FreeTransformationMatrices()
+{
+   vector<arma::mat>().swap(D_cache);
+   D_cache_memory.Set(0);
 }
 
 
@@ -596,6 +888,7 @@ Operator HartreeFock::GetNormalOrderedH()
    HNO.ZeroBody = EHF;
    HNO.OneBody = C.t() * F * C;
 
+   BuildTransformationMatrices();
    int nchan = modelspace->GetNumberTwoBodyChannels();
    int norb = modelspace->GetNumberOrbits();
    for (int ch=0;ch<nchan;++ch)
@@ -604,7 +897,7 @@ Operator HartreeFock::GetNormalOrderedH()
       int J = tbc.J;
       int npq = tbc.GetNumberKets();
 
-      arma::mat D     = arma::mat(npq,npq,arma::fill::zeros);  // <ij|ab> = <ji|ba>
+      arma::mat& D    = D_cache[ch];
       arma::mat V3NO  = arma::mat(npq,npq,arma::fill::zeros);  // <ij|ab> = <ji|ba>
 
       #pragma omp parallel for schedule(dynamic,1) // confirmed that this improves performance
@@ -616,30 +909,23 @@ Operator HartreeFock::GetNormalOrderedH()
          {
             Ket & ket = tbc.GetKet(j); 
             int e2ket = 2*ket.op->n + ket.op->l + 2*ket.oq->n + ket.oq->l;
-            D(i,j) = C(bra.p,ket.p) * C(bra.q,ket.q);
-            if (bra.p!=bra.q)
-            {
-               D(i,j) += C(bra.q,ket.p) * C(bra.p,ket.q) * bra.Phase(J);
-            }
-            if (bra.p==bra.q)    D(i,j) *= SQRT2;
-            if (ket.p==ket.q)    D(i,j) /= SQRT2;
 
-            // Now generate the NO2B part of the 3N interaction
-            if (Hbare.GetParticleRank()<3) continue;
+            // Generate the NO2B part of the 3N interaction
+            if (H3bare.GetParticleRank()<3) continue;
             if (i>j) continue;
             for (int a=0; a<norb; ++a)
             {
               Orbit & oa = modelspace->GetOrbit(a);
-              if ( 2*oa.n+oa.l+e2bra > Hbare.GetE3max() ) continue;
+              if ( 2*oa.n+oa.l+e2bra > H3bare.GetE3max() ) continue;
               for (int b : modelspace->OneBodyChannels.at({oa.l,oa.j2,oa.tz2}))
               {
                 Orbit & ob = modelspace->GetOrbit(b);
-                if ( 2*ob.n+ob.l+e2ket > Hbare.GetE3max() ) continue;
+                if ( 2*ob.n+ob.l+e2ket > H3bare.GetE3max() ) continue;
                 int J3min = abs(2*J-oa.j2);
                 int J3max = 2*J + oa.j2;
                 for (int J3=J3min; J3<=J3max; J3+=2)
                 {
-                  V3NO(i,j) += rho(a,b) * (J3+1) * Hbare.ThreeBody.GetME_pn(J,J,J3,bra.p,bra.q,a,ket.p,ket.q,b);
+                  V3NO(i,j) += rho(a,b) * (J3+1) * H3bare.ThreeBody.GetME_pn(J,J,J3,bra.p,bra.q,a,ket.p,ket.q,b);
                 }
               }
             }
@@ -656,6 +942,7 @@ Operator HartreeFock::GetNormalOrderedH()
    }
    
    FreeVmon();
+   FreeTransformationMatrices();
 
    profiler.timer["HF_GetNormalOrderedH"] += omp_get_wtime() - start_time;
    
@@ -669,7 +956,13 @@ void HartreeFock::FreeVmon()
    // free up some memory
    array< array< arma::mat,2>,3>().swap(Vmon);
    array< array< arma::mat,2>,3>().swap(Vmon_exch);
-   vector< pair<const array<int,6>,double>>().swap( Vmon3 );
+   array< array< arma::mat,4>,4>().swap(Vmon_gathered);
+   vector<double>().swap( Vmon3 );
+   vector<uint32_t>().swap( Vmon3_keys );
+   vector<size_t>().swap( Vmon3_row_start );
+   vector< array<int,2>>().swap( Vmon3_rows );
+   vector< array<int,2>>().swap( Vmon3_pairs );
+   vmon3_memory.Set(0);
 }
 
 
@@ -699,3 +992,125 @@ Operator HartreeFock::GetOmega()
 
 
 
+
+
+//**************************************************************************
+/// Save the HF solution to a binary file, so that a later calculation can start from it with ReadState().
+/// The file contains the quantum numbers \f$ n,l,j,t_z \f$ of each orbit,
+/// followed by the matrices \f$ C \f$ and \f$ \rho \f$ and the single-particle energies.
+//**************************************************************************
+void HartreeFock::WriteState(string filename)
+{
+   ofstream outfile(filename, ios::binary);
+   if ( not outfile.good() )
+   {
+     cout << "Trouble opening " << filename << ". Aborting WriteState." << endl;
+     return;
+   }
+   int norbits = modelspace->GetNumberOrbits();
+   outfile.write(HF_STATE_TAG, sizeof(HF_STATE_TAG));
+   outfile.write((char*)&norbits, sizeof(norbits));
+   for (int i=0; i<norbits; ++i)
+   {
+     Orbit& oi = modelspace->GetOrbit(i);
+     int qn[4] = {oi.n, oi.l, oi.j2, oi.tz2};
+     outfile.write((char*)qn, sizeof(qn));
+   }
+   outfile.write((char*)C.memptr(), norbits*norbits*sizeof(double));
+   outfile.write((char*)rho.memptr(), norbits*norbits*sizeof(double));
+   outfile.write((char*)energies.memptr(), norbits*sizeof(double));
+   outfile.write((char*)&EHF, sizeof(EHF));
+   if ( not outfile.good() ) cout << "Trouble writing HF state to " << filename << endl;
+}
+
+
+//**************************************************************************
+/// Start the HF iterations from a state saved with WriteState(), instead of from the oscillator basis.
+/// The orbits are matched by their quantum numbers, so the file may come from a different emax.
+/// Orbits that aren't in the file start out as oscillator orbits, and orbits that aren't in this model space are dropped.
+/// The coefficients in each one-body channel are then orthonormalized with
+/// \f$ C \rightarrow C (C^{\dagger}C)^{-1/2} \f$, and the density matrix and Fock matrix are rebuilt with the
+/// occupations of the current reference.
+/// Returns false and leaves things as they were if the file can't be read, or if the coefficients
+/// in some channel are (numerically) linearly dependent, so that \f$ C^{\dagger}C \f$ can't be inverted.
+//**************************************************************************
+bool HartreeFock::ReadState(string filename)
+{
+   ifstream infile(filename, ios::binary);
+   char tag[sizeof(HF_STATE_TAG)];
+   int norbits_file = 0;
+   infile.read(tag, sizeof(tag));
+   infile.read((char*)&norbits_file, sizeof(norbits_file));
+   if ( not infile.good() or string(tag,sizeof(tag)-1) != HF_STATE_TAG or norbits_file<=0 )
+   {
+     cerr << "************************************" << endl
+          << "**    Trouble reading file  !!!   **" << filename << endl
+          << "************************************" << endl;
+     return false;
+   }
+   vector<int> orbit_map(norbits_file,-1); // index in this model space of each orbit in the file
+   int nmatched = 0;
+   for (int i=0; i<norbits_file; ++i)
+   {
+     int qn[4];
+     infile.read((char*)qn, sizeof(qn));
+     if ( qn[0]<0 or qn[1]<0 or qn[1]>modelspace->GetEmax() or qn[0]*2+qn[1]>modelspace->GetEmax() ) continue;
+     int index = modelspace->GetOrbitIndex(qn[0],qn[1],qn[2],qn[3]);
+     if (index < 0 or index >= modelspace->GetNumberOrbits()) continue;
+     Orbit& oi = modelspace->GetOrbit(index);
+     if (oi.n!=qn[0] or oi.l!=qn[1] or oi.j2!=qn[2] or oi.tz2!=qn[3]) continue;
+     orbit_map[i] = index;
+     ++nmatched;
+   }
+   arma::mat C_file(norbits_file,norbits_file);
+   arma::mat rho_file(norbits_file,norbits_file);
+   arma::vec energies_file(norbits_file);
+   infile.read((char*)C_file.memptr(), norbits_file*norbits_file*sizeof(double));
+   infile.read((char*)rho_file.memptr(), norbits_file*norbits_file*sizeof(double));
+   infile.read((char*)energies_file.memptr(), norbits_file*sizeof(double));
+   if ( not infile.good() )
+   {
+     cerr << "Trouble reading HF state from " << filename << ". File is truncated?" << endl;
+     return false;
+   }
+
+   int norbits = modelspace->GetNumberOrbits();
+   arma::mat C_old = C;
+   arma::vec energies_old = energies;
+   C.eye(norbits,norbits);
+   FreeTransformationMatrices();
+   for (int i=0; i<norbits_file; ++i)
+   {
+     if (orbit_map[i]<0) continue;
+     for (int j=0; j<norbits_file; ++j)
+     {
+       if (orbit_map[j]<0) continue;
+       C(orbit_map[i],orbit_map[j]) = C_file(i,j);
+     }
+     energies(orbit_map[i]) = energies_file(i);
+   }
+
+   // If we've added or dropped orbits, C isn't quite unitary anymore.
+   for ( auto& it : modelspace->OneBodyChannels )
+   {
+     arma::uvec orbvec(it.second);
+     arma::mat C_ch = C.submat(orbvec,orbvec);
+     arma::vec s;
+     arma::mat U;
+     if ( not arma::eig_sym(s, U, C_ch.t()*C_ch) or s.min() < 1e-10*s.max() or s.max()<=0 )
+     {
+       cerr << "Trouble reading HF state from " << filename << ": the orbits in the channel l=" << it.first[0] << " j2=" << it.first[1] << " tz2=" << it.first[2]
+            << " are linearly dependent, so they can't be orthonormalized." << endl;
+       C = C_old;
+       energies = energies_old;
+       return false;
+     }
+     C.submat(orbvec,orbvec) = C_ch * U * arma::diagmat(1.0/arma::sqrt(s)) * U.t();
+   }
+
+   UpdateDensityMatrix();
+   UpdateF();
+   prev_energies = energies;
+   cout << "Starting Hartree-Fock from " << filename << " (" << nmatched << " of " << norbits << " orbits matched)" << endl;
+   return true;
+}
@@ -7,11 +7,15 @@
 #include <armadillo>
 #include <map>
 #include <deque>
+#include <cstdint>
+
+#define HF_STATE_TAG "IMSRG_HF_STATE_v1"
 
 class HartreeFock
 {
  public:
    Operator& Hbare;         ///< Input bare Hamiltonian
+   Operator& H3bare;        ///< Where the three-body part of the bare Hamiltonian is read from. Usually Hbare itself.
    ModelSpace * modelspace; ///< Model Space of the Hamiltonian
    arma::mat C;             ///< transformation coefficients, 1st index is ho basis, 2nd = HF basis
    arma::mat rho;           ///< density matrix rho_ij
@@ -21,39 +25,76 @@ class HartreeFock
    arma::mat F;             ///< Fock matrix
    array< array< arma::mat,2>,3> Vmon;          ///< Monopole 2-body interaction
    array< array< arma::mat,2>,3> Vmon_exch;          ///< Monopole 2-body interaction
+   array< vector< array<int,2>>,4> HF_pairs;  ///< Pairs of orbits i<=j in the same one-body channel, sorted by (tz,parity) of i
+   array< array< arma::mat,4>,4> Vmon_gathered; ///< Vmon rearranged so UpdateF() is a matrix-vector product. See BuildMonopoleGather().
    arma::uvec holeorbs;     ///< list of hole orbits for generating density matrix
    arma::rowvec hole_occ; /// occupations of hole orbits
    arma::vec energies;      ///< vector of single particle energies
    arma::vec prev_energies; ///< SPE's from last iteration
+   arma::vec prev_F_energies; ///< Eigenvalues of the unaccelerated Fock matrix from last iteration, see CheckConvergence()
    double tolerance;        ///< tolerance for convergence
    double EHF;              ///< Hartree-Fock energy (Normal-ordered 0-body term)
    double e1hf;             ///< One-body contribution to EHF
    double e2hf;             ///< Two-body contribution to EHF
    double e3hf;             ///< Three-body contribution to EHF
    int iterations;          ///< iterations used in Solve()
-   vector< pair<const array<int,6>,double>> Vmon3;
+   vector<double> Vmon3;                ///< Monopole 3-body interaction, stored in rows of (i,j). See BuildMonopoleV3().
+   vector<uint32_t> Vmon3_keys;         ///< For each element of Vmon3, the index of (a,b) in the low 16 bits and of (c,d) in the high 16 bits
+   vector<size_t> Vmon3_row_start;      ///< Row k of Vmon3 is [ Vmon3_row_start[k], Vmon3_row_start[k+1] )
+   vector< array<int,2>> Vmon3_rows;    ///< (i,j) for each row of Vmon3
+   vector< array<int,2>> Vmon3_pairs;   ///< Orbit pairs (a,b) in the same one-body channel, referred to by Vmon3_keys
+   IMSRGProfiler::MemoryTracker vmon3_memory; ///< The size of all the Vmon3 vectors, for the memory accounting
    IMSRGProfiler profiler;  ///< Profiler for timing, etc.
    deque<double> convergence_ediff; ///< Save last few convergence checks for diagnostics
    deque<double> convergence_EHF; ///< Save last few convergence checks for diagnostics
+   int maxiter;             ///< Maximum number of iterations in Solve()
+   string convergence_method; ///< How to get the next Fock matrix: "diis", "mixing", "levelshift" or "none" (plain iteration, the default)
+   string DIIS_fallback;    ///< "mixing", "levelshift" or "none", used before DIIS starts or when the extrapolation fails
+   int DIIS_max_vectors;    ///< Number of previous Fock matrices used in the DIIS extrapolation
+   double mixing_alpha;     ///< Fraction of the new Fock matrix kept with linear mixing
+   double level_shift;      ///< Energy by which unoccupied orbits are shifted with the level shift method
+   double applied_shift;    ///< The level shift that went into the last diagonalization
+   arma::mat F_prev;        ///< Fock matrix used in the last diagonalization, needed for mixing
+   deque<arma::mat> DIIS_F;     ///< Previous Fock matrices for DIIS
+   deque<arma::mat> DIIS_error; ///< Commutators [F,rho] corresponding to DIIS_F
+   vector<arma::mat> D_cache;   ///< Two-body transformation matrices for each channel. See BuildTransformationMatrices().
+   IMSRGProfiler::MemoryTracker D_cache_memory; ///< The size of D_cache, for the memory accounting
 
 // Methods
    HartreeFock(Operator&  hbare); ///< Constructor
+   HartreeFock(Operator&  hbare, Operator& h3bare); ///< Constructor taking the three-body part from another operator
    void BuildMonopoleV();         ///< Only the monopole part of V is needed, so construct it.
    void BuildMonopoleV3();        ///< Only the monopole part of V3 is needed.
+   void BuildMonopoleGather();    ///< Rearrange Vmon for a fast UpdateF()
    void Diagonalize();            ///< Diagonalize the Fock matrix
    void UpdateF();                ///< Update the Fock matrix with the new transformation coefficients C
    void UpdateDensityMatrix();    ///< Update the density matrix with the new coefficients C
    bool CheckConvergence();       ///< Compare the current energies with those from the previous iteration
+   void AccelerateF();            ///< Modify F with DIIS, mixing or a level shift before the next diagonalization
+   bool ExtrapolateF_DIIS();      ///< Replace F with the DIIS extrapolation. Returns false if that didn't work.
+   void MixF();                   ///< Linear mixing of the new and previous Fock matrices
+   void LevelShiftF();            ///< Shift the unoccupied orbits up in energy
    void Solve();                  ///< Diagonalize and UpdateF until convergence
    void CalcEHF();                ///< Evaluate the Hartree Fock energy
    void PrintEHF();               ///< Print out the Hartree Fock energy
    void ReorderCoefficients();    ///< Reorder the coefficients in C to eliminate phases etc.
+   void BuildTransformationMatrices(); ///< Construct the two-body transformation D for each channel from C
+   void FreeTransformationMatrices();  ///< Free D_cache once the operators that need it are transformed
    Operator TransformToHFBasis( Operator& OpIn); ///< Transform an operator from oscillator basis to HF basis
+   vector<Operator> TransformToHFBasis( vector<Operator>& OpsIn); ///< Transform several operators at once
+   void TransformInPlace( vector<Operator*>& Ops); ///< Transform operators which are already copies of the oscillator basis operators
    Operator GetNormalOrderedH();  ///< Return the Hamiltonian in the HF basis at the normal-ordered 2body level.
    Operator GetOmega();           ///< Return a generator of the Hartree Fock transformation
    Operator GetHbare(){return Hbare;}; ///< Getter function for Hbare
    void PrintSPE(){ F.diag().print();}; ///< Print out the single-particle energies
    void FreeVmon();               ///< Free up the memory used to store Vmon3.
+   void WriteState(string filename); ///< Save C, rho and the single-particle energies to a binary file
+   bool ReadState(string filename);  ///< Start from a solution saved with WriteState(), possibly with a smaller emax
+   void SetConvergenceMethod(string method, string fallback="mixing"){convergence_method=method; DIIS_fallback=fallback;};
+   void SetDIISVectors(int n){DIIS_max_vectors=n;};
+   void SetMixing(double alpha){mixing_alpha=alpha;};
+   void SetLevelShift(double shift){level_shift=shift;};
+   void SetMaxIterations(int n){maxiter=n;};
 
 };
 
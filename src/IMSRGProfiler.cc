@@ -3,11 +3,22 @@
 #include <stdlib.h>
 #include <sys/resource.h>
 #include <omp.h>
+#include <fstream>
+#include <algorithm>
 
 
-map<string, double> IMSRGProfiler::timer;
-map<string, int> IMSRGProfiler::counter;
-float IMSRGProfiler::start_time = -1;
+thread_local map<string, double> IMSRGProfiler::timer;
+thread_local map<string, int> IMSRGProfiler::counter;
+double IMSRGProfiler::start_time = -1;
+thread_local map<string, double> IMSRGProfiler::flops;
+thread_local map<string, double> IMSRGProfiler::bytes;
+double IMSRGProfiler::peak_gflops = 0;
+double IMSRGProfiler::peak_bandwidth = 0;
+thread_local IMSRGProfiler::ThreadBooks* IMSRGProfiler::books = NULL;
+vector<IMSRGProfiler::ThreadBooks*> IMSRGProfiler::all_books;
+mutex IMSRGProfiler::books_mutex;
+bool IMSRGProfiler::trace_enabled = false;
+size_t IMSRGProfiler::max_trace_events = 1000000;
 
 IMSRGProfiler::IMSRGProfiler()
 {
@@ -87,13 +98,314 @@ void IMSRGProfiler::PrintMemory()
      cout << fixed << setw(40) << std::left << it.first + ":  " << setw(12) << setprecision(3) << std::right << it.second/1024. << endl;
 
    cout << fixed << setw(40) << std::left << "Max Used:  " << setw(12) << setprecision(3) << std::right << MaxMemUsage()/1024.  << endl;
+
+   MemoryBooks& mem = GetMemoryBooks();
+   lock_guard<mutex> lock(mem.lock);
+   if (mem.peak.empty()) return;
+   cout << "---------------------- tracked ---------------------" << endl;
+   cout << setw(40) << "" << setw(12) << std::right << "now" << setw(12) << "peak" << endl;
+   for (auto it : mem.peak)
+     cout << setw(40) << std::left << it.first + ":  " << std::right << setprecision(3) << setw(12) << mem.current[it.first]/1048576. << setw(12) << it.second/1048576. << endl;
+   cout << setw(40) << std::left << "total:  " << std::right << setw(12) << mem.total/1048576. << setw(12) << mem.total_peak/1048576. << endl;
+   if (mem.phases.empty()) return;
+   cout << "------------------- peak by phase ------------------" << endl;
+   cout << setw(40) << "" << setw(12) << std::right << "tracked" << setw(12) << "RSS" << "   largest component" << endl;
+   if (mem.phases.back().rss_reset) mem.phases.back().rss_peak = ReadPeakRSS(); // the phase we're in
+   for (auto& phase : mem.phases)
+   {
+     auto largest = max_element(phase.component_peak.begin(), phase.component_peak.end(),
+                                [](const pair<string,long long>& a, const pair<string,long long>& b){return a.second < b.second;});
+     cout << setw(40) << std::left << phase.name + ":  " << std::right << setw(12) << phase.tracked_peak/1048576.;
+     if (phase.rss_peak > 0) cout << setw(12) << phase.rss_peak/1024.;
+     else                    cout << setw(12) << "-";
+     if (largest != phase.component_peak.end()) cout << "   " << largest->first << " (" << largest->second/1048576. << ")";
+     cout << endl;
+   }
 }
 
 void IMSRGProfiler::PrintAll()
 {
   PrintCounters();
   PrintTimes();
+  PrintTree();
+  PrintRoofline();
   PrintMemory();
 }
 
 
+IMSRGProfiler::MemoryBooks& IMSRGProfiler::GetMemoryBooks()
+{
+  static MemoryBooks* mem = new MemoryBooks;
+  return *mem;
+}
+
+void IMSRGProfiler::TrackMemory(const string& component, long long bytes)
+{
+  if (bytes == 0) return;
+  MemoryBooks& mem = GetMemoryBooks();
+  lock_guard<mutex> lock(mem.lock);
+  long long& current = mem.current[component];
+  current += bytes;
+  mem.total += bytes;
+  long long& peak = mem.peak[component];
+  if (current > peak) peak = current;
+  if (mem.total > mem.total_peak) mem.total_peak = mem.total;
+  if (mem.phases.empty()) return;
+  MemoryPhase& phase = mem.phases.back();
+  long long& phase_peak = phase.component_peak[component];
+  if (current > phase_peak) phase_peak = current;
+  if (mem.total > phase.tracked_peak) phase.tracked_peak = mem.total;
+}
+
+void IMSRGProfiler::MemoryTracker::Set(size_t b)
+{
+  TrackMemory(component, (long long)b - (long long)bytes);
+  bytes = b;
+}
+
+map<string,long long> IMSRGProfiler::GetTrackedMemory()
+{
+  MemoryBooks& mem = GetMemoryBooks();
+  lock_guard<mutex> lock(mem.lock);
+  map<string,long long> current = mem.current;
+  current["total"] = mem.total;
+  return current;
+}
+
+/// Finish the current memory phase (if any) and start a new one, which begins with what is held now.
+/// Phases are for the whole process, so with several flows running at the same time they get mixed up.
+void IMSRGProfiler::StartMemoryPhase(string name)
+{
+  MemoryBooks& mem = GetMemoryBooks();
+  lock_guard<mutex> lock(mem.lock);
+  if (not mem.phases.empty() and mem.phases.back().rss_reset) mem.phases.back().rss_peak = ReadPeakRSS();
+  bool reset = ResetPeakRSS();
+  mem.phases.push_back( {name, mem.total, mem.current, 0, reset} );
+}
+
+/// The high-water mark of the resident set size (VmHWM) in kB, or 0 if we can't tell.
+size_t IMSRGProfiler::ReadPeakRSS()
+{
+  ifstream status("/proc/self/status");
+  string line;
+  while (getline(status,line))
+  {
+    if (line.substr(0,6) == "VmHWM:") return strtoul(line.substr(6).c_str(),NULL,10);
+  }
+  return 0;
+}
+
+/// Reset the high-water mark of the resident set size, so that it can be read for each phase. Linux only.
+bool IMSRGProfiler::ResetPeakRSS()
+{
+  ofstream clear_refs("/proc/self/clear_refs");
+  clear_refs << "5" << endl;
+  return clear_refs.good();
+}
+
+
+/// Add work done by the calling thread to the Scope which is open, and to all the Scopes enclosing it.
+/// The kernels call this outside of their parallel loops, with counts worked out from the matrix dimensions.
+/// For the bytes, matrices which are used as a whole (as in a GEMM) are counted as read once, and the output
+/// as written once, so that the arithmetic intensity is an upper bound. Elements gathered one at a time,
+/// as in the Pandya transformations, are counted each time they are read, along with the 6j or 9j symbol.
+void IMSRGProfiler::CountWork(double nflops, double nbytes)
+{
+  for (TimerNode* node=GetBooks()->current; node->parent!=NULL; node=node->parent)
+  {
+    flops[node->name] += nflops;
+    bytes[node->name] += nbytes;
+  }
+}
+
+/// Count the matrix product \f$ C_{m\times n} = A_{m\times k} B_{k\times n} \f$
+void IMSRGProfiler::CountGEMM(double m, double n, double k)
+{
+  CountWork( 2*m*n*k, sizeof(double)*(m*k + k*n + m*n) );
+}
+
+
+/// Print the rate and arithmetic intensity (operations per byte) of each Scope which has counted its work.
+/// If the peaks of the machine are known, also say whether the kernel is below the ridge point of the roofline,
+/// i.e. memory-bound, or above it, i.e. compute-bound, and what fraction of the attainable rate it gets.
+void IMSRGProfiler::PrintRoofline()
+{
+  if (flops.empty()) return;
+  bool have_peaks = peak_gflops>0 and peak_bandwidth>0;
+  cout << "===================== ROOFLINE =====================" << endl;
+  cout << setw(40) << std::left << "" << setw(12) << std::right << "GFLOP" << setw(10) << "GFLOP/s" << setw(10) << "GB/s" << setw(10) << "FLOP/B";
+  if (have_peaks) cout << "    bound    %attainable   (ridge at " << setprecision(2) << fixed << peak_gflops/peak_bandwidth << " FLOP/B)";
+  cout << endl;
+  for ( auto it : flops )
+  {
+    double t = timer[it.first];
+    double gflop = it.second * 1e-9;
+    double gbyte = bytes[it.first] * 1e-9;
+    double intensity = gbyte>0 ? gflop/gbyte : 0;
+    double rate = t>0 ? gflop/t : 0;
+    cout << setw(40) << std::left << it.first + ":  " << std::right << fixed << setprecision(3) << setw(12) << gflop
+         << setw(10) << rate << setw(10) << (t>0 ? gbyte/t : 0) << setw(10) << intensity;
+    if (have_peaks)
+    {
+      double attainable = min(peak_gflops, intensity*peak_bandwidth);
+      cout << "  " << setw(8) << (intensity < peak_gflops/peak_bandwidth ? "memory" : "compute")
+           << setw(12) << setprecision(1) << (attainable>0 ? 100*rate/attainable : 0);
+    }
+    cout << endl;
+  }
+}
+
+
+
+
+IMSRGProfiler::TimerNode* IMSRGProfiler::TimerNode::GetChild(const char* n)
+{
+  for (auto child : children)
+  {
+    if (child->name == n) return child;
+  }
+  children.push_back( new TimerNode(n,this) );
+  return children.back();
+}
+
+IMSRGProfiler::ThreadBooks* IMSRGProfiler::GetBooks()
+{
+  if (books == NULL)
+  {
+    lock_guard<mutex> lock(books_mutex);
+    books = new ThreadBooks(all_books.size());
+    all_books.push_back(books);
+  }
+  return books;
+}
+
+IMSRGProfiler::Scope::Scope(const char* name, int ind)
+ : books(GetBooks()), index(ind)
+{
+  node = books->current->GetChild(name);
+  books->current = node;
+  t_start = omp_get_wtime();
+}
+
+IMSRGProfiler::Scope::~Scope()
+{
+  double dt = omp_get_wtime() - t_start;
+  node->time += dt;
+  node->ncalls++;
+  books->current = node->parent;
+  timer[node->name] += dt;
+  if (trace_enabled and books->trace.size() < max_trace_events)
+    books->trace.push_back( {node, t_start-start_time, dt, index} );
+}
+
+
+/// Print the call tree of this thread's Scopes, with the fraction of the parent's time spent in each.
+void IMSRGProfiler::PrintTree()
+{
+  ThreadBooks* b = GetBooks();
+  if (b->root.children.empty()) return;
+  cout << "===================== CALL TREE (s) ================" << endl;
+  vector<pair<TimerNode*,int>> stack; // node and depth, for a depth-first walk
+  for (auto it=b->root.children.rbegin(); it!=b->root.children.rend(); ++it) stack.push_back({*it,0});
+  while (not stack.empty())
+  {
+    TimerNode* node = stack.back().first;
+    int depth = stack.back().second;
+    stack.pop_back();
+    double parent_time = node->parent->parent==NULL ? GetTimes()["real"] : node->parent->time;
+    cout << setw(40) << std::left << string(2*depth,' ') + node->name + ":  " << setw(12) << setprecision(5) << std::right << fixed << node->time
+         << " (" << setw(5) << setprecision(1) << 100*node->time/parent_time << "%)  " << setw(8) << node->ncalls << " calls" << endl;
+    for (auto it=node->children.rbegin(); it!=node->children.rend(); ++it) stack.push_back({*it,depth+1});
+  }
+}
+
+
+/// Write the Scopes recorded since EnableTrace() as Chrome trace events, i.e. JSON which can be
+/// loaded into chrome://tracing or https://ui.perfetto.dev. Each thread gets its own row.
+void IMSRGProfiler::WriteTrace(string filename)
+{
+  ofstream outfile(filename);
+  if (not outfile.good())
+  {
+    cout << "IMSRGProfiler::WriteTrace: couldn't open " << filename << " for writing" << endl;
+    return;
+  }
+  lock_guard<mutex> lock(books_mutex);
+  int pid = getpid();
+  outfile << "{\"traceEvents\":[" << endl;
+  bool first = true;
+  outfile << fixed << setprecision(3);
+  for (auto b : all_books)
+  {
+    outfile << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << b->thread_number
+            << ",\"args\":{\"name\":\"thread " << b->thread_number << "\"}}";
+    first = false;
+    for (auto& event : b->trace)
+    {
+      outfile << ",\n{\"name\":\"" << event.node->name << "\",\"cat\":\"imsrg\",\"ph\":\"X\",\"ts\":" << 1e6*event.start << ",\"dur\":" << 1e6*event.duration
+              << ",\"pid\":" << pid << ",\"tid\":" << b->thread_number;
+      if (event.index >= 0) outfile << ",\"args\":{\"index\":" << event.index << "}";
+      outfile << "}";
+    }
+  }
+  outfile << "\n],\"displayTimeUnit\":\"ms\"}" << endl;
+}
+
+
+/// Write the call trees of all threads in the "collapsed stack" format, one line per path through the tree
+/// with the time in microseconds spent in the last node but not its children. The threads are summed.
+/// This is the input for flamegraph.pl, and can be loaded into https://speedscope.app.
+void IMSRGProfiler::WriteCollapsedStacks(string filename)
+{
+  ofstream outfile(filename);
+  if (not outfile.good())
+  {
+    cout << "IMSRGProfiler::WriteCollapsedStacks: couldn't open " << filename << " for writing" << endl;
+    return;
+  }
+  lock_guard<mutex> lock(books_mutex);
+  map<string,double> self_time;
+  for (auto b : all_books)
+  {
+    vector<pair<TimerNode*,string>> stack;
+    for (auto child : b->root.children) stack.push_back({child,child->name});
+    while (not stack.empty())
+    {
+      TimerNode* node = stack.back().first;
+      string path = stack.back().second;
+      stack.pop_back();
+      double t_self = node->time;
+      for (auto child : node->children)
+      {
+        t_self -= child->time;
+        stack.push_back({child, path + ";" + child->name});
+      }
+      self_time[path] += t_self;
+    }
+  }
+  for (auto& it : self_time)
+  {
+    long usec = (long) (1e6*it.second);
+    if (usec > 0) outfile << it.first << " " << usec << endl;
+  }
+}
+
+
+void IMSRGProfiler::Clear()
+{
+  timer.clear();
+  counter.clear();
+  flops.clear();
+  bytes.clear();
+  ThreadBooks* b = GetBooks();
+  b->trace.clear();
+  vector<TimerNode*> stack = {&b->root};
+  while (not stack.empty())
+  {
+    TimerNode* node = stack.back();
+    stack.pop_back();
+    node->time = 0;
+    node->ncalls = 0;
+    for (auto child : node->children) stack.push_back(child);
+  }
+}
@@ -7,20 +7,137 @@
 #include <iostream>
 #include <iomanip>
 #include <map>
+#include <vector>
+#include <string>
+#include <mutex>
 
 /// Profiling class with all static data members.
 /// This is for keeping track of timing and memory usage, etc.
-/// IMSRGProfiler methods should probably not be called inside parallel blocks.
+/// The timers and counters are kept separately for each thread, so that flows
+/// running at the same time (e.g. the jobs of an ensemble) don't step on each other.
+///
+/// Besides the flat timers, there are nested timers made with Scope, which record
+/// where in the call tree the time was spent, e.g. Commutator -> comm222_phss -> DoPandyaTransformation.
+/// Scopes may be used inside parallel blocks. Each thread keeps its own call tree, and
+/// optionally a list of trace events. These can be written out with WriteTrace(), for
+/// chrome://tracing or Perfetto, and WriteCollapsedStacks(), for flamegraph.pl or speedscope.
+/// The printing and writing methods should be called outside of parallel blocks.
+///
+/// The heavy kernels also count their floating point operations and the bytes they move with CountWork(),
+/// from the dimensions of the matrices involved. PrintRoofline() turns these into GFLOP/s and arithmetic
+/// intensity, which tells whether a kernel is limited by the arithmetic or by the memory bandwidth.
+///
+/// The memory held by the big parts of the calculation (OneBody, TwoBody, ThreeBody, the angular momentum caches,
+/// commutator scratch, ...) is tracked by MemoryTrackers and TrackMemory(). Unlike the timers, this is for the whole process.
+/// The peaks are also kept for each phase of the calculation started with StartMemoryPhase(), and printed by PrintMemory().
 
 using namespace std;
 
 class IMSRGProfiler
 {
  public:
-  // timer and counter are declaired as static so that there's only one copy of each of them
-  static map<string, double> timer; ///< For keeping timing information for various method calls
-  static map<string, int> counter;
-  static float start_time;
+  // timer and counter are declaired as static so that there's only one copy of each of them per thread
+  static thread_local map<string, double> timer; ///< For keeping timing information for various method calls
+  static thread_local map<string, int> counter;
+  static double start_time;
+  static thread_local map<string, double> flops; ///< Floating point operations, for each Scope name. Like the timers, these include the children.
+  static thread_local map<string, double> bytes; ///< Bytes moved to or from memory, for each Scope name
+  static double peak_gflops;     ///< Peak GFLOP/s of the machine. If this and peak_bandwidth are set, PrintRoofline says what bounds each kernel.
+  static double peak_bandwidth;  ///< Peak memory bandwidth of the machine, in GB/s
+
+  /// One node in the call tree of a thread's Scopes.
+  struct TimerNode
+  {
+    string name;
+    TimerNode* parent;
+    vector<TimerNode*> children;
+    double time;   ///< Total time spent in this node, including its children
+    long ncalls;
+    TimerNode(string n, TimerNode* p) : name(n), parent(p), time(0), ncalls(0) {};
+    TimerNode* GetChild(const char* n);
+  };
+
+  /// A finished Scope, for the trace. Times are in seconds since start_time.
+  struct TraceEvent
+  {
+    const TimerNode* node;
+    double start;
+    double duration;
+    int index;
+  };
+
+  /// Everything recorded by the Scopes of one thread. These are never deleted,
+  /// so the records of threads which have finished can still be written out.
+  struct ThreadBooks
+  {
+    TimerNode root;
+    TimerNode* current;
+    vector<TraceEvent> trace;
+    int thread_number; ///< Order in which the threads first used a Scope. Used as the tid in the trace.
+    ThreadBooks(int n) : root("",NULL), current(&root), thread_number(n) {};
+  };
+
+  /// Time the enclosing block, as a child of whichever Scope is open on this thread.
+  /// The time is also added to timer[name]. An index (e.g. the flow step) can be given, which goes into the trace.
+  class Scope
+  {
+   public:
+    Scope(const char* name, int index=-1);
+    ~Scope();
+   private:
+    ThreadBooks* books;
+    TimerNode* node;
+    double t_start;
+    int index;
+  };
+
+  /// Keeps the count of one component's memory up to date for an object which holds it.
+  /// The object calls Set() with its current size whenever its storage is allocated or freed.
+  /// Copying the tracker along with the object counts the memory of the copy too, and the destructor takes it off.
+  class MemoryTracker
+  {
+   public:
+    MemoryTracker(const char* comp) : component(comp), bytes(0) {};
+    MemoryTracker(const MemoryTracker& other) : component(other.component), bytes(0) {Set(other.bytes);};
+    MemoryTracker(MemoryTracker&& other) : component(other.component), bytes(other.bytes) {other.bytes=0;};
+    MemoryTracker& operator=(const MemoryTracker& other){Set(other.bytes); return *this;};
+    MemoryTracker& operator=(MemoryTracker&& other){Set(0); bytes=other.bytes; other.bytes=0; return *this;};
+    ~MemoryTracker(){Set(0);};
+    void Set(size_t b);
+    void SetComponent(const char* comp){size_t b=bytes; Set(0); component=comp; Set(b);}; ///< Count the memory under another component from now on
+    size_t GetBytes() const {return bytes;};
+   private:
+    const char* component;
+    size_t bytes;
+  };
+
+  /// Peak memory during one phase of the calculation
+  struct MemoryPhase
+  {
+    string name;
+    long long tracked_peak;               ///< Peak of the sum of all the tracked components
+    map<string,long long> component_peak;
+    size_t rss_peak;                      ///< Peak resident set size in kB, filled in when the phase is over
+    bool rss_reset;                       ///< Whether the system let us reset the peak RSS at the start of the phase
+  };
+
+  /// The memory accounting. Made the first time it's needed, and never deleted,
+  /// so that objects destroyed at exit can still take themselves off the books.
+  struct MemoryBooks
+  {
+    mutex lock;
+    map<string,long long> current;
+    map<string,long long> peak;
+    long long total = 0;
+    long long total_peak = 0;
+    vector<MemoryPhase> phases;
+  };
+
+  static thread_local ThreadBooks* books;   ///< This thread's books. Made the first time it's needed.
+  static vector<ThreadBooks*> all_books;
+  static mutex books_mutex;
+  static bool trace_enabled;
+  static size_t max_trace_events;  ///< Per thread, so that the trace can't grow without bound
 
   IMSRGProfiler();
   map<string,size_t> CheckMem(); // Kbytes  RSS  DIRTY
@@ -28,8 +145,28 @@ class IMSRGProfiler
   void PrintTimes();
   void PrintCounters();
   void PrintMemory();
+  void PrintTree();
+  void PrintRoofline();
   void PrintAll();
   size_t MaxMemUsage();
+
+  void EnableTrace(bool enable=true, size_t max_events=1000000){trace_enabled=enable; max_trace_events=max_events;};
+  void WriteTrace(string filename);
+  void WriteCollapsedStacks(string filename);
+  void Clear(); ///< Clear this thread's timers, counters, work counts, call tree and trace
+  void SetMachinePeak(double gflops, double gbytes_per_second){peak_gflops=gflops; peak_bandwidth=gbytes_per_second;};
+
+  static void CountWork(double nflops, double nbytes);
+  static void CountGEMM(double m, double n, double k);
+
+  static MemoryBooks& GetMemoryBooks();
+  static void TrackMemory(const string& component, long long bytes); ///< Add (or take off, if negative) bytes held by a component
+  static map<string,long long> GetTrackedMemory(); ///< Bytes currently held by each tracked component, and the "total"
+  void StartMemoryPhase(string name);
+  static size_t ReadPeakRSS();
+  static bool ResetPeakRSS();
+
+  static ThreadBooks* GetBooks();
 };
 
 #endif
@@ -1,20 +1,87 @@
 
 #include "IMSRGSolver.hh"
 #include <iomanip>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <array>
 
 #ifndef NO_ODE
 #include <boost/numeric/odeint.hpp>
 #endif
 
+
+/// Write buffer to fname on a background thread. The data goes to fname.tmp first and is then
+/// renamed, so a reader never sees a partly written file. If that fails, failed is set to true.
+/// The caller has to join the thread before looking at it.
+static shared_ptr<thread> WriteFileInBackground(shared_ptr<string> buffer, string fname, bool& failed)
+{
+  return make_shared<thread>( [buffer,fname,&failed]()
+  {
+    string tmpname = fname + ".tmp";
+    ofstream ofs(tmpname, ios::binary);
+    ofs.write(buffer->data(), buffer->size());
+    ofs.close();
+    if ( ofs.fail() or rename(tmpname.c_str(), fname.c_str()) != 0 )
+    {
+      cerr << "Trouble writing " << fname << endl;
+      remove(tmpname.c_str());
+      failed = true;
+    }
+  });
+}
+
+/// Lets us serialize an Operator with WriteBinary() straight into a string, which then goes to the I/O thread without being copied.
+struct StringWriteBuffer : streambuf
+{
+  string& buffer;
+  StringWriteBuffer(string& b) : buffer(b) {}
+  streamsize xsputn(const char* s, streamsize n) { buffer.append(s,n); return n; }
+  int_type overflow(int_type c) { if (c != traits_type::eof()) buffer.push_back(c); return c; }
+};
+
+/// Read the whole file into buffer. Used to prefetch the next Omega from the scratch directory.
+static void ReadFileToBuffer(string fname, string& buffer)
+{
+  ifstream ifs(fname, ios::binary|ios::ate);
+  buffer.clear();
+  if ( not ifs.good() ) return;
+  buffer.resize( ifs.tellg() );
+  ifs.seekg(0);
+  ifs.read(&buffer[0], buffer.size());
+  if ( not ifs.good() ) buffer.clear();
+}
+
+/// Lets us read an Operator out of a buffer with ReadBinary() without copying it.
+struct MemoryBuffer : streambuf
+{
+  MemoryBuffer(string& buffer) { setg(&buffer[0], &buffer[0], &buffer[0]+buffer.size()); }
+};
+
+
+/// The pid, plus a multiple of 10^7 (more than any pid) for every solver made before this one,
+/// so that two solvers in the same process don't use the same scratch files.
+static int UniqueOmegaFileId()
+{
+  static atomic<int> nsolvers(0);
+  return getpid() + 10000000 * (nsolvers++ % 200);
+}
+
+
 IMSRGSolver::~IMSRGSolver()
 {
+  FinishCheckpoint();
+  FinishOmegaWrite();
   CleanupScratch();
 }
 
 IMSRGSolver::IMSRGSolver()
     : rw(NULL),s(0),ds(0.1),ds_max(0.5),
      norm_domega(0.1), omega_norm_max(2.0),eta_criterion(1e-6),method("magnus_euler"),
-     flowfile(""), n_omega_written(0),max_omega_written(50),magnus_adaptive(true)
+     flowfile(""), n_omega_written(0),max_omega_written(50),magnus_adaptive(true),magnus_tolerance(1e-4),extrapolation_tolerance(0)
+     ,E0_extrapolated(0),E0_extrapolation_error(0),omega_sparsify_threshold(0),sparse_fill_cutoff(0),sparsify_test_operator(NULL)
+     ,omega_file_id(UniqueOmegaFileId()),checkpoint_file(""),checkpoint_interval(10),checkpoint_walltime(0)
+     ,last_checkpoint_step(0),last_checkpoint_time(0),omega_write_failed(false),checkpoint_write_failed(false),restarted(false),flowfile_memory(false)
      ,ode_monitor(*this),ode_mode("H"),ode_e_abs(1e-6),ode_e_rel(1e-6)
 {}
 
@@ -23,7 +90,10 @@ IMSRGSolver::IMSRGSolver( Operator &H_in)
    : modelspace(H_in.GetModelSpace()),rw(NULL), H_0(&H_in), FlowingOps(1,H_in), Eta(H_in), 
     istep(0), s(0),ds(0.1),ds_max(0.5),
     smax(2.0), norm_domega(0.1), omega_norm_max(2.0),eta_criterion(1e-6),method("magnus_euler"),
-    flowfile(""), n_omega_written(0),max_omega_written(50),magnus_adaptive(true)
+    flowfile(""), n_omega_written(0),max_omega_written(50),magnus_adaptive(true),magnus_tolerance(1e-4),extrapolation_tolerance(0)
+    ,E0_extrapolated(0),E0_extrapolation_error(0),omega_sparsify_threshold(0),sparse_fill_cutoff(0),sparsify_test_operator(NULL)
+    ,omega_file_id(UniqueOmegaFileId()),checkpoint_file(""),checkpoint_interval(10),checkpoint_walltime(0)
+    ,last_checkpoint_step(0),last_checkpoint_time(0),omega_write_failed(false),checkpoint_write_failed(false),restarted(false),flowfile_memory(false)
     ,ode_monitor(*this),ode_mode("H"),ode_e_abs(1e-6),ode_e_rel(1e-6)
 {
    Eta.Erase();
@@ -38,19 +108,25 @@ void IMSRGSolver::NewOmega()
   H_saved = FlowingOps[0];
   cout << "pushing back another Omega. Omega.size = " << Omega.size()
        << " , operator size = " << Omega.front().Size()/1024./1024. << " MB"
+       << ",  all Omegas = " << GetMemoryUsage()["Omega"]/1024./1024./1024. << " GB"
        << ",  memory usage = " << profiler.CheckMem()["RSS"]/1024./1024. << " GB"
        << endl;
   if ((rw != NULL) and (rw->GetScratchDir() !=""))
   {
-    
-    char tmp[512];
-    sprintf(tmp,"%s/OMEGA_%06d_%03d",rw->GetScratchDir().c_str(), getpid(), n_omega_written);
-    string fname(tmp);
-    ofstream ofs(fname, ios::binary);
-    Omega.back().WriteBinary(ofs);
+    // Serialize Omega here, and leave the slow part to the I/O thread so the flow can go on.
+    double t_start = omp_get_wtime();
+    FinishOmegaWrite(); // at most one Omega in flight, and we stop here if the last one couldn't be written
+    string fname = GetOmegaFileName(n_omega_written);
+    auto buffer = make_shared<string>();
+    buffer->reserve(Omega.back().Size() + 1024);
+    StringWriteBuffer strbuf(*buffer);
+    ostream os(&strbuf);
+    Omega.back().WriteBinary(os);
+    omega_write_thread = WriteFileInBackground(buffer, fname, omega_write_failed);
     if (Omega.back().GetModelSpace() != Eta.GetModelSpace()) Omega.back() = Eta;
     n_omega_written++;
-    cout << "Omega written to file " << fname << "  written " << n_omega_written << " so far." << endl;
+    profiler.timer["IMSRGSolver_SpillOmega"] += omp_get_wtime() - t_start;
+    cout << "Omega being written to file " << fname << "  written " << n_omega_written << " so far." << endl;
     if (n_omega_written > max_omega_written)
     {
       cout << "n_omega_written > max_omega_written.  (" << n_omega_written << " > " << max_omega_written
@@ -86,6 +162,91 @@ void IMSRGSolver::SetHin( Operator & H_in)
    }
 }
 
+/// Drop the elements of the current Omega which are smaller than omega_sparsify_threshold
+/// times its largest element. This is done when an Omega is finished, so that the transformations
+/// with it afterwards can use sparse products (see Operator::comm222_pp_hh_221ss).
+/// The fill cutoff is set on that Omega alone (Operator::sparse_fill_cutoff), and the sparse copies of its
+/// mostly-zero channels are built here once. The cutoff is written with the Omega, so they're built again
+/// when it's read back from the scratch directory. This is experimental.
+/// H(s) is recomputed with the sparsified Omega, so it stays consistent with what Transform() will give,
+/// and we report the fraction of elements kept and the change in E0 (and in the test operator, if there is one).
+void IMSRGSolver::SparsifyOmega()
+{
+  if (omega_sparsify_threshold <= 0 or Omega.back().Norm() < 1e-6) return;
+  double t_start = omp_get_wtime();
+  Operator& omega = Omega.back();
+  Operator* H_base = (Omega.size()+n_omega_written)<2 ? H_0 : &H_saved;
+  double E0_before = FlowingOps[0].ZeroBody;
+  double norm_before = omega.Norm();
+  Operator omega_full;
+  if (sparsify_test_operator != NULL) omega_full = omega;
+
+  double fill = omega.ZeroSmallElements(omega_sparsify_threshold);
+  int nsparse = omega.SetSparseFillCutoff(sparse_fill_cutoff); // only this Omega, so solvers running side by side don't interfere
+  FlowingOps[0] = H_base->BCH_Transform( omega );
+  generator.Update(&FlowingOps[0],&Eta);
+
+  double dO = 0;
+  if (sparsify_test_operator != NULL)
+    dO = sparsify_test_operator->BCH_Transform(omega).ZeroBody - sparsify_test_operator->BCH_Transform(omega_full).ZeroBody;
+
+  auto cout_flags = cout.flags();
+  auto cout_precision = cout.precision();
+  cout << scientific << setprecision(3)
+       << "Sparsified Omega with threshold " << omega_sparsify_threshold << ":  fill = " << fill
+       << ",  " << nsparse << " of " << omega.TwoBody.MatEl.size() << " channels sparse"
+       << ",  |dOmega|/|Omega| = " << sqrt( max(0., norm_before*norm_before - pow(omega.Norm(),2)) )/norm_before
+       << ",  dE0 = " << FlowingOps[0].ZeroBody - E0_before;
+  if (sparsify_test_operator != NULL) cout << ",  d<O> = " << dO;
+  cout << endl;
+  cout.flags(cout_flags);
+  cout.precision(cout_precision);
+  profiler.timer["IMSRGSolver_SparsifyOmega"] += omp_get_wtime() - t_start;
+}
+
+/// Start the flow from an Omega obtained elsewhere, typically in a smaller model space,
+/// so that the flow only needs to take care of the remainder. omega is embedded in our model space
+/// and appended to the Omegas we already have, and H(s) is transformed accordingly.
+void IMSRGSolver::SeedOmega(Operator& omega)
+{
+  if (Omega.back().Norm() > 1e-6) NewOmega();
+  Omega.back() = omega.GetModelSpace()==modelspace ? omega : omega.Embed(*modelspace);
+  Operator* H_base = (Omega.size()+n_omega_written)<2 ? H_0 : &H_saved;
+  FlowingOps[0] = H_base->BCH_Transform( Omega.back() );
+  Eta.Erase();
+}
+
+/// Seed the flow with all the Omegas of another solver, e.g. one which was run with a smaller emax.
+/// This is continuation in emax: most of the decoupling is done by the low-lying orbits,
+/// so the flow in the large space should only need a few more steps.
+void IMSRGSolver::SeedFrom(IMSRGSolver& other)
+{
+  double t_start = omp_get_wtime();
+  int nseed = other.n_omega_written + other.Omega.size();
+  if ( other.n_omega_written > 0 )
+  {
+    other.FinishOmegaWrite();
+    Operator omega(other.Omega.back());
+    for (int i=0;i<other.n_omega_written;++i)
+    {
+      ifstream ifs(other.GetOmegaFileName(i), ios::binary);
+      if ( not ifs.good() )
+      {
+        cerr << "Trouble reading " << other.GetOmegaFileName(i) << ". Not seeding with it." << endl;
+        continue;
+      }
+      omega.ReadBinary(ifs);
+      SeedOmega(omega);
+    }
+  }
+  for (auto& omega : other.Omega)
+  {
+    if (omega.Norm() > 1e-6) SeedOmega(omega);
+  }
+  cout << "Seeded the flow with " << nseed << " Omegas.  E0 = " << FlowingOps[0].ZeroBody << endl;
+  profiler.timer["IMSRGSolver_SeedFrom"] += omp_get_wtime() - t_start;
+}
+
 void IMSRGSolver::Reset()
 {
    s=0;
@@ -115,15 +276,38 @@ void IMSRGSolver::SetFlowFile(string str)
    }
 }
 
+/// Bytes held by the Omegas kept in memory, the flowing operators, Eta and the saved H
+map<string,size_t> IMSRGSolver::GetMemoryUsage()
+{
+  map<string,size_t> mem;
+  mem["Omega"] = 0;
+  mem["FlowingOps"] = 0;
+  for (auto& omega : Omega) mem["Omega"] += omega.Size();
+  for (auto& op : FlowingOps) mem["FlowingOps"] += op.Size();
+  mem["Eta"] = Eta.Size();
+  mem["H_saved"] = H_saved.Size();
+  return mem;
+}
+
 
 void IMSRGSolver::Solve()
 {
+  // start a new history for the extrapolation, unless we're continuing one restored by Restart()
+  if (not restarted)
+  {
+    times.clear();
+    E0.clear();
+    eta1.clear();
+    eta2.clear();
+  }
   if (s<1e-4)
    WriteFlowStatusHeader(cout);
   if (method == "magnus_euler" or method =="magnus")
     Solve_magnus_euler();
   else if (method == "magnus_modified_euler")
     Solve_magnus_modified_euler();
+  else if (method == "magnus_rkmk4")
+    Solve_magnus_rkmk4();
   else if (method == "flow_adaptive" or method == "flow")
     Solve_ode_adaptive();
   else if (method == "magnus_adaptive")
@@ -138,6 +322,57 @@ void IMSRGSolver::Solve()
   }
   else
     cout << "IMSRGSolver: I don't know method " << method << endl;
+  SparsifyOmega();
+  restarted = false;
+  FinishCheckpoint();
+}
+
+/// Fit \f$ y(s) \approx y_\infty + A e^{-\kappa s} \f$ through the points i-2, i-1, i and return
+/// \f$ y_\infty - y_i \f$ in tail. The points don't need to be evenly spaced in s.
+/// Returns false if y isn't approaching a limit monotonically over those points.
+static bool ExponentialTail(const vector<double>& s, const vector<double>& y, size_t i, double& tail)
+{
+  double d1 = (y[i-1]-y[i-2]) / (s[i-1]-s[i-2]);
+  double d2 = (y[i]-y[i-1]) / (s[i]-s[i-1]);
+  if (d1*d2 <= 0 or abs(d2) >= abs(d1)) return false;
+  double m1 = 0.5*(s[i-1]+s[i-2]);
+  double m2 = 0.5*(s[i]+s[i-1]);
+  double kappa = log(d1/d2) / (m2-m1);
+  tail = d2 * exp(-kappa*(s[i]-m2)) / kappa;
+  return true;
+}
+
+/// Record E0 and the norm of \f$\eta\f$ for the current step, and extrapolate E0 to \f$ s\rightarrow\infty \f$
+/// assuming that the end of the flow is an exponential approach to convergence.
+/// This is the Shanks transformation for evenly spaced steps.
+/// The difference between the extrapolations from the last two sets of three points is taken as the error.
+/// Returns true, so the flow can stop, if both the predicted remaining change in E0 and the error
+/// are below extrapolation_tolerance, and the norm of \f$\eta\f$ is also decreasing exponentially.
+bool IMSRGSolver::ConvergedByExtrapolation()
+{
+  if (extrapolation_tolerance <= 0) return false;
+  times.push_back(s);
+  E0.push_back(FlowingOps[0].ZeroBody);
+  eta1.push_back(Eta.OneBodyNorm());
+  eta2.push_back(Eta.TwoBodyNorm());
+  size_t n = times.size();
+  if (n < 4) return false;
+
+  vector<double> eta_norm(n);
+  for (size_t i=0;i<n;++i) eta_norm[i] = sqrt(eta1[i]*eta1[i] + eta2[i]*eta2[i]);
+  double tail, tail_last, tail_eta;
+  if ( not ExponentialTail(times, E0, n-1, tail) ) return false;
+  if ( not ExponentialTail(times, E0, n-2, tail_last) ) return false;
+  if ( not ExponentialTail(times, eta_norm, n-1, tail_eta) ) return false;
+
+  E0_extrapolated = E0[n-1] + tail;
+  E0_extrapolation_error = abs( E0_extrapolated - (E0[n-2] + tail_last) );
+  if ( abs(tail) > extrapolation_tolerance or E0_extrapolation_error > extrapolation_tolerance ) return false;
+
+  cout << "Flow converged by extrapolation at s = " << s << ":  E0 = " << setprecision(9) << E0[n-1]
+       << "   extrapolated E0 = " << E0_extrapolated << " +/- " << E0_extrapolation_error
+       << "   (remaining change " << tail << ")" << setprecision(6) << endl;
+  return true;
 }
 
 void IMSRGSolver::UpdateEta()
@@ -147,20 +382,29 @@ void IMSRGSolver::UpdateEta()
 
 void IMSRGSolver::Solve_magnus_euler()
 {
-   istep = 0;
-   generator.Update(&FlowingOps[0],&Eta);
-
-   if (generator.GetType() == "shell-model-atan")
+   if (restarted)
    {
-     generator.SetDenominatorCutoff(1.0);
+     // Eta, H(s) and the generator settings were restored by Restart()
+     restarted = false;
    }
+   else
+   {
+     istep = 0;
+     generator.Update(&FlowingOps[0],&Eta);
 
-    // Write details of the flow
-   WriteFlowStatus(flowfile);
-   WriteFlowStatus(cout);
+     if (generator.GetType() == "shell-model-atan")
+     {
+       generator.SetDenominatorCutoff(1.0);
+     }
+
+      // Write details of the flow
+     WriteFlowStatus(flowfile);
+     WriteFlowStatus(cout);
+   }
 
-   for (istep=1;s<smax;++istep)
+   for (++istep;s<smax;++istep)
    {
+      IMSRGProfiler::Scope step_scope("IMSRGSolver_FlowStep", istep);
 
       double norm_eta = Eta.Norm();
 //      double norm_omega = Omega.Norm();
@@ -171,6 +415,7 @@ void IMSRGSolver::Solve_magnus_euler()
       double norm_omega = Omega.back().Norm();
       if (norm_omega > omega_norm_max)
       {
+        SparsifyOmega();
         NewOmega();
         norm_omega = 0;
       }
@@ -206,6 +451,8 @@ void IMSRGSolver::Solve_magnus_euler()
       WriteFlowStatus(flowfile);
       WriteFlowStatus(cout);
 //      profiler.PrintMemory();
+      if (ConvergedByExtrapolation()) break;
+      CheckpointIfDue(); // after this step's entry in the extrapolation history, which the checkpoint includes
 
    }
 
@@ -214,20 +461,29 @@ void IMSRGSolver::Solve_magnus_euler()
 
 void IMSRGSolver::Solve_magnus_modified_euler()
 {
-   istep = 0;
-   generator.Update(&FlowingOps[0],&Eta);
+   if (restarted)
+   {
+     restarted = false;
+   }
+   else
+   {
+     istep = 0;
+     generator.Update(&FlowingOps[0],&Eta);
 
-   Operator H_temp;
-    // Write details of the flow
-   WriteFlowStatus(flowfile);
-   WriteFlowStatus(cout);
+      // Write details of the flow
+     WriteFlowStatus(flowfile);
+     WriteFlowStatus(cout);
+   }
 
-   for (istep=1;s<smax;++istep)
+   Operator H_temp;
+   for (++istep;s<smax;++istep)
    {
+      IMSRGProfiler::Scope step_scope("IMSRGSolver_FlowStep", istep);
       double norm_eta = Eta.Norm();
       double norm_omega = Omega.back().Norm();
       if (norm_omega > omega_norm_max)
       {
+        SparsifyOmega();
         NewOmega();
         norm_omega = 0;
       }
@@ -258,122 +514,342 @@ void IMSRGSolver::Solve_magnus_modified_euler()
       // Write details of the flow
       WriteFlowStatus(flowfile);
       WriteFlowStatus(cout);
+      if (ConvergedByExtrapolation()) break;
+      CheckpointIfDue();
 
    }
 
 }
 
 
-#ifndef NO_ODE
+/// Zero-body part of \f$[X,Y]\f$, with scratch used to hold the result.
+/// This is much cheaper than the full commutator.
+static double CommutatorZeroBody(const Operator& X, const Operator& Y, Operator& scratch)
+{
+  scratch.ZeroBody = 0;
+  scratch.comm110ss(X,Y);
+  scratch.comm220ss(X,Y);
+  return scratch.ZeroBody;
+}
 
-// Implement element-wise division and abs and reduce for Operators.
-// This is required for adaptive steppers
-//vector<Operator> operator/ (const vector<Operator>& num, const vector<Operator>& denom)
-deque<Operator> operator/ (const deque<Operator>& num, const deque<Operator>& denom)
+/// Fourth-order Runge-Kutta-Munthe-Kaas integration of the Magnus flow, with adaptive step size.
+/// Each step generates a rotation \f$\theta\f$ from four evaluations of the generator,
+/// \f[
+/// \begin{array}{ll}
+///  Q_1 = ds\, \eta[H_n]                                        &  Q_2 = ds\, \eta[e^{Q_1/2}H_n e^{-Q_1/2}] \\
+///  Q_3 = ds\, \eta[e^{\theta_3}H_n e^{-\theta_3}],\ \theta_3 = \tfrac{1}{2}Q_2 - \tfrac{1}{8}[Q_1,Q_2]  &  Q_4 = ds\, \eta[e^{Q_3}H_n e^{-Q_3}] \\
+/// \end{array}
+/// \f]
+/// \f[ \theta = \tfrac{1}{6}(Q_1 + 2Q_2 + 2Q_3 + Q_4) - \tfrac{1}{12}[Q_1,Q_4] \f]
+/// and then \f$ e^{\Omega} \rightarrow e^{\theta}e^{\Omega} \f$.
+/// The generator at the end of the step, \f$ Q_5 = ds\,\eta[H_{n+1}] \f$, is needed for the next step anyway,
+/// and replacing \f$ Q_4 \f$ by \f$ Q_5 \f$ in \f$\theta\f$ gives a third-order rotation. To leading order, the difference is
+/// \f$ \delta\theta = \tfrac{1}{6}(Q_4-Q_5) \f$, which we use as the error of the step, both for \f$\Omega\f$
+/// (\f$ ||\delta\theta|| \f$) and for the energy (\f$ [\delta\theta,H_n]_{(0)} \f$).
+/// A step is redone with a smaller ds if either error is above magnus_tolerance,
+/// and otherwise the next ds is scaled up or down with the error. Once ds is below 1e-4 the step is taken
+/// anyway, with a warning, and counted in IMSRGSolver_RKMK4_OverTolerance.
+void IMSRGSolver::Solve_magnus_rkmk4()
 {
-//   vector<Operator> quotient = num;
-   deque<Operator> quotient = num;
-   for ( size_t i=0;i<num.size();++i )
+   if (restarted)
    {
-     quotient[i].ZeroBody /= denom[i].ZeroBody;
-     quotient[i].OneBody /= denom[i].OneBody;
-     for ( auto& itmat: quotient[i].TwoBody.MatEl )    itmat.second /= denom[i].TwoBody.GetMatrix(itmat.first[0],itmat.first[1]);
+     restarted = false;
+   }
+   else
+   {
+     istep = 0;
+     generator.Update(&FlowingOps[0],&Eta);
+
+      // Write details of the flow
+     WriteFlowStatus(flowfile);
+     WriteFlowStatus(cout);
+   }
+
+   Operator H_stage, Eta_stage(Eta);
+   for (++istep;s<smax;++istep)
+   {
+      IMSRGProfiler::Scope step_scope("IMSRGSolver_FlowStep", istep);
+      double norm_eta = Eta.Norm();
+      if (norm_eta < eta_criterion )
+      {
+        break;
+      }
+      double norm_omega = Omega.back().Norm();
+      if (norm_omega > omega_norm_max)
+      {
+        SparsifyOmega();
+        NewOmega();
+        norm_omega = 0;
+      }
+      Operator& H_n = FlowingOps[0];
+      Operator* H_base = (Omega.size()+n_omega_written)<2 ? H_0 : &H_saved;
+      // don't rotate by more than omega_norm_max in a single step
+      ds = min( min(ds, omega_norm_max/norm_eta), ds_max);
+
+      Operator Omega_new;
+      double error;
+      while (true)
+      {
+        ds = min(ds,smax-s);
+        double t_start = omp_get_wtime();
+
+        Operator Q1 = ds * Eta;
+        H_stage = H_n.BCH_Transform( 0.5*Q1 );
+        generator.Update(&H_stage,&Eta_stage);
+
+        Operator Q2 = ds * Eta_stage;
+        H_stage = H_n.BCH_Transform( 0.5*Q2 - 0.125*Commutator(Q1,Q2) );
+        generator.Update(&H_stage,&Eta_stage);
+
+        Operator Q = ds * Eta_stage; // Q3
+        Operator theta = (1./6)*Q1 + (1./3)*Q2 + (1./3)*Q;
+        H_stage = H_n.BCH_Transform( Q );
+        generator.Update(&H_stage,&Eta_stage);
+
+        Q = ds * Eta_stage; // Q4
+        theta += (1./6)*Q - (1./12)*Commutator(Q1,Q);
+
+        // accumulated generator (aka Magnus operator) exp(Omega) = exp(theta) * exp(Omega_last)
+        Omega_new = theta.BCH_Product( Omega.back() );
+        H_stage = H_base->BCH_Transform( Omega_new );
+        generator.Update(&H_stage,&Eta_stage);
+
+        Operator& dtheta = Q;
+        dtheta -= ds * Eta_stage;
+        dtheta *= 1./6;
+        double error_omega = dtheta.Norm();
+        double error_E0 = abs( CommutatorZeroBody(dtheta, H_n, Q2) );
+        error = max(error_omega, error_E0) / magnus_tolerance;
+        profiler.timer["IMSRGSolver_RKMK4_Step"] += omp_get_wtime() - t_start;
+
+        if (error <= 1.0) break;
+        if (ds < 1e-4)
+        {
+          // Can't make ds any smaller, so take the step anyway, but don't let it pass unnoticed
+          profiler.counter["IMSRGSolver_RKMK4_OverTolerance"] ++;
+          auto cout_flags = cout.flags();
+          auto cout_precision = cout.precision();
+          cout << scientific << setprecision(3)
+               << "Warning: magnus_rkmk4 took the step at s = " << s << " with ds = " << ds << ", where the error is "
+               << error << " times magnus_tolerance." << endl;
+          cout.flags(cout_flags);
+          cout.precision(cout_precision);
+          break;
+        }
+        profiler.counter["IMSRGSolver_RKMK4_Rejected"] ++;
+        ds *= max(0.2, 0.9*pow(error,-0.25));
+      }
+      s += ds;
+      Omega.back() = Omega_new;
+      swap(FlowingOps[0], H_stage);
+      swap(Eta, Eta_stage);
+
+      // the error estimate goes like ds^4
+      ds *= min(4.0, max(0.2, 0.9*pow(max(error,1e-12),-0.25)));
+
+      // Write details of the flow
+      WriteFlowStatus(flowfile);
+      WriteFlowStatus(cout);
+      if (ConvergedByExtrapolation()) break;
+      CheckpointIfDue();
+
    }
-   return quotient;
-}
 
-//vector<Operator> operator* (const double a, const vector<Operator>& X)
-deque<Operator> operator* (const double a, const deque<Operator>& X)
-{
-//  vector<Operator> Y = X;
-  deque<Operator> Y = X;
-  for ( auto& y : Y )  y *= a;
-  return Y;
 }
 
-//vector<Operator> operator+ ( const vector<Operator>& X, const vector<Operator>& Y)
-deque<Operator> operator+ ( const deque<Operator>& X, const deque<Operator>& Y)
+
+#ifndef NO_ODE
+
+// odeint support for a deque<Operator> state.
+// Rather than the vector_space_algebra, which builds a temporary Operator for every
+// term of every Runge-Kutta stage, we provide an algebra and operations that work
+// element by element on the stepper's own buffers. Those buffers are allocated once with
+// the same shape as the state, and the stage sums are accumulated directly into their matrices.
+
+/// Check that two operators store their matrix elements in the same layout,
+/// so that one can be overwritten in place with a combination of the other.
+static bool SameLayout(const Operator& X, const Operator& Y)
 {
-//  vector<Operator> Z = X;
-  deque<Operator> Z = X;
-  for ( size_t i=0;i<Z.size();++i )  Z[i] += Y[i];
-  return Z;
+  return X.modelspace==Y.modelspace and X.rank_J==Y.rank_J and X.rank_T==Y.rank_T and X.parity==Y.parity
+     and X.particle_rank==Y.particle_rank and X.OneBody.n_elem==Y.OneBody.n_elem
+     and X.TwoBody.MatEl.size()==Y.TwoBody.MatEl.size();
 }
 
-// Also need the dubious operation of adding a double to an operator.
-//vector<Operator> operator+ (const double a, const vector<Operator>& X)
-deque<Operator> operator+ (const double a, const deque<Operator>& X)
+/// Set \f$ Z = \sum_k a_k X_k \f$ without allocating, if Z already has the right shape.
+/// Each element is read before it is written, so Z may be one of the \f$ X_k \f$.
+template <size_t N>
+static void ScaleSumInPlace(Operator& Z, const array<double,N>& a, const array<const Operator*,N>& X)
 {
-//   vector<Operator> Y = X;
-   deque<Operator> Y = X;
-   for ( auto& y : Y )
-   {
-     y.ZeroBody += a;
-     y.OneBody += a;
-//     for( auto& v : y.OneBody ) v += a;
-     for ( auto& itmat: y.TwoBody.MatEl )
-      itmat.second += a;
-//       for ( auto& v : itmat.second ) v += a;
-   }
-   return Y;
+  for (size_t k=1;k<N;++k)
+  {
+    if (not SameLayout(*X[0],*X[k]))
+    { // shouldn't happen with the odeint buffers, but fall back on the operator arithmetic
+      Operator sum = a[0] * (*X[0]);
+      for (size_t j=1;j<N;++j) sum += a[j] * (*X[j]);
+      Z = sum;
+      return;
+    }
+  }
+  if (not SameLayout(Z,*X[0])) Z = *X[0];
+  Z.hermitian = X[0]->hermitian;
+  Z.antihermitian = X[0]->antihermitian;
+
+  double zb = 0;
+  for (size_t k=0;k<N;++k) zb += a[k] * X[k]->ZeroBody;
+  Z.ZeroBody = zb;
+
+  // collect the one-body matrix and each two-body channel, then sum them in parallel.
+  // The two-body norm is accumulated on the way, with weight 2 for blocks that stand for two orderings of the channels.
+  vector<double*> out = { Z.OneBody.memptr() };
+  vector<size_t> len = { Z.OneBody.n_elem };
+  vector<double> norm_weight = { 0 };
+  vector<array<const double*,N>> in(1);
+  for (size_t k=0;k<N;++k) in[0][k] = X[k]->OneBody.memptr();
+  array<map<array<int,2>,arma::mat>::const_iterator,N> iters;
+  for (size_t k=0;k<N;++k) iters[k] = X[k]->TwoBody.MatEl.begin();
+  for (auto& itmat : Z.TwoBody.MatEl)
+  {
+    out.push_back( itmat.second.memptr() );
+    len.push_back( itmat.second.n_elem );
+    norm_weight.push_back( itmat.first[0]==itmat.first[1] ? 1 : 2 );
+    in.push_back( array<const double*,N>() );
+    for (size_t k=0;k<N;++k) in.back()[k] = (iters[k]++)->second.memptr();
+  }
+
+  Z.TwoBody.InvalidateNorm(); // the norm is set below, but this also drops any sparse copies
+  double norm2 = 0;
+  #pragma omp parallel for schedule(dynamic,1) reduction(+:norm2)
+  for (size_t m=0;m<out.size();++m)
+  {
+    double* z = out[m];
+    const array<const double*,N>& x = in[m];
+    double block_norm2 = 0;
+    for (size_t i=0;i<len[m];++i)
+    {
+      double sum = 0;
+      for (size_t k=0;k<N;++k) sum += a[k] * x[k][i];
+      z[i] = sum;
+      block_norm2 += sum*sum;
+    }
+    norm2 += norm_weight[m] * block_norm2;
+  }
+  Z.TwoBody.norm_cached = sqrt(norm2);
 }
 
-// Return the element-wise absolute value of an operator
-// this is needed for ODE adaptive solver
-//vector<Operator> abs(const vector<Operator>& OpIn)
-deque<Operator> abs(const deque<Operator>& OpIn)
+/// Odeint algebra for deque<Operator>: apply the operation to each Operator in turn.
+struct operator_algebra
 {
-//   vector<Operator> OpOut = OpIn;
-   deque<Operator> OpOut = OpIn;
-   for (auto& opout : OpOut )
-   {
-     opout.ZeroBody = abs(opout.ZeroBody);
-     opout.OneBody = arma::abs(opout.OneBody);
-     for ( auto& itmat : opout.TwoBody.MatEl )    itmat.second = arma::abs(itmat.second);
-   }
-   return OpOut;
-}
+  template <class S1, class Op>
+  static void for_each1(S1& s1, Op op)
+  { for (size_t i=0;i<s1.size();++i) op(s1[i]); }
 
-// Apply operation to each element of X and return the result
-// this is needed for ODE adaptive solver
-// USE THIS FOR BOOST VERSION < 1.56
-/*
-namespace boost {namespace numeric {namespace odeint{
-template<>
-struct vector_space_reduce< Operator >
+  template <class S1, class S2, class Op>
+  static void for_each2(S1& s1, S2& s2, Op op)
+  { for (size_t i=0;i<s1.size();++i) op(s1[i],s2[i]); }
+
+  template <class S1, class S2, class S3, class Op>
+  static void for_each3(S1& s1, S2& s2, S3& s3, Op op)
+  { for (size_t i=0;i<s1.size();++i) op(s1[i],s2[i],s3[i]); }
+
+  template <class S1, class S2, class S3, class S4, class Op>
+  static void for_each4(S1& s1, S2& s2, S3& s3, S4& s4, Op op)
+  { for (size_t i=0;i<s1.size();++i) op(s1[i],s2[i],s3[i],s4[i]); }
+
+  template <class S1, class S2, class S3, class S4, class S5, class Op>
+  static void for_each5(S1& s1, S2& s2, S3& s3, S4& s4, S5& s5, Op op)
+  { for (size_t i=0;i<s1.size();++i) op(s1[i],s2[i],s3[i],s4[i],s5[i]); }
+
+  template <class S1, class S2, class S3, class S4, class S5, class S6, class Op>
+  static void for_each6(S1& s1, S2& s2, S3& s3, S4& s4, S5& s5, S6& s6, Op op)
+  { for (size_t i=0;i<s1.size();++i) op(s1[i],s2[i],s3[i],s4[i],s5[i],s6[i]); }
+
+  template <class S1, class S2, class S3, class S4, class S5, class S6, class S7, class Op>
+  static void for_each7(S1& s1, S2& s2, S3& s3, S4& s4, S5& s5, S6& s6, S7& s7, Op op)
+  { for (size_t i=0;i<s1.size();++i) op(s1[i],s2[i],s3[i],s4[i],s5[i],s6[i],s7[i]); }
+
+  template <class S1, class S2, class S3, class S4, class S5, class S6, class S7, class S8, class Op>
+  static void for_each8(S1& s1, S2& s2, S3& s3, S4& s4, S5& s5, S6& s6, S7& s7, S8& s8, Op op)
+  { for (size_t i=0;i<s1.size();++i) op(s1[i],s2[i],s3[i],s4[i],s5[i],s6[i],s7[i],s8[i]); }
+
+  // used by the adaptive steppers for the error estimate
+  template <class S>
+  static double norm_inf(const S& s)
+  {
+    double norm = 0;
+    for ( auto& x : s )
+      norm += x.Norm();
+    return norm;
+  }
+};
+
+/// Odeint operations on a single Operator, done in place.
+struct operator_operations
 {
-   template<class Op>
-   double operator()(const Operator& X, Op op, double init)
-   {
-      init = op(init,X.ZeroBody);
-      for ( auto& v : X.OneBody )    init = op(init,v);
-      for ( auto& itmat : X.TwoBody.MatEl )
+  // t1 = alpha1*t2 + alpha2*t3 + ...
+  template <class... Fac>
+  struct scale_sum
+  {
+    array<double,sizeof...(Fac)> alpha;
+    scale_sum(Fac... a) : alpha{{double(a)...}} {};
+    template <class... T>
+    void operator()(Operator& t1, const T&... t) const
+    {
+      ScaleSumInPlace<sizeof...(Fac)>(t1, alpha, {{&t...}});
+    }
+  };
+  template <class F1> using scale_sum1 = scale_sum<F1>;
+  template <class F1, class F2=F1> using scale_sum2 = scale_sum<F1,F2>;
+  template <class F1, class F2=F1, class F3=F2> using scale_sum3 = scale_sum<F1,F2,F3>;
+  template <class F1, class F2=F1, class F3=F2, class F4=F3> using scale_sum4 = scale_sum<F1,F2,F3,F4>;
+  template <class F1, class F2=F1, class F3=F2, class F4=F3, class F5=F4> using scale_sum5 = scale_sum<F1,F2,F3,F4,F5>;
+  template <class F1, class F2=F1, class F3=F2, class F4=F3, class F5=F4, class F6=F5> using scale_sum6 = scale_sum<F1,F2,F3,F4,F5,F6>;
+  template <class F1, class F2=F1, class F3=F2, class F4=F3, class F5=F4, class F6=F5, class F7=F6> using scale_sum7 = scale_sum<F1,F2,F3,F4,F5,F6,F7>;
+
+  // t3 = |t3| / ( eps_abs + eps_rel*( a_x*|t1| + a_dxdt*|t2| ) ), element by element
+  template <class Fac>
+  struct rel_error
+  {
+    double eps_abs, eps_rel, a_x, a_dxdt;
+    rel_error(Fac e_abs, Fac e_rel, Fac ax, Fac adxdt) : eps_abs(e_abs), eps_rel(e_rel), a_x(ax), a_dxdt(adxdt) {};
+    void operator()(Operator& t3, const Operator& t1, const Operator& t2) const
+    {
+      t3.ZeroBody = abs(t3.ZeroBody) / (eps_abs + eps_rel*(a_x*abs(t1.ZeroBody) + a_dxdt*abs(t2.ZeroBody)));
+      t3.OneBody = arma::abs(t3.OneBody) / (eps_abs + eps_rel*(a_x*arma::abs(t1.OneBody) + a_dxdt*arma::abs(t2.OneBody)));
+      for ( auto& itmat : t3.TwoBody.MatEl )
       {
-          for (auto& v : itmat.second )    init = op(init,v);
+        const arma::mat& m1 = t1.TwoBody.GetMatrix(itmat.first[0],itmat.first[1]);
+        const arma::mat& m2 = t2.TwoBody.GetMatrix(itmat.first[0],itmat.first[1]);
+        itmat.second = arma::abs(itmat.second) / (eps_abs + eps_rel*(a_x*arma::abs(m1) + a_dxdt*arma::abs(m2)));
       }
-      return init;
-   }
+      t3.TwoBody.InvalidateNorm();
+    }
+  };
 };
-}}}
-*/
 
-// Apply operation to each element of X and return the result
-// this is needed for ODE adaptive solver
-// USE THIS FOR BOOST VERSION >= 1.56
-//struct vector_space_norm_inf< vector<Operator> >
+// The stepper's stage buffers are allocated once, as copies of the state,
+// and the accepted step is copied back into the state without reallocating it.
 namespace boost {namespace numeric {namespace odeint{
 template<>
-struct vector_space_norm_inf< deque<Operator> >
+struct is_resizeable< deque<Operator> > : boost::true_type {};
+
+template<>
+struct resize_impl< deque<Operator>, deque<Operator> >
 {
-   typedef double result_type;
-//   double operator()(const vector<Operator>& X)
-   double operator()(const deque<Operator>& X)
-   {
-     double norm = 0;
-     for ( auto& x : X )
-       norm += x.Norm();
-     return norm;
-   }
+  static void resize(deque<Operator>& x1, const deque<Operator>& x2)
+  {
+    x1 = x2;
+  }
+};
+
+template<>
+struct copy_impl< deque<Operator>, deque<Operator> >
+{
+  static void copy(const deque<Operator>& from, deque<Operator>& to)
+  {
+    if (to.size() != from.size()) to.resize(from.size());
+    for (size_t i=0;i<from.size();++i)
+      ScaleSumInPlace<1>(to[i], {{1.0}}, {{&from[i]}});
+  }
 };
 }}}
 
@@ -386,11 +862,14 @@ void IMSRGSolver::Solve_ode()
    WriteFlowStatus(flowfile);
    using namespace boost::numeric::odeint;
 //   runge_kutta4< vector<Operator>, double, vector<Operator>, double, vector_space_algebra> stepper;
-   runge_kutta4< deque<Operator>, double, deque<Operator>, double, vector_space_algebra> stepper;
-   auto system = *this;
+   runge_kutta4< deque<Operator>, double, deque<Operator>, double, operator_algebra, operator_operations> stepper;
+   ODE_System system(*this);
    auto monitor = ode_monitor;
 //   size_t steps = integrate_const(stepper, system, FlowingOps, s, smax, ds, monitor);
-   integrate_const(stepper, system, FlowingOps, s, smax, ds, monitor);
+   // operator() uses FlowingOps for the operators at the current stage, so integrate a separate state
+   deque<Operator> state = FlowingOps;
+   integrate_const(stepper, system, state, s, smax, ds, monitor);
+   FlowingOps = state;
    monitor.report();
 }
 
@@ -402,13 +881,15 @@ void IMSRGSolver::Solve_ode_adaptive()
    WriteFlowStatus(flowfile);
    cout << "done writing header and status" << endl;
    using namespace boost::numeric::odeint;
-   auto system = *this;
+   ODE_System system(*this);
 //   typedef runge_kutta_dopri5< vector<Operator> , double , vector<Operator> ,double , vector_space_algebra > stepper;
-   typedef runge_kutta_dopri5< deque<Operator> , double , deque<Operator> ,double , vector_space_algebra > stepper;
+   typedef runge_kutta_dopri5< deque<Operator> , double , deque<Operator> ,double , operator_algebra, operator_operations > stepper;
 //   typedef adams_bashforth_moulton< 4, vector<Operator> , double , vector<Operator> ,double , vector_space_algebra > stepper;
    auto monitor = ode_monitor;
 //   size_t steps = integrate_adaptive(make_controlled<stepper>(ode_e_abs,ode_e_rel), system, FlowingOps, s, smax, ds, monitor);
-   integrate_adaptive(make_controlled<stepper>(ode_e_abs,ode_e_rel), system, FlowingOps, s, smax, ds, monitor);
+   deque<Operator> state = FlowingOps;
+   integrate_adaptive(make_controlled<stepper>(ode_e_abs,ode_e_rel), system, state, s, smax, ds, monitor);
+   FlowingOps = state;
    monitor.report();
 
 }
@@ -429,14 +910,15 @@ void IMSRGSolver::operator()( const deque<Operator>& x, deque<Operator>& dxdt, c
      {
        for (size_t i=0;i<x.size();++i)
        {
-         dxdt[i] = 0*x[i];
+         if (not SameLayout(dxdt[i],x[i])) dxdt[i] = x[i];
+         dxdt[i].Erase();
        }
      }
      else
      {
        for (size_t i=0;i<x.size();++i)
        {
-         dxdt[i] = Commutator(Eta,x[i]);
+         dxdt[i].SetToCommutator(Eta,x[i]);
        }
      }
    }
@@ -458,26 +940,29 @@ void IMSRGSolver::operator()( const deque<Operator>& x, deque<Operator>& dxdt, c
        H_s = H_0->BCH_Transform(Omega_s);
      generator.Update(&H_s,&Eta);
      if (dxdt.size() < x.size()) dxdt.resize(x.size());
-     dxdt.back() = Eta - 0.5*Commutator(Omega_s,Eta);
+     Operator& dOmega = dxdt.back();
+     dOmega.SetToCommutator(Omega_s,Eta);
+     ScaleSumInPlace<2>(dOmega, {{1.0,-0.5}}, {{&Eta,&dOmega}});
    }
    else if (ode_mode == "Restored" )
    {
      FlowingOps[0] = x[0];
      FlowingOps[1] = x[1];
      if (dxdt.size() < x.size()) dxdt.resize(x.size());
-     dxdt[1] = Operator(x[1]);
+     if (not SameLayout(dxdt[1],x[1])) dxdt[1] = x[1];
      auto& H_s = FlowingOps[0];
      generator.Update(&H_s,&Eta);
      if (Eta.Norm() < eta_criterion)
      {
        for (size_t i=0;i<x.size();++i)
        {
-         dxdt[i] = 0*x[i];
+         if (not SameLayout(dxdt[i],x[i])) dxdt[i] = x[i];
+         dxdt[i].Erase();
        }
      }
      else
      {
-       dxdt[0] = Commutator(Eta,x[0]+x[1]);
+       dxdt[0].SetToCommutator(Eta,x[0]+x[1]);
        dxdt[1].Erase();
        dxdt[1].comm221ss(Eta,x[0]);
        // keep only pp and hh parts of d chi/ ds
@@ -493,7 +978,7 @@ void IMSRGSolver::operator()( const deque<Operator>& x, deque<Operator>& dxdt, c
        }
        for (size_t i=2;i<x.size();++i)
        {
-         dxdt[i] = Commutator(Eta,x[i]);
+         dxdt[i].SetToCommutator(Eta,x[i]);
        }
 //       cout << "Made it out of the first iteration" << endl;
      }
@@ -513,11 +998,13 @@ void IMSRGSolver::Solve_ode_magnus()
    using namespace boost::numeric::odeint;
    namespace pl = std::placeholders;
 //   runge_kutta4<vector<Operator>, double, vector<Operator>, double, vector_space_algebra> stepper;
-   runge_kutta4<deque<Operator>, double, deque<Operator>, double, vector_space_algebra> stepper;
-   auto system = *this;
+   runge_kutta4<deque<Operator>, double, deque<Operator>, double, operator_algebra, operator_operations> stepper;
+   ODE_System system(*this);
    auto monitor = ode_monitor;
 //   size_t steps = integrate_const(stepper, system, Omega, s, smax, ds, monitor);
-   integrate_const(stepper, system, Omega, s, smax, ds, monitor);
+   deque<Operator> state = Omega;
+   integrate_const(stepper, system, state, s, smax, ds, monitor);
+   Omega = state;
    monitor.report();
 }
 
@@ -543,10 +1030,6 @@ Operator IMSRGSolver::Transform(Operator&& OpIn)
 /// Returns \f$ e^{-Omega} \mathcal{O} e^{Omega} \f$
 Operator IMSRGSolver::InverseTransform(Operator& OpIn)
 {
-  if (OpIn.GetJRank()+OpIn.GetTRank()+OpIn.GetParity()>0)
-  {
-    OpIn.ResetTensorTransformFirstPass();
-  }
   Operator OpOut = OpIn;
   for (auto omega=Omega.rbegin(); omega !=Omega.rend(); ++omega )
   {
@@ -560,58 +1043,80 @@ Operator IMSRGSolver::InverseTransform(Operator& OpIn)
 /// for the \f$\Omega_i\f$s with index greater than or equal to n.
 Operator IMSRGSolver::Transform_Partial(Operator& OpIn, int n)
 {
-//  cout << "Begin Transform_Partial" << endl;
-  Operator OpOut = OpIn;
-  if ((rw != NULL) and rw->GetScratchDir() != "")
+  vector<Operator> OpsOut = {OpIn};
+  Transform_Partial_InPlace(OpsOut, n);
+  return OpsOut[0];
+}
+
+/// Returns \f$ e^{\Omega} \mathcal{O}_k e^{-\Omega} \f$ for each operator in the list.
+/// Each Omega in the scratch directory is read only once, and applied to all
+/// of the operators before moving on to the next one.
+vector<Operator> IMSRGSolver::Transform(vector<Operator>& OpsIn)
+{
+  return Transform_Partial(OpsIn, 0);
+}
+
+/// Same as Transform(vector<Operator>&), but only for the \f$\Omega_i\f$s with index greater than or equal to n.
+vector<Operator> IMSRGSolver::Transform_Partial(vector<Operator>& OpsIn, int n)
+{
+  vector<Operator> OpsOut = OpsIn;
+  Transform_Partial_InPlace(OpsOut, n);
+  return OpsOut;
+}
+
+/// Apply \f$ e^{\Omega_i} \cdot e^{-\Omega_i} \f$ for \f$ i\geq n \f$ to all the operators in Ops.
+/// The Omegas in the scratch directory are read one ahead on a background thread,
+/// so file i+1 is loading while the BCH transformations with Omega i are computed.
+/// The operators are transformed one after the other, not in parallel with each other.
+/// Each BCH_Transform already spreads its channels over all the threads, and transforming
+/// several operators at once would need a set of scratch operators (TempOp) for each of them.
+/// So the time grows linearly with the number of operators, and only the reading of the
+/// Omegas is shared.
+void IMSRGSolver::Transform_Partial_InPlace(vector<Operator>& Ops, int n)
+{
+  if (Ops.size()<1) return;
+  if ((rw != NULL) and rw->GetScratchDir() != "" and n < n_omega_written)
   {
-    Operator omega(OpIn);
-    char tmp[512];
+    FinishOmegaWrite();
+    Operator omega(Ops[0]);
+    array<string,2> buffers; // double buffer: one being read from disk, one being used
+    thread reader(ReadFileToBuffer, GetOmegaFileName(n), ref(buffers[n%2]));
     for (int i=n;i<n_omega_written;i++)
     {
-     sprintf(tmp,"%s/OMEGA_%06d_%03d",rw->GetScratchDir().c_str(), getpid(), i);
-     string fname(tmp);
-     ifstream ifs(fname,ios::binary);
-     omega.ReadBinary(ifs);
-//     if (OpIn.GetJRank()>0) cout << "step " << i << endl;
-     OpOut = OpOut.BCH_Transform( omega );
-//     if (OpIn.GetJRank()>0)cout << "done" << endl;
+     double t_start = omp_get_wtime();
+     reader.join();
+     profiler.timer["IMSRGSolver_WaitForOmegaIO"] += omp_get_wtime() - t_start;
+     if (i+1 < n_omega_written)
+       reader = thread(ReadFileToBuffer, GetOmegaFileName(i+1), ref(buffers[(i+1)%2]));
+     string& buffer = buffers[i%2];
+     MemoryBuffer membuf(buffer);
+     istream is(&membuf);
+     if (not buffer.empty()) omega.ReadBinary(is);
+     if (buffer.empty() or not is.good())
+     {
+       // Going on without this Omega would give a wrong transformation, with nothing to show for it.
+       cerr << "Trouble reading " << GetOmegaFileName(i) << " in Transform_Partial. Calling terminate." << endl;
+       if (reader.joinable()) reader.join();
+       terminate();
+     }
+     string().swap(buffer);
+     for (auto& op : Ops)
+       op = op.BCH_Transform( omega );
     }
   }
 
   for (size_t i=max(n-n_omega_written,0); i<Omega.size();++i)
   {
-//     if (OpIn.GetJRank()>0) cout << "step " << i << endl;
-    OpOut = OpOut.BCH_Transform( Omega[i] );
-//     if (OpIn.GetJRank()>0)cout << "done" << endl;
+    for (auto& op : Ops)
+      op = op.BCH_Transform( Omega[i] );
   }
-
-  return OpOut;
 }
 
 
 Operator IMSRGSolver::Transform_Partial(Operator&& OpIn, int n)
 {
 //  cout << "Calling r-value version of Transform_Partial, n = " << n << endl;
-  Operator OpOut = OpIn;
-  if ((rw != NULL) and rw->GetScratchDir() != "")
-  {
-    Operator omega(OpIn);
-    char tmp[512];
-    for (int i=n;i<n_omega_written;i++)
-    {
-     sprintf(tmp,"%s/OMEGA_%06d_%03d",rw->GetScratchDir().c_str(), getpid(), i);
-     string fname(tmp);
-     ifstream ifs(fname,ios::binary);
-     omega.ReadBinary(ifs);
-     OpOut = OpOut.BCH_Transform( omega );
-    }
-  }
-
-  for (size_t i=max(n-n_omega_written,0); i<Omega.size();++i)
-  {
-    OpOut = OpOut.BCH_Transform( Omega[i] );
-  }
-  return OpOut;
+  return Transform_Partial(OpIn, n);
 }
 
 // count number of equations to be solved
@@ -630,13 +1135,12 @@ int IMSRGSolver::GetSystemDimension()
 void IMSRGSolver::CleanupScratch()
 {
   if (n_omega_written<=0) return;
+  FinishOmegaWrite();
   cout << "Cleaning up files written to scratch space" << endl;
-  char tmp[512];
   for (int i=0;i<n_omega_written;i++)
   {
-    sprintf(tmp,"%s/OMEGA_%06d_%03d",rw->GetScratchDir().c_str(), getpid(), i);
-    string fname(tmp);
-    if ( remove(tmp) !=0 )
+    string fname = GetOmegaFileName(i);
+    if ( remove(fname.c_str()) !=0 )
     {
       cout << "Error when attempting to delete " << fname << endl;
     }
@@ -645,6 +1149,283 @@ void IMSRGSolver::CleanupScratch()
 
 
 
+/// Name of the file in the scratch directory where the ith split Omega is kept.
+string IMSRGSolver::GetOmegaFileName(int i)
+{
+  char tmp[512];
+  sprintf(tmp,"%s/OMEGA_%06d_%03d",rw->GetScratchDir().c_str(), omega_file_id, i);
+  return string(tmp);
+}
+
+
+/// Write a checkpoint to fname every interval steps of the Magnus flow,
+/// and/or whenever walltime seconds have passed since the last checkpoint.
+/// Setting either one to zero turns that criterion off.
+void IMSRGSolver::SetCheckpoint(string fname, int interval, double walltime)
+{
+  checkpoint_file = fname;
+  checkpoint_interval = interval;
+  checkpoint_walltime = walltime;
+  last_checkpoint_step = istep;
+  last_checkpoint_time = omp_get_wtime();
+}
+
+
+void IMSRGSolver::CheckpointIfDue()
+{
+  if (checkpoint_file == "") return;
+  if (  (checkpoint_interval>0 and istep-last_checkpoint_step >= checkpoint_interval)
+     or (checkpoint_walltime>0 and omp_get_wtime()-last_checkpoint_time >= checkpoint_walltime) )
+  {
+    WriteCheckpoint();
+  }
+}
+
+
+/// Save everything needed to continue the flow with Restart(): s, ds, istep,
+/// the generator settings, the history used by ConvergedByExtrapolation(), \f$ H(s) \f$, \f$ \eta \f$, H_saved and the Omegas still in memory.
+/// The Omegas which were already written to the scratch directory are not copied, so
+/// those files need to be kept, and only the number of them and their names are stored.
+/// The checkpoint is serialized straight into one buffer here, and then written to disk on a
+/// background thread so the flow can go on. So while it's being written, the checkpoint is held in memory once.
+/// The file is first written as fname.tmp and then renamed, so an interrupted write never clobbers the previous checkpoint.
+/// The next checkpoint, the end of Solve() and the destructor wait for the write to finish.
+void IMSRGSolver::WriteCheckpoint()
+{
+  double t_start = omp_get_wtime();
+  FinishCheckpoint(); // only one write at a time
+  FinishOmegaWrite(); // the checkpoint refers to the OMEGA files, so they need to be complete
+
+  auto buffer = make_shared<string>();
+  StringWriteBuffer strbuf(*buffer);
+  ostream ofs(&strbuf);
+  int norbits = modelspace->GetNumberOrbits();
+  int nchannels = modelspace->GetNumberTwoBodyChannels();
+  double hw = modelspace->GetHbarOmega();
+  int Aref = modelspace->GetAref();
+  int Zref = modelspace->GetZref();
+  int nomega = Omega.size();
+  bool have_H_saved = H_saved.GetModelSpace() != NULL;
+  string gentype = generator.GetType();
+  size_t gentype_len = gentype.size();
+  ofs.write(IMSRG_CHECKPOINT_TAG, sizeof(IMSRG_CHECKPOINT_TAG));
+  ofs.write((char*)&norbits, sizeof(norbits));
+  ofs.write((char*)&nchannels, sizeof(nchannels));
+  ofs.write((char*)&hw, sizeof(hw));
+  ofs.write((char*)&Aref, sizeof(Aref));
+  ofs.write((char*)&Zref, sizeof(Zref));
+  ofs.write((char*)&s, sizeof(s));
+  ofs.write((char*)&ds, sizeof(ds));
+  ofs.write((char*)&istep, sizeof(istep));
+  ofs.write((char*)&n_omega_written, sizeof(n_omega_written));
+  ofs.write((char*)&omega_file_id, sizeof(omega_file_id));
+  ofs.write((char*)&gentype_len, sizeof(gentype_len));
+  ofs.write(gentype.data(), gentype_len);
+  ofs.write((char*)&generator.denominator_cutoff, sizeof(generator.denominator_cutoff));
+  ofs.write((char*)&generator.denominator_delta, sizeof(generator.denominator_delta));
+  ofs.write((char*)&generator.denominator_delta_index, sizeof(generator.denominator_delta_index));
+  size_t nhistory = times.size();
+  ofs.write((char*)&nhistory, sizeof(nhistory));
+  for (auto* history : {&times, &E0, &eta1, &eta2}) ofs.write((char*)history->data(), nhistory*sizeof(double));
+  FlowingOps[0].WriteBinary(ofs);
+  Eta.WriteBinary(ofs);
+  ofs.write((char*)&have_H_saved, sizeof(have_H_saved));
+  if (have_H_saved) H_saved.WriteBinary(ofs);
+  ofs.write((char*)&nomega, sizeof(nomega));
+  for (auto& omega : Omega) omega.WriteBinary(ofs);
+
+  checkpoint_thread = WriteFileInBackground(buffer, checkpoint_file, checkpoint_write_failed);
+  cout << "Writing checkpoint at s = " << s << " to " << checkpoint_file << "  (" << buffer->size()/1024./1024. << " MB)" << endl;
+  last_checkpoint_step = istep;
+  last_checkpoint_time = omp_get_wtime();
+  profiler.timer["IMSRGSolver_WriteCheckpoint"] += omp_get_wtime() - t_start;
+}
+
+
+/// Wait for the checkpoint being written in the background, if there is one.
+/// If it couldn't be written, the previous checkpoint is still there, so we just say so and go on.
+void IMSRGSolver::FinishCheckpoint()
+{
+  if (checkpoint_thread != nullptr and checkpoint_thread->joinable())
+  {
+    double t_start = omp_get_wtime();
+    checkpoint_thread->join();
+    profiler.timer["IMSRGSolver_WaitForCheckpointIO"] += omp_get_wtime() - t_start;
+  }
+  if (checkpoint_write_failed)
+  {
+    cerr << "The checkpoint at step " << last_checkpoint_step << " couldn't be written. Restart() would use the one before it." << endl;
+    checkpoint_write_failed = false;
+  }
+}
+
+
+/// Wait for the Omega being written to the scratch directory in the background, if there is one.
+/// If it couldn't be written, Transform() would silently leave it out, so we stop there.
+void IMSRGSolver::FinishOmegaWrite()
+{
+  if (omega_write_thread != nullptr and omega_write_thread->joinable())
+  {
+    double t_start = omp_get_wtime();
+    omega_write_thread->join();
+    profiler.timer["IMSRGSolver_WaitForOmegaIO"] += omp_get_wtime() - t_start;
+  }
+  if (omega_write_failed)
+  {
+    omega_write_failed = false; // CleanupScratch() comes back here
+    cerr << "Couldn't write an Omega to the scratch directory. Deleting OMEGA files and calling terminate." << endl;
+    CleanupScratch();
+    terminate();
+  }
+}
+
+
+/// Restore the state saved by WriteCheckpoint(). The solver should be set up the same way
+/// as when the checkpoint was written (model space, H_in, method, smax, domega, scratch directory, etc.),
+/// and then the next call to Solve() continues the flow, giving the same result as an uninterrupted run.
+/// This works for the magnus_euler (magnus), magnus_modified_euler and magnus_rkmk4 methods.
+bool IMSRGSolver::Restart(string fname)
+{
+  double t_start = omp_get_wtime();
+  FinishCheckpoint();
+  ifstream ifs(fname, ios::binary);
+  char tag[sizeof(IMSRG_CHECKPOINT_TAG)];
+  int norbits=0, nchannels=0, Aref=0, Zref=0;
+  double hw=0;
+  ifs.read(tag, sizeof(tag));
+  ifs.read((char*)&norbits, sizeof(norbits));
+  ifs.read((char*)&nchannels, sizeof(nchannels));
+  ifs.read((char*)&hw, sizeof(hw));
+  ifs.read((char*)&Aref, sizeof(Aref));
+  ifs.read((char*)&Zref, sizeof(Zref));
+  if ( not ifs.good() or string(tag,sizeof(tag)-1) != IMSRG_CHECKPOINT_TAG )
+  {
+    cerr << "Trouble reading checkpoint " << fname << endl;
+    return false;
+  }
+  if ( norbits != modelspace->GetNumberOrbits() or nchannels != modelspace->GetNumberTwoBodyChannels()
+       or hw != modelspace->GetHbarOmega() or Aref != modelspace->GetAref() or Zref != modelspace->GetZref() )
+  {
+    cerr << "Checkpoint " << fname << " was written with a different model space ("
+         << norbits << " orbits, " << nchannels << " channels, hw = " << hw << ", reference A = " << Aref << " Z = " << Zref
+         << "). Not restarting." << endl;
+    return false;
+  }
+
+  int file_n_omega_written=0, file_omega_file_id=0, file_istep=0;
+  double file_s=0, file_ds=0;
+  size_t gentype_len=0;
+  ifs.read((char*)&file_s, sizeof(file_s));
+  ifs.read((char*)&file_ds, sizeof(file_ds));
+  ifs.read((char*)&file_istep, sizeof(file_istep));
+  ifs.read((char*)&file_n_omega_written, sizeof(file_n_omega_written));
+  ifs.read((char*)&file_omega_file_id, sizeof(file_omega_file_id));
+  ifs.read((char*)&gentype_len, sizeof(gentype_len));
+  if ( not ifs.good() or gentype_len > 256 )
+  {
+    cerr << "Trouble reading checkpoint " << fname << endl;
+    return false;
+  }
+  string gentype(gentype_len,' ');
+  ifs.read(&gentype[0], gentype_len);
+
+  // The split Omegas are still in the scratch directory. Make sure they're all there.
+  if (file_n_omega_written > 0)
+  {
+    if (rw == NULL or rw->GetScratchDir() == "")
+    {
+      cerr << "Checkpoint " << fname << " needs " << file_n_omega_written << " OMEGA files, but no scratch directory is set." << endl;
+      return false;
+    }
+    int my_omega_file_id = omega_file_id;
+    omega_file_id = file_omega_file_id;
+    for (int i=0; i<file_n_omega_written; ++i)
+    {
+      if ( not ifstream(GetOmegaFileName(i)).good() )
+      {
+        cerr << "Missing " << GetOmegaFileName(i) << " needed by checkpoint " << fname << endl;
+        omega_file_id = my_omega_file_id;
+        return false;
+      }
+    }
+    omega_file_id = my_omega_file_id; // only switch over once the whole checkpoint is read
+  }
+
+  Operator H_s(FlowingOps[0]);
+  Operator eta(Eta);
+  Operator h_saved(Eta);
+  bool have_H_saved = false;
+  int nomega = 0;
+  double cutoff=0, delta=0;
+  int delta_index=0;
+  ifs.read((char*)&cutoff, sizeof(cutoff));
+  ifs.read((char*)&delta, sizeof(delta));
+  ifs.read((char*)&delta_index, sizeof(delta_index));
+  size_t nhistory = 0;
+  ifs.read((char*)&nhistory, sizeof(nhistory));
+  if ( not ifs.good() or nhistory > 100000000 )
+  {
+    cerr << "Trouble reading checkpoint " << fname << endl;
+    return false;
+  }
+  array<vector<double>,4> history;
+  for (auto& h : history)
+  {
+    h.resize(nhistory);
+    ifs.read((char*)h.data(), nhistory*sizeof(double));
+  }
+  H_s.ReadBinary(ifs);
+  eta.ReadBinary(ifs);
+  ifs.read((char*)&have_H_saved, sizeof(have_H_saved));
+  if (have_H_saved) h_saved.ReadBinary(ifs);
+  ifs.read((char*)&nomega, sizeof(nomega));
+  // each Omega takes at least as much space in the file as its matrix elements, so don't allocate more than the file can hold
+  streampos pos = ifs.tellg();
+  ifs.seekg(0, ios::end);
+  double bytes_left = ifs.tellg() - pos;
+  ifs.seekg(pos);
+  if ( not ifs.good() or nomega < 1 or nomega*(double)Eta.Size() > bytes_left )
+  {
+    cerr << "Checkpoint " << fname << " is truncated. Not restarting." << endl;
+    return false;
+  }
+  deque<Operator> omegas(nomega, Eta);
+  for (auto& omega : omegas) omega.ReadBinary(ifs);
+  if ( not ifs.good() )
+  {
+    cerr << "Checkpoint " << fname << " is truncated. Not restarting." << endl;
+    return false;
+  }
+
+  s = file_s;
+  ds = file_ds;
+  istep = file_istep;
+  n_omega_written = file_n_omega_written;
+  if (n_omega_written > 0) omega_file_id = file_omega_file_id;
+  generator.SetType(gentype);
+  generator.SetDenominatorCutoff(cutoff);
+  generator.SetDenominatorDelta(delta);
+  generator.SetDenominatorDeltaIndex(delta_index);
+  FlowingOps[0] = H_s;
+  Eta = eta;
+  if (have_H_saved) H_saved = h_saved;
+  Omega = omegas;
+  times = history[0];
+  E0 = history[1];
+  eta1 = history[2];
+  eta2 = history[3];
+  restarted = true;
+  last_checkpoint_step = istep;
+  last_checkpoint_time = omp_get_wtime();
+
+  cout << "Restarting the flow from " << fname << " at s = " << s << ", step " << istep
+       << ", with " << n_omega_written << " Omegas on disk and " << Omega.size() << " in memory." << endl;
+  profiler.timer["IMSRGSolver_Restart"] += omp_get_wtime() - t_start;
+  return true;
+}
+
+
+
 void IMSRGSolver::WriteFlowStatus(string fname)
 {
    if (fname !="")
@@ -675,8 +1456,17 @@ void IMSRGSolver::WriteFlowStatus(ostream& f)
         << setw(7)      << setprecision(0)          << profiler.counter["N_Operators"]
         << setprecision(fprecision)
         << setw(12) << setprecision(3) << profiler.GetTimes()["real"]
-        << setw(12) << setprecision(3) << profiler.CheckMem()["RSS"]/1024. << " / " << skipws << profiler.MaxMemUsage()/1024. << fixed
-        << endl;
+        << setw(12) << setprecision(3) << profiler.CheckMem()["RSS"]/1024. << " / " << skipws << profiler.MaxMemUsage()/1024. << fixed;
+      if (flowfile_memory)
+      {
+        auto solver_mem = GetMemoryUsage();
+        auto tracked_mem = profiler.GetTrackedMemory();
+        f << setw(12) << setprecision(3) << solver_mem["Omega"]/1048576.
+          << setw(12) << setprecision(3) << solver_mem["FlowingOps"]/1048576.
+          << setw(12) << setprecision(3) << tracked_mem["Commutator scratch"]/1048576.
+          << setw(12) << setprecision(3) << tracked_mem["total"]/1048576.;
+      }
+      f << endl;
    }
 
 }
@@ -706,9 +1496,13 @@ void IMSRGSolver::WriteFlowStatusHeader(ostream& f)
         << setw(16)     << setprecision(fprecision) << "E(MP2)" 
         << setw(7)      << setprecision(fprecision) << "N_Ops"
         << setw(16) << setprecision(fprecision) << "Walltime (s)"
-        << setw(19) << setprecision(fprecision) << "Memory (MB)"
-        << endl;
-        for (int x=0;x<175;x++) f << "-";
+        << setw(19) << setprecision(fprecision) << "Memory (MB)";
+      if (flowfile_memory)
+      {
+        f << setw(12) << "Omega (MB)" << setw(12) << "FlowOps" << setw(12) << "Scratch" << setw(12) << "Tracked";
+      }
+      f << endl;
+        for (int x=0;x<(flowfile_memory ? 223 : 175);x++) f << "-";
         f << endl;
    }
 
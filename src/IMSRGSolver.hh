@@ -5,6 +5,8 @@
 #include <fstream>
 #include <string>
 #include <deque>
+#include <thread>
+#include <memory>
 #include "Operator.hh"
 #include "Generator.hh"
 #include "IMSRGProfiler.hh"
@@ -12,6 +14,8 @@
 
 using namespace std;
 
+#define IMSRG_CHECKPOINT_TAG "IMSRG_CHECKPOINT_v4"
+
 
 class IMSRGSolver
 {
@@ -43,13 +47,34 @@ class IMSRGSolver
   int n_omega_written;
   int max_omega_written;
   bool magnus_adaptive;
-
+  double magnus_tolerance;      ///< Error allowed per step in E0 and in Omega, for magnus_rkmk4
+  double extrapolation_tolerance; ///< Stop the flow when the extrapolated remaining change in E0 is below this. 0 means don't.
+  double E0_extrapolated;       ///< Extrapolated \f$ E_0(s\rightarrow\infty) \f$ from the last steps of the flow
+  double E0_extrapolation_error; ///< Uncertainty of E0_extrapolated
+  double omega_sparsify_threshold; ///< Drop elements of a finished Omega smaller than this times its largest element. 0 means don't.
+  double sparse_fill_cutoff;     ///< Channels of a sparsified Omega with fewer nonzero elements than this fraction use sparse products
+  Operator* sparsify_test_operator; ///< If set, report how much its expectation value changes when Omega is sparsified
+  int omega_file_id;            ///< Used in the names of the OMEGA files in the scratch directory. Normally the pid.
+  string checkpoint_file;       ///< Where to write checkpoints. Empty means no checkpoints.
+  int checkpoint_interval;      ///< Write a checkpoint every this many steps (0 to only use checkpoint_walltime)
+  double checkpoint_walltime;   ///< Write a checkpoint when this many seconds have passed since the last one (0 to only use checkpoint_interval)
+  int last_checkpoint_step;
+  double last_checkpoint_time;
+  shared_ptr<thread> omega_write_thread; ///< Background thread writing the last Omega to the scratch directory
+  bool omega_write_failed;      ///< Set by omega_write_thread if the Omega couldn't be written. Checked by FinishOmegaWrite().
+  shared_ptr<thread> checkpoint_thread; ///< Background thread writing the last checkpoint
+  bool checkpoint_write_failed; ///< Set by checkpoint_thread if the checkpoint couldn't be written
+  bool restarted;               ///< Set by Restart(), so the next Solve() picks up where the checkpoint left off
+  bool flowfile_memory;         ///< Also write the memory held by the Omegas, the flowing operators, and the tracked totals to the flow file
 
 
   ~IMSRGSolver();
   IMSRGSolver();
   IMSRGSolver( Operator& H_in);
   void NewOmega();
+  void SparsifyOmega();
+  void SeedOmega(Operator& omega);
+  void SeedFrom(IMSRGSolver& other);
   void SetHin( Operator& H_in);
   void SetReadWrite( ReadWrite& r){rw = &r;};
   void Reset();
@@ -60,6 +85,7 @@ class IMSRGSolver
   void Solve();
   void Solve_magnus_euler();
   void Solve_magnus_modified_euler();
+  void Solve_magnus_rkmk4();
 
   Operator Transform(Operator& OpIn);
   Operator Transform(Operator&& OpIn);
@@ -69,8 +95,13 @@ class IMSRGSolver
   int GetNOmegaWritten(){return n_omega_written;};
   Operator Transform_Partial(Operator& OpIn, int n);
   Operator Transform_Partial(Operator&& OpIn, int n);
+  vector<Operator> Transform(vector<Operator>& OpsIn);
+  vector<Operator> Transform_Partial(vector<Operator>& OpsIn, int n);
+  void Transform_Partial_InPlace(vector<Operator>& Ops, int n);
 
   void SetFlowFile(string s);
+  void SetFlowFileMemory(bool b){flowfile_memory = b;};
+  map<string,size_t> GetMemoryUsage();
   void SetDs(double d){ds = d;};
   void SetDsmax(double d){ds_max = d;};
   void SetdOmega(double d){norm_domega = d;};
@@ -80,6 +111,14 @@ class IMSRGSolver
   void SetODETolerance(float x){ode_e_abs=x;ode_e_rel=x;};
   void SetEtaCriterion(float x){eta_criterion = x;};
   void SetMagnusAdaptive(bool b){magnus_adaptive = b;};
+  void SetMagnusTolerance(double x){magnus_tolerance = x;};
+  void SetExtrapolationTolerance(double x){extrapolation_tolerance = x;};
+  double GetE0Extrapolated(){return E0_extrapolated;};
+  double GetE0ExtrapolationError(){return E0_extrapolation_error;};
+  /// Experimental, and off by default: so far it has made the flow slower, since the sparse products are rebuilt from the dense
+  /// matrices in every commutator. See SparsifyOmega().
+  void SetOmegaSparsify(double threshold, double fill_cutoff=0.3){omega_sparsify_threshold = threshold; sparse_fill_cutoff = threshold>0 ? fill_cutoff : 0;};
+  void SetSparsifyTestOperator(Operator& op){sparsify_test_operator = &op;};
 
   int GetSystemDimension();
   Operator& GetH_s(){return FlowingOps[0];};
@@ -100,6 +139,15 @@ class IMSRGSolver
   void SetDenominatorDeltaOrbit(string o){generator.SetDenominatorDeltaOrbit(o);};
 
   void CleanupScratch();
+  string GetOmegaFileName(int i);
+
+  void SetCheckpoint(string fname, int interval=10, double walltime=0);
+  void CheckpointIfDue();
+  bool ConvergedByExtrapolation();
+  void WriteCheckpoint();
+  void FinishCheckpoint();
+  void FinishOmegaWrite();
+  bool Restart(string fname);
 
 
   // This is used to get flow info from odeint
@@ -133,6 +181,18 @@ class IMSRGSolver
   };
 
 
+  // odeint takes the system by value, so we hand it this instead of a copy of the whole solver
+  class ODE_System
+  {
+    public:
+     ODE_System(IMSRGSolver& solver) : imsrgsolver(solver) {};
+     IMSRGSolver& imsrgsolver;
+     void operator() (const deque<Operator>& x, deque<Operator>& dxdt, const double t)
+     {
+        imsrgsolver(x,dxdt,t);
+     }
+  };
+
   ODE_Monitor ode_monitor;
 
   vector<double> times;
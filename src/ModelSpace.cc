@@ -1,9 +1,15 @@
 #include "ModelSpace.hh"
 #include "AngMom.hh"
+#include "IMSRGProfiler.hh"
 #include <iostream>
 #include <vector>
 #include <cmath>
 #include <sstream>
+#include <fstream>
+#include <omp.h>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
 
 
 using namespace std;
@@ -242,9 +248,20 @@ bool TwoBodyChannel_CC::CheckChannel_ket(Orbit* op, Orbit* oq) const
 
 // Static members
 
-unordered_map<unsigned long int,double> ModelSpace::SixJList;
-unordered_map<unsigned long long int,double> ModelSpace::NineJList;
-unordered_map<unsigned long long int,double> ModelSpace::MoshList;
+int ModelSpace::sixj_twoj_max = -1;
+int ModelSpace::sixj_twoJ3_max = -1;
+vector<double> ModelSpace::SixJTable_4half;
+vector<size_t> ModelSpace::SixJTable_4half_offset;
+vector<double> ModelSpace::SixJTable_3half;
+vector<size_t> ModelSpace::SixJTable_3half_offset;
+vector<vector<double>> ModelSpace::NineJTable;
+vector<vector<size_t>> ModelSpace::NineJTable_offset;
+int ModelSpace::mosh_E2max = -1;
+vector<double> ModelSpace::MoshTable;
+vector<size_t> ModelSpace::MoshTable_offset;
+vector<size_t> ModelSpace::MoshTable_suboffset;
+string ModelSpace::moshinsky_cache_dir = "";
+size_t ModelSpace::angmom_cache_bytes = 0;
 map<string,vector<string>> ModelSpace::ValenceSpaces  {
 { "s-shell"  ,         {"vacuum", "p0s1","n0s1"}},
 { "p-shell"  ,         {"He4", "p0p3","n0p3","p0p1","n0p1"}},
@@ -272,7 +289,7 @@ ModelSpace::~ModelSpace()
 }
 
 ModelSpace::ModelSpace()
-:  Emax(0), E2max(0), E3max(0), Lmax2(0), Lmax3(0), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0), norbits(0),
+:  Emax(0), E2max(0), E3max(0), Lmax2(0), Lmax3(0), E3max_bra(-1), E3max_ket(-1), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0), norbits(0),
   hbar_omega(20), target_mass(16), isNuclear(true)
 {
   cout << "In default constructor" << endl;
@@ -293,7 +310,7 @@ ModelSpace::ModelSpace(const ModelSpace& ms)
    KetIndex_qq( ms.KetIndex_qq),
    Ket_occ_hh( ms.Ket_occ_hh),
    Ket_unocc_hh( ms.Ket_unocc_hh),
-   Emax(ms.Emax), E2max(ms.E2max), E3max(ms.E3max), Lmax2(ms.Lmax2), Lmax3(ms.Lmax3),
+   Emax(ms.Emax), E2max(ms.E2max), E3max(ms.E3max), Lmax2(ms.Lmax2), Lmax3(ms.Lmax3), E3max_bra(ms.E3max_bra), E3max_ket(ms.E3max_ket),
    OneBodyJmax(ms.OneBodyJmax), TwoBodyJmax(ms.TwoBodyJmax), ThreeBodyJmax(ms.ThreeBodyJmax),
    OneBodyChannels(ms.OneBodyChannels),
    SortedTwoBodyChannels(ms.SortedTwoBodyChannels),
@@ -324,7 +341,7 @@ ModelSpace::ModelSpace(ModelSpace&& ms)
    KetIndex_qq( ms.KetIndex_qq),
    Ket_occ_hh( ms.Ket_occ_hh),
    Ket_unocc_hh( ms.Ket_unocc_hh),
-   Emax(ms.Emax), E2max(ms.E2max), E3max(ms.E3max), Lmax2(ms.Lmax2), Lmax3(ms.Lmax3),
+   Emax(ms.Emax), E2max(ms.E2max), E3max(ms.E3max), Lmax2(ms.Lmax2), Lmax3(ms.Lmax3), E3max_bra(ms.E3max_bra), E3max_ket(ms.E3max_ket),
    OneBodyJmax(ms.OneBodyJmax), TwoBodyJmax(ms.TwoBodyJmax), ThreeBodyJmax(ms.ThreeBodyJmax),
    OneBodyChannels(move(ms.OneBodyChannels)),
    SortedTwoBodyChannels(move(ms.SortedTwoBodyChannels)),
@@ -346,34 +363,34 @@ ModelSpace::ModelSpace(ModelSpace&& ms)
 // orbit string representation is e.g. p0f7
 // Assumes that the core is hole states that aren't in the valence space.
 ModelSpace::ModelSpace(int emax, vector<string> hole_list, vector<string> valence_list)
-:  Emax(emax), E2max(2*emax), E3max(3*emax), Lmax2(emax), Lmax3(emax), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0), norbits(0), hbar_omega(20), target_mass(16), isNuclear(true)
+:  Emax(emax), E2max(2*emax), E3max(3*emax), Lmax2(emax), Lmax3(emax), E3max_bra(-1), E3max_ket(-1), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0), norbits(0), hbar_omega(20), target_mass(16), isNuclear(true)
 {
    Init(emax, hole_list, hole_list, valence_list); 
 }
 
 // If we don't want the reference to be the core
 ModelSpace::ModelSpace(int emax, vector<string> hole_list, vector<string> core_list, vector<string> valence_list)
-: Emax(emax), E2max(2*emax), E3max(3*emax), Lmax2(emax), Lmax3(emax), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0), norbits(0), hbar_omega(20), target_mass(16), isNuclear(true)
+: Emax(emax), E2max(2*emax), E3max(3*emax), Lmax2(emax), Lmax3(emax), E3max_bra(-1), E3max_ket(-1), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0), norbits(0), hbar_omega(20), target_mass(16), isNuclear(true)
 {
    Init(emax, hole_list, core_list, valence_list); 
 }
 
 // Most conventient interface
 ModelSpace::ModelSpace(int emax, string reference, string valence)
-: Emax(emax), E2max(2*emax), E3max(3*emax), Lmax2(emax), Lmax3(emax), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0),hbar_omega(20), isNuclear(true)
+: Emax(emax), E2max(2*emax), E3max(3*emax), Lmax2(emax), Lmax3(emax), E3max_bra(-1), E3max_ket(-1), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0),hbar_omega(20), isNuclear(true)
 {
   Init(emax,reference,valence);
 }
 
 // Second most conventient (sp?) interface
 ModelSpace::ModelSpace(int emax, string reference, string valence, bool setNuclear)
-: Emax(emax), E2max(2*emax), E3max(3*emax), Lmax2(emax), Lmax3(emax), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0),hbar_omega(20), isNuclear(true)
+: Emax(emax), E2max(2*emax), E3max(3*emax), Lmax2(emax), Lmax3(emax), E3max_bra(-1), E3max_ket(-1), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0),hbar_omega(20), isNuclear(true)
 {
   Init(emax,reference,valence,setNuclear);
 }
 
 ModelSpace::ModelSpace(int emax, string valence)
-: Emax(emax), E2max(2*emax), E3max(3*emax), Lmax2(emax), Lmax3(emax), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0),hbar_omega(20), isNuclear(true)
+: Emax(emax), E2max(2*emax), E3max(3*emax), Lmax2(emax), Lmax3(emax), E3max_bra(-1), E3max_ket(-1), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0),hbar_omega(20), isNuclear(true)
 {
   auto itval = ValenceSpaces.find(valence);
   if ( itval != ValenceSpaces.end() ) // we've got a valence space
@@ -383,7 +400,7 @@ ModelSpace::ModelSpace(int emax, string valence)
 }
 
 ModelSpace::ModelSpace(int emax, string valence, bool setNuclear)
-: Emax(emax), E2max(2*emax), E3max(3*emax), Lmax2(emax), Lmax3(emax), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0),hbar_omega(20), isNuclear(setNuclear)
+: Emax(emax), E2max(2*emax), E3max(3*emax), Lmax2(emax), Lmax3(emax), E3max_bra(-1), E3max_ket(-1), OneBodyJmax(0), TwoBodyJmax(0), ThreeBodyJmax(0),hbar_omega(20), isNuclear(setNuclear)
 {
   auto itval = ValenceSpaces.find(valence);
   if ( itval != ValenceSpaces.end() ) // we've got a valence space
@@ -886,6 +903,8 @@ ModelSpace ModelSpace::operator=(const ModelSpace& ms)
    E3max = ms.E3max;
    Lmax2 = ms.Lmax2;
    Lmax3 = ms.Lmax3;
+   E3max_bra = ms.E3max_bra;
+   E3max_ket = ms.E3max_ket;
    OneBodyJmax = ms.OneBodyJmax;
    TwoBodyJmax = ms.TwoBodyJmax;
    ThreeBodyJmax = ms.ThreeBodyJmax;
@@ -938,6 +957,8 @@ ModelSpace ModelSpace::operator=(ModelSpace&& ms)
    E3max = move(ms.E3max);
    Lmax2 = move(ms.Lmax2);
    Lmax3 = move(ms.Lmax3);
+   E3max_bra = move(ms.E3max_bra);
+   E3max_ket = move(ms.E3max_ket);
    OneBodyJmax = move(ms.OneBodyJmax);
    TwoBodyJmax = move(ms.TwoBodyJmax);
    ThreeBodyJmax = move(ms.ThreeBodyJmax);
@@ -1066,12 +1087,18 @@ void ModelSpace::SetupKets()
      }
    }
    cout << "Resized Kets, moving on to other stuff..." << endl;
-  for (index_t index=1;index<Kets.size();++index)
+  // Local index of each ket within its Tz,parity block. Every ket needs one, since HartreeFock looks them all up.
+  for (index_t index=0;index<Kets.size();++index)
   {
     Ket& ket = Kets[index];
     int Tz = (ket.op->tz2 + ket.oq->tz2)/2;
     int parity = (ket.op->l + ket.oq->l)%2;
-    MonopoleKets[Tz+1][parity][index] = MonopoleKets[Tz+1][parity].size()-1;
+    index_t local_index = MonopoleKets[Tz+1][parity].size();
+    MonopoleKets[Tz+1][parity][index] = local_index;
+  }
+  for (index_t index=1;index<Kets.size();++index)
+  {
+    Ket& ket = Kets[index];
     double occp = ket.op->occ;
     double occq = ket.oq->occ;
     int cvq_p = ket.op->cvq;
@@ -1116,6 +1143,7 @@ void ModelSpace::SetupKets()
    while (  TwoBodyChannels[ SortedTwoBodyChannels.back() ].GetNumberKets() <1 ) SortedTwoBodyChannels.pop_back();
    while (  TwoBodyChannels_CC[ SortedTwoBodyChannels_CC.back() ].GetNumberKets() <1 ) SortedTwoBodyChannels_CC.pop_back();
    //cout << "Did I make it here?" << endl;
+   PreCalculateSixJ();
 }
 
 
@@ -1151,79 +1179,344 @@ void ModelSpace::ClearVectors()
 }
 
 
+//*****************************************************************************************
+/// Look up a 6j symbol in the tables filled by PreCalculateSixJ().
+/// The symbol is brought to one of the stored forms using its symmetries
+/// (column permutations, and swapping upper and lower entries in two columns).
+/// Anything not covered by the tables is calculated on the fly, so this is thread safe.
+//*****************************************************************************************
 double ModelSpace::GetSixJ(double j1, double j2, double j3, double J1, double J2, double J3)
 {
 // { j1 j2 j3 }
 // { J1 J2 J3 }
+   int t[6] = { int(2*j1), int(2*j2), int(2*j3), int(2*J1), int(2*J2), int(2*J3) };
+   int nhalf = (t[0]&1) + (t[1]&1) + (t[2]&1) + (t[3]&1) + (t[4]&1) + (t[5]&1);
 
-//   unsigned long long int key = 20000000000*j1 + 200000000*j2 + 2000000*j3 + 20000*J1 + 200*J2 + 2*J3;
-   unsigned long int key = (((unsigned long int) (2*j1)) << 30) +
-                           (((unsigned long int) (2*j2)) << 24) +
-                           (((unsigned long int) (2*j3)) << 18) +
-                           (((unsigned long int) (2*J1)) << 12) +
-                           (((unsigned long int) (2*J2)) <<  6) +
-                            ((unsigned long int) (2*J3));
-
-   auto it = SixJList.find(key);
-   if (it != SixJList.end() ) return it->second;
-   double sixj = AngMom::SixJ(j1,j2,j3,J1,J2,J3);
-   #pragma omp critical
-   SixJList[key] = sixj;
-   return sixj;
+   if (nhalf==4) // { a b J ; c d J' }
+   {
+     int k = (t[0]&1)==0 ? 0 : ( (t[1]&1)==0 ? 1 : 2 );
+     if ( (t[k]&1) or (t[k+3]&1) ) return 0; // the integers aren't in the same column, so some triad is non-integer
+     int a = t[(k+1)%3];
+     int c = t[(k+1)%3+3];
+     int b = t[(k+2)%3];
+     int d = t[(k+2)%3+3];
+     int J = t[k]/2;
+     int Jp = t[k+3]/2;
+     // move the largest half-integer to the d slot
+     if (a>=b and a>=c and a>=d)
+     {
+       swap(a,b); swap(c,d); swap(b,d); swap(J,Jp);
+     }
+     else if (b>=c and b>=d)
+     {
+       swap(b,d); swap(J,Jp);
+     }
+     else if (c>=d)
+     {
+       swap(a,b); swap(c,d);
+     }
+     if (a<=sixj_twoj_max and b<=sixj_twoj_max and c<=sixj_twoj_max and d<=sixj_twoJ3_max)
+     {
+       int Jmin  = max( abs(a-b), abs(c-d) )/2;
+       int Jmax  = min( a+b, c+d )/2;
+       int Jpmin = max( abs(a-d), abs(c-b) )/2;
+       int Jpmax = min( a+d, c+b )/2;
+       if (J<Jmin or J>Jmax or Jp<Jpmin or Jp>Jpmax) return 0;
+       int nj  = (sixj_twoj_max+1)/2;
+       int nJ3 = (sixj_twoJ3_max+1)/2;
+       size_t iblock = (((a-1)/2*nj + (b-1)/2)*nj + (c-1)/2)*nJ3 + (d-1)/2;
+       return SixJTable_4half[ SixJTable_4half_offset[iblock] + (J-Jmin)*(Jpmax-Jpmin+1) + (Jp-Jpmin) ];
+     }
+   }
+   else if (nhalf==3) // { J1 J2 J3 ; j1 j2 j3 }
+   {
+     // The integers have to form a triad. Bring them to the upper row.
+     int nswap = 0;
+     for (int k=0;k<3;++k)
+     {
+       if ((t[k]&1)>0)
+       {
+         swap(t[k],t[k+3]);
+         ++nswap;
+       }
+     }
+     if ( nswap%2>0 or (t[0]&1) or (t[1]&1) or (t[2]&1) ) return 0; // non-integer triad
+     int a = t[3];
+     int b = t[4];
+     int c = t[5];
+     if (a<=sixj_twoj_max and b<=sixj_twoj_max and c<=sixj_twoj_max)
+     {
+       int J1min = abs(b-c)/2;
+       int J2min = abs(a-c)/2;
+       int J3min = abs(a-b)/2;
+       int n1 = (b+c)/2 - J1min + 1;
+       int n2 = (a+c)/2 - J2min + 1;
+       int n3 = (a+b)/2 - J3min + 1;
+       int i1 = t[0]/2 - J1min;
+       int i2 = t[1]/2 - J2min;
+       int i3 = t[2]/2 - J3min;
+       if (i1<0 or i1>=n1 or i2<0 or i2>=n2 or i3<0 or i3>=n3) return 0;
+       int nj  = (sixj_twoj_max+1)/2;
+       size_t iblock = ((a-1)/2*nj + (b-1)/2)*nj + (c-1)/2;
+       return SixJTable_3half[ SixJTable_3half_offset[iblock] + (i1*n2 + i2)*n3 + i3 ];
+     }
+   }
+   return AngMom::SixJ(j1,j2,j3,J1,J2,J3);
 }
 
 
+//*****************************************************************************************
+/// Fill dense tables with all the 6j symbols reachable in this model space.
+/// Two types of symbol show up: those with four half-integer entries
+/// \f$ \left\{ \begin{array}{ccc} j_1 & j_2 & J \\ j_3 & j_4 & J' \end{array} \right\} \f$
+/// (Pandya transformations, three-body recoupling) and those with three,
+/// \f$ \left\{ \begin{array}{ccc} J_1 & J_2 & J_3 \\ j_1 & j_2 & j_3 \end{array} \right\} \f$
+/// (tensor commutators). In the first type, \f$j_4\f$ may be as large as the total \f$J\f$ of a three-body state.
+/// The tables are static, so this only does something if the model space is bigger than the last one.
+/// They are read without locking, so they're only written at serial points. Inside a parallel region
+/// (e.g. the jobs of an ensemble) this does nothing, and GetSixJ() calculates anything missing on the fly.
+/// It is called at the end of SetupKets().
+//*****************************************************************************************
+void ModelSpace::PreCalculateSixJ()
+{
+  if (omp_in_parallel()) return;
+  int twoj_max = 1;
+  for (auto& o : Orbits) twoj_max = max(twoj_max, o.j2);
+  int twoJ3_max = max( twoj_max, min(3*twoj_max, 2*E3max+3) );
+  if (twoj_max <= sixj_twoj_max and twoJ3_max <= sixj_twoJ3_max) return; // Already done calculated it...
+
+  double t_start = omp_get_wtime();
+  twoj_max = max(twoj_max, sixj_twoj_max);
+  twoJ3_max = max(twoJ3_max, sixj_twoJ3_max);
+  int nj = (twoj_max+1)/2;
+  int nJ3 = (twoJ3_max+1)/2;
+
+  // { a b J ; c d J' }. Work out where each block starts first, then fill them in parallel.
+  size_t nblocks = nj*nj*nj*nJ3;
+  vector<size_t> offset_4half(nblocks+1,0);
+  for (size_t iblock=0; iblock<nblocks; ++iblock)
+  {
+    int a = 2*(iblock/(nJ3*nj*nj))+1;
+    int b = 2*((iblock/(nJ3*nj))%nj)+1;
+    int c = 2*((iblock/nJ3)%nj)+1;
+    int d = 2*(iblock%nJ3)+1;
+    int nJ  = min(a+b,c+d)/2 - max(abs(a-b),abs(c-d))/2 + 1;
+    int nJp = min(a+d,c+b)/2 - max(abs(a-d),abs(c-b))/2 + 1;
+    offset_4half[iblock+1] = offset_4half[iblock] + max(nJ,0)*max(nJp,0);
+  }
+  vector<double> table_4half(offset_4half[nblocks]);
 
+  #pragma omp parallel for schedule(dynamic,1)
+  for (size_t iblock=0; iblock<nblocks; ++iblock)
+  {
+    int a = 2*(iblock/(nJ3*nj*nj))+1;
+    int b = 2*((iblock/(nJ3*nj))%nj)+1;
+    int c = 2*((iblock/nJ3)%nj)+1;
+    int d = 2*(iblock%nJ3)+1;
+    int Jmin  = max( abs(a-b), abs(c-d) )/2;
+    int Jmax  = min( a+b, c+d )/2;
+    int Jpmin = max( abs(a-d), abs(c-b) )/2;
+    int Jpmax = min( a+d, c+b )/2;
+    if (Jmax<Jmin or Jpmax<Jpmin) continue;
+    size_t indx = offset_4half[iblock];
+    for (int J=Jmin; J<=Jmax; ++J)
+    {
+      AngMom::SixJ_Batch(0.5*a, 0.5*b, J, 0.5*c, 0.5*d, Jpmin, Jpmax, &table_4half[indx]);
+      indx += Jpmax-Jpmin+1;
+    }
+  }
+
+  // { J1 J2 J3 ; a b c }
+  nblocks = nj*nj*nj;
+  vector<size_t> offset_3half(nblocks+1,0);
+  for (size_t iblock=0; iblock<nblocks; ++iblock)
+  {
+    int a = 2*(iblock/(nj*nj))+1;
+    int b = 2*((iblock/nj)%nj)+1;
+    int c = 2*(iblock%nj)+1;
+    offset_3half[iblock+1] = offset_3half[iblock] + ((b+c)/2-abs(b-c)/2+1) * ((a+c)/2-abs(a-c)/2+1) * ((a+b)/2-abs(a-b)/2+1);
+  }
+  vector<double> table_3half(offset_3half[nblocks]);
+
+  #pragma omp parallel for schedule(dynamic,1)
+  for (size_t iblock=0; iblock<nblocks; ++iblock)
+  {
+    int a = 2*(iblock/(nj*nj))+1;
+    int b = 2*((iblock/nj)%nj)+1;
+    int c = 2*(iblock%nj)+1;
+    size_t indx = offset_3half[iblock];
+    for (int J1=abs(b-c)/2; J1<=(b+c)/2; ++J1)
+    {
+     for (int J2=abs(a-c)/2; J2<=(a+c)/2; ++J2)
+     {
+       AngMom::SixJ_Batch(0.5*a, J2, 0.5*c, J1, 0.5*b, abs(a-b)/2, (a+b)/2, &table_3half[indx]); // { a J2 c ; J1 b J3 } = { J1 J2 J3 ; a b c }
+       indx += (a+b)/2-abs(a-b)/2+1;
+     }
+    }
+  }
+
+  SixJTable_4half.swap(table_4half);
+  SixJTable_4half_offset.swap(offset_4half);
+  SixJTable_3half.swap(table_3half);
+  SixJTable_3half_offset.swap(offset_3half);
+  sixj_twoj_max = twoj_max;
+  sixj_twoJ3_max = twoJ3_max;
+  // The 9j tables are indexed with the old jmax, so they need to be redone.
+  for (size_t Lambda=0; Lambda<NineJTable.size(); ++Lambda)
+  {
+    if (NineJTable_offset[Lambda].empty()) continue;
+    NineJTable_offset[Lambda].clear();
+    PreCalculateNineJ(Lambda);
+  }
+
+  TrackAngMomCacheMemory();
+  cout << "Calculated " << SixJTable_4half.size() + SixJTable_3half.size() << " 6j symbols ("
+       << (SixJTable_4half.size() + SixJTable_3half.size())*sizeof(double)/1024./1024. << " MB) in "
+       << omp_get_wtime() - t_start << " seconds" << endl;
+}
+
+
+//*****************************************************************************************
+/// Fill a dense table with the Moshinsky brackets
+/// \f$ \langle N\Lambda n\lambda L | n_1 l_1 n_2 l_2 L \rangle \f$ up to E2max.
+/// Only the ordering returned by the symmetry reduction in GetMoshinsky() is stored.
+/// The table is organized in blocks of \f$ (N,\Lambda,n,\lambda) \f$, and within a block
+/// by \f$ (L,n_1,n_2) \f$, with \f$ l_2 \f$ fixed by energy conservation and \f$ l_1 \f$
+/// running over the values allowed by the triangle condition.
+/// If a cache directory has been set with SetMoshinskyCacheDir(), the brackets are read from
+/// there when available, and written there otherwise. The file starts with MOSHINSKY_CACHE_TAG,
+/// E2max and the number of brackets, and is only used if all of those and its size match.
+/// Like PreCalculateSixJ(), this does nothing inside a parallel region.
+//*****************************************************************************************
 void ModelSpace::PreCalculateMoshinsky()
 {
-//  if ( not MoshList.empty() ) return; // Already done calculated it...
-  #pragma omp parallel for schedule(dynamic,1)
-  for (int N=0; N<=E2max/2; ++N)
+  if (omp_in_parallel()) return;
+  if ( E2max <= mosh_E2max ) return; // Already done calculated it...
+
+  double t_start = omp_get_wtime();
+  int E = E2max;
+  int nN = E/2+1;
+
+  // Work out the layout, then fill in the blocks in parallel.
+  vector<size_t> offset( nN*(E+1)*nN*(E+1), 0 );
+  vector<size_t> suboffset;
+  vector<array<int,4>> blocks;
+  size_t nmosh = 0;
+  for (int N=0; N<=E/2; ++N)
   {
-   unordered_map<unsigned long long int,double> local_MoshList;
-   for (int n=0; n<=min(N,E2max/2-N); ++n)
+   for (int Lam=0; Lam<=E-2*N; ++Lam)
    {
-    for (int Lam=0; Lam<=E2max-2*N-2*n; ++Lam)
+    for (int n=0; n<=min(N,(E-2*N-Lam)/2); ++n)
     {
-     int lam_max = (N==n ? min(Lam,E2max-2*N-2*n-Lam) : E2max-2*N-2*n-Lam);
+     int lam_max = (N==n ? min(Lam,E-2*N-2*n-Lam) : E-2*N-2*n-Lam);
      for (int lam=0; lam<=lam_max; ++lam)
      {
       int e2 = 2*N+Lam + 2*n+lam;
+      offset[((N*(E+1)+Lam)*nN+n)*(E+1)+lam] = suboffset.size();
+      blocks.push_back({N,Lam,n,lam});
       for (int L=abs(Lam-lam); L<=Lam+lam; ++L)
       {
        for (int n1=0; n1<=N; ++n1)
        {
-        for (int n2=0; n2<=min(n1,e2/2-n1); ++n2)
+        for (int n2=0; n2<=N; ++n2)
         {
-         int l1max = n1==N? min(Lam,e2-2*n1-2*n2) : e2-2*n1-2*n2;
-         for (int l1=0; l1<=l1max; ++l1 )
-         {
-          int l2 = e2-2*n1-2*n2-l1;
-          if ( (l1+l2+lam+Lam)%2 >0 ) continue;
-          if ( l2<abs(L-l1) or l2>L+l1 ) continue;
-          // emax = 16, lmax = 32 -> good up to emax=32, which I'm nowhere near.
-          unsigned long long int key =   ((unsigned long long int) N   << 40)
-                                       + ((unsigned long long int) Lam << 34)
-                                       + ((unsigned long long int) n   << 30)
-                                       + ((unsigned long long int) lam << 26)
-                                       + ((unsigned long long int) n1  << 22)
-                                       + ((unsigned long long int) l1  << 16)
-                                       + ((unsigned long long int) n2  << 12)
-                                       + ((unsigned long long int) l2  << 6 )
-                                       +  L;
-
-          double mosh = AngMom::Moshinsky(N,Lam,n,lam,n1,l1,n2,l2,L);
-          local_MoshList[key] = mosh;
-         }
+          suboffset.push_back(nmosh);
+          int R = e2-2*n1-2*n2; // l1+l2
+          if (n2>n1 or R<L) continue;
+          nmosh += min(R,(R+L)/2) - (R-L+1)/2 + 1;
         }
        }
       }
      }
     }
    }
-   #pragma omp critical
-   MoshList.insert( local_MoshList.begin(), local_MoshList.end() );
   }
+
+  vector<double> table(nmosh,0.0);
+  bool read_from_cache = false;
+  string cachefile;
+  if (moshinsky_cache_dir != "")
+  {
+    ostringstream oss;
+    oss << moshinsky_cache_dir << "/moshinsky_e2max" << E << ".bin";
+    cachefile = oss.str();
+    ifstream infile(cachefile, ios::binary|ios::ate);
+    if ( infile.good() )
+    {
+      size_t filesize = infile.tellg();
+      infile.seekg(0);
+      string tag(strlen(MOSHINSKY_CACHE_TAG),' ');
+      int E_file = -1;
+      size_t n_file = 0;
+      infile.read(&tag[0],tag.size());
+      infile.read((char*)&E_file,sizeof(E_file));
+      infile.read((char*)&n_file,sizeof(n_file));
+      if (tag==MOSHINSKY_CACHE_TAG and E_file==E and n_file==nmosh
+          and filesize == tag.size()+sizeof(E_file)+sizeof(n_file)+nmosh*sizeof(double))
+      {
+        infile.read((char*)&table[0],nmosh*sizeof(double));
+        read_from_cache = infile.good();
+      }
+      if (not read_from_cache)
+        cerr << "Warning: " << cachefile << " isn't a complete table for E2max = " << E << ". Recalculating." << endl;
+    }
+  }
+
+  if (not read_from_cache)
+  {
+   #pragma omp parallel for schedule(dynamic,1)
+   for (size_t iblock=0; iblock<blocks.size(); ++iblock)
+   {
+    int N   = blocks[iblock][0];
+    int Lam = blocks[iblock][1];
+    int n   = blocks[iblock][2];
+    int lam = blocks[iblock][3];
+    int e2 = 2*N+Lam + 2*n+lam;
+    size_t isub = offset[((N*(E+1)+Lam)*nN+n)*(E+1)+lam];
+    for (int L=abs(Lam-lam); L<=Lam+lam; ++L)
+    {
+     for (int n1=0; n1<=N; ++n1)
+     {
+      for (int n2=0; n2<=N; ++n2)
+      {
+        size_t indx = suboffset[isub++];
+        int R = e2-2*n1-2*n2;
+        if (n2>n1 or R<L) continue;
+        for (int l1=(R-L+1)/2; l1<=min(R,(R+L)/2); ++l1)
+        {
+          table[indx++] = AngMom::Moshinsky(N,Lam,n,lam,n1,l1,n2,R-l1,L);
+        }
+      }
+     }
+    }
+   }
+   if (cachefile != "")
+   {
+     // Write to a temporary file and rename it, so a run reading the cache never sees a partly written table.
+     // The pid keeps runs which share the cache directory from writing to the same temporary file.
+     ostringstream tmpname;
+     tmpname << cachefile << ".tmp" << getpid();
+     ofstream outfile(tmpname.str(), ios::binary);
+     outfile.write(MOSHINSKY_CACHE_TAG,strlen(MOSHINSKY_CACHE_TAG));
+     outfile.write((char*)&E,sizeof(E));
+     outfile.write((char*)&nmosh,sizeof(nmosh));
+     outfile.write((char*)&table[0],nmosh*sizeof(double));
+     outfile.close();
+     if ( outfile.fail() or rename(tmpname.str().c_str(), cachefile.c_str()) != 0 )
+     {
+       cerr << "Warning: trouble writing Moshinsky brackets to " << cachefile << endl;
+       remove(tmpname.str().c_str());
+     }
+   }
+  }
+
+  MoshTable.swap(table);
+  MoshTable_offset.swap(offset);
+  MoshTable_suboffset.swap(suboffset);
+  mosh_E2max = E;
+  TrackAngMomCacheMemory();
+  cout << (read_from_cache ? "Read " : "Calculated ") << nmosh << " Moshinsky brackets (" << nmosh*sizeof(double)/1024./1024. << " MB) in "
+       << omp_get_wtime()-t_start << " seconds" << endl;
 }
 
 
@@ -1262,109 +1555,181 @@ double ModelSpace::GetMoshinsky( int N, int Lam, int n, int lam, int n1, int l1,
    }
   }
 
-          unsigned long long int key =   ((unsigned long long int) N   << 40)
-                                       + ((unsigned long long int) Lam << 34)
-                                       + ((unsigned long long int) n   << 30)
-                                       + ((unsigned long long int) lam << 26)
-                                       + ((unsigned long long int) n1  << 22)
-                                       + ((unsigned long long int) l1  << 16)
-                                       + ((unsigned long long int) n2  << 12)
-                                       + ((unsigned long long int) l2  << 6 )
-                                       +  L;
-
-//   unsigned long long int key =  1000000000000 * N
-//                                + 100000000000 * Lam
-//                                +   1000000000 * n
-//                                +    100000000 * lam
-//                                +      1000000 * n1
-//                                +       100000 * l1
-//                                +         1000 * n2
-//                                +          100 * l2
-//                                +                 L;
-   auto it = MoshList.find(key);
-   if ( it != MoshList.end() )  return it->second * phase_mosh;
-
-   // if we didn't find it, we need to calculate it.
-   double mosh = AngMom::Moshinsky(N,Lam,n,lam,n1,l1,n2,l2,L);
-//   cout << "Shouldn't be here..." << N << " " << Lam << " " <<  n << " " << lam << " " << n1 << " " << l1 << " " << n2 << " " << l2 << " " << L << endl;
-//   #pragma omp atomic
-   MoshList[key] = mosh;
-   return mosh * phase_mosh;
+   // Look it up in the table, if it's there.
+   int e2 = 2*N+Lam + 2*n+lam;
+   if (2*n1+l1 + 2*n2+l2 != e2) return 0;
+   if (L<abs(Lam-lam) or L>Lam+lam or L<abs(l1-l2) or L>l1+l2) return 0;
+   if (e2 <= mosh_E2max)
+   {
+     int E = mosh_E2max;
+     int nN = E/2+1;
+     int R = l1+l2;
+     size_t isub = MoshTable_offset[((N*(E+1)+Lam)*nN+n)*(E+1)+lam] + ((L-abs(Lam-lam))*(N+1) + n1)*(N+1) + n2;
+     return MoshTable[ MoshTable_suboffset[isub] + l1 - (R-L+1)/2 ] * phase_mosh;
+   }
+
+   // if it's not in the table, we need to calculate it.
+   return AngMom::Moshinsky(N,Lam,n,lam,n1,l1,n2,l2,L) * phase_mosh;
 
 }
 
 
 
 
+//*****************************************************************************************
+/// Look up a 9j symbol in the tables filled by PreCalculateNineJ().
+/// The tables hold symbols of the form
+/// \f$ \left\{ \begin{array}{ccc} j_1 & j_2 & J_{12} \\ j_3 & j_4 & J_{34} \\ J_{13} & J_{24} & \Lambda \end{array} \right\} \f$
+/// with half-integer \f$ j_i \f$. These are reduced using the symmetries of the 9j symbol (row and column swaps, and transposition)
+/// so that \f$ j_1 \f$ is the largest and \f$ j_3 \geq j_2 \f$.
+/// Anything not covered by the tables is calculated on the fly, so this is thread safe.
+//*****************************************************************************************
 double ModelSpace::GetNineJ(double j1, double j2, double J12, double j3, double j4, double J34, double J13, double J24, double J)
 {
-//   cout << "Calling GetNineJ" << endl;
-   int k1 = 2*j1;
-   int k2 = 2*j2;
+   int a = 2*j1;
+   int d = 2*j2;
+   int b = 2*j3;
+   int c = 2*j4;
    int K12 = 2*J12;
-   int k3 = 2*j3;
-   int k4 = 2*j4;
    int K34 = 2*J34;
    int K13 = 2*J13;
    int K24 = 2*J24;
-   int K = 2*J;
-
-   array<int,9> klist = {k1,k2,K12,k3,k4,K34,K13,K24,K};
-   array<double,9> jlist = {j1,j2,J12,j3,j4,J34,J13,J24,J};
-   int imin = min_element(klist.begin(),klist.end()) - klist.begin();
-   switch (imin)
+   int L = 2*J;
+   bool in_table = (a&1) and (b&1) and (c&1) and (d&1) and not ((K12|K34|K13|K24|L)&1);
+   L /= 2;
+   if ( in_table and L<(int)NineJTable.size() and not NineJTable_offset[L].empty()
+        and max(max(a,b),max(c,d)) <= sixj_twoj_max )
    {
-      case 0:
-       klist = {k4,K34,k3,K24,K,K13,k2,K12,k1};
-       jlist = {j4,J34,j3,J24,J,J13,j2,J12,j1};
-       break;
-      case 1:
-       klist = {K13,K,K24,k3,K34,k4,k1,K12,k2};
-       jlist = {J13,J,J24,j3,J34,j4,j1,J12,j2};
-       break;
-      case 2:
-       klist = {k3,k4,K34,K13,K24,K,k1,k2,K12};
-       jlist = {j3,j4,J34,J13,J24,J,j1,j2,J12};
-       break;
-      case 3:
-       klist = {K12,k2,k1,K,K24,K13,K34,k4,k3};
-       jlist = {J12,j2,j1,J,J24,J13,J34,j4,j3};
-       break;
-      case 4:
-       klist = {k1,K12,k2,K13,K,K24,k3,K34,k4};
-       jlist = {j1,J12,j2,J13,J,J24,j3,J34,j4};
-       break;
-      case 5:
-       klist = {K13,K24,K,k1,k2,K12,k3,k4,K34};
-       jlist = {J13,J24,J,j1,j2,J12,j3,j4,J34};
-       break;
-      case 6:
-       klist = {k2,K12,k1,k4,K34,k3,K24,K,K13};
-       jlist = {j2,J12,j1,j4,J34,j3,J24,J,J13};
-       break;
-      case 7:
-       klist = {K12,k1,k2,K34,k3,k4,K,K13,K24};
-       jlist = {J12,j1,j2,J34,j3,j4,J,J13,J24};
-       break;
-      case 8:
-       break;
+     K12 /= 2;
+     K34 /= 2;
+     K13 /= 2;
+     K24 /= 2;
+     // Swapping two rows or two columns gives a phase (-1)^(sum of all entries)
+     int phase_9j = phase( (a+b+c+d)/2 + K12+K34+K13+K24+L );
+     if (a>=b and a>=c and a>=d)
+     {
+       phase_9j = 1;
+     }
+     else if (b>=c and b>=d) // swap rows
+     {
+       swap(a,b); swap(d,c); swap(K12,K34);
+     }
+     else if (d>=c) // swap columns
+     {
+       swap(a,d); swap(b,c); swap(K13,K24);
+     }
+     else // swap rows and columns
+     {
+       swap(a,c); swap(b,d); swap(K12,K34); swap(K13,K24);
+       phase_9j = 1;
+     }
+     if (b<d) // transpose
+     {
+       swap(b,d); swap(K12,K13); swap(K34,K24);
+     }
+     int J12min = abs(a-d)/2;
+     int J13min = abs(a-b)/2;
+     int n12 = (a+d)/2 - J12min + 1;
+     int n13 = (a+b)/2 - J13min + 1;
+     int nk = 2*L+1;
+     int i12 = K12 - J12min;
+     int i13 = K13 - J13min;
+     int k34 = K34 - K12 + L;
+     int k24 = K24 - K13 + L;
+     if (i12<0 or i12>=n12 or i13<0 or i13>=n13 or k34<0 or k34>=nk or k24<0 or k24>=nk) return 0;
+     int nj = (sixj_twoj_max+1)/2;
+     size_t iblock = (((a-1)/2*nj + (b-1)/2)*nj + (c-1)/2)*nj + (d-1)/2;
+     return phase_9j * NineJTable[L][ NineJTable_offset[L][iblock] + ((i12*nk + k34)*n13 + i13)*nk + k24 ];
    }
+   return AngMom::NineJ(j1,j2,J12,j3,j4,J34,J13,J24,J);
+}
 
-   unsigned long long int key =   klist[0];
-   unsigned long long int factor = 100;
-   for (int i=1; i<9; ++i)
-   {
-      key += klist[i]*factor;
-      factor *=100;
-   }
-   auto it = NineJList.find(key);
-   if (it != NineJList.end() )
-   {
-     return it->second;
-   }
-   double ninej = AngMom::NineJ(jlist[0],jlist[1],jlist[2],jlist[3],jlist[4],jlist[5],jlist[6],jlist[7],jlist[8]);
-   #pragma omp critical
-   NineJList[key] = ninej;
-   return ninej;
 
+//*****************************************************************************************
+/// Fill a dense table with the 9j symbols
+/// \f$ \left\{ \begin{array}{ccc} j_1 & j_2 & J_{12} \\ j_3 & j_4 & J_{34} \\ J_{13} & J_{24} & \Lambda \end{array} \right\} \f$
+/// needed for the Pandya transformation of a rank \f$\Lambda\f$ tensor.
+/// Like PreCalculateSixJ(), this does nothing inside a parallel region, where GetNineJ() falls back
+/// to AngMom::NineJ() for a missing Lambda. Code which runs flows in parallel should call it beforehand
+/// for each tensor rank it needs. It is also called at the start of Operator::CommutatorScalarTensor().
+//*****************************************************************************************
+void ModelSpace::PreCalculateNineJ(int Lambda)
+{
+  if (omp_in_parallel()) return;
+  PreCalculateSixJ(); // make sure sixj_twoj_max is set
+  if (Lambda < (int)NineJTable.size() and not NineJTable_offset[Lambda].empty()) return;
+  if (Lambda >= (int)NineJTable.size())
+  {
+    NineJTable.resize(Lambda+1);
+    NineJTable_offset.resize(Lambda+1);
+  }
+
+  double t_start = omp_get_wtime();
+  int nj = (sixj_twoj_max+1)/2;
+  int nk = 2*Lambda+1;
+  size_t nblocks = nj*nj*nj*nj;
+  vector<size_t>& offset = NineJTable_offset[Lambda];
+  offset.assign(nblocks+1,0);
+  for (size_t iblock=0; iblock<nblocks; ++iblock)
+  {
+    int a = 2*(iblock/(nj*nj*nj))+1;
+    int b = 2*((iblock/(nj*nj))%nj)+1;
+    int c = 2*((iblock/nj)%nj)+1;
+    int d = 2*(iblock%nj)+1;
+    size_t blocksize = 0;
+    if (a>=b and a>=c and a>=d and b>=d) // only the reduced form is stored
+      blocksize = ((a+d)/2-abs(a-d)/2+1) * nk * ((a+b)/2-abs(a-b)/2+1) * nk;
+    offset[iblock+1] = offset[iblock] + blocksize;
+  }
+  vector<double>& table = NineJTable[Lambda];
+  table.assign(offset[nblocks],0.0);
+
+  #pragma omp parallel for schedule(dynamic,1)
+  for (size_t iblock=0; iblock<nblocks; ++iblock)
+  {
+    if (offset[iblock+1] == offset[iblock]) continue;
+    int a = 2*(iblock/(nj*nj*nj))+1;
+    int b = 2*((iblock/(nj*nj))%nj)+1;
+    int c = 2*((iblock/nj)%nj)+1;
+    int d = 2*(iblock%nj)+1;
+    size_t indx = offset[iblock];
+    vector<double> ninej(nk);
+    for (int J12=abs(a-d)/2; J12<=(a+d)/2; ++J12)
+    {
+     for (int k34=0; k34<nk; ++k34)
+     {
+      int J34 = J12 - Lambda + k34;
+      for (int J13=abs(a-b)/2; J13<=(a+b)/2; ++J13)
+      {
+       // Swapping the last two columns puts J24 in the corner, so the whole run of J24 is one NineJ_Batch call.
+       int J24min = max(J13-Lambda, abs(d-c)/2);
+       int J24max = min(J13+Lambda, (d+c)/2);
+       if (J34>=abs(b-c)/2 and J34<=(b+c)/2 and J24min<=J24max)
+       {
+         AngMom::NineJ_Batch(0.5*a, J12, 0.5*d, 0.5*b, J34, 0.5*c, J13, Lambda, J24min, J24max, &ninej[0]);
+         for (int J24=J24min; J24<=J24max; ++J24)
+           table[indx + J24-(J13-Lambda)] = phase( (a+b+c+d)/2 + J12+J34+J13+J24+Lambda ) * ninej[J24-J24min];
+       }
+       indx += nk;
+      }
+     }
+    }
+  }
+  TrackAngMomCacheMemory();
+  cout << "Calculated " << table.size() << " 9j symbols with Lambda = " << Lambda << " ("
+       << table.size()*sizeof(double)/1024./1024. << " MB) in " << omp_get_wtime() - t_start << " seconds" << endl;
 }
+
+
+/// Report the size of the static 6j, 9j and Moshinsky tables to the profiler's memory accounting
+void ModelSpace::TrackAngMomCacheMemory()
+{
+  size_t bytes = (SixJTable_4half.capacity() + SixJTable_3half.capacity() + MoshTable.capacity()) * sizeof(double)
+               + (SixJTable_4half_offset.capacity() + SixJTable_3half_offset.capacity()
+                  + MoshTable_offset.capacity() + MoshTable_suboffset.capacity()) * sizeof(size_t);
+  for (auto& table : NineJTable) bytes += table.capacity() * sizeof(double);
+  for (auto& offset : NineJTable_offset) bytes += offset.capacity() * sizeof(size_t);
+  IMSRGProfiler::TrackMemory("AngMom caches", (long long)bytes - (long long)angmom_cache_bytes);
+  angmom_cache_bytes = bytes;
+}
+
@@ -10,6 +10,7 @@
   #define SQRT2 1.4142135623730950488
 #endif
 #define OCC_CUT 1e-6
+#define MOSHINSKY_CACHE_TAG "IMSRG_MOSHINSKY_v1"
 
 
 using namespace std;
@@ -247,18 +248,20 @@ class ModelSpace
    int GetE3max(){return E3max;};
    int GetLmax2(){return Lmax2;};
    int GetLmax3(){return Lmax3;};
+   int GetE3maxBra(){return E3max_bra<0 ? E3max : min(E3max,E3max_bra);};
+   int GetE3maxKet(){return E3max_ket<0 ? E3max : min(E3max,E3max_ket);};
    bool GetNuclear(){return isNuclear;};
    void SetEmax(int e){Emax=e;};
    void SetE2max(int e){E2max=e;};
    void SetE3max(int e){E3max=e;};
    void SetLmax2(int l){Lmax2=l;};
    void SetLmax3(int l){Lmax3=l;};
+   void SetE3maxBraKet(int ebra, int eket){E3max_bra=ebra; E3max_ket=eket;}; ///< Separate 3N truncation for bra and ket. Negative means use E3max.
    void SetNuclear(bool nuclear){isNuclear=nuclear;};
 
    double GetSixJ(double j1, double j2, double j3, double J1, double J2, double J3);
    double GetNineJ(double j1, double j2, double j3, double j4, double j5, double j6, double j7, double j8, double j9);
    double GetMoshinsky( int N, int Lam, int n, int lam, int n1, int l1, int n2, int l2, int L); // Inconsistent notation. Not ideal.
-   bool SixJ_is_empty(){ return SixJList.empty(); };
 
    int GetOrbitIndex(string);
    int GetTwoBodyChannelIndex(int j, int p, int t);
@@ -269,6 +272,10 @@ class ModelSpace
    inline int Index2(int p, int q) const {return q*(q+1)/2 + p;};
 
    void PreCalculateMoshinsky();
+   void SetMoshinskyCacheDir(string dir){moshinsky_cache_dir = dir;}; ///< Keep the Moshinsky brackets on disk here, to reuse them in later runs.
+   void PreCalculateSixJ();
+   void PreCalculateNineJ(int Lambda);
+   static void TrackAngMomCacheMemory();
    void ClearVectors();
 
 
@@ -307,6 +314,8 @@ class ModelSpace
    int E3max;
    int Lmax2;
    int Lmax3;
+   int E3max_bra;
+   int E3max_ket;
    int OneBodyJmax;
    int TwoBodyJmax;
    int ThreeBodyJmax;
@@ -334,9 +343,22 @@ class ModelSpace
    bool isNuclear;
 //   map<long int,double> SixJList;
 
-   static unordered_map<unsigned long int,double> SixJList;
-   static unordered_map<long long unsigned int,double> NineJList;
-   static unordered_map<long long unsigned int,double> MoshList;
+   // Dense tables of 6j and 9j symbols, filled by PreCalculateSixJ() and PreCalculateNineJ().
+   // They are only written outside of parallel regions (the PreCalculate functions check omp_in_parallel()), so reads don't need any locking.
+   static int sixj_twoj_max;  // largest 2j of the single-particle slots in the tables
+   static int sixj_twoJ3_max; // largest 2j of the slot which can hold a three-body J
+   static vector<double> SixJTable_4half;     // { j1 j2 J ; j3 J3 J' }, one integer column
+   static vector<size_t> SixJTable_4half_offset;
+   static vector<double> SixJTable_3half;     // { J1 J2 J3 ; j1 j2 j3 }, integer upper row
+   static vector<size_t> SixJTable_3half_offset;
+   static vector<vector<double>> NineJTable;  // indexed by Lambda, { j1 j2 J12 ; j3 j4 J34 ; J13 J24 Lambda }
+   static vector<vector<size_t>> NineJTable_offset;
+   static int mosh_E2max; // Moshinsky brackets are stored up to this 2N+Lambda+2n+lambda
+   static vector<double> MoshTable;
+   static vector<size_t> MoshTable_offset;    // start of each (N,Lambda,n,lambda) block in MoshTable_suboffset
+   static vector<size_t> MoshTable_suboffset; // start of each (L,n1,n2) run of l1 in MoshTable
+   static string moshinsky_cache_dir;
+   static size_t angmom_cache_bytes; // size of the tables above, as last reported to IMSRGProfiler
 
 };
 
@@ -5,6 +5,7 @@
 #include <cmath>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 #include <deque>
 
 #ifndef SQRT2
@@ -22,12 +23,11 @@ using namespace std;
 //double  Operator::bch_transform_threshold = 1e-6;
 double  Operator::bch_transform_threshold = 1e-9;
 double  Operator::bch_product_threshold = 1e-4;
-bool Operator::tensor_transform_first_pass = true; // Flag to check if we've calculated a commutator yet
 bool Operator::use_brueckner_bch = false;
 
 Operator& Operator::TempOp(size_t n)
 {
-  static deque<Operator> TempArray;
+  static thread_local deque<Operator> TempArray;
   if (n >= TempArray.size()) TempArray.resize(n+1,*this);
   return TempArray[n];
 }
@@ -47,9 +47,9 @@ Operator::~Operator()
 
 /////////////////// CONSTRUCTORS /////////////////////////////////////////
 Operator::Operator()
- :   modelspace(NULL), 
+ :   modelspace(NULL), onebody_memory("OneBody"),
     rank_J(0), rank_T(0), parity(0), particle_rank(2),
-    hermitian(true), antihermitian(false), nChannels(0)
+    hermitian(true), antihermitian(false), nChannels(0), sparse_fill_cutoff(0)
 {
   profiler.counter["N_Operators"] ++;
 }
@@ -58,50 +58,52 @@ Operator::Operator()
 // Create a zero-valued operator in a given model space
 Operator::Operator(ModelSpace& ms, int Jrank, int Trank, int p, int part_rank) : 
     modelspace(&ms), ZeroBody(0), OneBody(ms.GetNumberOrbits(), ms.GetNumberOrbits(),arma::fill::zeros),
-    TwoBody(&ms,Jrank,Trank,p),  ThreeBody(&ms),
+    onebody_memory("OneBody"), TwoBody(&ms,Jrank,Trank,p),  ThreeBody(&ms),
     rank_J(Jrank), rank_T(Trank), parity(p), particle_rank(part_rank),
     E3max(ms.GetE3max()),
     hermitian(true), antihermitian(false),  
-    nChannels(ms.GetNumberTwoBodyChannels()) 
+    nChannels(ms.GetNumberTwoBodyChannels()), sparse_fill_cutoff(0)
 {
   cout << "About to SetUpOneBodyChannels();" << endl;
   SetUpOneBodyChannels();
   cout << "About to Allocate() for prank="<<particle_rank<<endl;
   if (particle_rank >=3) ThreeBody.Allocate();
   cout << "Finished allocating, counting, then moving on" << endl;
+  onebody_memory.Set(OneBody.n_elem*sizeof(double));
   profiler.counter["N_Operators"] ++;
 }
 
 Operator::Operator(ModelSpace& ms) :
     modelspace(&ms), ZeroBody(0), OneBody(ms.GetNumberOrbits(), ms.GetNumberOrbits(),arma::fill::zeros),
-    TwoBody(&ms),  ThreeBody(&ms),
+    onebody_memory("OneBody"), TwoBody(&ms),  ThreeBody(&ms),
     rank_J(0), rank_T(0), parity(0), particle_rank(2),
     E3max(ms.GetE3max()),
     hermitian(true), antihermitian(false),  
-    nChannels(ms.GetNumberTwoBodyChannels())
+    nChannels(ms.GetNumberTwoBodyChannels()), sparse_fill_cutoff(0)
 {
   SetUpOneBodyChannels();
+  onebody_memory.Set(OneBody.n_elem*sizeof(double));
   profiler.counter["N_Operators"] ++;
 }
 
 Operator::Operator(const Operator& op)
 : modelspace(op.modelspace),  ZeroBody(op.ZeroBody),
-  OneBody(op.OneBody), TwoBody(op.TwoBody) ,ThreeBody(op.ThreeBody),
+  OneBody(op.OneBody), onebody_memory(op.onebody_memory), TwoBody(op.TwoBody) ,ThreeBody(op.ThreeBody),
   rank_J(op.rank_J), rank_T(op.rank_T), parity(op.parity), particle_rank(op.particle_rank),
   E2max(op.E2max), E3max(op.E3max), 
   hermitian(op.hermitian), antihermitian(op.antihermitian),
-  nChannels(op.nChannels), OneBodyChannels(op.OneBodyChannels)
+  nChannels(op.nChannels), sparse_fill_cutoff(op.sparse_fill_cutoff), OneBodyChannels(op.OneBodyChannels)
 {
   profiler.counter["N_Operators"] ++;
 }
 
 Operator::Operator(Operator&& op)
 : modelspace(op.modelspace), ZeroBody(op.ZeroBody),
-  OneBody(move(op.OneBody)), TwoBody(move(op.TwoBody)) , ThreeBody(move(op.ThreeBody)),
+  OneBody(move(op.OneBody)), onebody_memory(move(op.onebody_memory)), TwoBody(move(op.TwoBody)) , ThreeBody(move(op.ThreeBody)),
   rank_J(op.rank_J), rank_T(op.rank_T), parity(op.parity), particle_rank(op.particle_rank),
   E2max(op.E2max), E3max(op.E3max), 
   hermitian(op.hermitian), antihermitian(op.antihermitian),
-  nChannels(op.nChannels), OneBodyChannels(op.OneBodyChannels)
+  nChannels(op.nChannels), sparse_fill_cutoff(op.sparse_fill_cutoff), OneBodyChannels(op.OneBodyChannels)
 {
   profiler.counter["N_Operators"] ++;
 }
@@ -219,6 +221,7 @@ Operator Operator::operator-() const
 
 void Operator::SetUpOneBodyChannels()
 {
+  OneBodyChannels.clear(); // ReadBinary() calls this on an operator which already has channels
   for ( int i=0; i<modelspace->GetNumberOrbits(); ++i )
   {
     Orbit& oi = modelspace->GetOrbit(i);
@@ -281,7 +284,7 @@ double Operator::GetTwoBody(int ch_bra, int ch_ket, int ibra, int iket)
 }
 
 
-void Operator::WriteBinary(ofstream& ofs)
+void Operator::WriteBinary(ostream& ofs)
 {
   double tstart = omp_get_wtime();
   ofs.write((char*)&rank_J,sizeof(rank_J));
@@ -293,6 +296,7 @@ void Operator::WriteBinary(ofstream& ofs)
   ofs.write((char*)&hermitian,sizeof(hermitian));
   ofs.write((char*)&antihermitian,sizeof(antihermitian));
   ofs.write((char*)&nChannels,sizeof(nChannels));
+  ofs.write((char*)&sparse_fill_cutoff,sizeof(sparse_fill_cutoff));
   ofs.write((char*)&ZeroBody,sizeof(ZeroBody));
   ofs.write((char*)OneBody.memptr(),OneBody.size()*sizeof(double));
   if (particle_rank > 1)
@@ -303,7 +307,7 @@ void Operator::WriteBinary(ofstream& ofs)
 }
 
 
-void Operator::ReadBinary(ifstream& ifs)
+void Operator::ReadBinary(istream& ifs)
 {
   double tstart = omp_get_wtime();
   ifs.read((char*)&rank_J,sizeof(rank_J));
@@ -315,11 +319,15 @@ void Operator::ReadBinary(ifstream& ifs)
   ifs.read((char*)&hermitian,sizeof(hermitian));
   ifs.read((char*)&antihermitian,sizeof(antihermitian));
   ifs.read((char*)&nChannels,sizeof(nChannels));
+  ifs.read((char*)&sparse_fill_cutoff,sizeof(sparse_fill_cutoff));
   SetUpOneBodyChannels();
   ifs.read((char*)&ZeroBody,sizeof(ZeroBody));
   ifs.read((char*)OneBody.memptr(),OneBody.size()*sizeof(double));
   if (particle_rank > 1)
+  {
     TwoBody.ReadBinary(ifs);
+    if (sparse_fill_cutoff > 0) TwoBody.BuildSparse(sparse_fill_cutoff); // so a sparsified Omega read back from scratch stays sparse
+  }
   if (particle_rank > 2)
     ThreeBody.ReadBinary(ifs);
   profiler.timer["Read Binary Op"] += omp_get_wtime() - tstart;
@@ -611,6 +619,59 @@ Operator Operator::Truncate(ModelSpace& ms_new)
     }
     Mat_new = Mat.submat(ibra_old,ibra_old);
   }
+  OpNew.TwoBody.InvalidateNorm();
+  return OpNew;
+}
+
+/// Embed an operator in a model space with a larger emax, e.g. to start the flow at a larger emax
+/// from the Omega obtained at a smaller one. This is the inverse of Truncate().
+/// Orbits are matched by their quantum numbers, and matrix elements involving the new orbits are zero.
+/// The three-body part is not embedded.
+Operator Operator::Embed(ModelSpace& ms_new)
+{
+  Operator OpNew(ms_new, rank_J, rank_T, parity, min(particle_rank,2));
+
+  if ( ms_new.GetEmax() < modelspace->GetEmax() )
+  {
+    cout << "Error: Cannot embed an operator with emax = " << modelspace->GetEmax() << " in one with emax = " << ms_new.GetEmax() << endl;
+    return OpNew;
+  }
+  OpNew.ZeroBody = ZeroBody;
+  OpNew.hermitian = hermitian;
+  OpNew.antihermitian = antihermitian;
+
+  int norb = modelspace->GetNumberOrbits();
+  arma::uvec orbit_new(norb);
+  for (int i=0;i<norb;++i)
+  {
+    Orbit& oi = modelspace->GetOrbit(i);
+    orbit_new(i) = ms_new.GetOrbitIndex(oi.n, oi.l, oi.j2, oi.tz2);
+  }
+  OpNew.OneBody.submat(orbit_new,orbit_new) = OneBody;
+
+  for (auto& itmat : TwoBody.MatEl )
+  {
+    TwoBodyChannel& tbc_bra = modelspace->GetTwoBodyChannel(itmat.first[0]);
+    TwoBodyChannel& tbc_ket = modelspace->GetTwoBodyChannel(itmat.first[1]);
+    int chbra_new = ms_new.GetTwoBodyChannelIndex(tbc_bra.J,tbc_bra.parity,tbc_bra.Tz);
+    int chket_new = ms_new.GetTwoBodyChannelIndex(tbc_ket.J,tbc_ket.parity,tbc_ket.Tz);
+    TwoBodyChannel& tbc_bra_new = ms_new.GetTwoBodyChannel(chbra_new);
+    TwoBodyChannel& tbc_ket_new = ms_new.GetTwoBodyChannel(chket_new);
+    int nbras = tbc_bra.GetNumberKets();
+    int nkets = tbc_ket.GetNumberKets();
+    arma::uvec ibra_new(nbras), iket_new(nkets);
+    for (int ibra=0;ibra<nbras;++ibra)
+    {
+      Ket& bra = tbc_bra.GetKet(ibra);
+      ibra_new(ibra) = tbc_bra_new.GetLocalIndex(orbit_new(bra.p), orbit_new(bra.q));
+    }
+    for (int iket=0;iket<nkets;++iket)
+    {
+      Ket& ket = tbc_ket.GetKet(iket);
+      iket_new(iket) = tbc_ket_new.GetLocalIndex(orbit_new(ket.p), orbit_new(ket.q));
+    }
+    OpNew.TwoBody.GetMatrix(chbra_new,chket_new).submat(ibra_new,iket_new) = itmat.second;
+  }
   return OpNew;
 }
 
@@ -689,6 +750,7 @@ void Operator::MakeReduced()
     TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(itmat.first[0]);
     itmat.second *= sqrt(2*tbc.J+1);
   }
+  TwoBody.InvalidateNorm();
 }
 
 void Operator::MakeNotReduced()
@@ -713,6 +775,7 @@ void Operator::MakeNotReduced()
     TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(itmat.first[0]);
     itmat.second /= sqrt(2*tbc.J+1);
   }
+  TwoBody.InvalidateNorm();
 }
 
 
@@ -1112,7 +1175,7 @@ Operator Operator::BCH_Transform( const Operator &Omega)
 /// with all commutators truncated at the two-body level.
 Operator Operator::Standard_BCH_Transform( const Operator &Omega)
 {
-   double t_start = omp_get_wtime();
+   IMSRGProfiler::Scope scope("BCH_Transform");
    int max_iter = 40;
    int warn_iter = 12;
    double nx = Norm();
@@ -1154,7 +1217,6 @@ Operator Operator::Standard_BCH_Transform( const Operator &Omega)
         else if (i == max_iter)   cout << "Warning: BCH_Transform didn't coverge after "<< max_iter << " nested commutators" << endl;
      }
    }
-   profiler.timer["BCH_Transform"] += omp_get_wtime() - t_start;
    return OpOut;
 }
 /// Variation of the BCH transformation procedure
@@ -1190,7 +1252,7 @@ Operator Operator::Brueckner_BCH_Transform( const Operator &Omega)
 //*****************************************************************************************
 Operator Operator::BCH_Product(  Operator &Y)
 {
-   double tstart = omp_get_wtime();
+   IMSRGProfiler::Scope scope("BCH_Product");
    Operator& X = *this;
    double nx = X.Norm();
    double ny = Y.Norm();
@@ -1220,7 +1282,6 @@ Operator Operator::BCH_Product(  Operator &Y)
      k++;
    }
 
-   profiler.timer["BCH_Product"] += omp_get_wtime() - tstart;
    return Z;
 }
 
@@ -1278,6 +1339,31 @@ double Operator::TwoBodyNorm() const
   return TwoBody.Norm();
 }
 
+/// Set to zero all one- and two-body matrix elements whose magnitude is smaller than
+/// rel_threshold times the largest matrix element.
+/// Returns the fraction of two-body matrix elements that are still nonzero.
+double Operator::ZeroSmallElements(double rel_threshold)
+{
+   double maxelement = OneBody.n_elem>0 ? arma::abs(OneBody).max() : 0;
+   for ( auto& itmat : TwoBody.MatEl )
+   {
+     if (itmat.second.n_elem>0) maxelement = max(maxelement, arma::abs(itmat.second).max() );
+   }
+   double threshold = rel_threshold * maxelement;
+
+   OneBody.transform( [threshold](double x){return abs(x)<threshold ? 0. : x;} );
+   size_t nonzero = 0;
+   size_t total = 0;
+   for ( auto& itmat : TwoBody.MatEl )
+   {
+     itmat.second.transform( [threshold](double x){return abs(x)<threshold ? 0. : x;} );
+     nonzero += count_if(itmat.second.begin(), itmat.second.end(), [](double x){return x!=0;} );
+     total += itmat.second.n_elem;
+   }
+   TwoBody.InvalidateNorm();
+   return total>0 ? double(nonzero)/total : 0;
+}
+
 void Operator::Symmetrize()
 {
    if (rank_J==0)
@@ -1346,7 +1432,7 @@ Operator Commutator( const Operator& X, const Operator& Y)
 void Operator::SetToCommutator( const Operator& X, const Operator& Y)
 {
    profiler.counter["N_Commutators"] += 1;
-   double t_start = omp_get_wtime();
+   IMSRGProfiler::Scope scope("Commutator");
    Operator& Z = *this;
    int xrank = X.rank_J + X.rank_T + X.parity;
    int yrank = Y.rank_J + Y.rank_T + Y.parity;
@@ -1378,7 +1464,6 @@ void Operator::SetToCommutator( const Operator& X, const Operator& Y)
       cout << " Tensor-Tensor commutator not yet implemented." << endl;
 //      return X;
    }
-   profiler.timer["Commutator"] += omp_get_wtime() - t_start;
 }
 
 
@@ -1388,7 +1473,7 @@ void Operator::SetToCommutator( const Operator& X, const Operator& Y)
 //Operator CommutatorScalarScalar( const Operator& X, const Operator& Y) 
 void Operator::CommutatorScalarScalar( const Operator& X, const Operator& Y) 
 {
-   double t_css = omp_get_wtime();
+   IMSRGProfiler::Scope scope("CommutatorScalarScalar");
    Operator& Z = *this;
    Z = X.GetParticleRank()>Y.GetParticleRank() ? X : Y;
    Z.EraseZeroBody();
@@ -1408,27 +1493,14 @@ void Operator::CommutatorScalarScalar( const Operator& X, const Operator& Y)
       Z.comm220ss(X, Y) ;
    }
 
-   double t_start = omp_get_wtime();
    Z.comm111ss(X, Y);
-   profiler.timer["comm111ss"] += omp_get_wtime() - t_start;
-
-    t_start = omp_get_wtime();
    Z.comm121ss(X,Y);
-   profiler.timer["comm121ss"] += omp_get_wtime() - t_start;
-
-    t_start = omp_get_wtime();
    Z.comm122ss(X,Y); 
-   profiler.timer["comm122ss"] += omp_get_wtime() - t_start;
 
    if (X.particle_rank>1 and Y.particle_rank>1)
    {
-    t_start = omp_get_wtime();
     Z.comm222_pp_hh_221ss(X, Y);
-    profiler.timer["comm222_pp_hh_221ss"] += omp_get_wtime() - t_start;
-     
-    t_start = omp_get_wtime();
     Z.comm222_phss(X, Y);
-    profiler.timer["comm222_phss"] += omp_get_wtime() - t_start;
    }
 
 
@@ -1437,7 +1509,6 @@ void Operator::CommutatorScalarScalar( const Operator& X, const Operator& Y)
    else if (Z.IsAntiHermitian() )
       Z.AntiSymmetrize();
 
-   profiler.timer["CommutatorScalarScalar"] += omp_get_wtime() - t_css;
 
 //   return Z;
 }
@@ -1449,9 +1520,10 @@ void Operator::CommutatorScalarScalar( const Operator& X, const Operator& Y)
 //Operator CommutatorScalarTensor( const Operator& X, const Operator& Y) 
 void Operator::CommutatorScalarTensor( const Operator& X, const Operator& Y) 
 {
-   double t_start = omp_get_wtime();
+   IMSRGProfiler::Scope scope("CommutatorScalarTensor");
    Operator& Z = *this;
    Z = Y; // This ensures the commutator has the same tensor rank as Y
+   modelspace->PreCalculateNineJ(Z.rank_J); // so the tensor Pandya transformations can go parallel. Does nothing if we're already in a parallel region.
    Z.EraseZeroBody();
    Z.EraseOneBody();
    Z.EraseTwoBody();
@@ -1478,7 +1550,6 @@ void Operator::CommutatorScalarTensor( const Operator& X, const Operator& Y)
    else if (Z.IsAntiHermitian() )
       Z.AntiSymmetrize();
 //   cout << "done." << endl;
-   profiler.timer["CommutatorScalarTensor"] += omp_get_wtime() - t_start;
 //   return Z;
 }
 
@@ -1585,6 +1656,7 @@ void Operator::comm220ss( const Operator& X, const Operator& Y)
 //void Operator::comm111ss( Operator & Y, Operator& Z) 
 void Operator::comm111ss( const Operator & X, const Operator& Y) 
 {
+   IMSRGProfiler::Scope scope("comm111ss");
    Operator& Z = *this;
    Z.OneBody += X.OneBody*Y.OneBody - Y.OneBody*X.OneBody;
 }
@@ -1611,6 +1683,7 @@ void Operator::comm111ss( const Operator & X, const Operator& Y)
 //void Operator::comm121ss( Operator& Y, Operator& Z) 
 void Operator::comm121ss( const Operator& X, const Operator& Y) 
 {
+   IMSRGProfiler::Scope scope("comm121ss");
    Operator& Z = *this;
    index_t norbits = modelspace->GetNumberOrbits();
    #pragma omp parallel for 
@@ -1783,6 +1856,7 @@ void Operator::comm221ss( const Operator& X, const Operator& Y)
 //void Operator::comm122ss( Operator& Y, Operator& Z ) 
 void Operator::comm122ss( const Operator& X, const Operator& Y ) 
 {
+   IMSRGProfiler::Scope scope("comm122ss");
    Operator& Z = *this;
    auto& X1 = X.OneBody;
    auto& Y1 = Y.OneBody;
@@ -1862,6 +1936,23 @@ void Operator::comm122ss( const Operator& X, const Operator& Y )
       }
    }
 
+   // Count the work. The sums over a for <ij|kl> have as many terms as there are orbits in the
+   // one body channels of i,j,k and l, each about 6 flops. X2, Y2 and Z2 are each used as a whole.
+   for (int ich=0; ich<n_nonzero; ++ich)
+   {
+      TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(modelspace->SortedTwoBodyChannels[ich]);
+      double npq = tbc.GetNumberKets();
+      double n_a = 0;
+      for (int iket=0; iket<npq; ++iket)
+      {
+         Orbit& op = modelspace->GetOrbit(tbc.GetKet(iket).p);
+         Orbit& oq = modelspace->GetOrbit(tbc.GetKet(iket).q);
+         n_a += X.OneBodyChannels.at({op.l,op.j2,op.tz2}).size() + X.OneBodyChannels.at({oq.l,oq.j2,oq.tz2}).size();
+      }
+      double nterms = Z.IsNonHermitian() ? 2*npq*n_a : (npq+1)*n_a;
+      double nZ = Z.IsNonHermitian() ? npq*npq : npq*(npq+1)/2;
+      IMSRGProfiler::CountWork( 6*nterms, sizeof(double)*(2*npq*npq + 2*nZ) );
+   }
 }
 
 
@@ -1922,14 +2013,27 @@ void Operator::comm222_pp_hhss( const Operator& X, const Operator& Y )
 //void Operator::comm222_pp_hh_221ss( Operator& Y, Operator& Z )  
 void Operator::comm222_pp_hh_221ss( const Operator& X, const Operator& Y )  
 {
+   IMSRGProfiler::Scope scope("comm222_pp_hh_221ss");
 
 //   int herm = Z.IsHermitian() ? 1 : -1;
    Operator& Z = *this;
    int norbits = modelspace->GetNumberOrbits();
 
-   static TwoBodyME Mpp = Z.TwoBody;
-   static TwoBodyME Mhh = Z.TwoBody;
-   static TwoBodyME Mff = Z.TwoBody;
+   // The intermediates are kept between calls, one set for each thread calling this (so that several
+   // flows can run at the same time), but they need to be remade if we're now in another model space
+   static thread_local TwoBodyME Mpp_saved, Mhh_saved, Mff_saved;
+   if (Mpp_saved.modelspace != Z.TwoBody.modelspace or Mpp_saved.nChannels != Z.TwoBody.nChannels)
+   {
+     Mpp_saved = Z.TwoBody;
+     Mhh_saved = Z.TwoBody;
+     Mff_saved = Z.TwoBody;
+     Mpp_saved.memory_tracker.SetComponent("Commutator scratch");
+     Mhh_saved.memory_tracker.SetComponent("Commutator scratch");
+     Mff_saved.memory_tracker.SetComponent("Commutator scratch");
+   }
+   TwoBodyME& Mpp = Mpp_saved;
+   TwoBodyME& Mhh = Mhh_saved;
+   TwoBodyME& Mff = Mff_saved;
 
    double t = omp_get_wtime();
    // Don't use omp, because the matrix multiplication is already
@@ -1956,9 +2060,20 @@ void Operator::comm222_pp_hh_221ss( const Operator& X, const Operator& Y )
       auto& nanb = tbc.Ket_occ_hh;
       auto& nabar_nbbar = tbc.Ket_unocc_hh;
       
-      Matrixpp =  LHS.cols(kets_pp) * RHS.rows(kets_pp);
-      Matrixhh =  LHS.cols(kets_hh) * arma::diagmat(nanb) *  RHS.rows(kets_hh) ;
-      Matrixff =  LHS.cols(kets_hh) * arma::diagmat(nabar_nbbar) *  RHS.rows(kets_hh) ;
+      // If X is mostly zeros in this channel (e.g. a sparsified Omega), only multiply the nonzero elements
+      auto sparse_lhs = X.TwoBody.GetSparse_pp_hh(ch);
+      if (sparse_lhs != NULL)
+      {
+        Matrixpp =  (*sparse_lhs)[0] * arma::mat( RHS.rows(kets_pp) );
+        Matrixhh =  (*sparse_lhs)[1] * arma::mat( arma::diagmat(nanb) *  RHS.rows(kets_hh) );
+        Matrixff =  (*sparse_lhs)[1] * arma::mat( arma::diagmat(nabar_nbbar) *  RHS.rows(kets_hh) );
+      }
+      else
+      {
+        Matrixpp =  LHS.cols(kets_pp) * RHS.rows(kets_pp);
+        Matrixhh =  LHS.cols(kets_hh) * arma::diagmat(nanb) *  RHS.rows(kets_hh) ;
+        Matrixff =  LHS.cols(kets_hh) * arma::diagmat(nabar_nbbar) *  RHS.rows(kets_hh) ;
+      }
 //      Matrixhh =  LHS.cols(kets_hh) * ( RHS.rows(kets_hh).each_col() % nanb );
 //      Matrixff =  LHS.cols(kets_hh) * ( RHS.rows(kets_hh).each_col() % nabar_nbbar); // 
 
@@ -1989,9 +2104,25 @@ void Operator::comm222_pp_hh_221ss( const Operator& X, const Operator& Y )
    } //for ch
    profiler.timer["pphh TwoBody bit"] += omp_get_wtime() - t;
 
+   // Count the work of the two body part. Sparse products are counted as if they were dense.
+   for (int ich=0; ich<nch; ++ich)
+   {
+      TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(modelspace->SortedTwoBodyChannels[ich]);
+      double npq = tbc.GetNumberKets();
+      int nproducts = (Z.IsHermitian() or Z.IsAntiHermitian()) ? 1 : 2;
+      for (int iprod=0; iprod<nproducts; ++iprod)
+      {
+        IMSRGProfiler::CountGEMM( npq, npq, tbc.GetKetIndex_pp().n_elem );
+        IMSRGProfiler::CountGEMM( npq, npq, tbc.GetKetIndex_hh().n_elem );
+        IMSRGProfiler::CountGEMM( npq, npq, tbc.GetKetIndex_hh().n_elem );
+      }
+      IMSRGProfiler::CountWork( 6*npq*npq, 11*sizeof(double)*npq*npq ); // adding the transposes, and adding up into OUT
+   }
+
    t = omp_get_wtime();
    // The one body part
-   #pragma omp parallel for schedule(dynamic,1)
+   double n_ij = 0;
+   #pragma omp parallel for schedule(dynamic,1) reduction(+:n_ij)
    for (int i=0;i<norbits;++i)
    {
       Orbit &oi = modelspace->GetOrbit(i);
@@ -1999,6 +2130,7 @@ void Operator::comm222_pp_hh_221ss( const Operator& X, const Operator& Y )
       for (int j : Z.OneBodyChannels.at({oi.l,oi.j2,oi.tz2}) )
       {
          if (j<jmin) continue;
+         n_ij++;
          double cijJ = 0;
          for (int ch=0;ch<nChannels;++ch)
          {
@@ -2023,6 +2155,9 @@ void Operator::comm222_pp_hh_221ss( const Operator& X, const Operator& Y )
       } // for j
    } // for i
    profiler.timer["pphh One Body bit"] += omp_get_wtime() - t;
+   // About 3 flops and one matrix element read for each term in the sums over c
+   double nterms = n_ij * nChannels * (2*modelspace->holes.size() + modelspace->particles.size());
+   IMSRGProfiler::CountWork( 3*nterms, sizeof(double)*nterms );
 }
 
 
@@ -2049,10 +2184,12 @@ void Operator::comm222_pp_hh_221ss( const Operator& X, const Operator& Y )
 //void Operator::DoPandyaTransformation(deque<arma::mat>& TwoBody_CC_hp, deque<arma::mat>& TwoBody_CC_ph, string orientation="normal") const
 void Operator::DoPandyaTransformation(deque<arma::mat>& TwoBody_CC_ph, string orientation="normal") const
 {
+   IMSRGProfiler::Scope scope("DoPandyaTransformation");
    // loop over cross-coupled channels
    int n_nonzero = modelspace->SortedTwoBodyChannels_CC.size();
    int herm = IsHermitian() ? 1 : -1;
-   #pragma omp parallel for schedule(dynamic,1) if (not modelspace->SixJ_is_empty())
+   double nterms = 0;
+   #pragma omp parallel for schedule(dynamic,1) reduction(+:nterms)
    for (int ich=0; ich<n_nonzero; ++ich)
    {
       int ch_cc = modelspace->SortedTwoBodyChannels_CC[ich];
@@ -2097,6 +2234,7 @@ void Operator::DoPandyaTransformation(deque<arma::mat>& TwoBody_CC_ph, string or
                if (abs(sixj) < 1e-8) continue;
                double tbme = TwoBody.GetTBME_J(J_std,a,d,c,b);
                sm -= (2*J_std+1) * sixj * tbme ;
+               nterms++;
             }
             // Xabij = sm
             // Xbaji = hx * (-1)**(a+b+i+j) Xabij
@@ -2129,6 +2267,7 @@ void Operator::DoPandyaTransformation(deque<arma::mat>& TwoBody_CC_ph, string or
                if (abs(sixj) < 1e-8) continue;
                double tbme = TwoBody.GetTBME_J(J_std,b,d,c,a);
                sm -= (2*J_std+1) * sixj * tbme ;
+               nterms++;
             }
             // Xbaij = sm
             // Xabji = hx * (-1)**(a+b+i+j) Xbaij
@@ -2152,6 +2291,10 @@ void Operator::DoPandyaTransformation(deque<arma::mat>& TwoBody_CC_ph, string or
          }
       }
    }
+   // Each term in the sums over J reads a 6j symbol and a matrix element, and every element of the output is written
+   double nwritten = 0;
+   for (int ich=0; ich<n_nonzero; ++ich) nwritten += TwoBody_CC_ph[modelspace->SortedTwoBodyChannels_CC[ich]].n_elem;
+   IMSRGProfiler::CountWork( 4*nterms, sizeof(double)*(2*nterms + nwritten) );
 }
 
 
@@ -2160,10 +2303,11 @@ void Operator::DoPandyaTransformation(deque<arma::mat>& TwoBody_CC_ph, string or
 //void Operator::AddInversePandyaTransformation(vector<arma::mat>& Zbar)
 void Operator::AddInversePandyaTransformation(deque<arma::mat>& Zbar)
 {
+   IMSRGProfiler::Scope scope("InversePandyaTransformation");
     // Do the inverse Pandya transform
-    // Only go parallel if we've previously calculated the SixJ's. Otherwise, it's not thread safe.
    int n_nonzeroChannels = modelspace->SortedTwoBodyChannels.size();
-   #pragma omp parallel for schedule(dynamic,1) if (not modelspace->SixJ_is_empty())
+   double nterms = 0, nZ = 0;
+   #pragma omp parallel for schedule(dynamic,1) reduction(+:nterms,nZ)
    for (int ich = 0; ich < n_nonzeroChannels; ++ich)
    {
       int ch = modelspace->SortedTwoBodyChannels[ich];
@@ -2181,6 +2325,7 @@ void Operator::AddInversePandyaTransformation(deque<arma::mat>& Zbar)
          double ji = oi.j2/2.;
          double jj = oj.j2/2.;
          int ketmin = IsHermitian() ? ibra : ibra+1;
+         nZ += nKets-ketmin;
          for (int iket=ketmin; iket<nKets; ++iket)
          {
             Ket & ket = tbc.GetKet(iket);
@@ -2210,6 +2355,7 @@ void Operator::AddInversePandyaTransformation(deque<arma::mat>& Zbar)
                if (k>j) indx_kj += tbc_cc.GetNumberKets();
                double me1 = Zbar[ch_cc](indx_il,indx_kj);
                commij += (2*Jprime+1) * sixj * me1;
+               nterms++;
 
             }
 
@@ -2230,6 +2376,7 @@ void Operator::AddInversePandyaTransformation(deque<arma::mat>& Zbar)
                if (k>i) indx_ki += tbc_cc.GetNumberKets();
                double me1 = Zbar[ch_cc](indx_jl,indx_ki);
                commji += (2*Jprime+1) *  sixj * me1;
+               nterms++;
 
             }
 
@@ -2238,6 +2385,8 @@ void Operator::AddInversePandyaTransformation(deque<arma::mat>& Zbar)
          }
       }
    }
+   // Each term in the sums over J' reads a 6j symbol and an element of Zbar, and each element of Z is updated once
+   IMSRGProfiler::CountWork( 4*nterms + 4*nZ, sizeof(double)*(2*nterms + 2*nZ) );
  
 }
 
@@ -2328,42 +2477,52 @@ deque<arma::mat> Operator::InitializePandya(size_t nch, string orientation="norm
 ///
 void Operator::comm222_phss( const Operator& X, const Operator& Y ) 
 {
+   IMSRGProfiler::Scope scope("comm222_phss");
 
    Operator& Z = *this;
    // Create Pandya-transformed hp and ph matrix elements
    deque<arma::mat> Y_bar_ph (InitializePandya( nChannels, "normal"));
    deque<arma::mat> Xt_bar_ph (InitializePandya( nChannels, "transpose"));
+   IMSRGProfiler::MemoryTracker scratch_memory("Commutator scratch");
+   size_t scratch_bytes = 0;
+   for (auto& mat : Y_bar_ph) scratch_bytes += mat.n_elem*sizeof(double);
+   for (auto& mat : Xt_bar_ph) scratch_bytes += mat.n_elem*sizeof(double);
+   scratch_memory.Set(scratch_bytes);
 
-   double t_start = omp_get_wtime();
    Y.DoPandyaTransformation(Y_bar_ph, "normal" );
    X.DoPandyaTransformation(Xt_bar_ph ,"transpose");
-   profiler.timer["DoPandyaTransformation"] += omp_get_wtime() - t_start;
 
    // Construct the intermediate matrix Z_bar
-   t_start = omp_get_wtime();
    deque<arma::mat> Z_bar (nChannels );
-
-   int nch = modelspace->SortedTwoBodyChannels_CC.size();
-   #ifndef OPENBLAS_NOUSEOMP
-   #pragma omp parallel for schedule(dynamic,1)
-   #endif
-   for (int ich=0; ich<nch; ++ich )
    {
-      int ch = modelspace->SortedTwoBodyChannels_CC[ich];
-
-      Z_bar[ch] =  (Xt_bar_ph[ch] * Y_bar_ph[ch]);
-      // If Z is hermitian, then XY is anti-hermitian, and so XY - YX = XY + (XY)^T
-      if ( Z.IsHermitian() )
-         Z_bar[ch] += Z_bar[ch].t();
-      else
-         Z_bar[ch] -= Z_bar[ch].t();
+     IMSRGProfiler::Scope build_scope("Build Z_bar");
+     int nch = modelspace->SortedTwoBodyChannels_CC.size();
+     #ifndef OPENBLAS_NOUSEOMP
+     #pragma omp parallel for schedule(dynamic,1)
+     #endif
+     for (int ich=0; ich<nch; ++ich )
+     {
+        int ch = modelspace->SortedTwoBodyChannels_CC[ich];
+
+        Z_bar[ch] =  (Xt_bar_ph[ch] * Y_bar_ph[ch]);
+        // If Z is hermitian, then XY is anti-hermitian, and so XY - YX = XY + (XY)^T
+        if ( Z.IsHermitian() )
+           Z_bar[ch] += Z_bar[ch].t();
+        else
+           Z_bar[ch] -= Z_bar[ch].t();
+     }
+     for (int ich=0; ich<nch; ++ich )
+     {
+        int ch = modelspace->SortedTwoBodyChannels_CC[ich];
+        IMSRGProfiler::CountGEMM( Xt_bar_ph[ch].n_rows, Y_bar_ph[ch].n_cols, Xt_bar_ph[ch].n_cols );
+        IMSRGProfiler::CountWork( Z_bar[ch].n_elem, 3*sizeof(double)*Z_bar[ch].n_elem ); // adding the transpose
+        scratch_bytes += Z_bar[ch].n_elem*sizeof(double);
+     }
+     scratch_memory.Set(scratch_bytes);
    }
-   profiler.timer["Build Z_bar"] += omp_get_wtime() - t_start;
 
    // Perform inverse Pandya transform on Z_bar to get Z
-   t_start = omp_get_wtime();
    Z.AddInversePandyaTransformation(Z_bar);
-   profiler.timer["InversePandyaTransformation"] += omp_get_wtime() - t_start;
 
 }
 
@@ -2389,9 +2548,8 @@ void Operator::comm222_phss( const Operator& X, const Operator& Y )
 // This is no different from the scalar-scalar version
 void Operator::comm111st( const Operator & X, const Operator& Y)
 {
-   double tstart = omp_get_wtime();
+   IMSRGProfiler::Scope scope("comm111st");
    comm111ss(X,Y);
-   profiler.timer["comm111st"] += omp_get_wtime() - tstart;
 }
 
 
@@ -2412,7 +2570,7 @@ void Operator::comm111st( const Operator & X, const Operator& Y)
 void Operator::comm121st( const Operator& X, const Operator& Y) 
 {
 
-   double tstart = omp_get_wtime();
+   IMSRGProfiler::Scope scope("comm121st");
    Operator& Z = *this;
    int norbits = modelspace->GetNumberOrbits();
    int Lambda = Z.GetJRank();
@@ -2483,7 +2641,6 @@ void Operator::comm121st( const Operator& X, const Operator& Y)
       }
    }
    
-   profiler.timer["comm121st"] += omp_get_wtime() - tstart;
 }
 
 
@@ -2503,7 +2660,7 @@ void Operator::comm121st( const Operator& X, const Operator& Y)
 //void Operator::comm122st( Operator& Y, Operator& Z ) 
 void Operator::comm122st( const Operator& X, const Operator& Y ) 
 {
-   double tstart = omp_get_wtime();
+   IMSRGProfiler::Scope scope("comm122st");
    Operator& Z = *this;
    int Lambda = Z.rank_J;
 
@@ -2596,11 +2753,33 @@ void Operator::comm122st( const Operator& X, const Operator& Y )
          }
       }
    }
+
+   // Count the work. For each a, there's a term X1*Y2 with about 2 flops and a matrix element read,
+   // and a term Y1*X2 with about 5 flops and a 6j symbol and matrix element read.
+   auto number_of_a = [&](TwoBodyChannel& tbc)
+   {
+      double n_a = 0;
+      for (int iket=0; iket<tbc.GetNumberKets(); ++iket)
+      {
+         Orbit& op = modelspace->GetOrbit(tbc.GetKet(iket).p);
+         Orbit& oq = modelspace->GetOrbit(tbc.GetKet(iket).q);
+         n_a += X.OneBodyChannels.at({op.l,op.j2,op.tz2}).size() + X.OneBodyChannels.at({oq.l,oq.j2,oq.tz2}).size();
+      }
+      return n_a;
+   };
+   for (int ii=0; ii<nmat; ++ii)
+   {
+      TwoBodyChannel& tbc_bra = modelspace->GetTwoBodyChannel(channels[ii][0]);
+      TwoBodyChannel& tbc_ket = modelspace->GetTwoBodyChannel(channels[ii][1]);
+      double nbras = tbc_bra.GetNumberKets();
+      double nkets = tbc_ket.GetNumberKets();
+      double nterms = nkets*number_of_a(tbc_bra) + nbras*number_of_a(tbc_ket);
+      IMSRGProfiler::CountWork( 7*nterms, sizeof(double)*(3*nterms + 2*nbras*nkets) );
+   }
 //   int chbra = modelspace->GetTwoBodyChannelIndex(0,0,-1);
 //   int chket = modelspace->GetTwoBodyChannelIndex(2,0,-1);
 //   int ibra = modelspace->GetTwoBodyChannel(chbra).GetLocalIndex(0,0);
 //   int iket = modelspace->GetTwoBodyChannel(chket).GetLocalIndex(2,2);
-   profiler.timer["comm122st"] += omp_get_wtime() - tstart;
 }
 
 
@@ -2615,7 +2794,7 @@ void Operator::comm122st( const Operator& X, const Operator& Y )
 void Operator::comm222_pp_hh_221st( const Operator& X, const Operator& Y )  
 {
 
-   double tstart = omp_get_wtime();
+   IMSRGProfiler::Scope scope("comm222_pp_hh_221st");
    Operator& Z = *this;
    int Lambda = Z.GetJRank();
 
@@ -2675,12 +2854,23 @@ void Operator::comm222_pp_hh_221st( const Operator& X, const Operator& Y )
     // Now, the two body part is easy
     OUT2 += Matrixpp + Matrixff - Matrixhh;
 
+    double nbras = tbc_bra.GetNumberKets();
+    double nkets = tbc_ket.GetNumberKets();
+    IMSRGProfiler::CountGEMM( nbras, nkets, bras_pp.n_elem );
+    IMSRGProfiler::CountGEMM( nbras, nkets, kets_pp.n_elem );
+    IMSRGProfiler::CountGEMM( nbras, nkets, bras_hh.n_elem );
+    IMSRGProfiler::CountGEMM( nbras, nkets, kets_hh.n_elem );
+    IMSRGProfiler::CountGEMM( nbras, nkets, bras_hh.n_elem );
+    IMSRGProfiler::CountGEMM( nbras, nkets, kets_hh.n_elem );
+    IMSRGProfiler::CountWork( 6*nbras*nkets, 8*sizeof(double)*nbras*nkets ); // the differences, and adding up into OUT2
+
    }// for itmat
 
       // The one body part takes some additional work
 
    int norbits = modelspace->GetNumberOrbits();
-   #pragma omp parallel for schedule(dynamic,1)
+   double nterms_hole = 0, nterms_particle = 0;
+   #pragma omp parallel for schedule(dynamic,1) reduction(+:nterms_hole,nterms_particle)
    for (int i=0;i<norbits;++i)
    {
       Orbit &oi = modelspace->GetOrbit(i);
@@ -2711,6 +2901,7 @@ void Operator::comm222_pp_hh_221st( const Operator& X, const Operator& Y )
                 double sixj = modelspace->GetSixJ(J1, J2, Lambda, jj, ji, jc);
                 cijJ += hatfactor * sixj * modelspace->phase(jj + jc + J1 + Lambda) * occ_c * Mpp.GetTBME_J(J1,J2,c,i,c,j);
                 cijJ += hatfactor * sixj * modelspace->phase(jj + jc + J1 + Lambda) * (1-occ_c) * Mff.GetTBME_J(J1,J2,c,i,c,j);  // This is probably right???
+                nterms_hole++;
                }
               }
            // Sum c over particles and include the n_a * n_b terms
@@ -2730,6 +2921,7 @@ void Operator::comm222_pp_hh_221st( const Operator& X, const Operator& Y )
                 double hatfactor = sqrt( (2*J1+1)*(2*J2+1) );
                 double sixj = modelspace->GetSixJ(J1, J2, Lambda, jj, ji, jc);
                 cijJ += hatfactor * sixj * modelspace->phase(jj + jc + J1 + Lambda) * Mhh.GetTBME_J(J1,J2,c,i,c,j);
+                nterms_particle++;
                }
               }
            }
@@ -2737,7 +2929,8 @@ void Operator::comm222_pp_hh_221st( const Operator& X, const Operator& Y )
          Z.OneBody(i,j) += cijJ ;
       } // for j
     } // for i
-    profiler.timer["comm222_pp_hh_221st"] += omp_get_wtime() - tstart;
+   // Reading the 6j symbol and the matrix elements, Mpp and Mff for holes and Mhh for particles
+   IMSRGProfiler::CountWork( 14*nterms_hole + 8*nterms_particle, sizeof(double)*(3*nterms_hole + 2*nterms_particle) );
 }
 
 
@@ -2766,6 +2959,7 @@ void Operator::comm222_pp_hh_221st( const Operator& X, const Operator& Y )
 //void Operator::DoTensorPandyaTransformation(map<array<int,2>,arma::mat>& TwoBody_CC_hp, map<array<int,2>,arma::mat>& TwoBody_CC_ph) const
 void Operator::DoTensorPandyaTransformation( map<array<int,2>,arma::mat>& TwoBody_CC_ph) const
 {
+   IMSRGProfiler::Scope scope("DoTensorPandyaTransformation");
    int Lambda = rank_J;
    // loop over cross-coupled channels
    int nch = modelspace->SortedTwoBodyChannels_CC.size();
@@ -2786,7 +2980,8 @@ void Operator::DoTensorPandyaTransformation( map<array<int,2>,arma::mat>& TwoBod
       }
    }
 
-   #pragma omp parallel for schedule(dynamic,1) if (not this->tensor_transform_first_pass)
+   double nterms = 0, nwritten = 0;
+   #pragma omp parallel for schedule(dynamic,1) reduction(+:nterms,nwritten)
    for (int ich=0;ich<nch;++ich)
    {
       int ch_bra_cc = modelspace->SortedTwoBodyChannels_CC[ich];
@@ -2803,6 +2998,7 @@ void Operator::DoTensorPandyaTransformation( map<array<int,2>,arma::mat>& TwoBod
         if ( (tbc_bra_cc.parity + tbc_ket_cc.parity + parity)%2>0 ) continue;
 
         int nKets_cc = tbc_ket_cc.GetNumberKets();
+        nwritten += 4*nph_bras*nKets_cc;
 
 //        arma::mat& MatCC_hp = TwoBody_CC_hp[{ch_bra_cc,ch_ket_cc}];
         arma::mat& MatCC_ph = TwoBody_CC_ph[{ch_bra_cc,ch_ket_cc}];
@@ -2844,6 +3040,7 @@ void Operator::DoTensorPandyaTransformation( map<array<int,2>,arma::mat>& TwoBod
                   double hatfactor = sqrt( (2*J1+1)*(2*J2+1)*(2*Jbra_cc+1)*(2*Jket_cc+1) );
                   double tbme = TwoBody.GetTBME_J(J1,J2,a,d,c,b);
                   sm -= hatfactor * modelspace->phase(jb+jd+Jket_cc+J2) * ninej * tbme ;
+                  nterms++;
                 }
               }
 //              MatCC_hp(ibra,iket_cc) = sm;
@@ -2865,6 +3062,7 @@ void Operator::DoTensorPandyaTransformation( map<array<int,2>,arma::mat>& TwoBod
                   double hatfactor = sqrt( (2*J1+1)*(2*J2+1)*(2*Jbra_cc+1)*(2*Jket_cc+1) );
                   double tbme = TwoBody.GetTBME_J(J1,J2,b,d,c,a);
                   sm -= hatfactor * modelspace->phase(ja+jd+Jket_cc+J2) * ninej * tbme ;
+                  nterms++;
                 }
               }
 //              MatCC_ph(ibra,iket_cc) = sm;
@@ -2874,24 +3072,28 @@ void Operator::DoTensorPandyaTransformation( map<array<int,2>,arma::mat>& TwoBod
         }
     }
    }
+   // Each term in the sums over J1 and J2 reads a 9j symbol and a matrix element
+   IMSRGProfiler::CountWork( 8*nterms, sizeof(double)*(2*nterms + nwritten) );
 }
 
 
 void Operator::AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>& Zbar)
 {
+   IMSRGProfiler::Scope scope("InverseTensorPandyaTransformation");
     // Do the inverse Pandya transform
-    // Only go parallel if we've previously calculated the SixJ's. Otherwise, it's not thread safe.
 //   for (int ch=0;ch<nChannels;++ch)
 //   int n_nonzeroChannels = modelspace->SortedTwoBodyChannels.size();
-//   #pragma omp parallel for schedule(dynamic,1) if (not modelspace->SixJ_is_empty())
+//   #pragma omp parallel for schedule(dynamic,1)
 //   for (int ich = 0; ich < n_nonzeroChannels; ++ich)
    Operator& Z = *this;
    int Lambda = Z.rank_J;
    vector<map<array<int,2>,arma::mat>::iterator> iteratorlist;
    for (map<array<int,2>,arma::mat>::iterator iter= Z.TwoBody.MatEl.begin(); iter!= Z.TwoBody.MatEl.end(); ++iter) iteratorlist.push_back(iter);
+   Z.TwoBody.InvalidateNorm();
    int niter = iteratorlist.size();
+   double nterms = 0, nZ = 0;
 //   for (auto& iter : Z.TwoBody.MatEl)
-   #pragma omp parallel for schedule(dynamic,1) if (not this->tensor_transform_first_pass)
+   #pragma omp parallel for schedule(dynamic,1) reduction(+:nterms,nZ)
 //   for (auto iter=Z.TwoBody.MatEl.begin(); iter<Z.TwoBody.MatEl.end(); ++iter)
    for (int i=0; i<niter; ++i)
    {
@@ -2907,6 +3109,7 @@ void Operator::AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>&
       int nBras = tbc_bra.GetNumberKets();
       int nKets = tbc_ket.GetNumberKets();
       arma::mat& Zijkl = iter->second;
+      nZ += nBras*nKets;
 
       for (int ibra=0; ibra<nBras; ++ibra)
       {
@@ -2969,6 +3172,7 @@ void Operator::AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>&
                   double tbme = Zbar[{ch_bra_cc,ch_ket_cc}](indx_il,indx_kj);
 //                  cout << "after getting tbme" << endl;
                   commij += hatfactor * modelspace->phase(jj+jl+J2+J4) * ninej * tbme ;
+                  nterms++;
               }
             }
 //            cout << "after J3 loop" << endl;
@@ -3001,6 +3205,7 @@ void Operator::AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>&
                   double hatfactor = sqrt( (2*J1+1)*(2*J2+1)*(2*J3+1)*(2*J4+1) );
                   double tbme = Zbar[{ch_bra_cc,ch_ket_cc}](indx_jl,indx_ki);
                   commji += hatfactor * modelspace->phase(ji+jl+J2+J4) * ninej * tbme ;
+                  nterms++;
               }
             }
 
@@ -3009,8 +3214,9 @@ void Operator::AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>&
          }
       }
    }
- 
-   tensor_transform_first_pass = false;
+   // Each term in the sums over J3 and J4 reads a 9j symbol and an element of Zbar, and each element of Z is updated once
+   IMSRGProfiler::CountWork( 8*nterms + 4*nZ, sizeof(double)*(2*nterms + 2*nZ) );
+
 }
 
 
@@ -3087,6 +3293,7 @@ void Operator::AddInverseTensorPandyaTransformation(map<array<int,2>,arma::mat>&
 //void Operator::comm222_phst( Operator& Y, Operator& Z ) 
 void Operator::comm222_phst( const Operator& X, const Operator& Y ) 
 {
+   IMSRGProfiler::Scope scope("comm222_phst");
 
    Operator& Z = *this;
    // Create Pandya-transformed hp and ph matrix elements
@@ -3096,15 +3303,18 @@ void Operator::comm222_phst( const Operator& X, const Operator& Y )
 //   map<array<int,2>,arma::mat> Y_bar_hp;
    map<array<int,2>,arma::mat> Y_bar_ph;
 
-   double t_start = omp_get_wtime();
    X.DoPandyaTransformation(Xt_bar_ph, "transpose" );
 //   X.DoPandyaTransformation(X_bar_hp, X_bar_ph, "transpose" );
 //   Y.DoTensorPandyaTransformation(Y_bar_hp, Y_bar_ph );
    Y.DoTensorPandyaTransformation(Y_bar_ph );
-   profiler.timer["DoTensorPandyaTransformation"] += omp_get_wtime() - t_start;
+   IMSRGProfiler::MemoryTracker scratch_memory("Commutator scratch");
+   size_t scratch_bytes = 0;
+   for (auto& mat : Xt_bar_ph) scratch_bytes += mat.n_elem*sizeof(double);
+   for (auto& iter : Y_bar_ph) scratch_bytes += iter.second.n_elem*sizeof(double);
+   scratch_memory.Set(scratch_bytes);
 
 
-   t_start = omp_get_wtime();
+   double t_start = omp_get_wtime();
    // Construct the intermediate matrix Z_bar
    map<array<int,2>,arma::mat> Z_bar;
 //   vector<int> ybras(Y_bar_hp.size());
@@ -3121,29 +3331,39 @@ void Operator::comm222_phst( const Operator& X, const Operator& Y )
       counter++;
    }
    profiler.timer["Allocate Z_bar_tensor"] += omp_get_wtime() - t_start;
-   t_start = omp_get_wtime();
 
-   // This should definitely be checked, especially the hermitian phase business.
-   #pragma omp parallel for schedule(dynamic,1)
-   for(int i=0;i<counter;++i)
    {
-      int ch_bra_cc = ybras[i];
-      int ch_ket_cc = ykets[i];
-      int Jbra = modelspace->GetTwoBodyChannel_CC(ch_bra_cc).J;
-      int Jket = modelspace->GetTwoBodyChannel_CC(ch_ket_cc).J;
-      int flipphase = modelspace->phase( Jbra - Jket ) * ( Z.IsHermitian() ? -1 : 1 );
-      auto& XJ1 = Xt_bar_ph[ch_bra_cc];
-      auto& XJ2 = Xt_bar_ph[ch_ket_cc];
-      auto& YJ1J2 = Y_bar_ph[{ch_bra_cc,ch_ket_cc}]; // These two should be related...
-      auto& YJ2J1 = Y_bar_ph[{ch_ket_cc,ch_bra_cc}];
-      
-      Z_bar[{ch_bra_cc,ch_ket_cc}] = XJ1 * YJ1J2 -flipphase*(XJ2 * YJ2J1).t();
+     IMSRGProfiler::Scope build_scope("Build Z_bar_tensor");
+     // This should definitely be checked, especially the hermitian phase business.
+     #pragma omp parallel for schedule(dynamic,1)
+     for(int i=0;i<counter;++i)
+     {
+        int ch_bra_cc = ybras[i];
+        int ch_ket_cc = ykets[i];
+        int Jbra = modelspace->GetTwoBodyChannel_CC(ch_bra_cc).J;
+        int Jket = modelspace->GetTwoBodyChannel_CC(ch_ket_cc).J;
+        int flipphase = modelspace->phase( Jbra - Jket ) * ( Z.IsHermitian() ? -1 : 1 );
+        auto& XJ1 = Xt_bar_ph[ch_bra_cc];
+        auto& XJ2 = Xt_bar_ph[ch_ket_cc];
+        auto& YJ1J2 = Y_bar_ph[{ch_bra_cc,ch_ket_cc}]; // These two should be related...
+        auto& YJ2J1 = Y_bar_ph[{ch_ket_cc,ch_bra_cc}];
+        
+        Z_bar[{ch_bra_cc,ch_ket_cc}] = XJ1 * YJ1J2 -flipphase*(XJ2 * YJ2J1).t();
+     }
+     for(int i=0;i<counter;++i)
+     {
+        auto& XJ1 = Xt_bar_ph[ybras[i]];
+        auto& XJ2 = Xt_bar_ph[ykets[i]];
+        IMSRGProfiler::CountGEMM( XJ1.n_rows, Y_bar_ph[{ybras[i],ykets[i]}].n_cols, XJ1.n_cols );
+        IMSRGProfiler::CountGEMM( XJ2.n_rows, Y_bar_ph[{ykets[i],ybras[i]}].n_cols, XJ2.n_cols );
+        double nZ = Z_bar[{ybras[i],ykets[i]}].n_elem;
+        IMSRGProfiler::CountWork( 2*nZ, 3*sizeof(double)*nZ ); // subtracting the transpose
+        scratch_bytes += nZ*sizeof(double);
+     }
+     scratch_memory.Set(scratch_bytes);
    }
-   profiler.timer["Build Z_bar_tensor"] += omp_get_wtime() - t_start;
 
-   t_start = omp_get_wtime();
    Z.AddInverseTensorPandyaTransformation(Z_bar);
-   profiler.timer["InverseTensorPandyaTransformation"] += omp_get_wtime() - t_start;
 
 }
 
@@ -25,6 +25,7 @@ class Operator
   ModelSpace * modelspace; ///< Pointer to the associated modelspace
   double ZeroBody; ///< The zero body piece of the operator.
   arma::mat OneBody; ///< The one body piece of the operator, stored in a single NxN armadillo matrix, where N is the number of single-particle orbits.
+  IMSRGProfiler::MemoryTracker onebody_memory; ///< The size of OneBody, for the memory accounting
   TwoBodyME TwoBody; ///< The two body piece of the operator.
   ThreeBodyME ThreeBody; ///< The three body piece of the operator.
 
@@ -39,6 +40,7 @@ class Operator
   bool hermitian;
   bool antihermitian;
   int nChannels; ///< Number of two-body channels \f$ J,\pi,T_z \f$ associated with the model space
+  double sparse_fill_cutoff; ///< Experimental. When this operator is the left operand of comm222_pp_hh_221ss, its channels with fewer nonzero elements than this fraction use sparse products (see TwoBodyME::BuildSparse). 0 means never. Kept by WriteBinary/ReadBinary.
 
 
   map<array<int,3>,vector<index_t> > OneBodyChannels;
@@ -46,7 +48,6 @@ class Operator
 
   static double bch_transform_threshold;
   static double bch_product_threshold;
-  static bool tensor_transform_first_pass;
   static bool use_brueckner_bch;
 
 
@@ -113,7 +114,6 @@ class Operator
   int GetTRank()const {return rank_T;};
   int GetParity()const {return parity;};
   void SetParticleRank(int pr) {particle_rank = pr;};
-  void ResetTensorTransformFirstPass(){tensor_transform_first_pass=true;};
 
   void MakeReduced();
   void MakeNotReduced();
@@ -126,8 +126,8 @@ class Operator
   void SetUpOneBodyChannels();
   size_t Size();
 
-  void WriteBinary(ofstream& ofs);
-  void ReadBinary(ifstream& ifs);
+  void WriteBinary(ostream& ofs);
+  void ReadBinary(istream& ifs);
 
 
   // The actually interesting methods
@@ -136,6 +136,7 @@ class Operator
   Operator DoNormalOrdering3(); ///< Returns the normal ordered three-body operator
   Operator UndoNormalOrdering(); ///< Returns the operator normal-ordered wrt the vacuum
   Operator Truncate(ModelSpace& ms_new); ///< Returns the operator trunacted to the new model space
+  Operator Embed(ModelSpace& ms_new); ///< Returns the operator embedded in a larger model space. The inverse of Truncate.
 
   void SetToCommutator(const Operator& X, const Operator& Y);
   void CommutatorScalarScalar( const Operator& X, const Operator& Y) ;
@@ -162,6 +163,7 @@ class Operator
   double Norm() const;
   double OneBodyNorm() const;
   double TwoBodyNorm() const;
+  double ZeroSmallElements(double rel_threshold);
 
 
   void PrintOneBody() const {OneBody.print();};
@@ -171,6 +173,7 @@ class Operator
   static void Set_BCH_Transform_Threshold(double x){bch_transform_threshold=x;};
   static void Set_BCH_Product_Threshold(double x){bch_product_threshold=x;};
   static void SetUseBruecknerBCH(bool tf){use_brueckner_bch = tf;};
+  int SetSparseFillCutoff(double x){sparse_fill_cutoff = x; return TwoBody.BuildSparse(x);};
 
   deque<arma::mat> InitializePandya(size_t nch, string orientation);
 //  void DoPandyaTransformation(deque<arma::mat>&, deque<arma::mat>&, string orientation) const ;
@@ -7,6 +7,8 @@
 #include <string>
 #include <chrono>
 #include <ctime>
+#include <thread>
+#include <omp.h>
 
 #include <boost/iostreams/filtering_streambuf.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
@@ -34,7 +36,7 @@ ReadWrite::~ReadWrite()
 }
 
 ReadWrite::ReadWrite()
-: doCoM_corr(false), goodstate(true),LECs({-0.81,-3.20,5.40,1.271,-0.131}),File2N("none"),File3N("none"),Aref(0),Zref(0) // default to the EM2.0_2.0 LECs
+: doCoM_corr(false), goodstate(true),LECs({-0.81,-3.20,5.40,1.271,-0.131}),File2N("none"),File3N("none"),Aref(0),Zref(0),h5_chunk_size(0),h5_deflate(0) // default to the EM2.0_2.0 LECs
 {
 }
 
@@ -836,7 +838,6 @@ void ReadWrite::Read_Darmstadt_3body_from_stream( T& infile, Operator& Hbare, in
   int e1max = modelspace->GetEmax();
   int e2max = modelspace->GetE2max(); // not used yet
   int e3max = modelspace->GetE3max();
-  int lmax3 = modelspace->GetLmax3();
   cout << "Reading 3body file. emax limits for file: " << E1max << " " << E2max << " " << E3max << "  for modelspace: " << e1max << " " << e2max << " " << e3max << endl;
 
   vector<int> orbits_remap(0);
@@ -947,6 +948,10 @@ void ReadWrite::Read_Darmstadt_3body_from_stream( T& infile, Operator& Hbare, in
               int twoJCMaxup = min(twoJCMaxupbra, twoJCMaxupket);
               if (twoJCMindown > twoJCMaxup) continue;
 
+              // Matrix elements outside the lmax3 or E3max truncation have no storage, so we just read past them.
+              bool in_truncation = (ea<=e1max and eb<=e1max and ec<=e1max and ed<=e1max and ee<=e1max and ef<=e1max)
+                                   and Hbare.ThreeBody.CheckTruncation(a,b,c,d,e,f);
+
               //inner loops
               for(int Jab = JabMin; Jab <= JabMax; Jab++)
               {
@@ -984,7 +989,7 @@ void ReadWrite::Read_Darmstadt_3body_from_stream( T& infile, Operator& Hbare, in
                     float V = block[5*(twoJC-twoJCMin)/2+2*tab+ttab+(twoT-1)/2];
 //                    ++nread;
                     bool autozero = false;
-                    if (oa.l>lmax3 or ob.l>lmax3 or oc.l>lmax3 or od.l>lmax3 or oe.l>lmax3 or of.l>lmax3) V=0;
+                    if (not in_truncation) V=0;
 
 //                    if (a==20 and b==0 and c==0 and d==2 and e==2 and f==0)
 //                    {
@@ -1325,6 +1330,11 @@ void ReadWrite::Read3bodyHDF5( string filename,Operator& op )
 
 // THIS ONE SEEMS TO WORK, SO FAR
 
+/// Read 3N matrix elements from an HDF5 file containing the basis "alphas" and the matrix elements "vtnf",
+/// with one column for each LEC (c1 c3 c4 cD cE).
+/// The vtnf dataset is read in hyperslabs of h5_chunk_size rows, which are double-buffered so that
+/// one thread reads the next slab while the OpenMP threads insert the current one into op.ThreeBody.
+/// If h5_chunk_size is not set (see SetHDF5ChunkSize()), the slab size is matched to the chunking of the dataset.
 void ReadWrite::Read3bodyHDF5_new( string filename,Operator& op )
 {
 
@@ -1345,82 +1355,173 @@ void ReadWrite::Read3bodyHDF5_new( string filename,Operator& op )
   hsize_t iDim_basis[6];
   basis_dspace.getSimpleExtentDims(iDim_basis,NULL);
 
+  vector<int> dbuf(iDim_basis[0]*iDim_basis[1]);
+  basis.read(&dbuf[0], PredType::NATIVE_INT);
 
-  // Generate a 2d buffer in contiguous memory
-  //TODO: Do this with vectors so we don't have to worry about new and delete[]
-  int** dbuf = new int*[iDim_basis[0]];
-  dbuf[0] = new int[iDim_basis[0]*iDim_basis[1]];
-  for (hsize_t i=1;i<iDim_basis[0];++i)
+  int alpha_max = iDim_basis[0];
+  int ncol = iDim_basis[1];
+
+  // Translate the basis states to orbit indices once, rather than once per pair.
+  // alpha_qn[alpha] = {a, b, c, la+lb+lc, j12, jtot}
+  vector<array<int,6>> alpha_qn(alpha_max);
+  for (int alpha=0;alpha<alpha_max;++alpha)
+  {
+    int* row = &dbuf[alpha*ncol];
+    alpha_qn[alpha][0] = modelspace->GetOrbitIndex(row[1],row[2],row[3],-1);
+    alpha_qn[alpha][1] = modelspace->GetOrbitIndex(row[4],row[5],row[6],-1);
+    alpha_qn[alpha][2] = modelspace->GetOrbitIndex(row[7],row[8],row[9],-1);
+    alpha_qn[alpha][3] = row[2] + row[5] + row[8];
+    alpha_qn[alpha][4] = row[10];
+    alpha_qn[alpha][5] = row[11];
+  }
+
+  // Enumerate the (alpha',alpha) pairs in the order they appear in the file. Each pair owns 5 consecutive
+  // rows of vtnf (one for each isospin combination). We only keep the pairs that fit in the model space,
+  // along with a key identifying the block of ThreeBody.MatEl that they write to.
+  vector<array<int,2>> pair_alphas;
+  vector<long long> pair_rows;
+  vector<unsigned long long> pair_keys;
+  long long i=-5; 
+  for (int alphaspp=0;alphaspp<alpha_max;++alphaspp)
   {
-    dbuf[i] = dbuf[i-1] + iDim_basis[1];
+    auto& qnp = alpha_qn[alphaspp];
+    if (qnp[0] > norb) break;
+    for (int alphasp=alphaspp; alphasp<alpha_max;++alphasp)
+    {
+      auto& qn = alpha_qn[alphasp];
+      if (qn[5] != qnp[5] or (qnp[3]+qn[3])%2>0) continue; 
+      i+=5;
+      if (qnp[0]>=norb or qnp[1]>=norb or qnp[2]>=norb) continue;
+      if (qn[0]>=norb or qn[1]>=norb or qn[2]>=norb) continue;
+      if (not op.ThreeBody.CheckTruncation(qnp[0],qnp[1],qnp[2],qn[0],qn[1],qn[2])) continue; // no storage, so don't bother reading it
+      int a,b,c,d,e,f;
+      op.ThreeBody.SortOrbits(qnp[0],qnp[1],qnp[2],a,b,c);
+      op.ThreeBody.SortOrbits(qn[0],qn[1],qn[2],d,e,f);
+      if (d>a or (d==a and e>b) or (d==a and e==b and f>c))
+      {
+        swap(a,d);
+        swap(b,e);
+        swap(c,f);
+      }
+      // Only the even (proton) orbits are stored, so key on orbit/2 to use all the residues.
+      unsigned long long key = a/2;
+      for (int orb : {b,c,d,e,f}) key = key*(norb/2+1) + orb/2;
+      pair_alphas.push_back({alphaspp,alphasp});
+      pair_rows.push_back(i);
+      pair_keys.push_back(key);
+    }
   }
 
-  basis.read(&dbuf[0][0], PredType::NATIVE_INT);
-
-
   DataSet value = file.openDataSet("vtnf");
   DataSpace value_dspace = value.getSpace();
   hsize_t value_maxDim[2];
   value_dspace.getSimpleExtentDims(value_maxDim,NULL);
 
-  hsize_t value_curDim[2];
-  value_curDim[0] = value_maxDim[0];
-  value_curDim[1] = 5 ; // c1 c3 c4 cD cE
-  
-  // This needs to be a 2d array now
-  float **value_buf = new float*[value_maxDim[0]];
-  value_buf[0] = new float[value_curDim[0] * value_curDim[1]];
-  for (hsize_t i=1; i<value_curDim[0]; ++i)
+  hsize_t nrows = pair_rows.size()>0 ? pair_rows.back()+5 : 0;
+  if (nrows > value_maxDim[0] or value_maxDim[1] != 5)
   {
-    value_buf[i] = value_buf[i-1] + value_curDim[1];  
+    cerr << "Error. The vtnf dataset in " << filename << " has dimension " << value_maxDim[0] << " x " << value_maxDim[1]
+         << ", but the alphas basis requires at least " << nrows << " x 5." << endl;
+    goodstate = false;
+    return;
   }
 
-  value.read(&value_buf[0][0], PredType::NATIVE_FLOAT);
+  // Pick the slab size. By default, use a multiple of the dataset chunking so that each chunk is decompressed only once.
+  hsize_t chunk_rows = h5_chunk_size;
+  if (chunk_rows < 1)
+  {
+    chunk_rows = 1<<20;
+    DSetCreatPropList plist = value.getCreatePlist();
+    if (plist.getLayout() == H5D_CHUNKED)
+    {
+      hsize_t h5_chunk_dims[2];
+      plist.getChunk(2,h5_chunk_dims);
+      chunk_rows = max( chunk_rows/h5_chunk_dims[0], hsize_t(1)) * h5_chunk_dims[0];
+    }
+  }
+  chunk_rows = max(chunk_rows,hsize_t(5));
 
-  int alpha_max = iDim_basis[0];
+  // Group the pairs into slabs of at most chunk_rows rows. Rows which only contain matrix elements outside
+  // the truncation are skipped, so a slab starts at its first pair and ends with its last.
+  vector<array<size_t,2>> slab_pairs; // range [begin,end) in the pair list
+  for (size_t ip=0; ip<pair_rows.size(); ++ip)
+  {
+    if (slab_pairs.empty() or (hsize_t)(pair_rows[ip]+5-pair_rows[slab_pairs.back()[0]]) > chunk_rows)
+      slab_pairs.push_back({ip,ip});
+    slab_pairs.back()[1] = ip+1;
+  }
+  size_t nchunks = slab_pairs.size();
 
-//  int i=-5; 
-  long long i=-5; 
-  for (int alphaspp=0;alphaspp<alpha_max;++alphaspp)
+  // Split each slab between the threads up front. Pairs which recouple to the same block of MatEl go in the same list,
+  // so no two threads ever write to the same matrix element. The key is hashed so that nearby blocks spread out.
+  size_t nthreads = omp_get_max_threads();
+  vector<vector<size_t>> thread_pairs(nchunks*nthreads);
+  for (size_t ichunk=0; ichunk<nchunks; ++ichunk)
   {
-    int lap = dbuf[alphaspp][2];
-    int lbp = dbuf[alphaspp][5];
-    int lcp = dbuf[alphaspp][8];
+    for (size_t ip=slab_pairs[ichunk][0]; ip<slab_pairs[ichunk][1]; ++ip)
+    {
+      size_t ithread = ((pair_keys[ip] * 0x9e3779b97f4a7c15ULL) >> 32) % nthreads;
+      thread_pairs[ichunk*nthreads+ithread].push_back(ip);
+    }
+  }
 
-    int ap = modelspace->GetOrbitIndex(dbuf[alphaspp][1],lap,dbuf[alphaspp][3],-1);
-    int bp = modelspace->GetOrbitIndex(dbuf[alphaspp][4],lbp,dbuf[alphaspp][6],-1);
-    int cp = modelspace->GetOrbitIndex(dbuf[alphaspp][7],lcp,dbuf[alphaspp][9],-1);
-    int j12p = dbuf[alphaspp][10];
-    int jtotp = dbuf[alphaspp][11];
-    if (ap > norb) break;
+  cout << "Reading " << 5*pair_rows.size() << " of " << value_maxDim[0] << " rows of vtnf in " << nchunks << " slabs of up to " << chunk_rows << " rows" << endl;
 
-    for (int alphasp=alphaspp; alphasp<alpha_max;++alphasp)
+  auto read_slab = [&value](hsize_t row_start, hsize_t nrows_slab, vector<float>& buf)
+  {
+    buf.resize(nrows_slab*5);
+    hsize_t start[2] = {row_start,0};
+    hsize_t count[2] = {nrows_slab,5};
+    DataSpace mem_dspace(2,count);
+    DataSpace file_dspace = value.getSpace();
+    file_dspace.selectHyperslab( H5S_SELECT_SET, count, start);
+    value.read(&buf[0], PredType::NATIVE_FLOAT, mem_dspace, file_dspace);
+  };
+
+  // first and last+1 row of each slab
+  auto slab_row_start = [&](size_t ichunk){ return (hsize_t)pair_rows[slab_pairs[ichunk][0]]; };
+  auto slab_row_end   = [&](size_t ichunk){ return (hsize_t)pair_rows[slab_pairs[ichunk][1]-1]+5; };
+
+  array<vector<float>,2> value_buf;
+  if (nchunks>0) read_slab(slab_row_start(0), slab_row_end(0)-slab_row_start(0), value_buf[0]);
+
+  for (size_t ichunk=0; ichunk<nchunks; ++ichunk)
+  {
+    hsize_t row_start = slab_row_start(ichunk);
+
+    // Start reading the next slab while we work on this one
+    thread reader;
+    if (ichunk+1 < nchunks)
+      reader = thread(read_slab, slab_row_start(ichunk+1), slab_row_end(ichunk+1)-slab_row_start(ichunk+1), ref(value_buf[(ichunk+1)%2]) );
+
+    vector<float>& buf = value_buf[ichunk%2];
+
+    #pragma omp parallel for schedule(dynamic,1)
+    for (size_t ithread=0; ithread<nthreads; ++ithread)
     {
-      int la = dbuf[alphasp][2];
-      int lb = dbuf[alphasp][5];
-      int lc = dbuf[alphasp][8];
-      int a = modelspace->GetOrbitIndex(dbuf[alphasp][1],la,dbuf[alphasp][3],-1);
-      int b = modelspace->GetOrbitIndex(dbuf[alphasp][4],lb,dbuf[alphasp][6],-1);
-      int c = modelspace->GetOrbitIndex(dbuf[alphasp][7],lc,dbuf[alphasp][9],-1);
-      int j12 = dbuf[alphasp][10];
-      int jtot = dbuf[alphasp][11];
-      if (jtot != jtotp or (lap+lbp+lcp+la+lb+lc)%2>0) continue; 
-      i+=5;
-      if (ap>=norb or bp>=norb or cp>=norb) continue;
-      if (a>=norb or b>=norb or c>=norb) continue;
+     for (size_t ip : thread_pairs[ichunk*nthreads+ithread])
+     {
+      auto& qnp = alpha_qn[pair_alphas[ip][0]];
+      auto& qn  = alpha_qn[pair_alphas[ip][1]];
+      int ap = qnp[0];
+      int bp = qnp[1];
+      int cp = qnp[2];
+      int j12p = qnp[4];
+      int a = qn[0];
+      int b = qn[1];
+      int c = qn[2];
+      int j12 = qn[4];
+      int jtot = qn[5];
       
       for (hsize_t k_iso=0;k_iso<5;++k_iso)
       {
        int T12  = t12p_list[k_iso];
        int TT12 = t12_list[k_iso];
        int twoT = twoT_list[k_iso];
-       float *me = value_buf[i+k_iso];
+       float *me = &buf[(pair_rows[ip] - row_start + k_iso)*5];
        float summed_me = 0;
        for (int ii=0;ii<5;++ii) summed_me += LECs[ii] * me[ii] ;
        summed_me *= HBARC;
-       // Phase due to different conventions for HO wave functions.
-       // Now obsolete -- Feb 2016
-//       summed_me *= modelspace->phase(dbuf[alphasp][1]+dbuf[alphasp][4]+dbuf[alphasp][7]+dbuf[alphaspp][1]+dbuf[alphaspp][4]+dbuf[alphaspp][7]);
 
        if ( (ap==bp and (j12p+T12)%2 !=1) or ( a==b  and (j12+TT12)%2 !=1 ) )
        {
@@ -1431,7 +1532,6 @@ void ReadWrite::Read3bodyHDF5_new( string filename,Operator& op )
        }
        else
        {
-//        cout << "read <" << ap << " " << bp << " " << cp << " | V | " << a << " " << b << " " << c << "  (" << j12p << " " << j12 << " " << jtot << ")  ( " << T12 << " " << TT12 << " " << twoT << endl;
         op.ThreeBody.SetME(j12p,j12,jtot,T12,TT12,twoT,ap,bp,cp,a,b,c, summed_me);
         if (a==ap and b==bp and c==cp and j12 != j12p) // we're only looping through alphap > alphaspp, while I'm set up to read in all J,T possibilities for a given set of orbits
         {
@@ -1439,19 +1539,140 @@ void ReadWrite::Read3bodyHDF5_new( string filename,Operator& op )
         }
        }
       }
-
+     }
     }
-  }
 
-  delete[] dbuf[0];
-  delete[] dbuf;
-  delete[] value_buf[0];
-  delete[] value_buf;
+    double t_wait = omp_get_wtime();
+    if (reader.joinable()) reader.join();
+    op.profiler.timer["Read3bodyHDF5_io_wait"] += omp_get_wtime() - t_wait;
+  }
 
 }
 
 
+/// Write three-body matrix elements in the HDF5 layout read by Read3bodyHDF5_new().
+/// The dataset "alphas" lists the states \f$ |(ab)J_{12}c;J\rangle \f$ with \f$ a\geq b\geq c\f$, as rows of
+/// {alpha, n1, l1, 2j1, n2, l2, 2j2, n3, l3, 2j3, J12, 2J}. The dataset "vtnf" has 5 rows, one for each isospin combination,
+/// for every pair alpha' <= alpha with the same J and parity. Its 5 columns are the contributions of the LECs,
+/// so each matrix element is split between them in proportion to the current LECs, and reading the file with the
+/// same LECs gives it back. vtnf is chunked by h5_chunk_size rows (default 65536) and compressed if h5_deflate>0.
+void ReadWrite::Write3bodyHDF5( string filename, Operator& op, int E1max, int E3max)
+{
+  double t_start = omp_get_wtime();
+  ModelSpace* modelspace = op.GetModelSpace();
+  int norb = modelspace->GetNumberOrbits();
 
+  double lec_norm2 = 0;
+  for (auto lec : LECs) lec_norm2 += lec*lec;
+  if (lec_norm2 < 1e-12)
+  {
+    cerr << "Error. Can't write " << filename << " with all the LECs set to zero." << endl;
+    goodstate = false;
+    return;
+  }
+
+  int t12p_list[5] = {0,0,1,1,1};
+  int t12_list[5]  = {0,1,0,1,1};
+  int twoT_list[5] = {1,1,1,1,3};
+
+  // The basis. alpha_qn[alpha] = {a, b, c, la+lb+lc, j12, jtot}, as in Read3bodyHDF5_new.
+  vector<array<int,6>> alpha_qn;
+  vector<int> alpha_buf;
+  for (int a=0; a<norb; a+=2)
+  {
+    Orbit& oa = modelspace->GetOrbit(a);
+    int ea = 2*oa.n+oa.l;
+    if (ea > E1max or ea > E3max) continue;
+    for (int b=0; b<=a; b+=2)
+    {
+      Orbit& ob = modelspace->GetOrbit(b);
+      int eb = 2*ob.n+ob.l;
+      if (ea+eb > E3max) continue;
+      for (int c=0; c<=b; c+=2)
+      {
+        Orbit& oc = modelspace->GetOrbit(c);
+        int ec = 2*oc.n+oc.l;
+        if (ea+eb+ec > E3max) continue;
+        for (int j12=abs(oa.j2-ob.j2)/2; j12<=(oa.j2+ob.j2)/2; ++j12)
+        {
+          for (int twoJ=abs(2*j12-oc.j2); twoJ<=2*j12+oc.j2; twoJ+=2)
+          {
+            alpha_qn.push_back({a,b,c,oa.l+ob.l+oc.l,j12,twoJ});
+            for (int x : {int(alpha_qn.size()), oa.n, oa.l, oa.j2, ob.n, ob.l, ob.j2, oc.n, oc.l, oc.j2, j12, twoJ})
+              alpha_buf.push_back(x);
+          }
+        }
+      }
+    }
+  }
+  hsize_t alpha_max = alpha_qn.size();
+
+  // Count the pairs first, so that vtnf can be made with the right size and then written a slab at a time.
+  hsize_t npairs = 0;
+  for (hsize_t alphapp=0; alphapp<alpha_max; ++alphapp)
+  {
+    for (hsize_t alphap=alphapp; alphap<alpha_max; ++alphap)
+    {
+      if (alpha_qn[alphap][5] == alpha_qn[alphapp][5] and (alpha_qn[alphap][3]+alpha_qn[alphapp][3])%2==0) ++npairs;
+    }
+  }
+  hsize_t nrows = 5*npairs;
+  cout << "Writing " << alpha_max << " three-body states and " << nrows << " rows of vtnf to " << filename << endl;
+
+  H5File file(filename, H5F_ACC_TRUNC);
+  hsize_t alpha_dims[2] = {alpha_max, 12};
+  DataSet basis = file.createDataSet("alphas", PredType::NATIVE_INT, DataSpace(2,alpha_dims));
+  if (alpha_max>0) basis.write(&alpha_buf[0], PredType::NATIVE_INT);
+
+  hsize_t chunk_rows = h5_chunk_size>0 ? h5_chunk_size : 1<<16;
+  chunk_rows = max( min(chunk_rows, nrows), hsize_t(1));
+  hsize_t value_dims[2] = {nrows, 5};
+  hsize_t chunk_dims[2] = {chunk_rows, 5};
+  DSetCreatPropList plist;
+  plist.setChunk(2,chunk_dims);
+  if (h5_deflate > 0) plist.setDeflate(h5_deflate);
+  DataSet value = file.createDataSet("vtnf", PredType::NATIVE_FLOAT, DataSpace(2,value_dims), plist);
+
+  vector<float> buf;
+  buf.reserve(5*chunk_rows);
+  hsize_t rows_written = 0;
+  auto write_slab = [&]()
+  {
+    hsize_t start[2] = {rows_written,0};
+    hsize_t count[2] = {buf.size()/5,5};
+    DataSpace mem_dspace(2,count);
+    DataSpace file_dspace = value.getSpace();
+    file_dspace.selectHyperslab( H5S_SELECT_SET, count, start);
+    value.write(&buf[0], PredType::NATIVE_FLOAT, mem_dspace, file_dspace);
+    rows_written += count[0];
+    buf.clear();
+  };
+
+  for (hsize_t alphapp=0; alphapp<alpha_max; ++alphapp)
+  {
+    auto& qnp = alpha_qn[alphapp];
+    for (hsize_t alphap=alphapp; alphap<alpha_max; ++alphap)
+    {
+      auto& qn = alpha_qn[alphap];
+      if (qn[5] != qnp[5] or (qnp[3]+qn[3])%2>0) continue;
+      for (int k_iso=0; k_iso<5; ++k_iso)
+      {
+        int T12  = t12p_list[k_iso];
+        int TT12 = t12_list[k_iso];
+        int twoT = twoT_list[k_iso];
+        double V = 0;
+        // These are zero by antisymmetry, and the reader checks that they are.
+        if ( not ((qnp[0]==qnp[1] and (qnp[4]+T12)%2 !=1) or (qn[0]==qn[1] and (qn[4]+TT12)%2 !=1)) )
+          V = op.ThreeBody.GetME(qnp[4],qn[4],qn[5],T12,TT12,twoT,qnp[0],qnp[1],qnp[2],qn[0],qn[1],qn[2]);
+        for (int ii=0; ii<5; ++ii) buf.push_back( V / HBARC * LECs[ii] / lec_norm2 );
+      }
+      if (buf.size() >= 5*chunk_rows) write_slab();
+    }
+  }
+  if (buf.size() > 0) write_slab();
+
+  op.profiler.timer["Write3bodyHDF5"] += omp_get_wtime() - t_start;
+}
 
 void ReadWrite::ReadOperator_Nathan( string filename1b, string filename2b, Operator& op)
 {
@@ -1552,9 +1773,11 @@ void ReadWrite::ReadTensorOperator_Nathan( string filename1b, string filename2b,
 
 }
 
+/// Write two-body matrix elements in the me2j format read by ReadBareTBME_Darmstadt().
+/// As for reading, the extension decides the flavor: .gz for gzipped, .bin for binary floats, and otherwise plain text.
 void ReadWrite::Write_me2j( string outfilename, Operator& Hbare, int emax, int Emax, int lmax)
 {
-  ofstream outfile(outfilename);
+  ofstream outfile(outfilename, ios_base::out | ios_base::binary);
   if ( !outfile.good() )
   {
      cerr << "************************************" << endl
@@ -1563,6 +1786,33 @@ void ReadWrite::Write_me2j( string outfilename, Operator& Hbare, int emax, int E
      goodstate = false;
      return;
   }
+  size_t dot = outfilename.find_last_of(".");
+  string extension = dot==string::npos ? "" : outfilename.substr(dot); // no extension means plain text
+  if (extension == ".gz")
+  {
+    boost::iostreams::filtering_ostream zipstream;
+    zipstream.push(boost::iostreams::gzip_compressor());
+    zipstream.push(outfile);
+    Write_me2j_to_stream(zipstream, Hbare, emax, Emax, lmax);
+    zipstream.reset(); // flush the compressor before the file is closed
+  }
+  else if (extension == ".bin")
+  {
+    char header[HEADERSIZE] = {};
+    snprintf(header, HEADERSIZE, "me2j binary floats, generated by IMSRG code. emax = %d  e2max = %d  lmax = %d", emax, Emax, lmax);
+    outfile.write(header,HEADERSIZE);
+    BinaryFloatStream binstream(outfile);
+    Write_me2j_to_stream(binstream, Hbare, emax, Emax, lmax);
+  }
+  else
+  {
+    Write_me2j_to_stream(outfile, Hbare, emax, Emax, lmax);
+  }
+}
+
+template<class T>
+void ReadWrite::Write_me2j_to_stream( T& outfile, Operator& Hbare, int emax, int Emax, int lmax)
+{
   ModelSpace * modelspace = Hbare.GetModelSpace();
   vector<int> orbits_remap;
 
@@ -1594,7 +1844,7 @@ void ReadWrite::Write_me2j( string outfilename, Operator& Hbare, int emax, int E
   int icount = 0;
 
   outfile << setiosflags(ios::fixed);
-  cout << "Writing file " << outfilename << "  emax =  " << emax << "  e2max = " << Emax << "  lmax = " << lmax << "  nljmax = " << nljmax << endl;
+  cout << "Writing me2j file.  emax =  " << emax << "  e2max = " << Emax << "  lmax = " << lmax << "  nljmax = " << nljmax << endl;
 
   for(int nlj1=0; nlj1<=nljmax; ++nlj1)
   {
@@ -1677,10 +1927,11 @@ void ReadWrite::Write_me2j( string outfilename, Operator& Hbare, int emax, int E
 
 
 
+/// Write three-body matrix elements in the me3j format read by Read_Darmstadt_3body().
+/// As for reading, the extension decides the flavor: .gz for gzipped, .bin for binary floats,
+/// .h5 for the HDF5 layout (see Write3bodyHDF5()), and otherwise plain text.
 void ReadWrite::Write_me3j( string ofilename, Operator& Hbare, int E1max, int E2max, int E3max)
 {
-  ofstream outfile(ofilename);
-
   if (Hbare.particle_rank < 3)
   {
     cerr << "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!! << " << endl;
@@ -1689,6 +1940,47 @@ void ReadWrite::Write_me3j( string ofilename, Operator& Hbare, int E1max, int E2
     goodstate = false;
     return;
   }
+  size_t dot = ofilename.find_last_of(".");
+  string extension = dot==string::npos ? "" : ofilename.substr(dot); // no extension means plain text
+  if (extension == ".h5")
+  {
+    Write3bodyHDF5(ofilename, Hbare, E1max, E3max);
+    return;
+  }
+  ofstream outfile(ofilename, ios_base::out | ios_base::binary);
+  if ( !outfile.good() )
+  {
+     cerr << "************************************" << endl
+          << "**    Trouble opening file  !!!   **" << endl
+          << "************************************" << endl;
+     goodstate = false;
+     return;
+  }
+  if (extension == ".gz")
+  {
+    boost::iostreams::filtering_ostream zipstream;
+    zipstream.push(boost::iostreams::gzip_compressor());
+    zipstream.push(outfile);
+    Write_me3j_to_stream(zipstream, Hbare, E1max, E2max, E3max);
+    zipstream.reset(); // flush the compressor before the file is closed
+  }
+  else if (extension == ".bin")
+  {
+    char header[HEADERSIZE] = {};
+    snprintf(header, HEADERSIZE, "me3j binary floats, generated by IMSRG code. E1max = %d  E2max = %d  E3max = %d", E1max, E2max, E3max);
+    outfile.write(header,HEADERSIZE);
+    BinaryFloatStream binstream(outfile);
+    Write_me3j_to_stream(binstream, Hbare, E1max, E2max, E3max);
+  }
+  else
+  {
+    Write_me3j_to_stream(outfile, Hbare, E1max, E2max, E3max);
+  }
+}
+
+template<class T>
+void ReadWrite::Write_me3j_to_stream( T& outfile, Operator& Hbare, int E1max, int E2max, int E3max)
+{
   ModelSpace * modelspace = Hbare.GetModelSpace();
   int e1max = modelspace->GetEmax();
   int e2max = modelspace->GetE2max(); // not used yet
@@ -31,7 +31,10 @@ class ReadWrite
    void ReadOperator_Nathan( string filename1b, string filename2b, Operator& op);
    void ReadTensorOperator_Nathan( string filename1b, string filename2b, Operator& op);
    void Write_me2j( string filename, Operator& op, int emax, int e2max, int lmax);
+   template<class T> void Write_me2j_to_stream( T& outfile, Operator& op, int emax, int e2max, int lmax);
    void Write_me3j( string filename, Operator& op, int E1max, int E2max, int E3max);
+   template<class T> void Write_me3j_to_stream( T& outfile, Operator& op, int E1max, int E2max, int E3max);
+   void Write3bodyHDF5( string filename, Operator& op, int E1max, int E3max);
    void WriteTBME_Navratil( string filename, Operator& Hbare);
    void WriteNuShellX_sps( Operator& op, string filename);
    void WriteNuShellX_int( Operator& op, string filename);
@@ -60,6 +63,8 @@ class ReadWrite
    void SetCoMCorr(bool b){doCoM_corr = b;cout <<"Setting com_corr to "<< b << endl;};
    void SetScratchDir( string d){scratch_dir = d;};
    string GetScratchDir(){return scratch_dir;};
+   void SetHDF5ChunkSize(long long n){h5_chunk_size = n;}; ///< Number of rows of vtnf per slab in Read3bodyHDF5_new(). 0 means match the dataset chunking.
+   void SetHDF5Deflate(int level){h5_deflate = level;}; ///< gzip level for the vtnf dataset written by Write3bodyHDF5(). 0 means no compression.
    int GetAref(){return Aref;};
    int GetZref(){return Zref;};
    void SetAref(int a){Aref = a;};
@@ -78,6 +83,8 @@ class ReadWrite
    string File3N;
    int Aref;
    int Zref;   
+   long long h5_chunk_size;
+   int h5_deflate;
 
 
 };
@@ -101,5 +108,21 @@ class VectorStream
   long long unsigned int i;
 };
 
+
+/// The other direction, so the me2j and me3j writers can write the .bin format with the insertion operator <<.
+/// Numbers go to the file as raw floats, and text and manipulators are dropped. The header is written separately.
+class BinaryFloatStream
+{
+ public:
+  BinaryFloatStream(ostream& os) : out(os) {};
+  BinaryFloatStream& operator<<(float x) { out.write((char*)&x,sizeof(float)); return *this;};
+  BinaryFloatStream& operator<<(double x) { return (*this) << float(x);};
+  BinaryFloatStream& operator<<(ostream& (*)(ostream&)) { return *this;}; // endl
+  template<class X> BinaryFloatStream& operator<<(const X&) { return *this;};
+  bool good(){ return out.good(); };
+ private:
+  ostream& out;
+};
+
 #endif
 
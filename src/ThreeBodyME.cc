@@ -6,72 +6,106 @@ ThreeBodyME::~ThreeBodyME()
 {}
 
 ThreeBodyME::ThreeBodyME()
-: modelspace(NULL),E3max(0),total_dimension(0)
+: modelspace(NULL),E3max(0),E3max_bra(0),E3max_ket(0),Lmax3(0),total_dimension(0),memory_tracker("ThreeBody")
 {
 }
 
 ThreeBodyME::ThreeBodyME(ModelSpace* ms)
-: modelspace(ms), E3max(ms->E3max), total_dimension(0)
+: modelspace(ms), E3max(ms->E3max), E3max_bra(ms->GetE3maxBra()), E3max_ket(ms->GetE3maxKet()), Lmax3(ms->GetLmax3()), total_dimension(0), memory_tracker("ThreeBody")
 {}
 
 ThreeBodyME::ThreeBodyME(ModelSpace* ms, int e3max)
-: modelspace(ms),E3max(e3max), total_dimension(0)
+: modelspace(ms),E3max(e3max), E3max_bra(e3max), E3max_ket(e3max), Lmax3(ms->GetLmax3()), total_dimension(0), memory_tracker("ThreeBody")
 {}
 
 
 // Confusing nomenclature: J2 means 2 times the total J of the three body system
+// Orbits with l>Lmax3 keep their slot in OrbitIndex (so the nested vectors can still be indexed by a/2, b/2...)
+// but the slot is left empty, so they take no storage for matrix elements.
 void ThreeBodyME::Allocate()
 {
   MatEl.clear();
   OrbitIndex.clear();
+  total_dimension = 0;
   E3max = modelspace->GetE3max();
-  cout << "Begin AllocateThreeBody() with E3max = " << E3max << endl;
+  E3max_bra = modelspace->GetE3maxBra();
+  E3max_ket = modelspace->GetE3maxKet();
+  Lmax3 = modelspace->GetLmax3();
+  // Only half of the matrix is stored, so the bra and ket truncations are applied symmetrically.
+  int E3max_hi = max(E3max_bra,E3max_ket);
+  int E3max_lo = min(E3max_bra,E3max_ket);
+  cout << "Begin AllocateThreeBody() with E3max = " << E3max << "  Lmax3 = " << Lmax3;
+  if (E3max_lo < E3max_hi) cout << "  E3max bra/ket = " << E3max_bra << " / " << E3max_ket;
+  cout << endl;
   int norbits = modelspace->GetNumberOrbits();
   int nvectors = 0;
-  int lmax = 500*norbits; // maybe do something with this later...
 
   for (int a=0; a<norbits; a+=2)
   {
    Orbit& oa = modelspace->GetOrbit(a);
    int ea = 2*oa.n+oa.l;
-   if (ea>E3max) break;
+   if (ea>E3max_hi) break;
+   if (oa.l > Lmax3)
+   {
+     OrbitIndex.emplace_back();
+     continue;
+   }
    vector<vector<vector<vector<vector<size_t>>>>> vecb;
    for (int b=0; b<=a; b+=2)
    {
-     if (oa.l > lmax) break;
      Orbit& ob = modelspace->GetOrbit(b);
      int eb = 2*ob.n+ob.l;
-     if ((ea+eb)>E3max) break;
+     if ((ea+eb)>E3max_hi) break;
+     if (ob.l > Lmax3)
+     {
+       vecb.emplace_back();
+       continue;
+     }
 
      int Jab_min = abs(oa.j2-ob.j2)/2;
      int Jab_max = (oa.j2+ob.j2)/2;
      vector<vector<vector<vector<size_t>>>> vecc;
      for (int c=0; c<=b; c+=2)
      {
-       if (ob.l > lmax) break;
        Orbit& oc = modelspace->GetOrbit(c);
        int ec = 2*oc.n+oc.l;
-       if ((ea+eb+ec)>E3max) break;
+       if ((ea+eb+ec)>E3max_hi) break;
+       if (oc.l > Lmax3)
+       {
+         vecc.emplace_back();
+         continue;
+       }
+       // If the bra is above the lower cut, the ket must be below it.
+       int E3max_def = (ea+eb+ec > E3max_lo) ? E3max_lo : E3max_hi;
        vector<vector<vector<size_t>>> vecd;
        for (int d=0; d<=a; d+=2)
        {
-         if (oc.l > lmax) break;
          Orbit& od = modelspace->GetOrbit(d);
          int ed = 2*od.n+od.l;
+         if (ed>E3max_def) break;
          vector<vector<size_t>> vece;
+         if (od.l > Lmax3)
+         {
+           vecd.push_back( vece );
+           continue;
+         }
          for (int e=0; e<= (d==a ? b : d); e+=2)
          {
-           if (od.l > lmax) break;
            Orbit& oe = modelspace->GetOrbit(e);
            int ee = 2*oe.n+oe.l;
+           if ((ed+ee)>E3max_def) break;
            vector<size_t> vecf;
+           if (oe.l > Lmax3)
+           {
+             vece.push_back( vecf );
+             continue;
+           }
            for (int f=0; f<=((d==a and e==b) ? c : e); f+=2)
            {
-             if (oe.l > lmax) break;
              Orbit& of = modelspace->GetOrbit(f);
              int ef = 2*of.n+of.l;
-             if ((ed+ee+ef)>E3max) break;
-             if ((oa.l+ob.l+oc.l+od.l+oe.l+of.l)%2>0 or of.l > lmax) 
+             if ((ed+ee+ef)>E3max_def) break;
+             if ((oa.l+ob.l+oc.l+od.l+oe.l+of.l)%2>0 or of.l > Lmax3) 
              {
                vecf.push_back( -1 );
                continue;
@@ -114,12 +148,34 @@ void ThreeBodyME::Allocate()
   } //a
   MatEl.resize(total_dimension,0.0);
   MatEl.shrink_to_fit();
+  memory_tracker.Set(MatEl.capacity()*sizeof(ThreeBME_type));
   cout << "Allocated " << total_dimension << " three body matrix elements (" <<  total_dimension * sizeof(ThreeBME_type)/1024./1024./1024. << " GB), "
        << nvectors << " vectors (" << nvectors * sizeof(vector<size_t>)/1024./1024./1024. <<" GB)." << endl;
 
 }
 
 
+//*******************************************************************
+/// Check if the orbits \f$ abc \f$, \f$ def \f$ are inside the
+/// Lmax3 and E3max truncations, i.e. if the matrix element is stored.
+/// Since only half of the matrix is stored, the separate bra and ket
+/// truncations are applied symmetrically.
+//*******************************************************************
+bool ThreeBodyME::CheckTruncation(int a, int b, int c, int d, int e, int f)
+{
+   Orbit& oa = modelspace->GetOrbit(a);
+   Orbit& ob = modelspace->GetOrbit(b);
+   Orbit& oc = modelspace->GetOrbit(c);
+   Orbit& od = modelspace->GetOrbit(d);
+   Orbit& oe = modelspace->GetOrbit(e);
+   Orbit& of = modelspace->GetOrbit(f);
+   if (oa.l>Lmax3 or ob.l>Lmax3 or oc.l>Lmax3 or od.l>Lmax3 or oe.l>Lmax3 or of.l>Lmax3) return false;
+   int e_abc = 2*(oa.n+ob.n+oc.n)+oa.l+ob.l+oc.l;
+   int e_def = 2*(od.n+oe.n+of.n)+od.l+oe.l+of.l;
+   return max(e_abc,e_def) <= max(E3max_bra,E3max_ket) and min(e_abc,e_def) <= min(E3max_bra,E3max_ket);
+}
+
+
 
 
 //*******************************************************************
@@ -139,23 +195,26 @@ ThreeBME_type ThreeBodyME::GetME_pn(int Jab_in, int Jde_in, int J2, int a, int b
    double tze = modelspace->GetOrbit(e).tz2*0.5;
    double tzf = modelspace->GetOrbit(f).tz2*0.5;
 
+   // Clebsch-Gordan coefficients for t_ab = 0,1 and T = 1/2,3/2
+   double CG1[2], CG2[2], CG3[2][2], CG4[2][2];
+   AngMom::CG_Batch(0.5,tza, 0.5,tzb, 0, 1, tza+tzb, CG1);
+   AngMom::CG_Batch(0.5,tzd, 0.5,tze, 0, 1, tzd+tze, CG2);
+   for (int t=0; t<=1; ++t)
+   {
+     AngMom::CG_Batch(t,tza+tzb, 0.5,tzc, 0.5, 1.5, tza+tzb+tzc, CG3[t]);
+     AngMom::CG_Batch(t,tzd+tze, 0.5,tzf, 0.5, 1.5, tzd+tze+tzf, CG4[t]);
+   }
+
    double Vpn=0;
-   int Tmin = min( abs(tza+tzb+tzc), abs(tzd+tze+tzf) );
-   for (int tab=abs(tza+tzb); tab<=1; ++tab)
+   for (int tab=0; tab<=1; ++tab)
    {
-      // CG calculates the Clebsch-Gordan coefficient
-      double CG1 = AngMom::CG(0.5,tza, 0.5,tzb, tab, tza+tzb);
-      for (int tde=abs(tzd+tze); tde<=1; ++tde)
+      for (int tde=0; tde<=1; ++tde)
       {
-         double CG2 = AngMom::CG(0.5,tzd, 0.5,tze, tde, tzd+tze);
-         if (CG1*CG2==0) continue;
-         for (int T=Tmin; T<=3; ++T)
+         if (CG1[tab]*CG2[tde]==0) continue;
+         for (int T=1; T<=3; T+=2)
          {
-           double CG3 = AngMom::CG(tab,tza+tzb, 0.5,tzc, T/2., tza+tzb+tzc);
-           double CG4 = AngMom::CG(tde,tzd+tze, 0.5,tzf, T/2., tzd+tze+tzf);
-           if (CG3*CG4==0) continue;
-           Vpn += CG1*CG2*CG3*CG4*GetME(Jab_in,Jde_in,J2,tab,tde,T,a,b,c,d,e,f);
-
+           if (CG3[tab][T/2]*CG4[tde][T/2]==0) continue;
+           Vpn += CG1[tab]*CG2[tde]*CG3[tab][T/2]*CG4[tde][T/2]*GetME(Jab_in,Jde_in,J2,tab,tde,T,a,b,c,d,e,f);
          }
       }
    }
@@ -194,6 +253,8 @@ void ThreeBodyME::SetME(int Jab_in, int Jde_in, int J2, int tab_in, int tde_in,
 /// its value \f$V_{out}\f$. To access a matrix element, we set
 /// \f$V_{in}=0\f$. To set the matrix element, we simply
 /// disregard $\V_{out}\f$.
+/// With \f$V_{in}=0\f$ nothing is written, so several threads (or jobs sharing
+/// the interaction) can read the same matrix elements at once.
 //*******************************************************************
 
 ThreeBME_type ThreeBodyME::AddToME(int Jab_in, int Jde_in, int J2, int tab_in, int tde_in, int T2, int a_in, int b_in, int c_in, int d_in, int e_in, int f_in, ThreeBME_type V_in)
@@ -216,14 +277,14 @@ ThreeBME_type ThreeBodyME::AddToME(int Jab_in, int Jde_in, int J2, int tab_in, i
 
 
 
+   if (not CheckTruncation(a,b,c,d,e,f)) return 0;
+
    Orbit& oa = modelspace->GetOrbit(a);
    Orbit& ob = modelspace->GetOrbit(b);
    Orbit& oc = modelspace->GetOrbit(c);
    Orbit& od = modelspace->GetOrbit(d);
    Orbit& oe = modelspace->GetOrbit(e);
    Orbit& of = modelspace->GetOrbit(f);
-   if (2*(oa.n+ob.n+oc.n)+oa.l+ob.l+oc.l > E3max) return 0;
-   if (2*(od.n+oe.n+of.n)+od.l+oe.l+of.l > E3max) return 0;
 
    double ja = oa.j2*0.5;
    double jb = ob.j2*0.5;
@@ -286,7 +347,7 @@ ThreeBME_type ThreeBodyME::AddToME(int Jab_in, int Jde_in, int J2, int tab_in, i
 
              int Tindex = 2*tab + tde + (T2-1)/2;
 
-             MatEl.at(indx + J_index + Tindex) += Cj_abc * Cj_def * Ct_abc * Ct_def * V_in;
+             if (V_in != 0) MatEl.at(indx + J_index + Tindex) += Cj_abc * Cj_def * Ct_abc * Ct_def * V_in;
              V_out += Cj_abc * Cj_def * Ct_abc * Ct_def * MatEl.at(indx + J_index + Tindex);
 
            }
@@ -360,18 +421,19 @@ void ThreeBodyME::Deallocate()
 {
   vector<ThreeBME_type>().swap(MatEl);
   vector<vector<vector<vector<vector<vector<size_t>>>>>>().swap( OrbitIndex ); 
+  memory_tracker.Set(0);
 }
 
 
 
-void ThreeBodyME::WriteBinary(ofstream& f)
+void ThreeBodyME::WriteBinary(ostream& f)
 {
   f.write((char*)&E3max,sizeof(E3max));
   f.write((char*)&total_dimension,sizeof(total_dimension));
-  f.write((char*)&MatEl[0],total_dimension);
+  f.write((char*)&MatEl[0],total_dimension*sizeof(ThreeBME_type));
 }
 
-void ThreeBodyME::ReadBinary(ifstream& f)
+void ThreeBodyME::ReadBinary(istream& f)
 {
   f.read((char*)&E3max,sizeof(E3max));
   f.read((char*)&total_dimension,sizeof(total_dimension));
@@ -2,6 +2,7 @@
 #define ThreeBodyME_h 1
 
 #include "ModelSpace.hh"
+#include "IMSRGProfiler.hh"
 #include <fstream>
 
 //typedef double ThreeBME_type;
@@ -15,6 +16,8 @@ typedef float ThreeBME_type;
 /// The other combinations are obtained on the fly by GetME().
 /// The storage format is MatEl[{a,b,c,d,e,f,J,Jab,Jde}][T_index] =
 /// \f$ \langle (abJ_{ab}t_{ab})c | V | (deJ_{de}t_{de})f  \rangle_{JT} \f$.
+/// Orbits with \f$ \ell > \f$ Lmax3, and combinations outside the E3max truncation
+/// (optionally different for bra and ket, see ModelSpace::SetE3maxBraKet()) are not stored at all.
 class ThreeBodyME
 {
  public:
@@ -23,7 +26,11 @@ class ThreeBodyME
   vector<ThreeBME_type> MatEl;
   vector<vector<vector<vector<vector<vector<size_t>>>>>> OrbitIndex; //
   int E3max;
+  int E3max_bra;
+  int E3max_ket;
+  int Lmax3;
   size_t total_dimension;
+  IMSRGProfiler::MemoryTracker memory_tracker;
   
   ~ThreeBodyME();
   ThreeBodyME();
@@ -43,6 +50,7 @@ class ThreeBodyME
 ///// Some other three body methods
 
   int SortOrbits(int a_in, int b_in, int c_in, int& a,int& b,int& c);
+  bool CheckTruncation(int a, int b, int c, int d, int e, int f);
   double RecouplingCoefficient(int recoupling_case, double ja, double jb, double jc, int Jab_in, int Jab, int J);
   void SetE3max(int e){E3max = e;};
   int GetE3max(){return E3max;};
@@ -52,8 +60,8 @@ class ThreeBodyME
   size_t size(){return total_dimension * sizeof(ThreeBME_type);};
 
 
-  void WriteBinary(ofstream&);
-  void ReadBinary(ifstream&);
+  void WriteBinary(ostream&);
+  void ReadBinary(istream&);
 
 };
 
@@ -10,7 +10,7 @@ TwoBodyME::~TwoBodyME()
 
 TwoBodyME::TwoBodyME()
 : modelspace(NULL), nChannels(0), hermitian(true),antihermitian(false),
-  rank_J(0), rank_T(0), parity(0)
+  rank_J(0), rank_T(0), parity(0), norm_cached(-1), sparse_valid(0), memory_tracker("TwoBody")
 {
 //  cout << "Default TwoBodyME constructor" << endl;
 }
@@ -18,7 +18,7 @@ TwoBodyME::TwoBodyME()
 
 TwoBodyME::TwoBodyME(ModelSpace* ms)
 : modelspace(ms), nChannels(ms->GetNumberTwoBodyChannels()),
-  hermitian(true), antihermitian(false), rank_J(0), rank_T(0), parity(0)
+  hermitian(true), antihermitian(false), rank_J(0), rank_T(0), parity(0), norm_cached(-1), sparse_valid(0), memory_tracker("TwoBody")
 {
   Allocate();
 }
@@ -26,7 +26,7 @@ TwoBodyME::TwoBodyME(ModelSpace* ms)
 
 TwoBodyME::TwoBodyME(ModelSpace* ms, int rJ, int rT, int p)
 : modelspace(ms), nChannels(ms->GetNumberTwoBodyChannels()),
-  hermitian(true), antihermitian(false), rank_J(rJ), rank_T(rT), parity(p)
+  hermitian(true), antihermitian(false), rank_J(rJ), rank_T(rT), parity(p), norm_cached(-1), sparse_valid(0), memory_tracker("TwoBody")
 {
   Allocate();
 }
@@ -38,28 +38,56 @@ TwoBodyME::TwoBodyME(ModelSpace* ms, int rJ, int rT, int p)
    {
       itmat.second *= rhs;
    }
+   if (norm_cached>=0) norm_cached *= abs(rhs);
+   sparse_valid = 0;
    return *this;
  }
 
+// Y += a*X, returning the sum of squares of the new Y.
+// This is done in one pass so that the norm doesn't need another sweep through memory later.
+static double AddScaledWithNorm2(arma::mat& Y, double a, const arma::mat& X)
+{
+   if (Y.n_rows != X.n_rows or Y.n_cols != X.n_cols) Y += a*X; // let armadillo complain about the sizes
+   double* y = Y.memptr();
+   const double* x = X.memptr();
+   double n2 = 0;
+   for (arma::uword i=0; i<Y.n_elem; ++i)
+   {
+      y[i] += a * x[i];
+      n2 += y[i]*y[i];
+   }
+   return n2;
+}
+
  TwoBodyME& TwoBodyME::operator+=(const TwoBodyME& rhs)
  {
+   double nrm = 0;
    for ( auto& itmat : MatEl )
    {
       int ch_bra = itmat.first[0];
       int ch_ket = itmat.first[1];
-      itmat.second += rhs.GetMatrix(ch_bra,ch_ket);
+      double n2 = AddScaledWithNorm2(itmat.second, 1.0, rhs.GetMatrix(ch_bra,ch_ket));
+      nrm += (ch_bra==ch_ket) ? n2 : 2*n2;
    }
+   norm_cached = sqrt(nrm);
+   sparse_valid = 0;
    return *this;
  }
 
  TwoBodyME& TwoBodyME::operator-=(const TwoBodyME& rhs)
  {
+   InvalidateNorm();
+   double nrm = 0;
    for ( auto& itmat : rhs.MatEl )
    {
       int ch_bra = itmat.first[0];
       int ch_ket = itmat.first[1];
-      GetMatrix(ch_bra,ch_ket) -= itmat.second;
+      double n2 = AddScaledWithNorm2(MatEl.at({ch_bra,ch_ket}), -1.0, itmat.second);
+      nrm += (ch_bra==ch_ket) ? n2 : 2*n2;
    }
+   // If rhs has fewer channels than this, we haven't seen all of our matrices
+   if (rhs.MatEl.size() == MatEl.size()) norm_cached = sqrt(nrm);
+   sparse_valid = 0;
    return *this;
  }
 
@@ -68,6 +96,9 @@ TwoBodyME::TwoBodyME(ModelSpace* ms, int rJ, int rT, int p)
 void TwoBodyME::Allocate()
 {
   MatEl.clear();
+  sparse_pp_hh.clear();
+  norm_cached = -1;
+  sparse_valid = 0;
   for (int ch_bra=0; ch_bra<nChannels;++ch_bra)
   {
      TwoBodyChannel& tbc_bra = modelspace->GetTwoBodyChannel(ch_bra);
@@ -81,6 +112,7 @@ void TwoBodyME::Allocate()
         MatEl[{ch_bra,ch_ket}] =  arma::mat(tbc_bra.GetNumberKets(), tbc_ket.GetNumberKets(), arma::fill::zeros);
      }
   }
+  memory_tracker.Set(size());
 }
 
 void TwoBodyME::SetHermitian()
@@ -524,6 +556,8 @@ double TwoBodyME::GetTBMEmonopole(Ket & bra, Ket & ket) const
    return GetTBMEmonopole(bra.p,bra.q,ket.p,ket.q);
 }
 
+/// The norm is left unknown rather than set to zero, because an erased operator
+/// is usually about to be filled, often from inside a parallel loop, where it shouldn't be reset.
 void TwoBodyME::Erase()
 {
   for ( auto& itmat : MatEl )
@@ -531,11 +565,16 @@ void TwoBodyME::Erase()
      arma::mat& matrix = itmat.second;
      matrix.zeros();
   }
+  norm_cached = -1;
+  sparse_valid = 0;
 }
 
 
+/// The result is cached until the matrix elements are changed. Addition, scaling
+/// and (anti)symmetrization compute the new norm as they go, so it's usually free.
 double TwoBodyME::Norm() const
 {
+   if (norm_cached>=0) return norm_cached;
    double nrm = 0;
    for ( auto& itmat : MatEl )
    {
@@ -547,30 +586,63 @@ double TwoBodyME::Norm() const
       if (itmat.first[0] != itmat.first[1])
          nrm += n2*n2;
    }
-   return sqrt(nrm);
+   norm_cached = sqrt(nrm);
+   return norm_cached;
 }
 
 
+/// Copy the upper triangle of each matrix to the lower triangle, computing the norm on the way.
 void TwoBodyME::Symmetrize()
 {
   if (rank_J>0 or rank_T>0 or parity>0) return;
+  double nrm = 0;
   for (auto& itmat : MatEl )
   {
       arma::mat& matrix = itmat.second;
-      matrix = arma::symmatu(matrix);
+      if (not matrix.is_square()) matrix = arma::symmatu(matrix); // let armadillo complain
+      arma::uword n = matrix.n_rows;
+      double* m = matrix.memptr();
+      double n2 = 0;
+      for (arma::uword j=0; j<n; ++j)
+      {
+        for (arma::uword i=0; i<j; ++i)
+        {
+          m[j+i*n] = m[i+j*n];
+          n2 += 2*m[i+j*n]*m[i+j*n];
+        }
+        n2 += m[j+j*n]*m[j+j*n];
+      }
+      nrm += (itmat.first[0]==itmat.first[1]) ? n2 : 2*n2;
   }
+  norm_cached = sqrt(nrm);
+  sparse_valid = 0;
 }
 
+/// Copy minus the upper triangle of each matrix to the lower triangle and zero the diagonal, computing the norm on the way.
 void TwoBodyME::AntiSymmetrize()
 {
   if (rank_J>0) return;
+  double nrm = 0;
   for (auto& itmat : MatEl )
   {
     arma::mat& matrix = itmat.second;
-    matrix = arma::trimatu(matrix) - arma::trimatu(matrix).t();
+    if (not matrix.is_square()) matrix = arma::trimatu(matrix); // let armadillo complain
+    arma::uword n = matrix.n_rows;
+    double* m = matrix.memptr();
+    double n2 = 0;
+    for (arma::uword j=0; j<n; ++j)
+    {
+      for (arma::uword i=0; i<j; ++i)
+      {
+        m[j+i*n] = -m[i+j*n];
+        n2 += 2*m[i+j*n]*m[i+j*n];
+      }
+      m[j+j*n] = 0;
+    }
+    nrm += (itmat.first[0]==itmat.first[1]) ? n2 : 2*n2;
   }
-
-
+  norm_cached = sqrt(nrm);
+  sparse_valid = 0;
 }
 
 
@@ -581,7 +653,8 @@ void TwoBodyME::Scale(double x)
       arma::mat& matrix = itmat.second;
       matrix *= x;
    }
-
+   if (norm_cached>=0) norm_cached *= abs(x);
+   sparse_valid = 0;
 }
 
 void TwoBodyME::Eye()
@@ -591,6 +664,8 @@ void TwoBodyME::Eye()
       arma::mat& matrix = itmat.second;
       matrix.eye();
    }
+   norm_cached = -1;
+   sparse_valid = 0;
 }
 
 
@@ -605,9 +680,9 @@ int TwoBodyME::Dimension()
    return dim;
 }
 
-int TwoBodyME::size()
+size_t TwoBodyME::size()
 {
-  int size=0;
+  size_t size=0;
   for ( auto& itmat : MatEl )
      size += itmat.second.size();
   return size*sizeof(double);
@@ -615,7 +690,41 @@ int TwoBodyME::size()
 
 
 
-void TwoBodyME::WriteBinary( ofstream& of )
+/// Keep sparse copies of the pp and hh ket columns of the scalar channels in which fewer than
+/// fill_cutoff of the matrix elements are nonzero. Operator::comm222_pp_hh_221ss() uses them when
+/// this is the left operand, so they're only built once for an Omega which is used in many commutators.
+/// They're dropped as soon as the matrix elements change. Returns the number of sparse channels.
+int TwoBodyME::BuildSparse(double fill_cutoff)
+{
+  sparse_pp_hh.clear();
+  sparse_valid = 0;
+  if (fill_cutoff <= 0) return 0;
+  Norm(); // so the next change goes through InvalidateNorm(), which drops the sparse copies
+  for ( auto& itmat : MatEl )
+  {
+    if (itmat.first[0] != itmat.first[1]) continue;
+    arma::mat& matrix = itmat.second;
+    if ( count_if(matrix.begin(), matrix.end(), [](double x){return x!=0;}) >= fill_cutoff*matrix.n_elem ) continue;
+    TwoBodyChannel& tbc = modelspace->GetTwoBodyChannel(itmat.first[0]);
+    auto& sparse = sparse_pp_hh[itmat.first[0]];
+    sparse[0] = arma::sp_mat( arma::mat(matrix.cols(tbc.GetKetIndex_pp())) );
+    sparse[1] = arma::sp_mat( arma::mat(matrix.cols(tbc.GetKetIndex_hh())) );
+  }
+  sparse_valid = 1;
+  return sparse_pp_hh.size();
+}
+
+/// The sparse pp and hh columns of channel ch, or NULL if that channel is only stored dense.
+const array<arma::sp_mat,2>* TwoBodyME::GetSparse_pp_hh(int ch) const
+{
+  if (not sparse_valid) return NULL;
+  auto it = sparse_pp_hh.find(ch);
+  if (it == sparse_pp_hh.end()) return NULL;
+  return &(it->second);
+}
+
+
+void TwoBodyME::WriteBinary( ostream& of )
 {
   of.write((char*)&nChannels,sizeof(nChannels));
   of.write((char*)&hermitian,sizeof(hermitian));
@@ -629,7 +738,7 @@ void TwoBodyME::WriteBinary( ofstream& of )
 }
 
 
-void TwoBodyME::ReadBinary( ifstream& of )
+void TwoBodyME::ReadBinary( istream& of )
 {
   of.read((char*)&nChannels,sizeof(nChannels));
   of.read((char*)&hermitian,sizeof(hermitian));
@@ -5,6 +5,7 @@
 #include <memory>
 #include <fstream>
 #include "ModelSpace.hh"
+#include "IMSRGProfiler.hh"
 class TwoBodyME_ph;
 
 /// The two-body piece of the operator, stored in a vector of maps of of armadillo matrices.
@@ -39,6 +40,10 @@ class TwoBodyME
   int rank_J;
   int rank_T;
   int parity;
+  mutable double norm_cached; ///< Norm() of the matrix elements, kept until they're changed. Negative means unknown.
+  map<int,array<arma::sp_mat,2>> sparse_pp_hh; ///< Sparse copies of the pp and hh ket columns of the mostly-zero channels. See BuildSparse().
+  int sparse_valid; ///< Whether sparse_pp_hh matches MatEl. Cleared along with norm_cached whenever the matrix elements change.
+  IMSRGProfiler::MemoryTracker memory_tracker;
 
   ~TwoBodyME();
   TwoBodyME();
@@ -59,7 +64,7 @@ class TwoBodyME
   void SetAntiHermitian();
   void SetNonHermitian();
 
-  arma::mat& GetMatrix(int chbra, int chket){return MatEl.at({chbra,chket});};
+  arma::mat& GetMatrix(int chbra, int chket){InvalidateNorm(); return MatEl.at({chbra,chket});};
   arma::mat& GetMatrix(int ch){return GetMatrix(ch,ch);};
   arma::mat& GetMatrix(array<int,2> a){return GetMatrix(a[0],a[1]);};
   const arma::mat& GetMatrix(int chbra, int chket)const {return  MatEl.at({chbra,chket});};
@@ -123,15 +128,33 @@ class TwoBodyME
   void Erase();
   void Scale(double);
   double Norm() const;
+  /// Forget the cached norm, and the sparse copies. The non-const accessors do this, but code which writes to MatEl directly must call it.
+  /// The non-const GetMatrix() is called from inside omp parallel loops, so the flags are read and written atomically.
+  /// BuildSparse() leaves a valid norm, so the first change after it always gets here.
+  void InvalidateNorm()
+  {
+    double n;
+    #pragma omp atomic read
+    n = norm_cached;
+    if (n>=0)
+    {
+      #pragma omp atomic write
+      norm_cached = -1;
+      #pragma omp atomic write
+      sparse_valid = 0;
+    }
+  };
+  int BuildSparse(double fill_cutoff);
+  const array<arma::sp_mat,2>* GetSparse_pp_hh(int ch) const;
   void Symmetrize();
   void AntiSymmetrize();
   void Eye();
   void PrintMatrix(int chbra,int chket) const { MatEl.at({chbra,chket}).print();};
   int Dimension();
-  int size();
+  size_t size();
 
-  void WriteBinary(ofstream&);
-  void ReadBinary(ifstream&);
+  void WriteBinary(ostream&);
+  void ReadBinary(istream&);
 
 
 };
@@ -820,7 +820,7 @@ Operator RSquaredOp(ModelSpace& modelspace)
    double oscillator_b = (HBARC*HBARC/M_NUCLEON/modelspace.GetHbarOmega());
 
    int nchan = modelspace.GetNumberTwoBodyChannels();
-//   modelspace.PreCalculateMoshinsky();
+   modelspace.PreCalculateMoshinsky();
    #pragma omp parallel for schedule(dynamic,1) 
    for (int ch=0; ch<nchan; ++ch)
    {
@@ -1206,6 +1206,7 @@ Operator FourierBesselCoeff(ModelSpace& modelspace, int nu, double R, vector<ind
       int J = modelspace->GetTwoBodyChannel(ch_bra).J;
       itmat.second *= sqrt(2*J+1.);
     }
+    X.TwoBody.InvalidateNorm();
   }
 
   void UnReduce(Operator& X)
@@ -1227,6 +1228,7 @@ Operator FourierBesselCoeff(ModelSpace& modelspace, int nu, double R, vector<ind
       int J = modelspace->GetTwoBodyChannel(ch_bra).J;
       itmat.second /= sqrt(2*J+1.);
     }
+    X.TwoBody.InvalidateNorm();
 
   }
 
@@ -55,6 +55,8 @@ BOOST_PYTHON_MODULE(pyIMSRG)
       .def("SetHbarOmega", &ModelSpace::SetHbarOmega)
       .def("SetTargetMass", &ModelSpace::SetTargetMass)
       .def("SetE3max", &ModelSpace::SetE3max)
+      .def("SetE3maxBraKet", &ModelSpace::SetE3maxBraKet)
+      .def("SetMoshinskyCacheDir", &ModelSpace::SetMoshinskyCacheDir)
       .def("GetHbarOmega", &ModelSpace::GetHbarOmega)
       .def("GetTargetMass", &ModelSpace::GetTargetMass)
       .def("GetNumberOrbits", &ModelSpace::GetNumberOrbits)
@@ -88,6 +90,8 @@ BOOST_PYTHON_MODULE(pyIMSRG)
       .def("ScaleOneBody", &Operator::ScaleOneBody)
       .def("ScaleTwoBody", &Operator::ScaleTwoBody)
       .def("DoNormalOrdering", &Operator::DoNormalOrdering)
+      .def("Truncate", &Operator::Truncate)
+      .def("Embed", &Operator::Embed)
       .def("UndoNormalOrdering", &Operator::UndoNormalOrdering)
       .def("SetModelSpace", &Operator::SetModelSpace)
       .def("CalculateKineticEnergy", &Operator::CalculateKineticEnergy)
@@ -98,6 +102,7 @@ BOOST_PYTHON_MODULE(pyIMSRG)
       .def("SetAntiHermitian", &Operator::SetAntiHermitian)
       .def("SetNonHermitian", &Operator::SetNonHermitian)
       .def("Set_BCH_Transform_Threshold", &Operator::Set_BCH_Transform_Threshold)
+      .def("SetSparseFillCutoff", &Operator::SetSparseFillCutoff)
       .def("Set_BCH_Product_Threshold", &Operator::Set_BCH_Product_Threshold)
       .def("PrintOneBody", &Operator::PrintOneBody)
       .def("PrintTwoBody", &Operator::PrintTwoBody)
@@ -138,8 +143,11 @@ BOOST_PYTHON_MODULE(pyIMSRG)
       .def("ReadBareTBME_Darmstadt", &ReadWrite::ReadBareTBME_Darmstadt)
       .def("Read_Darmstadt_3body", &ReadWrite::Read_Darmstadt_3body)
       .def("Read3bodyHDF5", &ReadWrite::Read3bodyHDF5)
+      .def("SetHDF5ChunkSize", &ReadWrite::SetHDF5ChunkSize)
+      .def("SetHDF5Deflate", &ReadWrite::SetHDF5Deflate)
       .def("Write_me2j", &ReadWrite::Write_me2j)
       .def("Write_me3j", &ReadWrite::Write_me3j)
+      .def("Write3bodyHDF5", &ReadWrite::Write3bodyHDF5)
       .def("WriteTBME_Navratil", &ReadWrite::WriteTBME_Navratil)
       .def("WriteNuShellX_sps", &ReadWrite::WriteNuShellX_sps)
       .def("WriteNuShellX_int", &ReadWrite::WriteNuShellX_int)
@@ -172,11 +180,19 @@ BOOST_PYTHON_MODULE(pyIMSRG)
 
    class_<HartreeFock>("HartreeFock",init<Operator&>())
       .def("Solve",&HartreeFock::Solve)
-      .def("TransformToHFBasis",&HartreeFock::TransformToHFBasis)
+      .def("TransformToHFBasis",(Operator (HartreeFock::*)(Operator&)) &HartreeFock::TransformToHFBasis)
       .def("GetHbare",&HartreeFock::GetHbare)
       .def("GetNormalOrderedH",&HartreeFock::GetNormalOrderedH)
       .def("GetOmega",&HartreeFock::GetOmega)
       .def("PrintSPE",&HartreeFock::PrintSPE)
+      .def("SetConvergenceMethod",&HartreeFock::SetConvergenceMethod)
+      .def("SetDIISVectors",&HartreeFock::SetDIISVectors)
+      .def("SetMixing",&HartreeFock::SetMixing)
+      .def("SetLevelShift",&HartreeFock::SetLevelShift)
+      .def("SetMaxIterations",&HartreeFock::SetMaxIterations)
+      .def("WriteState",&HartreeFock::WriteState)
+      .def("ReadState",&HartreeFock::ReadState)
+      .def_readonly("iterations",&HartreeFock::iterations)
       .def_readonly("EHF",&HartreeFock::EHF)
    ;
 
@@ -188,6 +204,7 @@ BOOST_PYTHON_MODULE(pyIMSRG)
       .def("Transform",Transform_ref)
       .def("InverseTransform",&IMSRGSolver::InverseTransform)
       .def("SetFlowFile",&IMSRGSolver::SetFlowFile)
+      .def("SetFlowFileMemory",&IMSRGSolver::SetFlowFileMemory)
       .def("SetMethod",&IMSRGSolver::SetMethod)
       .def("SetEtaCriterion",&IMSRGSolver::SetEtaCriterion)
       .def("SetDs",&IMSRGSolver::SetDs)
@@ -206,6 +223,18 @@ BOOST_PYTHON_MODULE(pyIMSRG)
       .def("GetOmega",&IMSRGSolver::GetOmega)
       .def("GetH_s",&IMSRGSolver::GetH_s,return_value_policy<reference_existing_object>())
       .def("SetMagnusAdaptive",&IMSRGSolver::SetMagnusAdaptive)
+      .def("SetMagnusTolerance",&IMSRGSolver::SetMagnusTolerance)
+      .def("SetExtrapolationTolerance",&IMSRGSolver::SetExtrapolationTolerance)
+      .def("GetE0Extrapolated",&IMSRGSolver::GetE0Extrapolated)
+      .def("GetE0ExtrapolationError",&IMSRGSolver::GetE0ExtrapolationError)
+      .def("SetOmegaSparsify",&IMSRGSolver::SetOmegaSparsify)
+      .def("SeedOmega",&IMSRGSolver::SeedOmega)
+      .def("SeedFrom",&IMSRGSolver::SeedFrom)
+      .def("SetSparsifyTestOperator",&IMSRGSolver::SetSparsifyTestOperator)
+      .def("SetCheckpoint",&IMSRGSolver::SetCheckpoint)
+      .def("WriteCheckpoint",&IMSRGSolver::WriteCheckpoint)
+      .def("FinishCheckpoint",&IMSRGSolver::FinishCheckpoint)
+      .def("Restart",&IMSRGSolver::Restart)
       .def_readwrite("Eta", &IMSRGSolver::Eta)
    ;
 
@@ -216,6 +245,14 @@ BOOST_PYTHON_MODULE(pyIMSRG)
        .def("PrintCounters",&IMSRGProfiler::PrintCounters)
        .def("PrintAll",&IMSRGProfiler::PrintAll)
        .def("PrintMemory",&IMSRGProfiler::PrintMemory)
+       .def("PrintTree",&IMSRGProfiler::PrintTree)
+       .def("PrintRoofline",&IMSRGProfiler::PrintRoofline)
+       .def("SetMachinePeak",&IMSRGProfiler::SetMachinePeak)
+       .def("StartMemoryPhase",&IMSRGProfiler::StartMemoryPhase)
+       .def("EnableTrace",&IMSRGProfiler::EnableTrace)
+       .def("WriteTrace",&IMSRGProfiler::WriteTrace)
+       .def("WriteCollapsedStacks",&IMSRGProfiler::WriteCollapsedStacks)
+       .def("Clear",&IMSRGProfiler::Clear)
    ;
 
    def("TCM_Op",           imsrg_util::TCM_Op);
@@ -0,0 +1,230 @@
+// Compare the in-tree angular momentum coupling routines with GSL, for accuracy and speed.
+// Usage: AngMomBenchmark [twojmax] [emax] [e3max]
+// twojmax limits the full comparison. emax and e3max (default 16 and 3*emax) give the size of
+// the 6j tables in ModelSpace, whose largest 2j are checked separately.
+// Returns a nonzero exit code if any symbol differs from GSL by more than the tolerance.
+#include <stdlib.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cmath>
+#include <omp.h>
+#include <gsl/gsl_sf_coupling.h>
+#include "AngMom.hh"
+
+using namespace std;
+
+const double tolerance = 1e-12;
+
+struct Result
+{
+  long n = 0;
+  double maxerr = 0;
+  double t_native = 0;
+  double t_gsl = 0;
+  double sum_native = 0;  // accumulate the values, so the compiler can't skip the calls
+  double sum_gsl = 0;
+};
+
+void Report(string name, Result& r)
+{
+  cout << setw(6) << name << setw(12) << r.n << setw(14) << r.maxerr
+       << setw(12) << r.t_gsl << setw(12) << r.t_native << setw(10) << setprecision(3) << r.t_gsl/r.t_native << setprecision(6)
+       << (r.maxerr>tolerance ? "   FAIL" : "   ok") << endl;
+}
+
+int main(int argc, char** argv)
+{
+  int twojmax = argc>1 ? atoi(argv[1]) : 21;
+  int emax = argc>2 ? atoi(argv[2]) : 16;
+  int e3max = argc>3 ? atoi(argv[3]) : 3*emax;
+  cout << "Comparing to GSL with 2j <= " << twojmax << endl;
+  cout << setw(6) << "symbol" << setw(12) << "number" << setw(14) << "max error"
+       << setw(12) << "t_gsl" << setw(12) << "t_native" << setw(10) << "speedup" << endl;
+
+  // 3j and CG
+  Result r3j;
+  for (int j1=0; j1<=twojmax; ++j1)
+  {
+   for (int j2=0; j2<=twojmax; ++j2)
+   {
+    for (int j3=abs(j1-j2); j3<=min(j1+j2,twojmax); j3+=2)
+    {
+     vector<double> gsl_vals, native_vals;
+     double t = omp_get_wtime();
+     for (int m1=-j1; m1<=j1; m1+=2)
+      for (int m2=-j2; m2<=j2; m2+=2)
+        gsl_vals.push_back( gsl_sf_coupling_3j(j1,j2,j3,m1,m2,-m1-m2) );
+     r3j.t_gsl += omp_get_wtime() - t;
+     t = omp_get_wtime();
+     for (int m1=-j1; m1<=j1; m1+=2)
+      for (int m2=-j2; m2<=j2; m2+=2)
+        native_vals.push_back( AngMom::ThreeJ_int(j1,j2,j3,m1,m2,-m1-m2) );
+     r3j.t_native += omp_get_wtime() - t;
+     for (size_t i=0; i<gsl_vals.size(); ++i)
+     {
+       r3j.maxerr = max(r3j.maxerr, abs(gsl_vals[i]-native_vals[i]));
+       r3j.sum_gsl += gsl_vals[i];
+       r3j.sum_native += native_vals[i];
+     }
+     r3j.n += gsl_vals.size();
+    }
+   }
+  }
+  Report("3j",r3j);
+
+  // 6j, using the batch call for the last argument
+  Result r6j, r6jb;
+  for (int j1=0; j1<=twojmax; ++j1)
+  {
+   for (int j2=0; j2<=twojmax; ++j2)
+   {
+    for (int j3=abs(j1-j2); j3<=min(j1+j2,twojmax); j3+=2)
+    {
+     for (int j4=0; j4<=twojmax; ++j4)
+     {
+      for (int j5=abs(j4-j3)%2; j5<=twojmax; j5+=2)
+      {
+       if (j3<abs(j4-j5) or j3>j4+j5) continue;
+       int j6min = max(abs(j1-j5),abs(j4-j2));
+       int j6max = min(j1+j5,j4+j2);
+       if (j6max<j6min) continue;
+       int n6 = (j6max-j6min)/2+1;
+       vector<double> gsl_vals(n6), native_vals(n6), batch_vals(n6);
+       double t = omp_get_wtime();
+       for (int k=0; k<n6; ++k) gsl_vals[k] = gsl_sf_coupling_6j(j1,j2,j3,j4,j5,j6min+2*k);
+       r6j.t_gsl += omp_get_wtime() - t;
+       t = omp_get_wtime();
+       for (int k=0; k<n6; ++k) native_vals[k] = AngMom::SixJ_int(j1,j2,j3,j4,j5,j6min+2*k);
+       r6j.t_native += omp_get_wtime() - t;
+       t = omp_get_wtime();
+       AngMom::SixJ_Batch(0.5*j1,0.5*j2,0.5*j3,0.5*j4,0.5*j5,0.5*j6min,0.5*j6max,&batch_vals[0]);
+       r6jb.t_native += omp_get_wtime() - t;
+       for (int k=0; k<n6; ++k)
+       {
+         r6j.maxerr = max(r6j.maxerr, abs(gsl_vals[k]-native_vals[k]));
+         r6jb.maxerr = max(r6jb.maxerr, abs(gsl_vals[k]-batch_vals[k]));
+         r6j.sum_gsl += gsl_vals[k];
+         r6j.sum_native += native_vals[k];
+         r6jb.sum_native += batch_vals[k];
+       }
+       r6j.n += n6;
+      }
+     }
+    }
+   }
+  }
+  r6jb.n = r6j.n;
+  r6jb.t_gsl = r6j.t_gsl;
+  Report("6j",r6j);
+  Report("6j(b)",r6jb);
+
+  // 6j as they are stored by ModelSpace::PreCalculateSixJ(): { j1 j2 J ; j3 j4 J' } with half-integer
+  // j1..j3 up to 2*emax+1 and j4 as large as a three-body J. This is where the symbols get largest,
+  // so the cancellations in the sum are worst. There are too many to compare all of them with GSL,
+  // so every stride-th block of the table is checked.
+  Result r6jt;
+  int twoj_table = 2*emax+1;
+  int twoJ3_table = max( twoj_table, min(3*twoj_table, 2*e3max+3) );
+  int nj = (twoj_table+1)/2;
+  int nJ3 = (twoJ3_table+1)/2;
+  size_t nblocks = nj*nj*nj*nJ3;
+  size_t stride = max( (size_t)1, nblocks/20000 ) | 1;
+  cout << "Table 6j with 2j <= " << twoj_table << " and 2J3 <= " << twoJ3_table << ", checking every " << stride << "th block" << endl;
+  for (size_t iblock=nblocks-1; iblock<nblocks; iblock-=min(stride,iblock+1)) // start from the largest j's
+  {
+    int a = 2*(iblock/(nJ3*nj*nj))+1;
+    int b = 2*((iblock/(nJ3*nj))%nj)+1;
+    int c = 2*((iblock/nJ3)%nj)+1;
+    int d = 2*(iblock%nJ3)+1;
+    int Jmin  = max( abs(a-b), abs(c-d) )/2;
+    int Jmax  = min( a+b, c+d )/2;
+    int Jpmin = max( abs(a-d), abs(c-b) )/2;
+    int Jpmax = min( a+d, c+b )/2;
+    if (Jmax<Jmin or Jpmax<Jpmin) continue;
+    int nJp = Jpmax-Jpmin+1;
+    vector<double> gsl_vals(nJp), batch_vals(nJp);
+    for (int J=Jmin; J<=Jmax; ++J)
+    {
+      double t = omp_get_wtime();
+      for (int k=0; k<nJp; ++k) gsl_vals[k] = gsl_sf_coupling_6j(a,b,2*J,c,d,2*(Jpmin+k));
+      r6jt.t_gsl += omp_get_wtime() - t;
+      t = omp_get_wtime();
+      AngMom::SixJ_Batch(0.5*a, 0.5*b, J, 0.5*c, 0.5*d, Jpmin, Jpmax, &batch_vals[0]);
+      r6jt.t_native += omp_get_wtime() - t;
+      for (int k=0; k<nJp; ++k)
+      {
+        r6jt.maxerr = max(r6jt.maxerr, abs(gsl_vals[k]-batch_vals[k]));
+        r6jt.sum_gsl += gsl_vals[k];
+        r6jt.sum_native += batch_vals[k];
+      }
+      r6jt.n += nJp;
+    }
+  }
+  Report("6j(t)",r6jt);
+
+  // 9j, with half-integer j1..j4 as they appear in recoupling
+  Result r9j, r9jb;
+  int twoj9max = min(twojmax,11);
+  for (int a=1; a<=twoj9max; a+=2)
+  {
+   for (int b=1; b<=twoj9max; b+=2)
+   {
+    for (int c=1; c<=twoj9max; c+=2)
+    {
+     for (int d=1; d<=twoj9max; d+=2)
+     {
+      for (int J12=abs(a-b); J12<=a+b; J12+=2)
+      {
+       for (int J34=abs(c-d); J34<=c+d; J34+=2)
+       {
+        for (int J13=abs(a-c); J13<=a+c; J13+=2)
+        {
+         for (int J24=abs(b-d); J24<=b+d; J24+=2)
+         {
+           int Jmin = max(abs(J12-J34),abs(J13-J24));
+           int Jmax = min(J12+J34,J13+J24);
+           if (Jmax<Jmin) continue;
+           int n9 = (Jmax-Jmin)/2+1;
+           vector<double> gsl_vals(n9), native_vals(n9), batch_vals(n9);
+           double t = omp_get_wtime();
+           for (int k=0; k<n9; ++k) gsl_vals[k] = gsl_sf_coupling_9j(a,b,J12,c,d,J34,J13,J24,Jmin+2*k);
+           r9j.t_gsl += omp_get_wtime() - t;
+           t = omp_get_wtime();
+           for (int k=0; k<n9; ++k) native_vals[k] = AngMom::NineJ_int(a,b,J12,c,d,J34,J13,J24,Jmin+2*k);
+           r9j.t_native += omp_get_wtime() - t;
+           t = omp_get_wtime();
+           AngMom::NineJ_Batch(0.5*a,0.5*b,0.5*J12,0.5*c,0.5*d,0.5*J34,0.5*J13,0.5*J24,0.5*Jmin,0.5*Jmax,&batch_vals[0]);
+           r9jb.t_native += omp_get_wtime() - t;
+           for (int k=0; k<n9; ++k)
+           {
+             r9j.maxerr = max(r9j.maxerr, abs(gsl_vals[k]-native_vals[k]));
+             r9jb.maxerr = max(r9jb.maxerr, abs(gsl_vals[k]-batch_vals[k]));
+             r9j.sum_gsl += gsl_vals[k];
+             r9j.sum_native += native_vals[k];
+             r9jb.sum_native += batch_vals[k];
+           }
+           r9j.n += n9;
+         }
+        }
+       }
+      }
+     }
+    }
+   }
+  }
+  r9jb.n = r9j.n;
+  r9jb.t_gsl = r9j.t_gsl;
+  Report("9j",r9j);
+  Report("9j(b)",r9jb);
+
+  cout << "checksums (gsl,native): " << r3j.sum_gsl << " " << r3j.sum_native << "  "
+       << r6j.sum_gsl << " " << r6j.sum_native << " " << r6jb.sum_native << "  "
+       << r6jt.sum_gsl << " " << r6jt.sum_native << "  "
+       << r9j.sum_gsl << " " << r9j.sum_native << " " << r9jb.sum_native << endl;
+
+  bool passed = r3j.maxerr<tolerance and r6j.maxerr<tolerance and r6jb.maxerr<tolerance and r6jt.maxerr<tolerance
+                and r9j.maxerr<tolerance and r9jb.maxerr<tolerance;
+  cout << (passed ? "All symbols agree with GSL." : "Some symbols disagree with GSL!") << endl;
+  return passed ? 0 : 1;
+}
@@ -271,9 +271,9 @@ int main(int argc, char** argv)
 
   
 
+  if (basis == "HF") ops = hf.TransformToHFBasis(ops);
   for (auto& op : ops)
   {
-     if (basis == "HF") op = hf.TransformToHFBasis(op);
      op = op.DoNormalOrdering();
      if (method == "MP3")
      {
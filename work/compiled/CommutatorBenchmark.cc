@@ -0,0 +1,428 @@
+// Time the commutator kernels, BCH, the Pandya transformations and Hartree-Fock iterations
+// on synthetic operators, so that no interaction files are needed.
+// The operators are filled with random matrix elements from a fixed seed, so every run sees the same numbers.
+//
+// Usage: CommutatorBenchmark [emax_max=4] [reps=3] [output=commutator_benchmark.json] [baseline=old.json] ...
+//   emax_max       largest emax to run. Every emax from 2 up to this is done.
+//   reps           timed calls of each kernel, after one untimed warm-up call
+//   output         file to write the results to, as JSON
+//   baseline       results of an earlier run to compare with
+//   tolerance      allowed slowdown relative to the baseline, e.g. 0.2 means 20% (default 0.2)
+//   checksum_tolerance  allowed relative change of the checksums relative to the baseline (default 1e-8)
+//   min_compare_time    kernels faster than this many seconds in the baseline are too noisy to call slower (default 1e-4)
+//   reference      reference nucleus (default O16)
+//   tensor_rank    J rank of the tensor operator (default 2)
+//   hf_iterations  number of Hartree-Fock iterations to time (default 10)
+//   seed           seed for the random matrix elements (default 1)
+// Returns a nonzero exit code if a kernel got slower, or its checksum changed, compared with the baseline.
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <random>
+#include <functional>
+#include <cmath>
+#include <omp.h>
+#include "ModelSpace.hh"
+#include "Operator.hh"
+#include "HartreeFock.hh"
+#include "IMSRGProfiler.hh"
+
+using namespace std;
+
+map<string,string> options = {
+  {"emax_max",           "4"},
+  {"reps",               "3"},
+  {"output",             "commutator_benchmark.json"},
+  {"baseline",           ""},
+  {"tolerance",          "0.2"},
+  {"checksum_tolerance", "1e-8"},
+  {"min_compare_time",   "1e-4"},
+  {"reference",          "O16"},
+  {"tensor_rank",        "2"},
+  {"hf_iterations",      "10"},
+  {"seed",               "1"},
+};
+
+struct Timing
+{
+  int emax;
+  string kernel;
+  int calls;
+  double t_min;
+  double t_mean;
+  double gflop;    // per call, as counted by the profiler. 0 if the kernel doesn't count its work.
+  double checksum; // so that a faster kernel which gives different numbers doesn't pass unnoticed
+};
+
+
+// mt19937 gives the same sequence everywhere, while the standard distributions don't, so we scale it ourselves.
+double Uniform(mt19937& rng)
+{
+  return rng()/4294967296.0*2-1;
+}
+
+
+/// Fill the one and two body parts of op with random numbers in the allowed blocks.
+/// Only the upper triangles are filled here, and the (anti)symmetrizing is left to the caller.
+/// The matrix elements fall off with the energy of the orbits, a bit like a realistic interaction.
+void FillRandom(Operator& op, mt19937& rng, double scale1, double scale2)
+{
+  ModelSpace* modelspace = op.GetModelSpace();
+  int norbits = modelspace->GetNumberOrbits();
+  for (int i=0; i<norbits; ++i)
+  {
+    Orbit& oi = modelspace->GetOrbit(i);
+    for ( int j : op.OneBodyChannels.at({oi.l,oi.j2,oi.tz2}) )
+    {
+      if (j<i) continue;
+      Orbit& oj = modelspace->GetOrbit(j);
+      double ei = 2*oi.n+oi.l;
+      double ej = 2*oj.n+oj.l;
+      op.OneBody(i,j) = scale1 * Uniform(rng) / (1+0.5*(ei+ej));
+    }
+  }
+  for (auto& itmat : op.TwoBody.MatEl)
+  {
+    TwoBodyChannel& tbc_bra = modelspace->GetTwoBodyChannel(itmat.first[0]);
+    TwoBodyChannel& tbc_ket = modelspace->GetTwoBodyChannel(itmat.first[1]);
+    arma::mat& matrix = itmat.second;
+    for (arma::uword ibra=0; ibra<matrix.n_rows; ++ibra)
+    {
+      Ket& bra = tbc_bra.GetKet(ibra);
+      double ebra = bra.op->n*2+bra.op->l + bra.oq->n*2+bra.oq->l;
+      arma::uword ketmin = itmat.first[0]==itmat.first[1] ? ibra : 0;
+      for (arma::uword iket=ketmin; iket<matrix.n_cols; ++iket)
+      {
+        Ket& ket = tbc_ket.GetKet(iket);
+        double eket = ket.op->n*2+ket.op->l + ket.oq->n*2+ket.oq->l;
+        matrix(ibra,iket) = scale2 * Uniform(rng) / (1+0.25*(ebra+eket));
+      }
+    }
+  }
+  op.TwoBody.InvalidateNorm();
+}
+
+
+/// A Hamiltonian-like operator: oscillator single-particle energies on the diagonal, plus random matrix elements.
+Operator RandomHamiltonian(ModelSpace& modelspace, mt19937& rng)
+{
+  Operator H(modelspace);
+  FillRandom(H, rng, 2.0, 3.0);
+  for (int i=0; i<modelspace.GetNumberOrbits(); ++i)
+  {
+    Orbit& oi = modelspace.GetOrbit(i);
+    H.OneBody(i,i) = 0.5*modelspace.GetHbarOmega()*(2*oi.n+oi.l+1.5);
+  }
+  H.SetHermitian();
+  H.Symmetrize();
+  return H;
+}
+
+
+/// An anti-hermitian operator, like a generator, scaled to the given norm so that BCH converges in about the same number of terms for each emax.
+Operator RandomAntiHermitian(ModelSpace& modelspace, mt19937& rng, double norm)
+{
+  Operator X(modelspace);
+  FillRandom(X, rng, 1.0, 1.0);
+  X.SetAntiHermitian();
+  X.AntiSymmetrize();
+  X *= norm/X.Norm();
+  return X;
+}
+
+
+/// A hermitian tensor operator of rank J=Lambda. The diagonal channel blocks are symmetrized,
+/// the others are only stored once, with the lower blocks implied by the hermiticity.
+Operator RandomTensor(ModelSpace& modelspace, mt19937& rng, int Lambda)
+{
+  Operator T(modelspace, Lambda, 0, 0, 2);
+  FillRandom(T, rng, 1.0, 1.0);
+  T.SetHermitian();
+  T.Symmetrize();
+  for (auto& itmat : T.TwoBody.MatEl)
+  {
+    if (itmat.first[0]==itmat.first[1]) itmat.second = arma::symmatu(itmat.second);
+  }
+  T.TwoBody.InvalidateNorm();
+  return T;
+}
+
+
+/// Sum of squares of all the matrix elements, plus the zero body part
+double Checksum(const Operator& op)
+{
+  double sum = op.ZeroBody + arma::accu(op.OneBody % op.OneBody);
+  for (auto& itmat : op.TwoBody.MatEl) sum += arma::accu(itmat.second % itmat.second);
+  return sum;
+}
+
+
+/// Run setup() then kernel() once to warm up, and then reps more times, timing only the calls to kernel().
+/// scope_name is the name of the kernel's IMSRGProfiler::Scope, which is where its flops are counted.
+Timing TimeKernel(int emax, string name, string scope_name, int reps, function<void()> setup, function<void()> kernel, function<double()> checksum)
+{
+  setup();
+  kernel();
+  double flops_before = IMSRGProfiler::flops[scope_name];
+  Timing timing = {emax, name, reps, 1e99, 0, 0, 0};
+  for (int rep=0; rep<reps; ++rep)
+  {
+    setup();
+    double t_start = omp_get_wtime();
+    kernel();
+    double t = omp_get_wtime() - t_start;
+    timing.t_min = min(timing.t_min, t);
+    timing.t_mean += t/reps;
+  }
+  timing.gflop = (IMSRGProfiler::flops[scope_name] - flops_before) / reps * 1e-9;
+  timing.checksum = checksum();
+  cout << setw(6) << emax << "  " << setw(36) << left << name << right
+       << setw(12) << setprecision(4) << timing.t_min << setw(12) << timing.t_mean
+       << setw(12) << (timing.gflop>0 ? timing.gflop/timing.t_min : 0) << endl;
+  return timing;
+}
+
+
+/// Z set up for the result of [X,Y] the same way Operator::CommutatorScalarScalar and CommutatorScalarTensor do it.
+void PrepareCommutator(Operator& Z, const Operator& X, const Operator& Y)
+{
+  Z = Y;
+  Z.EraseZeroBody();
+  Z.EraseOneBody();
+  Z.EraseTwoBody();
+  if ( (X.IsHermitian() and Y.IsHermitian()) or (X.IsAntiHermitian() and Y.IsAntiHermitian()) ) Z.SetAntiHermitian();
+  else if ( (X.IsHermitian() and Y.IsAntiHermitian()) or (X.IsAntiHermitian() and Y.IsHermitian()) ) Z.SetHermitian();
+  else Z.SetNonHermitian();
+}
+
+
+vector<Timing> RunEmax(int emax, mt19937& rng)
+{
+  int reps = atoi(options["reps"].c_str());
+  int Lambda = atoi(options["tensor_rank"].c_str());
+  vector<Timing> timings;
+
+  ModelSpace modelspace(emax, options["reference"]);
+  modelspace.SetHbarOmega(20);
+  modelspace.PreCalculateSixJ();
+  modelspace.PreCalculateNineJ(Lambda);
+
+  Operator H = RandomHamiltonian(modelspace, rng);
+  Operator Eta = RandomAntiHermitian(modelspace, rng, 0.1);
+  Operator Omega = RandomAntiHermitian(modelspace, rng, 0.25);
+  Operator T = RandomTensor(modelspace, rng, Lambda);
+  Operator Z(H);
+  Operator Zt(T);
+  cout << "emax = " << emax << "  orbits = " << modelspace.GetNumberOrbits() << "  kets = " << modelspace.GetNumberKets()
+       << "  size of H = " << H.Size()/1048576. << " MB" << endl;
+
+  auto setup_ss = [&](){ PrepareCommutator(Z, Eta, H); };
+  auto setup_st = [&](){ PrepareCommutator(Zt, Eta, T); };
+  auto sum_ss = [&](){ return Checksum(Z); };
+  auto sum_st = [&](){ return Checksum(Zt); };
+
+  // scalar-scalar kernels
+  timings.push_back( TimeKernel(emax, "comm110ss", "comm110ss", reps, setup_ss, [&](){ Z.comm110ss(Eta,H); }, sum_ss) );
+  timings.push_back( TimeKernel(emax, "comm220ss", "comm220ss", reps, setup_ss, [&](){ Z.comm220ss(Eta,H); }, sum_ss) );
+  timings.push_back( TimeKernel(emax, "comm111ss", "comm111ss", reps, setup_ss, [&](){ Z.comm111ss(Eta,H); }, sum_ss) );
+  timings.push_back( TimeKernel(emax, "comm121ss", "comm121ss", reps, setup_ss, [&](){ Z.comm121ss(Eta,H); }, sum_ss) );
+  timings.push_back( TimeKernel(emax, "comm122ss", "comm122ss", reps, setup_ss, [&](){ Z.comm122ss(Eta,H); }, sum_ss) );
+  timings.push_back( TimeKernel(emax, "comm222_pp_hh_221ss", "comm222_pp_hh_221ss", reps, setup_ss, [&](){ Z.comm222_pp_hh_221ss(Eta,H); }, sum_ss) );
+  timings.push_back( TimeKernel(emax, "comm222_phss", "comm222_phss", reps, setup_ss, [&](){ Z.comm222_phss(Eta,H); }, sum_ss) );
+  timings.push_back( TimeKernel(emax, "CommutatorScalarScalar", "CommutatorScalarScalar", reps, [](){}, [&](){ Z.CommutatorScalarScalar(Eta,H); }, sum_ss) );
+
+  // scalar-tensor kernels
+  timings.push_back( TimeKernel(emax, "comm111st", "comm111st", reps, setup_st, [&](){ Zt.comm111st(Eta,T); }, sum_st) );
+  timings.push_back( TimeKernel(emax, "comm121st", "comm121st", reps, setup_st, [&](){ Zt.comm121st(Eta,T); }, sum_st) );
+  timings.push_back( TimeKernel(emax, "comm122st", "comm122st", reps, setup_st, [&](){ Zt.comm122st(Eta,T); }, sum_st) );
+  timings.push_back( TimeKernel(emax, "comm222_pp_hh_221st", "comm222_pp_hh_221st", reps, setup_st, [&](){ Zt.comm222_pp_hh_221st(Eta,T); }, sum_st) );
+  timings.push_back( TimeKernel(emax, "comm222_phst", "comm222_phst", reps, setup_st, [&](){ Zt.comm222_phst(Eta,T); }, sum_st) );
+  timings.push_back( TimeKernel(emax, "CommutatorScalarTensor", "CommutatorScalarTensor", reps, [](){}, [&](){ Zt.CommutatorScalarTensor(Eta,T); }, sum_st) );
+
+  // Pandya transformations
+  size_t nch = modelspace.GetNumberTwoBodyChannels();
+  deque<arma::mat> H_bar, Eta_bar, Z_bar;
+  auto sum_bar = [](deque<arma::mat>& bar){ double sum=0; for (auto& m : bar) sum += arma::accu(m%m); return sum; };
+  timings.push_back( TimeKernel(emax, "DoPandyaTransformation(normal)", "DoPandyaTransformation", reps,
+                                [&](){ H_bar = H.InitializePandya(nch,"normal"); }, [&](){ H.DoPandyaTransformation(H_bar,"normal"); },
+                                [&](){ return sum_bar(H_bar); }) );
+  timings.push_back( TimeKernel(emax, "DoPandyaTransformation(transpose)", "DoPandyaTransformation", reps,
+                                [&](){ Eta_bar = Eta.InitializePandya(nch,"transpose"); }, [&](){ Eta.DoPandyaTransformation(Eta_bar,"transpose"); },
+                                [&](){ return sum_bar(Eta_bar); }) );
+  Z_bar.resize(nch);
+  for (int ch : modelspace.SortedTwoBodyChannels_CC) Z_bar[ch] = Eta_bar[ch] * H_bar[ch];
+  timings.push_back( TimeKernel(emax, "InversePandyaTransformation", "InversePandyaTransformation", reps,
+                                [&](){ Z.Erase(); }, [&](){ Z.AddInversePandyaTransformation(Z_bar); }, sum_ss) );
+
+  map<array<int,2>,arma::mat> T_bar, Zt_bar;
+  timings.push_back( TimeKernel(emax, "DoTensorPandyaTransformation", "DoTensorPandyaTransformation", reps,
+                                [&](){ T_bar.clear(); }, [&](){ T.DoTensorPandyaTransformation(T_bar); },
+                                [&](){ double sum=0; for (auto& it : T_bar) sum += arma::accu(it.second%it.second); return sum; }) );
+  for (auto& it : T_bar) Zt_bar[it.first] = Eta_bar[it.first[0]] * it.second;
+  timings.push_back( TimeKernel(emax, "InverseTensorPandyaTransformation", "InverseTensorPandyaTransformation", reps,
+                                [&](){ Zt.Erase(); }, [&](){ Zt.AddInverseTensorPandyaTransformation(Zt_bar); }, sum_st) );
+
+  // BCH
+  Operator Hs(H);
+  Operator Omega_new(Omega);
+  timings.push_back( TimeKernel(emax, "BCH_Transform", "BCH_Transform", reps, [](){}, [&](){ Hs = H.BCH_Transform(Eta); }, [&](){ return Checksum(Hs); }) );
+  timings.push_back( TimeKernel(emax, "BCH_Product", "BCH_Product", reps, [](){}, [&](){ Omega_new = Eta.BCH_Product(Omega); }, [&](){ return Checksum(Omega_new); }) );
+
+  // Hartree-Fock. The random H won't necessarily converge, so we time a fixed number of iterations.
+  int hf_iterations = atoi(options["hf_iterations"].c_str());
+  HartreeFock* hf = NULL;
+  timings.push_back( TimeKernel(emax, "HartreeFock setup", "HartreeFock setup", 1,
+                                [&](){ delete hf; hf = NULL; }, [&](){ hf = new HartreeFock(H); }, [&](){ return arma::accu(hf->F%hf->F); }) );
+  timings.push_back( TimeKernel(emax, "HartreeFock iteration", "HartreeFock iteration", hf_iterations, [](){},
+                                [&](){ hf->Diagonalize(); hf->ReorderCoefficients(); hf->UpdateDensityMatrix(); hf->UpdateF(); },
+                                [&](){ return arma::accu(hf->F%hf->F); }) );
+  delete hf;
+
+  return timings;
+}
+
+
+void WriteJSON(string filename, vector<Timing>& timings)
+{
+  ofstream outfile(filename);
+  if (not outfile.good())
+  {
+    cout << "Trouble opening " << filename << " for writing" << endl;
+    return;
+  }
+  outfile << setprecision(10);
+  outfile << "{" << endl;
+  outfile << "  \"benchmark\": \"CommutatorBenchmark\"," << endl;
+  for (auto& opt : options)
+  {
+    if (opt.first=="output" or opt.first=="baseline") continue;
+    outfile << "  \"" << opt.first << "\": \"" << opt.second << "\"," << endl;
+  }
+  outfile << "  \"threads\": " << omp_get_max_threads() << "," << endl;
+  outfile << "  \"results\": [" << endl;
+  // one result per line, which ReadBaseline relies on
+  for (size_t i=0; i<timings.size(); ++i)
+  {
+    Timing& t = timings[i];
+    outfile << "    {\"emax\": " << t.emax << ", \"kernel\": \"" << t.kernel << "\", \"calls\": " << t.calls
+            << ", \"t_min\": " << t.t_min << ", \"t_mean\": " << t.t_mean << ", \"gflop\": " << t.gflop
+            << ", \"checksum\": " << t.checksum << "}" << (i+1<timings.size() ? "," : "") << endl;
+  }
+  outfile << "  ]" << endl;
+  outfile << "}" << endl;
+  cout << "Wrote " << filename << endl;
+}
+
+
+string JSONField(string& line, string key)
+{
+  size_t pos = line.find("\"" + key + "\":");
+  if (pos == string::npos) return "";
+  pos = line.find_first_not_of(" \"", pos + key.size() + 3);
+  size_t end = line.find_first_of(",}\"", pos);
+  return line.substr(pos, end-pos);
+}
+
+
+/// Read the results from a file written by WriteJSON, keyed by emax and kernel name.
+map<string,Timing> ReadBaseline(string filename)
+{
+  map<string,Timing> baseline;
+  ifstream infile(filename);
+  if (not infile.good())
+  {
+    cout << "Trouble reading baseline file " << filename << endl;
+    return baseline;
+  }
+  string line;
+  while (getline(infile,line))
+  {
+    if (line.find("\"kernel\":") == string::npos) continue;
+    Timing t;
+    t.emax = atoi(JSONField(line,"emax").c_str());
+    t.kernel = JSONField(line,"kernel");
+    t.calls = atoi(JSONField(line,"calls").c_str());
+    t.t_min = atof(JSONField(line,"t_min").c_str());
+    t.t_mean = atof(JSONField(line,"t_mean").c_str());
+    t.gflop = atof(JSONField(line,"gflop").c_str());
+    t.checksum = atof(JSONField(line,"checksum").c_str());
+    baseline[to_string(t.emax) + " " + t.kernel] = t;
+  }
+  return baseline;
+}
+
+
+/// Compare with the baseline. Returns the number of kernels which got slower or changed their results.
+int CompareBaseline(vector<Timing>& timings, map<string,Timing>& baseline)
+{
+  double tolerance = atof(options["tolerance"].c_str());
+  double checksum_tolerance = atof(options["checksum_tolerance"].c_str());
+  double min_compare_time = atof(options["min_compare_time"].c_str());
+  int nfail = 0;
+  cout << endl << "Comparing with " << options["baseline"] << "  (allowed slowdown " << 100*tolerance << "%)" << endl;
+  cout << setw(6) << "emax" << "  " << setw(36) << left << "kernel" << right << setw(12) << "baseline" << setw(12) << "now"
+       << setw(10) << "ratio" << endl;
+  for (auto& t : timings)
+  {
+    auto it = baseline.find(to_string(t.emax) + " " + t.kernel);
+    if (it == baseline.end()) continue;
+    Timing& b = it->second;
+    double ratio = t.t_min / b.t_min;
+    double checksum_diff = abs(t.checksum - b.checksum) / max(abs(b.checksum), 1e-300);
+    string status = "ok";
+    if (ratio > 1+tolerance) status = b.t_min < min_compare_time ? "ok (too short to tell)" : "SLOWER";
+    if (checksum_diff > checksum_tolerance) status = "CHANGED";
+    if (status.substr(0,2) != "ok") nfail++;
+    cout << setw(6) << t.emax << "  " << setw(36) << left << t.kernel << right << setw(12) << setprecision(4) << b.t_min
+         << setw(12) << t.t_min << setw(10) << setprecision(3) << ratio << "   " << status;
+    if (checksum_diff > checksum_tolerance) cout << " (checksum " << setprecision(10) << b.checksum << " -> " << t.checksum << ")";
+    cout << endl;
+  }
+  cout << (nfail==0 ? "No regressions." : to_string(nfail) + " regressions!") << endl;
+  return nfail;
+}
+
+
+int main(int argc, char** argv)
+{
+  for (int iarg=1; iarg<argc; ++iarg)
+  {
+    string arg = argv[iarg];
+    size_t eq = arg.find("=");
+    if (eq==string::npos or options.find(arg.substr(0,eq))==options.end())
+    {
+      cout << "Unknown option " << arg << ". Options are:";
+      for (auto& opt : options) cout << " " << opt.first;
+      cout << endl;
+      return 1;
+    }
+    options[arg.substr(0,eq)] = arg.substr(eq+1);
+  }
+
+  int emax_max = atoi(options["emax_max"].c_str());
+  mt19937 rng( atoi(options["seed"].c_str()) );
+  vector<Timing> timings;
+  cout << setw(6) << "emax" << "  " << setw(36) << left << "kernel" << right << setw(12) << "t_min (s)" << setw(12) << "t_mean (s)"
+       << setw(12) << "GFLOP/s" << endl;
+  for (int emax=2; emax<=emax_max; ++emax)
+  {
+    vector<Timing> t = RunEmax(emax, rng);
+    timings.insert(timings.end(), t.begin(), t.end());
+  }
+
+  if (options["output"] != "") WriteJSON(options["output"], timings);
+
+  if (options["baseline"] != "")
+  {
+    map<string,Timing> baseline = ReadBaseline(options["baseline"]);
+    if (baseline.empty()) return 1;
+    return CompareBaseline(timings, baseline)>0 ? 1 : 0;
+  }
+  return 0;
+}
@@ -12,23 +12,33 @@ double DF = 0.033; // Darwin-Foldy correction to the charge radius
 class Parameters
 {
  public:
-  static map<string,string> string_par;
-  static map<string,double> double_par;
-  static map<string,int> int_par;
-  static map<string,vector<string>> vec_par;
-
-  Parameters(){};
+  // The defaults. Each Parameters starts from a copy of these, so that several sets
+  // (e.g. the jobs of an ensemble) can be kept at the same time.
+  static map<string,string> default_string_par;
+  static map<string,double> default_double_par;
+  static map<string,int> default_int_par;
+  static map<string,vector<string>> default_vec_par;
+
+  map<string,string> string_par;
+  map<string,double> double_par;
+  map<string,int> int_par;
+  map<string,vector<string>> vec_par;
+
+  Parameters();
   Parameters(int, char**);
   void ParseCommandLineArgs(int, char**);
+  void ParseArgs(vector<string>);
+  void ParseJob(string);
   string s(string);
   double d(string);
   int i(string);
   vector<string> v(string);
   string DefaultFlowFile();
   string DefaultIntFile();
+  string JobFileName(string);
 };
 
-map<string,string> Parameters::string_par = {
+map<string,string> Parameters::default_string_par = {
   {"2bme",			"/itch/exch/BlockGen/me2j/chi2b_srg0800_eMax12_lMax10_hwHO020.me2j.gz"},
   {"3bme",			"none"},
   {"core_generator",		"atan"},	// generator used for core part of 2-step decoupling
@@ -45,10 +55,21 @@ map<string,string> Parameters::string_par = {
   {"scratch",			""},    // scratch directory for writing operators in binary format
   {"use_brueckner_bch",          "false"}, // switch to Brueckner version of BCH
   {"valence_file_format",       "nushellx"}, // file format for valence space interaction
+  {"mosh_cache",		""},	// directory to keep the Moshinsky brackets between runs
+  {"hf_convergence",		"none"},	// Hartree-Fock acceleration: none (plain iteration), diis, mixing or levelshift
+  {"hf_fallback",		"mixing"},	// used by diis before it has enough iterations, or if the extrapolation fails
+  {"jobs",			""},	// ensemble mode: file with one job per line, given as parameter=value overrides
+  {"hf_input",			""},	// start Hartree-Fock from a state saved in this file (possibly from a smaller emax)
+  {"hf_output",			""},	// save the Hartree-Fock state to this file
+  {"checkpoint",		""},	// write checkpoints of the IMSRG flow to this file
+  {"restart",			""},	// continue the IMSRG flow from this checkpoint
+  {"profile_trace",		""},	// write a timeline of the nested timers to this file, for chrome://tracing or Perfetto
+  {"profile_flamegraph",	""},	// write the nested timers as collapsed stacks to this file, for flamegraph.pl or speedscope
+  {"flowfile_memory",		"false"},	// also write the memory of the Omegas, the flowing operators and the commutator scratch to the flowfile
 };
 
 
-map<string,double> Parameters::double_par = {
+map<string,double> Parameters::default_double_par = {
   {"hw",		20.0},
   {"smax",		20.0},	// maximum s. If we reach this,	terminate even if we're not converged.
   {"dsmax",		0.5},	// maximum step size
@@ -56,16 +77,27 @@ map<string,double> Parameters::double_par = {
   {"domega",		0.5},	// max for norm of eta * ds
   {"omega_norm_max",	0.25},	 // norm of omega before we do the splitting
   {"ode_tolerance",	1e-6},	// error tolerance for the ode solver
+  {"magnus_tolerance",	1e-4},	// error allowed per step in E0 and Omega for method=magnus_rkmk4
+  {"extrapolation_tolerance",	0},	// stop the flow once the extrapolated remaining change in E0 is below this. 0 to turn off
+  {"omega_sparsify_threshold",	0},	// experimental: drop elements of a finished Omega below this times its largest element. 0 to turn off
+  {"sparse_fill_cutoff",	0.3},	// channels of a sparsified Omega with less than this fraction of nonzero elements use sparse products
   {"denominator_delta",	0},	// offset added to the denominator in the generator
   {"BetaCM",0}, // Prefactor for Lawson-Glockner term
+  {"hf_mixing",0.5}, // fraction of the new Fock matrix kept with mixing
+  {"hf_level_shift",1.0}, // shift (in MeV) of the unoccupied orbits with levelshift
+  {"checkpoint_walltime",0}, // also write a checkpoint when this many seconds have passed since the last one
+  {"peak_gflops",0}, // peak GFLOP/s of the machine, for the roofline summary. 0 means unknown
+  {"peak_bandwidth",0}, // peak memory bandwidth of the machine in GB/s, for the roofline summary
 
 };
 
-map<string,int> Parameters::int_par = {
+map<string,int> Parameters::default_int_par = {
   {"A",	-1},	// Aeff for kinetic energy. -1 means take A of reference
   {"e3max",		12},	
   {"emax",		6},
   {"lmax3",		-1}, // lmax for the 3body interaction
+  {"e3max_bra",		-1}, // separate e3max for the bra and ket of the 3body interaction. -1 means use e3max
+  {"e3max_ket",		-1},
   {"nsteps",		-1},	// do the decoupling in 1 step or core-then-valence. -1 means default
   {"file2e1max",	12},
   {"file2e2max",	24},
@@ -73,23 +105,38 @@ map<string,int> Parameters::int_par = {
   {"file3e1max",	12},
   {"file3e2max",	24},
   {"file3e3max",	12},
+  {"h5chunk",		0},	// rows of the 3N hdf5 file read per slab. 0 means match the dataset chunking
+  {"hf_diis_vectors",	8},	// number of previous Fock matrices used in the DIIS extrapolation
+  {"checkpoint_interval",	10},	// write a checkpoint every this many steps of the flow. 0 means only use checkpoint_walltime
+  {"ensemble_jobs",	1},	// in ensemble mode, run this many jobs at the same time, splitting the threads between them
+  {"emax_seed",		-1},	// first do the flow with this smaller emax and start the full flow from its Omega. -1 means don't
 };
 
-map<string,vector<string>> Parameters::vec_par = {
+map<string,vector<string>> Parameters::default_vec_par = {
  {"Operators", {} },
 };
 
 
+Parameters::Parameters()
+ : string_par(default_string_par), double_par(default_double_par),
+   int_par(default_int_par), vec_par(default_vec_par)
+{}
+
 Parameters::Parameters(int argc, char** argv)
+ : Parameters()
 {
   ParseCommandLineArgs(argc, argv);
 } 
 
 void Parameters::ParseCommandLineArgs(int argc, char** argv)
 {
-  for (int iarg=1; iarg<argc; ++iarg)
+  ParseArgs( vector<string>(argv+1, argv+argc) );
+}
+
+void Parameters::ParseArgs(vector<string> args)
+{
+  for (auto& arg : args)
   {
-    string arg = argv[iarg];
     size_t pos = arg.find("=");
     string var = arg.substr(0,pos);
     string val = arg.substr(pos+1);
@@ -133,6 +180,33 @@ void Parameters::ParseCommandLineArgs(int argc, char** argv)
   if (string_par["intfile"]=="default") string_par["intfile"] = DefaultIntFile();
 }
 
+/// Apply the parameter=value overrides for one job of an ensemble, separated by whitespace.
+/// The flow file and interaction file names follow the new parameters, unless they were set explicitly,
+/// and lists (e.g. Operators) given for the job replace the ones from the command line.
+/// The checkpoint and HF state files given on the command line get the job's parameters
+/// added to them with JobFileName(), unless the job sets its own.
+void Parameters::ParseJob(string job)
+{
+  if (string_par["flowfile"] == DefaultFlowFile()) string_par["flowfile"] = "default";
+  if (string_par["intfile"] == DefaultIntFile()) string_par["intfile"] = "default";
+  vector<string> per_job_files = {"checkpoint","restart","hf_input","hf_output"};
+  istringstream ss(job);
+  vector<string> args;
+  string arg;
+  while (ss >> arg)
+  {
+    args.push_back(arg);
+    string var = arg.substr(0,arg.find("="));
+    if (vec_par.find(var) != vec_par.end()) vec_par[var].clear();
+    per_job_files.erase( remove(per_job_files.begin(), per_job_files.end(), var), per_job_files.end() );
+  }
+  ParseArgs(args);
+  for (auto& var : per_job_files)
+  {
+    if (string_par[var] != "") string_par[var] = JobFileName(string_par[var]);
+  }
+}
+
 string Parameters::s(string key)
 {
   return string_par[key];
@@ -164,4 +238,16 @@ string Parameters::DefaultIntFile()
   return string(strbuf);
 }
 
+/// fname with the method, reference, valence space, hw, emax and A put in front of the extension,
+/// e.g. ck.bin -> ck_magnus_Ca48_Ca48_hw20_e10_A48.bin, so the jobs of an ensemble don't share files.
+string Parameters::JobFileName(string fname)
+{
+  char strbuf[200];
+  sprintf(strbuf, "_%s_%s_%s_hw%.0f_e%d_A%d",string_par["method"].c_str(),string_par["reference"].c_str(),string_par["valence_space"].c_str(),double_par["hw"],int_par["emax"],int_par["A"]);
+  size_t dot = fname.find_last_of(".");
+  size_t slash = fname.find_last_of("/");
+  if (dot == string::npos or (slash != string::npos and dot < slash)) return fname + strbuf;
+  return fname.substr(0,dot) + strbuf + fname.substr(dot);
+}
+
 
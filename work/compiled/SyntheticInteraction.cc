@@ -0,0 +1,358 @@
+// Write synthetic two- and three-body interaction files in every format ReadWrite can read, and time reading them back.
+// The matrix elements are pseudo-random numbers fixed by the quantum numbers and the seed, which fall off with
+// the oscillator energy and vanish where antisymmetry requires, so the files look like real ones to the readers
+// but can be made at any emax/E3max without an external interaction.
+//
+// Usage: SyntheticInteraction [emax=4] [E3max=4] [formats=me2j,me2j.gz,...] [mode=both] ...
+//   emax         emax of the files and of the model space
+//   e2max        e2max of the two-body files (default 2*emax)
+//   lmax         lmax of the two-body files (default emax)
+//   E3max        E3max of the three-body files. Negative means no three-body files.
+//   formats      comma-separated list from me2j, me2j.gz, me2j.bin, me3j, me3j.gz, me3j.bin, h5
+//   mode         write, read or both. read expects files written earlier with the same settings.
+//   dir          directory for the files (default .)
+//   name         start of the file names (default synthetic)
+//   seed         seed for the matrix elements (default 1)
+//   reps         number of times each file is read (default 1)
+//   h5_deflate   gzip level for the h5 file (default 0)
+//   h5_chunk     rows of vtnf per chunk in the h5 file, and per slab when reading it (default 0, i.e. automatic)
+//   tolerance    largest allowed difference between a matrix element read back and the generated one (default 1e-4)
+// Returns a nonzero exit code if any file doesn't read back to what was generated.
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <omp.h>
+#include "ModelSpace.hh"
+#include "Operator.hh"
+#include "ReadWrite.hh"
+
+using namespace std;
+
+#ifndef SQRT2
+  #define SQRT2 1.4142135623730950488
+#endif
+
+map<string,string> options = {
+  {"emax",        "4"},
+  {"e2max",       ""},
+  {"lmax",        ""},
+  {"E3max",       "4"},
+  {"formats",     "me2j,me2j.gz,me2j.bin,me3j,me3j.gz,me3j.bin,h5"},
+  {"mode",        "both"},
+  {"dir",         "."},
+  {"name",        "synthetic"},
+  {"seed",        "1"},
+  {"reps",        "1"},
+  {"h5_deflate",  "0"},
+  {"h5_chunk",    "0"},
+  {"tolerance",   "1e-4"},
+};
+
+unsigned long long seed = 1;
+
+
+/// A number in [-1,1) which depends only on the list of integers and the seed (splitmix64 of the list).
+double Synthetic(initializer_list<long long> qn)
+{
+  unsigned long long x = seed;
+  for (long long i : qn)
+  {
+    x ^= (unsigned long long)i + 0x9e3779b97f4a7c15ULL + (x<<6) + (x>>2);
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x>>30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x>>27)) * 0x94d049bb133111ebULL;
+    x ^= x>>31;
+  }
+  return ldexp((double)(x>>11), -53) * 2 - 1;
+}
+
+
+/// Set the two-body matrix elements the same way ReadBareTBME_Darmstadt_from_stream() would from an me2j file
+/// in which the (T,Tz) = (0,0) (1,1) (1,0) (1,-1) matrix elements are synthetic. The T=1 ones are nearly charge independent.
+void FillTwoBody(Operator& H, int emax, int e2max, int lmax)
+{
+  ModelSpace* modelspace = H.GetModelSpace();
+  vector<int> orbits_remap;
+  for (int e=0; e<=min(emax,modelspace->GetEmax()); ++e)
+  {
+    for (int l=e%2; l<=min(e,lmax); l+=2)
+    {
+      for (int twoj=abs(2*l-1); twoj<=2*l+1; twoj+=2)
+        orbits_remap.push_back( modelspace->GetOrbitIndex((e-l)/2,l,twoj,-1) );
+    }
+  }
+  int nljmax = orbits_remap.size()-1;
+
+  for (int nlj1=0; nlj1<=nljmax; ++nlj1)
+  {
+    int a = orbits_remap[nlj1];
+    Orbit& o1 = modelspace->GetOrbit(a);
+    int e1 = 2*o1.n + o1.l;
+    for (int nlj2=0; nlj2<=nlj1; ++nlj2)
+    {
+      int b = orbits_remap[nlj2];
+      Orbit& o2 = modelspace->GetOrbit(b);
+      int e2 = 2*o2.n + o2.l;
+      if (e1+e2 > e2max) break;
+      int parity = (o1.l + o2.l) % 2;
+      for (int nlj3=0; nlj3<=nlj1; ++nlj3)
+      {
+        int c = orbits_remap[nlj3];
+        Orbit& o3 = modelspace->GetOrbit(c);
+        int e3 = 2*o3.n + o3.l;
+        for (int nlj4=0; nlj4<=(nlj3==nlj1 ? nlj2 : nlj3); ++nlj4)
+        {
+          int d = orbits_remap[nlj4];
+          Orbit& o4 = modelspace->GetOrbit(d);
+          int e4 = 2*o4.n + o4.l;
+          if (e3+e4 > e2max) break;
+          if ( (o1.l + o2.l + o3.l + o4.l)%2 != 0) continue;
+          int Jmin = max( abs(o1.j2 - o2.j2), abs(o3.j2 - o4.j2) )/2;
+          int Jmax = min( o1.j2 + o2.j2, o3.j2 + o4.j2 )/2;
+          double scale = 4.0 * exp(-0.25*(e1+e2+e3+e4));
+          for (int J=Jmin; J<=Jmax; ++J)
+          {
+            float tbme_10 = scale * Synthetic({2,a,b,c,d,J,1});
+            float tbme_00 = scale * Synthetic({2,a,b,c,d,J,0});
+            float tbme_pp = tbme_10 * (1 + 0.02*Synthetic({2,a,b,c,d,J,-1}));
+            float tbme_nn = tbme_10 * (1 + 0.02*Synthetic({2,a,b,c,d,J,2}));
+            double norm_factor = 1;
+            if (a==b)  norm_factor /= SQRT2;
+            if (c==d)  norm_factor /= SQRT2;
+            if (norm_factor>0.9 or J%2==0)
+            {
+               H.TwoBody.SetTBME(J,parity,-1,a,b,c,d,tbme_pp*norm_factor);
+               H.TwoBody.SetTBME(J,parity,1,a+1,b+1,c+1,d+1,tbme_nn*norm_factor);
+               H.TwoBody.Set_pn_TBME_from_iso(J,1,0,a,b,c,d,tbme_10*norm_factor);
+            }
+            if (norm_factor>0.9 or J%2!=0)
+            {
+               H.TwoBody.Set_pn_TBME_from_iso(J,0,0,a,b,c,d,tbme_00*norm_factor);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+
+/// Fill every stored three-body matrix element, walking the storage in the order of ThreeBodyME::Allocate().
+/// Elements which vanish by antisymmetry are left at zero, and the blocks diagonal in the orbits are symmetric.
+void FillThreeBody(Operator& H)
+{
+  ModelSpace* modelspace = H.GetModelSpace();
+  ThreeBodyME& V3 = H.ThreeBody;
+  auto& OI = V3.OrbitIndex;
+  for (size_t ia=0; ia<OI.size(); ++ia)
+  for (size_t ib=0; ib<OI[ia].size(); ++ib)
+  for (size_t ic=0; ic<OI[ia][ib].size(); ++ic)
+  for (size_t id=0; id<OI[ia][ib][ic].size(); ++id)
+  for (size_t ie=0; ie<OI[ia][ib][ic][id].size(); ++ie)
+  for (size_t jf=0; jf<OI[ia][ib][ic][id][ie].size(); ++jf)
+  {
+    size_t index = OI[ia][ib][ic][id][ie][jf];
+    if (index == size_t(-1)) continue;
+    int a=2*ia, b=2*ib, c=2*ic, d=2*id, e=2*ie, f=2*jf;
+    Orbit& oa = modelspace->GetOrbit(a);
+    Orbit& ob = modelspace->GetOrbit(b);
+    Orbit& oc = modelspace->GetOrbit(c);
+    Orbit& od = modelspace->GetOrbit(d);
+    Orbit& oe = modelspace->GetOrbit(e);
+    Orbit& of = modelspace->GetOrbit(f);
+    int E_abc = 2*(oa.n+ob.n+oc.n)+oa.l+ob.l+oc.l;
+    int E_def = 2*(od.n+oe.n+of.n)+od.l+oe.l+of.l;
+    double scale = 0.5 * exp(-0.25*(E_abc+E_def));
+    bool diagonal = (a==d and b==e and c==f);
+    for (int Jab=abs(oa.j2-ob.j2)/2; Jab<=(oa.j2+ob.j2)/2; ++Jab)
+    {
+     for (int Jde=abs(od.j2-oe.j2)/2; Jde<=(od.j2+oe.j2)/2; ++Jde)
+     {
+      int J2_min = max( abs(2*Jab-oc.j2), abs(2*Jde-of.j2));
+      int J2_max = min( 2*Jab+oc.j2, 2*Jde+of.j2);
+      for (int J2=J2_min; J2<=J2_max; J2+=2)
+      {
+       for (int Tindex=0; Tindex<5; ++Tindex)
+       {
+         int tab = Tindex<4 ? Tindex/2 : 1;
+         int tde = Tindex<4 ? Tindex%2 : 1;
+         int T2 = Tindex<4 ? 1 : 3;
+         bool autozero = (a==b and (tab+Jab)%2==0) or (d==e and (tde+Jde)%2==0)
+                      or (a==b and a==c and T2==3 and oa.j2<3) or (d==e and d==f and T2==3 and od.j2<3);
+         double V = 0;
+         if (not autozero)
+         {
+           // on the diagonal, <Jab tab|V|Jde tde> = <Jde tde|V|Jab tab>
+           int J1 = Jab, t1 = tab, J2_ = Jde, t2 = tde;
+           if (diagonal and (Jde<Jab or (Jde==Jab and tde<tab))) { swap(J1,J2_); swap(t1,t2); }
+           V = scale * Synthetic({3,a,b,c,d,e,f,J1,J2_,J2,t1,t2,T2});
+         }
+         V3.MatEl[index++] = V;
+       }
+      }
+     }
+    }
+  }
+}
+
+
+/// Random numbers in the stored basis aren't antisymmetric under exchange of all three particles when two orbits are equal
+/// (for example <(ab)Jab c| with b==c), and the me3j writer recouples to the file's orbit ordering, where that shows up.
+/// Sending the matrix elements once through a .bin file projects them onto the antisymmetric states,
+/// after which they survive the trip unchanged.
+void AntisymmetrizeThreeBody(ReadWrite& rw, Operator& H, int emax, int E3max, string tmpfile)
+{
+  stringstream messages;
+  streambuf* coutbuf = cout.rdbuf(messages.rdbuf()); // the writer warns about every element that isn't antisymmetric yet
+  rw.Write_me3j(tmpfile, H, emax, E3max, E3max);
+  fill(H.ThreeBody.MatEl.begin(), H.ThreeBody.MatEl.end(), 0); // ThreeBodyME::Erase() would free the storage
+  rw.Read_Darmstadt_3body(tmpfile, H, emax, E3max, E3max);
+  cout.rdbuf(coutbuf);
+  remove(tmpfile.c_str());
+}
+
+
+double MaxDiff(Operator& A, Operator& B)
+{
+  double maxdiff = 0;
+  for (auto& itmat : A.TwoBody.MatEl)
+    if (itmat.second.n_elem>0)
+      maxdiff = max(maxdiff, arma::abs(itmat.second - B.TwoBody.MatEl.at(itmat.first)).max());
+  for (size_t i=0; i<A.ThreeBody.MatEl.size(); ++i)
+    maxdiff = max(maxdiff, (double)abs(A.ThreeBody.MatEl[i] - B.ThreeBody.MatEl[i]));
+  return maxdiff;
+}
+
+
+size_t FileSize(string filename)
+{
+  ifstream infile(filename, ios::binary | ios::ate);
+  return infile.good() ? (size_t)infile.tellg() : 0;
+}
+
+
+int main(int argc, char** argv)
+{
+  for (int iarg=1; iarg<argc; ++iarg)
+  {
+    string arg = argv[iarg];
+    size_t eq = arg.find("=");
+    if (eq==string::npos or options.find(arg.substr(0,eq))==options.end())
+    {
+      cout << "Unknown option " << arg << ". Options are:";
+      for (auto& opt : options) cout << " " << opt.first;
+      cout << endl;
+      return 1;
+    }
+    options[arg.substr(0,eq)] = arg.substr(eq+1);
+  }
+
+  int emax = atoi(options["emax"].c_str());
+  int e2max = options["e2max"]!="" ? atoi(options["e2max"].c_str()) : 2*emax;
+  int lmax = options["lmax"]!="" ? atoi(options["lmax"].c_str()) : emax;
+  int E3max = atoi(options["E3max"].c_str());
+  int reps = atoi(options["reps"].c_str());
+  double tolerance = atof(options["tolerance"].c_str());
+  string mode = options["mode"];
+  seed = atoll(options["seed"].c_str());
+
+  vector<string> formats;
+  stringstream ss(options["formats"]);
+  string fmt;
+  while (getline(ss,fmt,',')) formats.push_back(fmt);
+
+  ModelSpace modelspace(emax,"O16");
+  modelspace.SetHbarOmega(20);
+  if (E3max >= 0) modelspace.SetE3max(E3max);
+  int particle_rank = E3max>=0 ? 3 : 2;
+
+  ReadWrite rw;
+  rw.SetHDF5Deflate(atoi(options["h5_deflate"].c_str()));
+  rw.SetHDF5ChunkSize(atoll(options["h5_chunk"].c_str()));
+
+  double t_start = omp_get_wtime();
+  Operator H(modelspace,0,0,0,particle_rank);
+  FillTwoBody(H, emax, e2max, lmax);
+  if (particle_rank>2)
+  {
+    FillThreeBody(H);
+    AntisymmetrizeThreeBody(rw, H, emax, E3max, options["dir"] + "/" + options["name"] + "_antisymmetrize.me3j.bin");
+  }
+  size_t n2 = 0;
+  for (auto& itmat : H.TwoBody.MatEl) n2 += itmat.second.n_elem;
+  size_t n3 = H.ThreeBody.MatEl.size();
+  cout << "Generated " << n2 << " two-body and " << n3 << " three-body matrix elements in " << omp_get_wtime()-t_start << " s" << endl;
+
+  string base = options["dir"] + "/" + options["name"] + "_emax" + to_string(emax);
+  struct Result { string file; size_t bytes; double t_write; double t_read; size_t nme; double maxdiff; };
+  vector<Result> results;
+  int nfail = 0;
+
+  for (string& fmt : formats)
+  {
+    bool threebody = fmt.find("me3j")!=string::npos or fmt=="h5";
+    if (threebody and particle_rank<3)
+    {
+      cout << "Skipping " << fmt << ", since there are no three-body matrix elements (E3max<0)." << endl;
+      continue;
+    }
+    if (fmt.find("me2j")==string::npos and not threebody)
+    {
+      cout << "Unknown format " << fmt << endl;
+      return 1;
+    }
+    string filename = threebody ? base + "_E3max" + to_string(E3max) + "." + fmt : base + "_e2max" + to_string(e2max) + "." + fmt;
+    Result result = {filename, 0, 0, 0, threebody ? n3 : n2, 0};
+
+    if (mode=="write" or mode=="both")
+    {
+      double t = omp_get_wtime();
+      if (threebody) rw.Write_me3j(filename, H, emax, E3max, E3max);
+      else           rw.Write_me2j(filename, H, emax, e2max, lmax);
+      result.t_write = omp_get_wtime() - t;
+      if (not rw.InGoodState()) { cout << "Trouble writing " << filename << endl; return 1; }
+    }
+    result.bytes = FileSize(filename);
+
+    if (mode=="read" or mode=="both")
+    {
+      if (result.bytes==0) { cout << "Can't read " << filename << endl; return 1; }
+      Operator Hread(modelspace,0,0,0,threebody ? 3 : 2);
+      result.t_read = 1e99;
+      for (int rep=0; rep<reps; ++rep)
+      {
+        Hread.TwoBody.Erase();
+        fill(Hread.ThreeBody.MatEl.begin(), Hread.ThreeBody.MatEl.end(), 0);
+        double t = omp_get_wtime();
+        if (threebody) rw.Read_Darmstadt_3body(filename, Hread, emax, E3max, E3max);
+        else           rw.ReadBareTBME_Darmstadt(filename, Hread, emax, e2max, lmax);
+        result.t_read = min(result.t_read, omp_get_wtime() - t);
+      }
+      if (threebody) Hread.TwoBody = H.TwoBody; // only compare the three-body part
+      else           Hread.ThreeBody.MatEl = H.ThreeBody.MatEl;
+      result.maxdiff = MaxDiff(H, Hread);
+      if (result.maxdiff > tolerance or not rw.InGoodState()) nfail++;
+    }
+    results.push_back(result);
+  }
+
+  cout << endl << left << setw(50) << "file" << right << setw(12) << "size (MB)" << setw(12) << "write (s)" << setw(12) << "read (s)"
+       << setw(12) << "MB/s" << setw(12) << "M ME/s" << setw(12) << "max diff" << endl;
+  for (auto& r : results)
+  {
+    double mb = r.bytes/1048576.;
+    cout << left << setw(50) << r.file << right << fixed << setprecision(3) << setw(12) << mb << setw(12) << r.t_write << setw(12) << r.t_read
+         << setw(12) << (r.t_read>0 ? mb/r.t_read : 0) << setw(12) << (r.t_read>0 ? r.nme*1e-6/r.t_read : 0)
+         << scientific << setprecision(2) << setw(12) << r.maxdiff << (r.maxdiff>tolerance ? "  MISMATCH" : "") << endl;
+  }
+  if (nfail>0) cout << nfail << " files didn't read back to the generated matrix elements!" << endl;
+  return nfail>0 ? 1 : 0;
+}
@@ -2,39 +2,47 @@
 #include <iostream>
 #include <iomanip>
 #include <sstream>
+#include <fstream>
 #include <omp.h>
 #include "IMSRG.hh"
 #include "Parameters.hh"
 
 using namespace imsrg_util;
 
-int main(int argc, char** argv)
+/// The model space for the reference and valence space in PAR, with the truncations of the interaction.
+ModelSpace MakeModelSpace(Parameters& PAR)
 {
-  // Default parameters, and everything passed by command line args.
-  Parameters PAR(argc,argv);
-
-  string inputtbme = PAR.s("2bme");
-  string input3bme = PAR.s("3bme");
   string reference = PAR.s("reference");
   string valence_space = PAR.s("valence_space");
-  string basis = PAR.s("basis");
-  string method = PAR.s("method");
-  string flowfile = PAR.s("flowfile");
-  string intfile = PAR.s("intfile");
-  string core_generator = PAR.s("core_generator");
-  string valence_generator = PAR.s("valence_generator");
-  string fmt2 = PAR.s("fmt2");
-  string denominator_delta_orbit = PAR.s("denominator_delta_orbit");
-  string LECs = PAR.s("LECs");
-  string scratch = PAR.s("scratch");
-  string use_brueckner_bch = PAR.s("use_brueckner_bch");
-  string valence_file_format = PAR.s("valence_file_format");
-
+  string mosh_cache = PAR.s("mosh_cache");
   int eMax = PAR.i("emax");
   int E3max = PAR.i("e3max");
   int lmax3 = PAR.i("lmax3");
+  int e3max_bra = PAR.i("e3max_bra");
+  int e3max_ket = PAR.i("e3max_ket");
   int targetMass = PAR.i("A");
-  int nsteps = PAR.i("nsteps");
+  double hw = PAR.d("hw");
+
+  ModelSpace modelspace = reference=="default" ? ModelSpace(eMax,valence_space) : ModelSpace(eMax,reference,valence_space);
+  modelspace.SetHbarOmega(hw);
+  if (targetMass>0)
+     modelspace.SetTargetMass(targetMass);
+  modelspace.SetE3max(E3max);
+  if (lmax3>0)
+     modelspace.SetLmax3(lmax3);
+  modelspace.SetE3maxBraKet(e3max_bra,e3max_ket);
+  #pragma omp critical (MoshinskyCacheDir) // it's static, and the jobs of an ensemble make their model spaces at the same time
+  modelspace.SetMoshinskyCacheDir(mosh_cache);
+  return modelspace;
+}
+
+/// Read the bare 2N interaction, and the 3N interaction if Hbare has particle rank 3.
+/// Returns false if the files can't be read.
+bool ReadInteraction(Parameters& PAR, ReadWrite& rw, Operator& Hbare)
+{
+  string inputtbme = PAR.s("2bme");
+  string input3bme = PAR.s("3bme");
+  string fmt2 = PAR.s("fmt2");
   int file2e1max = PAR.i("file2e1max");
   int file2e2max = PAR.i("file2e2max");
   int file2lmax = PAR.i("file2lmax");
@@ -42,26 +50,12 @@ int main(int argc, char** argv)
   int file3e2max = PAR.i("file3e2max");
   int file3e3max = PAR.i("file3e3max");
 
-  double hw = PAR.d("hw");
-  double smax = PAR.d("smax");
-  double ode_tolerance = PAR.d("ode_tolerance");
-  double ds_max = PAR.d("ds_max");
-  double ds_0 = PAR.d("ds_0");
-  double domega = PAR.d("domega");
-  double omega_norm_max = PAR.d("omega_norm_max"); 
-  double denominator_delta = PAR.d("denominator_delta");
-  double BetaCM = PAR.d("BetaCM");
-
-  vector<string> opnames = PAR.v("Operators");
-
-  vector<Operator> ops;
-
   // test 2bme file
   ifstream test(inputtbme);
   if( not test.good() )
   {
     cout << "trouble reading " << inputtbme << " exiting. " << endl;
-    return 1;
+    return false;
   }
   test.close();
   // test 3bme file
@@ -71,42 +65,15 @@ int main(int argc, char** argv)
     if( not test.good() )
     {
       cout << "trouble reading " << input3bme << " exiting. " << endl;
-      return 1;
+      return false;
     }
     test.close();
   }
 
-
-
-  ReadWrite rw;
-  rw.SetLECs_preset(LECs);
-  rw.SetScratchDir(scratch);
-  ModelSpace modelspace = reference=="default" ? ModelSpace(eMax,valence_space) : ModelSpace(eMax,reference,valence_space);
-
-  if (nsteps < 0)
-    nsteps = modelspace.valence.size()>0 ? 2 : 1;
-
-
-  modelspace.SetHbarOmega(hw);
-  if (targetMass>0)
-     modelspace.SetTargetMass(targetMass);
-  modelspace.SetE3max(E3max);
-  if (lmax3>0)
-     modelspace.SetLmax3(lmax3);
-  
-  cout << "Making the operator..." << endl;
-  int particle_rank = input3bme=="none" ? 2 : 3;
-  Operator Hbare = Operator(modelspace,0,0,0,particle_rank);
-  Hbare.SetHermitian();
-
-  if (use_brueckner_bch == "true" or use_brueckner_bch == "True")
-  {
-    Hbare.SetUseBruecknerBCH(true);
-    cout << "Using Brueckner flavor of BCH" << endl;
-  }
-
   cout << "Reading interactions..." << endl;
 
+  // The timers of the reading threads are their own, so keep the total here
+  double t_start = omp_get_wtime();
   #pragma omp parallel sections 
   {
     #pragma omp section
@@ -129,6 +96,65 @@ int main(int argc, char** argv)
       cout << "done reading 3N" << endl;
     }  
   }
+  Hbare.profiler.timer["ReadInteraction"] += omp_get_wtime() - t_start;
+  return true;
+}
+
+
+/// Everything after reading the interaction, for one nucleus: Hartree-Fock, the IMSRG flow,
+/// and transforming and writing out the operators.
+/// Hbare comes in holding the bare interaction, and is changed.
+/// The three-body part is read from H3bare, which is usually Hbare itself, but can be shared by several jobs.
+int RunJob(Parameters& PAR, ModelSpace& modelspace, Operator& Hbare, ReadWrite& rw, Operator& H3bare)
+{
+  string reference = PAR.s("reference");
+  string valence_space = PAR.s("valence_space");
+  string basis = PAR.s("basis");
+  string method = PAR.s("method");
+  string flowfile = PAR.s("flowfile");
+  string flowfile_memory = PAR.s("flowfile_memory");
+  string intfile = PAR.s("intfile");
+  string core_generator = PAR.s("core_generator");
+  string valence_generator = PAR.s("valence_generator");
+  string denominator_delta_orbit = PAR.s("denominator_delta_orbit");
+  string valence_file_format = PAR.s("valence_file_format");
+  string hf_convergence = PAR.s("hf_convergence");
+  string hf_fallback = PAR.s("hf_fallback");
+  string hf_input = PAR.s("hf_input");
+  string hf_output = PAR.s("hf_output");
+  string checkpoint = PAR.s("checkpoint");
+  string restart = PAR.s("restart");
+
+  int eMax = PAR.i("emax");
+  int targetMass = PAR.i("A");
+  int nsteps = PAR.i("nsteps");
+  int emax_seed = PAR.i("emax_seed");
+  int hf_diis_vectors = PAR.i("hf_diis_vectors");
+  int checkpoint_interval = PAR.i("checkpoint_interval");
+
+  double hw = PAR.d("hw");
+  double smax = PAR.d("smax");
+  double ode_tolerance = PAR.d("ode_tolerance");
+  double magnus_tolerance = PAR.d("magnus_tolerance");
+  double extrapolation_tolerance = PAR.d("extrapolation_tolerance");
+  double omega_sparsify_threshold = PAR.d("omega_sparsify_threshold");
+  double sparse_fill_cutoff = PAR.d("sparse_fill_cutoff");
+  double ds_max = PAR.d("ds_max");
+  double ds_0 = PAR.d("ds_0");
+  double domega = PAR.d("domega");
+  double omega_norm_max = PAR.d("omega_norm_max"); 
+  double denominator_delta = PAR.d("denominator_delta");
+  double BetaCM = PAR.d("BetaCM");
+  double hf_mixing = PAR.d("hf_mixing");
+  double hf_level_shift = PAR.d("hf_level_shift");
+  double checkpoint_walltime = PAR.d("checkpoint_walltime");
+
+  vector<string> opnames = PAR.v("Operators");
+
+  vector<Operator> ops;
+
+  if (nsteps < 0)
+    nsteps = modelspace.valence.size()>0 ? 2 : 1;
 
   Hbare += Trel_Op(modelspace);
   if (abs(BetaCM)>1e-3)
@@ -136,10 +162,20 @@ int main(int argc, char** argv)
     Hbare += BetaCM * HCM_Op(modelspace);
   }
 
-  HartreeFock hf(Hbare);
+  Hbare.profiler.StartMemoryPhase("HF");
+  HartreeFock hf(Hbare, H3bare);
+  hf.SetConvergenceMethod(hf_convergence,hf_fallback);
+  hf.SetDIISVectors(hf_diis_vectors);
+  hf.SetMixing(hf_mixing);
+  hf.SetLevelShift(hf_level_shift);
+  if (hf_input != "")
+    hf.ReadState(hf_input);
   hf.Solve();
+  if (hf_output != "")
+    hf.WriteState(hf_output);
   cout << "EHF = " << hf.EHF << endl;
   
+  Hbare.profiler.StartMemoryPhase("NO");
   if (basis == "HF" and method !="HF")
     Hbare = hf.GetNormalOrderedH();
   else if (basis == "oscillator")
@@ -256,9 +292,9 @@ int main(int argc, char** argv)
 
   
 
+  if (basis == "HF") ops = hf.TransformToHFBasis(ops);
   for (auto& op : ops)
   {
-     if (basis == "HF") op = hf.TransformToHFBasis(op);
      op = op.DoNormalOrdering();
      if (method == "MP3")
      {
@@ -287,6 +323,7 @@ int main(int argc, char** argv)
     return 0;
   }
 
+  Hbare.profiler.StartMemoryPhase("flow");
   IMSRGSolver imsrgsolver(Hbare);
   imsrgsolver.SetReadWrite(rw);
   
@@ -295,40 +332,87 @@ int main(int argc, char** argv)
     omega_norm_max=500;
     method = "magnus";
   }
+  bool magnus = method.substr(0,6) == "magnus"; // any of the Magnus methods, which can transform operators afterwards
 
   imsrgsolver.SetMethod(method);
   imsrgsolver.SetHin(Hbare);
   imsrgsolver.SetSmax(smax);
   imsrgsolver.SetFlowFile(flowfile);
+  imsrgsolver.SetFlowFileMemory(flowfile_memory == "true" or flowfile_memory == "True");
   imsrgsolver.SetDs(ds_0);
   imsrgsolver.SetDenominatorDelta(denominator_delta);
   imsrgsolver.SetdOmega(domega);
   imsrgsolver.SetOmegaNormMax(omega_norm_max);
   imsrgsolver.SetODETolerance(ode_tolerance);
+  imsrgsolver.SetMagnusTolerance(magnus_tolerance);
+  imsrgsolver.SetExtrapolationTolerance(extrapolation_tolerance);
+  imsrgsolver.SetOmegaSparsify(omega_sparsify_threshold, sparse_fill_cutoff);
+  // use the first scalar operator to check what the sparsification does to an observable
+  Operator sparsify_test_op;
+  for (auto& op : ops)
+  {
+    if (op.GetJRank()>0) continue;
+    sparsify_test_op = op;
+    imsrgsolver.SetSparsifyTestOperator(sparsify_test_op);
+    break;
+  }
   if (denominator_delta_orbit != "none")
     imsrgsolver.SetDenominatorDeltaOrbit(denominator_delta_orbit);
+  if (checkpoint != "")
+    imsrgsolver.SetCheckpoint(checkpoint, checkpoint_interval, checkpoint_walltime);
+
+  // If the checkpoint was written during the valence decoupling, skip the core part.
+  bool restarted = (restart != "") and imsrgsolver.Restart(restart);
+  bool restarted_valence = restarted and imsrgsolver.GetGenerator().GetType() == valence_generator;
+
+  // Emax continuation: do the flow with a smaller emax first, and start from its Omega,
+  // so the flow at the full emax only needs to correct the remainder.
+  if (magnus and not restarted and emax_seed >= 0 and emax_seed < eMax)
+  {
+    cout << "Seeding the flow with emax = " << emax_seed << endl;
+    ModelSpace ms_seed = reference=="default" ? ModelSpace(emax_seed,valence_space) : ModelSpace(emax_seed,reference,valence_space);
+    ms_seed.SetHbarOmega(hw);
+    if (targetMass>0)
+       ms_seed.SetTargetMass(targetMass);
+    Operator H_seed = Hbare.Truncate(ms_seed);
+    IMSRGSolver seedsolver(H_seed);
+    seedsolver.SetReadWrite(rw);
+    seedsolver.SetMethod(method);
+    seedsolver.SetSmax(smax);
+    seedsolver.SetDs(ds_0);
+    seedsolver.SetDenominatorDelta(denominator_delta);
+    seedsolver.SetdOmega(domega);
+    seedsolver.SetOmegaNormMax(omega_norm_max);
+    seedsolver.SetMagnusTolerance(magnus_tolerance);
+    seedsolver.SetGenerator(nsteps > 1 ? core_generator : valence_generator);
+    seedsolver.Solve();
+    imsrgsolver.SeedFrom(seedsolver);
+  }
 
   if (nsteps > 1) // two-step decoupling, do core first
   {
-    imsrgsolver.SetGenerator(core_generator);
-    imsrgsolver.Solve();
-    if (method == "magnus") smax *= 2;
+    if (not restarted_valence)
+    {
+      if (not restarted) imsrgsolver.SetGenerator(core_generator);
+      imsrgsolver.Solve();
+    }
+    if (magnus) smax *= 2;
   }
 
-  imsrgsolver.SetGenerator(valence_generator);
+  if (not restarted_valence) imsrgsolver.SetGenerator(valence_generator);
   imsrgsolver.SetSmax(smax);
   imsrgsolver.Solve();
 
 
   // Transform all the operators
-  if (method == "magnus")
+  Hbare.profiler.StartMemoryPhase("transform");
+  if (magnus)
   {
     if (ops.size()>0) cout << "transforming operators" << endl;
+    ops = imsrgsolver.Transform(ops);
     for (size_t i=0;i<ops.size();++i)
     {
-      cout << opnames[i] << " " << flush;
-      ops[i] = imsrgsolver.Transform(ops[i]);
-      cout << " (" << ops[i].ZeroBody << " ) " << endl; 
+      cout << opnames[i] << " (" << ops[i].ZeroBody << " ) " << endl; 
     }
     cout << endl;
     // increase smax in case we need to do additional steps
@@ -379,17 +463,21 @@ int main(int argc, char** argv)
     imsrgsolver.Solve();
     // Change operators to the new basis, then apply the rest of the transformation
     cout << "Final transformation on the operators..." << endl;
+    vector<double> ZeroBody_before, ZeroBody_undo, ZeroBody_mid;
     for (auto& op : ops)
     {
-      double ZeroBody_before = op.ZeroBody;
+      ZeroBody_before.push_back(op.ZeroBody);
       op = op.UndoNormalOrdering();
-      double ZeroBody_undo = op.ZeroBody;
+      ZeroBody_undo.push_back(op.ZeroBody);
       op.SetModelSpace(ms2);
       op = op.DoNormalOrdering();
-      double ZeroBody_mid = op.ZeroBody;
-      // transform using the remaining omegas
-      op = imsrgsolver.Transform_Partial(op,nOmega);
-      cout << ZeroBody_before << "   =>   " << ZeroBody_undo << "   =>   " << ZeroBody_mid<< "   =>   " << op.ZeroBody << endl;
+      ZeroBody_mid.push_back(op.ZeroBody);
+    }
+    // transform using the remaining omegas
+    ops = imsrgsolver.Transform_Partial(ops,nOmega);
+    for (size_t i=0;i<ops.size();++i)
+    {
+      cout << ZeroBody_before[i] << "   =>   " << ZeroBody_undo[i] << "   =>   " << ZeroBody_mid[i] << "   =>   " << ops[i].ZeroBody << endl;
     }
   }
 
@@ -411,7 +499,7 @@ int main(int argc, char** argv)
       rw.WriteNuShellX_sps(imsrgsolver.GetH_s(),intfile+".sp");
 //    }
 
-    if (method == "magnus")
+    if (magnus)
     {
        for (int i=0;i<ops.size();++i)
        {
@@ -453,3 +541,181 @@ int main(int argc, char** argv)
   return 0;
 }
 
+
+
+/// Check if a parameter has the same value in both maps, without changing either of them.
+template <class T> bool SameValue(const map<string,T>& a, const map<string,T>& b, string par)
+{
+  auto ia = a.find(par);
+  auto ib = b.find(par);
+  if (ia==a.end() or ib==b.end()) return ia==a.end() and ib==b.end();
+  return ia->second == ib->second;
+}
+
+/// Spherical tensor rank of an operator from the Operators list of RunJob(). Everything not listed here is a scalar.
+int OperatorRankJ(string opname)
+{
+  if (opname == "E2") return 2;
+  if (opname == "M1" or opname == "GamowTeller") return 1;
+  return 0;
+}
+
+/// Ensemble mode. Each line of the file given by the parameter jobs is one job, written as
+/// parameter=value overrides of the command line (e.g. reference=Ca48 valence_space=Ca48 A=48).
+/// The interaction is read once, in the model space of the command line, and then every job
+/// runs HF+IMSRG+operators with its own copy of the 2N part. The 3N part is only read, so in the HF basis
+/// the jobs share the one in Hbare. ensemble_jobs of them run at the same time,
+/// each with its share of the threads. Their screen output is then interleaved,
+/// but the flow files, interaction files, checkpoints and HF states are still separate (see Parameters::ParseJob).
+/// Parameters that change what gets read (files, emax, hw, ...) can't be changed by a job,
+/// and two jobs may not write the same checkpoint or HF state file.
+int RunEnsemble(Parameters& PAR, ModelSpace& modelspace, Operator& Hbare, ReadWrite& rw)
+{
+  string jobfile = PAR.s("jobs");
+  ifstream infile(jobfile);
+  if ( not infile.good() )
+  {
+    cout << "trouble reading " << jobfile << " exiting. " << endl;
+    return 1;
+  }
+  vector<string> jobs;
+  string line;
+  while ( getline(infile,line) )
+  {
+    line = line.substr(0,line.find("#"));
+    if (line.find_first_not_of(" \t") != string::npos) jobs.push_back(line);
+  }
+
+  vector<string> shared_pars = {"2bme","3bme","fmt2","LECs","use_brueckner_bch","mosh_cache","emax","e3max","lmax3","e3max_bra","e3max_ket",
+                                "file2e1max","file2e2max","file2lmax","file3e1max","file3e2max","file3e3max","h5chunk","hw"};
+  int njobs = jobs.size();
+  int jobs_at_once = max(1, min(PAR.i("ensemble_jobs"), njobs));
+  int threads_per_job = max(1, omp_get_max_threads() / jobs_at_once);
+  cout << "Ensemble of " << njobs << " jobs, running " << jobs_at_once << " at a time with " << threads_per_job << " threads each" << endl;
+
+  // The angular momentum tables are static and have to be built outside of the parallel jobs.
+  // The 9j tables are needed up to the largest tensor rank of any job's operators.
+  int Lambda_max = 0;
+  map<string,int> output_files;
+  for (int ijob=0; ijob<njobs; ++ijob)
+  {
+    Parameters jobPAR(PAR);
+    jobPAR.ParseJob(jobs[ijob]);
+    for (auto& opname : jobPAR.v("Operators")) Lambda_max = max(Lambda_max, OperatorRankJ(opname));
+    for (auto& par : {"checkpoint","hf_output"})
+    {
+      string fname = jobPAR.s(par);
+      if (fname == "") continue;
+      if (output_files.find(fname) != output_files.end())
+      {
+        cout << "Jobs " << output_files[fname] << " and " << ijob << " would both write " << fname
+             << ". Give them different " << par << " files. Exiting." << endl;
+        return 1;
+      }
+      output_files[fname] = ijob;
+    }
+  }
+  modelspace.PreCalculateSixJ();
+  if (jobs_at_once > 1)
+  {
+    modelspace.PreCalculateMoshinsky();
+    for (int Lambda=0; Lambda<=Lambda_max; ++Lambda) modelspace.PreCalculateNineJ(Lambda);
+  }
+  Hbare.PrintTimes();
+
+  vector<int> status(njobs,0);
+  vector<double> walltime(njobs,0);
+  omp_set_max_active_levels(2);
+  #pragma omp parallel for schedule(dynamic,1) num_threads(jobs_at_once)
+  for (int ijob=0; ijob<njobs; ++ijob)
+  {
+    double t_start = omp_get_wtime();
+    Parameters jobPAR(PAR);
+    jobPAR.ParseJob(jobs[ijob]);
+    for (auto& par : shared_pars)
+    {
+      if ( not SameValue(jobPAR.string_par, PAR.string_par, par) or not SameValue(jobPAR.int_par, PAR.int_par, par)
+            or not SameValue(jobPAR.double_par, PAR.double_par, par) )
+      {
+        cout << "Job " << ijob << ": " << par << " can't be changed in ensemble mode. Skipping it." << endl;
+        status[ijob] = 1;
+      }
+    }
+    if (status[ijob] != 0) continue;
+    cout << "=== Starting job " << ijob << ": " << jobs[ijob] << endl;
+
+    omp_set_num_threads(threads_per_job);
+    IMSRGProfiler().Clear();
+    ModelSpace ms_job = MakeModelSpace(jobPAR);
+    ReadWrite rw_job(rw);
+    rw_job.SetScratchDir(jobPAR.s("scratch"));
+    // Normal ordering in the oscillator basis needs the 3N part in the job's own Hamiltonian, so that still gets a full copy.
+    bool share_3N = Hbare.particle_rank>=3 and jobPAR.s("basis") == "HF";
+    Operator H_job = share_3N ? Operator(ms_job,0,0,0,2) : Operator(Hbare);
+    if (share_3N)
+    {
+      H_job.ZeroBody = Hbare.ZeroBody;
+      H_job.OneBody = Hbare.OneBody;
+      H_job.TwoBody = Hbare.TwoBody;
+    }
+    H_job.SetModelSpace(ms_job);
+    status[ijob] = RunJob(jobPAR, ms_job, H_job, rw_job, share_3N ? Hbare : H_job);
+    walltime[ijob] = omp_get_wtime() - t_start;
+  }
+
+  cout << endl << "Ensemble summary:" << endl;
+  int nfailed = 0;
+  for (int ijob=0; ijob<njobs; ++ijob)
+  {
+    cout << setw(4) << ijob << (status[ijob]==0 ? "   ok    " : "   FAILED") << setw(10) << setprecision(1) << fixed << walltime[ijob] << " s   " << jobs[ijob] << endl;
+    if (status[ijob] != 0) nfailed++;
+  }
+  return nfailed>0 ? 1 : 0;
+}
+
+
+int main(int argc, char** argv)
+{
+  // Default parameters, and everything passed by command line args.
+  Parameters PAR(argc,argv);
+
+  string input3bme = PAR.s("3bme");
+  string use_brueckner_bch = PAR.s("use_brueckner_bch");
+
+  ReadWrite rw;
+  rw.SetLECs_preset(PAR.s("LECs"));
+  rw.SetScratchDir(PAR.s("scratch"));
+  rw.SetHDF5ChunkSize(PAR.i("h5chunk"));
+  ModelSpace modelspace = MakeModelSpace(PAR);
+
+  cout << "Making the operator..." << endl;
+  int particle_rank = input3bme=="none" ? 2 : 3;
+  Operator Hbare = Operator(modelspace,0,0,0,particle_rank);
+  Hbare.SetHermitian();
+
+  if (use_brueckner_bch == "true" or use_brueckner_bch == "True")
+  {
+    Hbare.SetUseBruecknerBCH(true);
+    cout << "Using Brueckner flavor of BCH" << endl;
+  }
+
+  if (PAR.s("profile_trace") != "")
+    Hbare.profiler.EnableTrace();
+  Hbare.profiler.SetMachinePeak(PAR.d("peak_gflops"), PAR.d("peak_bandwidth"));
+
+  Hbare.profiler.StartMemoryPhase("read");
+  if ( not ReadInteraction(PAR, rw, Hbare) ) return 1;
+
+  int status;
+  if (PAR.s("jobs") != "")
+    status = RunEnsemble(PAR, modelspace, Hbare, rw);
+  else
+    status = RunJob(PAR, modelspace, Hbare, rw, Hbare);
+
+  if (PAR.s("profile_trace") != "")
+    Hbare.profiler.WriteTrace(PAR.s("profile_trace"));
+  if (PAR.s("profile_flamegraph") != "")
+    Hbare.profiler.WriteCollapsedStacks(PAR.s("profile_flamegraph"));
+
+  return status;
+}
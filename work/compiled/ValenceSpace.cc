@@ -187,9 +187,12 @@ int main(int argc, char** argv)
   Operator R2_cm  = R2CM_Op(modelspace);
   if (basis == "HF")
   {
-    R2_p1 = hf.TransformToHFBasis(R2_p1);
-    R2_p2 = hf.TransformToHFBasis(R2_p2);
-    R2_cm = hf.TransformToHFBasis(R2_cm);
+    // all at once, so the two-body transformation matrices are only built once
+    vector<Operator> radii = {R2_p1, R2_p2, R2_cm};
+    radii = hf.TransformToHFBasis(radii);
+    R2_p1 = radii[0];
+    R2_p2 = radii[1];
+    R2_cm = radii[2];
   }
   R2_p1 = R2_p1.DoNormalOrdering();
   R2_p2 = R2_p2.DoNormalOrdering();
@@ -231,9 +234,11 @@ int main(int argc, char** argv)
   if (method == "magnus")
   {
 
-     R2_p1 = imsrgsolver.Transform(R2_p1);
-     R2_p2 = imsrgsolver.Transform(R2_p2);
-     R2_cm = imsrgsolver.Transform(R2_cm);
+     vector<Operator> R2ops = {R2_p1, R2_p2, R2_cm};
+     R2ops = imsrgsolver.Transform(R2ops);
+     R2_p1 = R2ops[0];
+     R2_p2 = R2ops[1];
+     R2_cm = R2ops[2];
      rw.WriteNuShellX_op(R2_p1,intfile+"_R2p1.int");
      rw.WriteNuShellX_op(R2_p2,intfile+"_R2p2.int");
      rw.WriteNuShellX_op(R2_cm,intfile+"_R2cm.int");
@@ -299,11 +299,11 @@ int main(int argc, char** argv)
      oplist.push_back(R2_p1_Op(modelspace_target));
      oplist.push_back(R2_p2_Op(modelspace_target));
      oplist.push_back(R2CM_Op(modelspace_target));
+     if (basis == "HF")
+        oplist = hf.TransformToHFBasis(oplist);
 
      for (Operator& op : oplist )
      {
-       if (basis == "HF")
-          op = hf.TransformToHFBasis(op);
        op = op.DoNormalOrdering();
        op = imsrgsolver.Transform(op);
        op = op.UndoNormalOrdering();